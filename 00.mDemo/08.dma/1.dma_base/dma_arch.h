@@ -0,0 +1,103 @@
+/*
+ * Per-architecture and per-kernel-version policy for the DMA demo.
+ *
+ * kDemo.c is built unchanged for x86_64 (1.dma_base) and arm64
+ * (2.dma_base_arm, Linux and Android GKI kernels). Everything the two
+ * used to differ in is decided here at compile time, so the driver only
+ * ever uses the DMA_ARCH_* / dma_* names below.
+ *
+ * The oldest kernel supported is 5.15, the first Android GKI release the
+ * arm build targets; older trees fail here instead of deep inside kDemo.c.
+ */
+
+#ifndef _DMA_ARCH_H
+#define _DMA_ARCH_H
+
+#include <linux/version.h>
+#include <linux/gfp.h>
+#include <linux/device.h>
+#include <linux/dma-mapping.h>
+#include <linux/dma-buf.h>
+#include <linux/shrinker.h>
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 15, 0)
+#error "kDemo needs Linux 5.15 or newer"
+#endif
+
+/*
+ * Zone that keeps pages inside a 32-bit DMA mask.
+ *
+ * x86_64 has a 16MB ZONE_DMA for ISA and the 4GB limit is ZONE_DMA32.
+ * On arm64 ZONE_DMA is sized from the firmware's DMA ranges and is the
+ * zone that matches what the SoC's masters can actually reach, so prefer
+ * it there and fall back to ZONE_DMA32 when it is not configured.
+ */
+#if defined(CONFIG_ARM64) || defined(CONFIG_ARM)
+#if defined(CONFIG_ZONE_DMA)
+#define DMA_ARCH_GFP_32BIT    GFP_DMA
+#elif defined(CONFIG_ZONE_DMA32)
+#define DMA_ARCH_GFP_32BIT    GFP_DMA32
+#else
+#define DMA_ARCH_GFP_32BIT    0
+#endif
+#define DMA_ARCH_NAME         "arm"
+#else
+#if defined(CONFIG_ZONE_DMA32)
+#define DMA_ARCH_GFP_32BIT    GFP_DMA32
+#else
+#define DMA_ARCH_GFP_32BIT    0
+#endif
+#define DMA_ARCH_NAME         "x86"
+#endif
+
+/*
+ * All-ones 64-bit mask. The arm build has always spelled it out: clang on
+ * some Android trees warns about the shift inside DMA_BIT_MASK(64).
+ */
+#if defined(CONFIG_ARM64) || defined(CONFIG_ARM)
+#define DMA_ARCH_MASK_64      (~0ULL)
+#else
+#define DMA_ARCH_MASK_64      DMA_BIT_MASK(64)
+#endif
+
+/* class->dev_uevent takes a const device since 6.2 */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 2, 0)
+#define DMA_UEVENT_CONST      const
+#else
+#define DMA_UEVENT_CONST
+#endif
+
+/* class_create() lost its owner argument in 6.4 */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 4, 0)
+#define dma_class_create(name)    class_create(name)
+#else
+#define dma_class_create(name)    class_create(THIS_MODULE, name)
+#endif
+
+/* iosys_map was called dma_buf_map before 5.18, same layout */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 18, 0)
+#include <linux/dma-buf-map.h>
+#define iosys_map                 dma_buf_map
+#define iosys_map_set_vaddr       dma_buf_map_set_vaddr
+#endif
+
+/*
+ * The _unlocked importer calls appeared in 6.2. Before that the plain
+ * ones took the reservation lock themselves for non-dynamic importers,
+ * which is all kDemo ever is.
+ */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 2, 0)
+#define dma_buf_map_attachment_unlocked     dma_buf_map_attachment
+#define dma_buf_unmap_attachment_unlocked   dma_buf_unmap_attachment
+#define dma_buf_vmap_unlocked               dma_buf_vmap
+#define dma_buf_vunmap_unlocked             dma_buf_vunmap
+#endif
+
+/* register_shrinker() takes a debugfs name since 6.0 */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 0, 0)
+#define dma_register_shrinker(s, fmt, ...)  register_shrinker(s, fmt, ##__VA_ARGS__)
+#else
+#define dma_register_shrinker(s, fmt, ...)  register_shrinker(s)
+#endif
+
+#endif /* _DMA_ARCH_H */
@@ -20,6 +20,35 @@
 #include <linux/dmapool.h>
 #include <linux/scatterlist.h>
 #include <linux/slab.h>
+#include <linux/idr.h>
+#include <linux/mutex.h>
+#include <linux/kref.h>
+#include <linux/mm.h>
+#include <linux/sort.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/shrinker.h>
+#include <linux/version.h>
+#include <linux/log2.h>
+#include <linux/dmaengine.h>
+#include <linux/kthread.h>
+#include <linux/completion.h>
+#include <linux/wait.h>
+#include <linux/ktime.h>
+#include <linux/workqueue.h>
+#include <linux/eventfd.h>
+#include <linux/poll.h>
+#include <linux/dma-buf.h>
+#include <linux/vmalloc.h>
+#include <linux/rcupdate.h>
+#include <linux/topology.h>
+#include <linux/nodemask.h>
+#include <linux/huge_mm.h>
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 17, 0)
+#include <linux/pfn_t.h>
+#endif
+
+#include "dma_arch.h"
 
 
 #define MAX_DEV 2
@@ -30,8 +59,28 @@
 #define SINGLE_BUF_SIZE       (PAGE_SIZE * 2)    /* 8KB streaming DMA buffer */
 #define DMA_POOL_SIZE         256                /* 256 bytes per pool allocation */
 #define DMA_POOL_BOUNDARY     0                  /* No boundary restriction */
-#define SG_NENTS              4                  /* Number of scatter-gather entries */
-#define SG_PAGE_SIZE          PAGE_SIZE          /* Each sg entry is one page */
+#define SG_NENTS              4                  /* Default scatter-gather pages */
+#define SG_PAGE_SIZE          PAGE_SIZE          /* Each sg page is one page */
+#define DMA_MAX_SG_SIZE       (256UL << 20)      /* 256MB per SG mapping */
+#define SG_PRINT_MAX          8                  /* SG entries logged per mapping */
+#define DMA_SG_MAX_ORDER      get_order(SZ_2M)   /* Largest chunk, one PMD */
+#define DMA_CACHE_CLASSES     4                  /* 4KB, 16KB, 64KB, 256KB */
+#define DMA_CACHE_MAX_FREE    16                 /* Idle buffers kept per class */
+#define DMA_MAX_COHERENT_BUFS 16                 /* Coherent buffers per device */
+#define DMA_MAX_USER_MAPS     16                 /* Pinned user mappings per device */
+#define DMA_MAX_USER_MAP_SIZE (256UL << 20)      /* 256MB per user mapping */
+#define DMA_MAX_POOLS         16                 /* Handle-based pools per device */
+#define DMA_POOL_DEF_BLOCKS   4096               /* Default blocks per pool */
+#define DMA_POOL_MAX_BLOCKS   (1U << 16)         /* Blocks per pool at most, ~1.3MB of slots */
+#define DMA_POOL_BULK_MAX     4096               /* Blocks per bulk ioctl */
+#define DMA_SYNC_BATCH_MAX    1024               /* Ranges per batched sync */
+#define DMA_MAX_IMPORTS       16                 /* Imported dma-bufs per device */
+#define DMA_XFER_MAX_SIZE     (4UL << 20)        /* 4MB per benchmark transfer */
+#define DMA_XFER_MAX_ITERS    100000
+#define DMA_XFER_TIMEOUT_MS   5000
+#define DMA_JOB_DEF_ENTRIES   256                /* Default job ring size */
+#define DMA_JOB_MAX_ENTRIES   4096               /* Job ring size at most */
+#define DMA_JOB_SIGNAL_BATCH  32                 /* Completions per wakeup */
 
 /* IOCTL commands for DMA operations */
 #define DMA_MAGIC             'D'
@@ -64,6 +113,46 @@
 /* DMA mask configuration */
 #define DMA_IOCTL_SET_MASK          _IOW(DMA_MAGIC, 16, struct dma_ioctl_param)
 
+/* Streaming buffer cache control and statistics */
+#define DMA_IOCTL_CACHE_CTL         _IOWR(DMA_MAGIC, 19, struct dma_cache_ctl)
+
+/* Zero-copy mapping of user memory */
+#define DMA_IOCTL_MAP_USER          _IOWR(DMA_MAGIC, 17, struct dma_ioctl_param)
+#define DMA_IOCTL_UNMAP_USER        _IOW(DMA_MAGIC, 18, struct dma_ioctl_param)
+
+/* Handle-based DMA pools with bulk block allocation */
+#define DMA_IOCTL_POOL_OPEN         _IOWR(DMA_MAGIC, 20, struct dma_pool_open)
+#define DMA_IOCTL_POOL_CLOSE        _IOW(DMA_MAGIC, 21, struct dma_pool_open)
+#define DMA_IOCTL_POOL_BULK_ALLOC   _IOWR(DMA_MAGIC, 22, struct dma_pool_bulk)
+#define DMA_IOCTL_POOL_BULK_FREE    _IOWR(DMA_MAGIC, 23, struct dma_pool_bulk)
+
+/* End-to-end memcpy transfer benchmark */
+#define DMA_IOCTL_XFER_BENCH        _IOWR(DMA_MAGIC, 24, struct dma_xfer_bench)
+
+/* Partial and batched sync of streaming mappings */
+#define DMA_IOCTL_SYNC_RANGE        _IOW(DMA_MAGIC, 28, struct dma_sync_range)
+#define DMA_IOCTL_SYNC_BATCH        _IOWR(DMA_MAGIC, 29, struct dma_sync_batch)
+
+/* dma-buf export and import */
+#define DMA_IOCTL_EXPORT_DMABUF     _IOWR(DMA_MAGIC, 30, struct dmabuf_export_req)
+#define DMA_IOCTL_IMPORT_DMABUF     _IOWR(DMA_MAGIC, 31, struct dmabuf_import_req)
+#define DMA_IOCTL_RELEASE_DMABUF    _IOW(DMA_MAGIC, 32, struct dmabuf_import_req)
+#define DMA_IOCTL_ACCESS_DMABUF     _IOW(DMA_MAGIC, 33, struct dmabuf_access)
+
+/* Asynchronous job queue */
+#define DMA_IOCTL_JOB_SETUP         _IOWR(DMA_MAGIC, 25, struct dma_job_setup)
+#define DMA_IOCTL_JOB_SUBMIT        _IOWR(DMA_MAGIC, 26, struct dma_job_batch)
+#define DMA_IOCTL_JOB_REAP          _IOWR(DMA_MAGIC, 27, struct dma_job_batch)
+
+/* Buffer placement, dma_ioctl_param.node_policy */
+#define DMA_NODE_DEFAULT    0   /* No preference, the allocator decides */
+#define DMA_NODE_LOCAL      1   /* Node of the CPU making the call */
+#define DMA_NODE_DEVICE     2   /* Node the device is attached to */
+#define DMA_NODE_EXPLICIT   3   /* The node given in dma_ioctl_param.node */
+
+/* Allocation flags, dma_ioctl_param.alloc_flags */
+#define DMA_ALLOC_HIGH_ORDER (1 << 0)  /* MAP_SG: compound chunks up to 2MB, not single pages */
+
 /* IOCTL parameter structure */
 struct dma_ioctl_param {
     unsigned long size;         /* Buffer size */
@@ -73,9 +162,171 @@ struct dma_ioctl_param {
     int count;                  /* Count for scatter-gather */
     unsigned int mask_bits;     /* DMA mask bits (32 or 64) */
     int result;                 /* Result code */
+    int handle;                 /* Coherent buffer / user mapping handle */
+    unsigned int nr_pages;      /* SG: pages backing the mapping */
+    unsigned int nr_segs;       /* SG: segments after merging adjacent pages */
+    int node_policy;            /* Alloc: DMA_NODE_* placement */
+    int node;                   /* In: node for DMA_NODE_EXPLICIT, out: node the buffer is on */
+    unsigned int alloc_flags;   /* DMA_ALLOC_* */
+    unsigned int max_order;     /* SG: largest chunk order actually used */
     char data[64];              /* Data buffer for small transfers */
 };
 
+/* Streaming buffer cache control parameter */
+struct dma_cache_ctl {
+    int enable;                 /* In: 1 on, 0 off (drains the cache), -1 keep */
+    unsigned int nr_free;       /* Idle pre-mapped buffers in the cache */
+    unsigned long long hits;    /* MAP_SINGLE served from the cache */
+    unsigned long long misses;  /* MAP_SINGLE that had to allocate and map */
+    unsigned long long reaped;  /* Idle buffers freed by the shrinker or disable */
+};
+
+/* Pool creation parameter for DMA_IOCTL_POOL_OPEN/CLOSE */
+struct dma_pool_open {
+    int handle;                 /* Out: pool handle (in for CLOSE) */
+    unsigned int size;          /* Block size in bytes */
+    unsigned int align;         /* Block alignment, power of two, 0 for none */
+    unsigned int boundary;      /* Blocks don't cross this, power of two, 0 for none */
+    unsigned int max_blocks;    /* Blocks outstanding at most, 0 for the default */
+};
+
+/* One pool block as seen by userspace */
+struct dma_pool_block {
+    unsigned long long dma_addr; /* DMA address of the block */
+    unsigned int id;            /* Block id, pass it back to free the block */
+    unsigned int pad;
+};
+
+/* Bulk alloc/free parameter */
+struct dma_pool_bulk {
+    int handle;                 /* Pool handle */
+    unsigned int count;         /* In: blocks requested, out: blocks done */
+    unsigned long long blocks;  /* User pointer to struct dma_pool_block[count] */
+};
+
+/* Buffer types for DMA_IOCTL_XFER_BENCH */
+enum dma_xfer_type {
+    DMA_XFER_COHERENT = 0,
+    DMA_XFER_SINGLE = 1,
+    DMA_XFER_SG = 2,
+    DMA_XFER_POOL = 3,
+};
+
+/* Transfer benchmark parameter */
+struct dma_xfer_bench {
+    int type;                   /* In: enum dma_xfer_type */
+    int engine;                 /* In: -1 auto, 0 kthread, 1 dmaengine; out: used */
+    unsigned int size;          /* In: bytes per transfer */
+    unsigned int iterations;    /* In: transfers to run */
+    unsigned int segments;      /* Out: memcpy descriptors per transfer */
+    unsigned int pad;
+    unsigned long long total_ns;    /* Out: wall time of all transfers */
+    unsigned long long lat_min_ns;  /* Out: submit to completion callback */
+    unsigned long long lat_avg_ns;
+    unsigned long long lat_max_ns;
+    char chan_name[32];         /* Out: dmaengine channel, or "kthread" */
+};
+
+/* Mappings a sync range can refer to */
+enum dma_sync_target {
+    DMA_SYNC_SINGLE = 0,        /* The device's single mapping, handle unused */
+    DMA_SYNC_SG = 1,            /* The device's scatter-gather mapping, handle unused */
+    DMA_SYNC_USER = 2,          /* A pinned user mapping, by handle */
+};
+
+/* One byte range to sync */
+struct dma_sync_range {
+    int target;                 /* enum dma_sync_target */
+    int handle;                 /* DMA_SYNC_USER: user mapping handle */
+    unsigned long long offset;  /* Byte offset into the mapping */
+    unsigned long long length;  /* Bytes to sync, 0 for the rest of the mapping */
+    int direction;              /* TO_DEVICE: for device, FROM_DEVICE: for cpu, BIDI: both */
+    unsigned int pad;
+};
+
+/* Batched sync parameter */
+struct dma_sync_batch {
+    unsigned int count;         /* In: ranges, out: ranges synced */
+    unsigned int pad;
+    unsigned long long ranges;  /* User pointer to struct dma_sync_range[count] */
+};
+
+/* What DMA_IOCTL_EXPORT_DMABUF exports */
+enum dmabuf_export_target {
+    DMABUF_EXPORT_COHERENT = 0, /* A coherent buffer, by handle */
+    DMABUF_EXPORT_SG = 1,       /* The pages of the device's SG mapping */
+};
+
+/* dma-buf export parameter */
+struct dmabuf_export_req {
+    int target;                 /* In: enum dmabuf_export_target */
+    int handle;                 /* In: coherent buffer handle */
+    int fd;                     /* Out: dma-buf file descriptor */
+    unsigned int pad;
+    unsigned long long size;    /* Out: dma-buf size in bytes */
+};
+
+/* dma-buf import parameter */
+struct dmabuf_import_req {
+    int fd;                     /* In: dma-buf to import */
+    int handle;                 /* Out: import handle (in for RELEASE) */
+    unsigned long long size;    /* Out: dma-buf size in bytes */
+    unsigned long long dma_addr; /* Out: first DMA address as seen by this device */
+    unsigned int nr_segs;       /* Out: DMA segments of the attachment mapping */
+    unsigned int pad;
+};
+
+/* CPU access to an imported dma-buf */
+struct dmabuf_access {
+    int handle;                 /* Import handle */
+    int write;                  /* 1: user buffer -> dma-buf, 0: dma-buf -> user buffer */
+    unsigned long long offset;  /* Byte offset into the dma-buf */
+    unsigned long long size;    /* Bytes to copy */
+    unsigned long long user_addr; /* User buffer */
+};
+
+/* Operations understood by the job queue */
+enum dma_job_op {
+    DMA_JOB_NOP = 0,            /* Completes immediately, measures queue overhead */
+    DMA_JOB_COPY = 1,           /* Coherent src_handle -> coherent handle */
+    DMA_JOB_FILL = 2,           /* Fill coherent handle with byte arg */
+    DMA_JOB_SYNC_USER = 3,      /* Sync user mapping handle, arg 1 for device, 0 for cpu */
+    DMA_JOB_MAP_STREAM = 4,     /* Map, sync and unmap a size byte streaming buffer */
+};
+
+/* One job submitted through DMA_IOCTL_JOB_SUBMIT */
+struct dma_job_desc {
+    unsigned long long user_data;   /* Returned unchanged in the completion */
+    unsigned int op;            /* enum dma_job_op */
+    int handle;                 /* Destination coherent buffer or user mapping */
+    int src_handle;             /* COPY: source coherent buffer */
+    unsigned int offset;        /* Offset into the destination */
+    unsigned int src_offset;    /* COPY: offset into the source */
+    unsigned int size;          /* Bytes to copy, fill or map */
+    unsigned int arg;           /* FILL: byte value, SYNC_USER: direction */
+    unsigned int pad;
+};
+
+/* One completion returned by DMA_IOCTL_JOB_REAP */
+struct dma_job_cqe {
+    unsigned long long user_data;   /* From the job descriptor */
+    int result;                 /* 0 or a negative errno */
+    unsigned int pad;
+};
+
+/* Job queue setup parameter */
+struct dma_job_setup {
+    unsigned int entries;       /* In: ring size, 0 for default; out: rounded up */
+    int eventfd;                /* In: eventfd signalled on completions, -1 for none */
+};
+
+/* Job submit/reap parameter */
+struct dma_job_batch {
+    unsigned int count;         /* In: array length, out: jobs queued / reaped */
+    unsigned int min_complete;  /* REAP: wait until this many completions are ready */
+    unsigned long long ptr;     /* User pointer to dma_job_desc[] or dma_job_cqe[] */
+};
+
 /* DMA directions for userspace */
 enum dma_user_dir {
     DMA_USER_TO_DEVICE = 1,
@@ -89,11 +340,28 @@ static char *exit_desc = "default exit desc";
 module_param(init_desc, charp, S_IRUGO);
 module_param(exit_desc, charp, S_IRUGO);
 
+/* Per-operation logging; turn off when benchmarking */
+static bool verbose = true;
+module_param(verbose, bool, S_IRUGO | S_IWUSR);
+
+/* Default state of the streaming buffer cache on each device */
+static bool buf_cache = true;
+module_param(buf_cache, bool, S_IRUGO);
+
+#define dma_log(fmt, ...) \
+    do { \
+        if (verbose) { \
+            printk(KERN_INFO "DMA: " fmt, ##__VA_ARGS__); \
+        } \
+    } while (0)
+
 static int m_chrdev_open(struct inode *inode, struct file *file);
 static int m_chrdev_release(struct inode *inode, struct file *file);
 static long m_chrdev_ioctl(struct file *file, unsigned int cmd, unsigned long arg);
 static ssize_t m_chrdev_read(struct file *file, char __user *buf, size_t count, loff_t *offset);
 static ssize_t m_chrdev_write(struct file *file, const char __user *buf, size_t count, loff_t *offset);
+static int m_chrdev_mmap(struct file *file, struct vm_area_struct *vma);
+static __poll_t m_chrdev_poll(struct file *file, struct poll_table_struct *wait);
 
 /* initialize file_operations */
 static const struct file_operations m_chrdev_fops = {
@@ -102,44 +370,207 @@ static const struct file_operations m_chrdev_fops = {
     .release    = m_chrdev_release,
     .unlocked_ioctl = m_chrdev_ioctl,
     .read       = m_chrdev_read,
-    .write       = m_chrdev_write
+    .write       = m_chrdev_write,
+    .mmap       = m_chrdev_mmap,
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+    /* PMD-aligns large mappings so the SG buffer can be mapped with huge pages */
+    .get_unmapped_area = thp_get_unmapped_area,
+#endif
+    .poll       = m_chrdev_poll
+};
+
+/*
+ * One coherent DMA buffer in a file's handle table. The table holds one
+ * reference and every user mapping or in-flight access holds another, so
+ * a buffer freed while still mmap()ed lives until the last munmap().
+ * Lookups run under RCU, hence the struct itself is freed after a grace
+ * period.
+ */
+struct dma_coherent_buf {
+    struct kref ref;
+    struct device *dev;
+    void *vaddr;
+    dma_addr_t dma;
+    size_t size;
+    int nid;                    /* NUMA node of the memory */
+    struct rcu_head rcu;
+};
+
+/* user memory pinned and mapped for DMA in place */
+struct dma_user_map {
+    struct device *dev;
+    struct page **pages;
+    int nr_pages;
+    struct sg_table sgt;
+    enum dma_data_direction dir;
+};
+
+/* a kmalloc buffer kept mapped DMA_BIDIRECTIONAL while it sits in the cache */
+struct dma_cache_buf {
+    struct list_head node;
+    void *vaddr;
+    dma_addr_t dma;
+    int cls;
+    int nid;                    /* NUMA node the buffer was allocated on */
+};
+
+/*
+ * Recycling cache of pre-mapped streaming buffers in DMA_CACHE_CLASSES size
+ * classes. Buffers are mapped bidirectionally once, so MAP/UNMAP_SINGLE
+ * only have to sync ownership; idle buffers are given back by the shrinker.
+ */
+struct dma_buf_cache {
+    spinlock_t lock;
+    struct list_head free[DMA_CACHE_CLASSES];
+    unsigned int nr_free[DMA_CACHE_CLASSES];
+    bool enabled;
+    u64 hits;
+    u64 misses;
+    u64 reaped;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+    struct shrinker *shrinker;
+#else
+    struct shrinker shrinker;
+#endif
+};
+
+/* a caller-configured dma_pool and the blocks handed out from it */
+struct dma_pool_ctx {
+    struct mutex lock;          /* Serialises bulk operations on this pool */
+    struct dma_pool *pool;
+    unsigned int size;
+    unsigned int max_blocks;
+    struct dma_pool_slot {
+        void *vaddr;            /* NULL while the id is free */
+        dma_addr_t dma;
+    } *slots;
+    unsigned int *free_ids;     /* Stack of unused slot ids */
+    unsigned int nr_free_ids;
+};
+
+/*
+ * Per-file asynchronous job queue. Submitted descriptors go to the
+ * submission ring and are run in order by a work item, which posts a
+ * completion for each to the completion ring. Both rings have the same
+ * size and inflight counts jobs not yet reaped, so neither can overflow.
+ */
+struct dma_job_queue {
+    struct dma_file_ctx *fctx;
+    struct work_struct work;
+    struct mutex submit_lock;   /* One submitter fills the submission ring */
+    struct mutex reap_lock;     /* One reaper drains the completion ring */
+    spinlock_t lock;            /* Ring indices and inflight */
+    struct dma_job_desc *sq;
+    struct dma_job_cqe *cq;
+    unsigned int mask;          /* Ring size - 1 */
+    unsigned int sq_head, sq_tail;
+    unsigned int cq_head, cq_tail;
+    unsigned int inflight;
+    wait_queue_head_t wait;
+    struct eventfd_ctx *eventfd;
+};
+
+/*
+ * A coherent buffer, or the pages of the SG mapping, exported as a dma-buf.
+ * The export holds its own reference on the memory, so it outlives
+ * FREE_COHERENT / UNMAP_SG for as long as anyone has the dma-buf.
+ */
+struct dmabuf_exp {
+    struct dma_coherent_buf *cbuf;  /* Coherent export */
+    struct page **pages;            /* SG export, one reference held per page */
+    unsigned int nr_pages;
+    size_t size;
+    struct mutex lock;              /* Protects attachments */
+    struct list_head attachments;
 };
 
-/* device data holder with DMA resources */
+/* one device attached to an exported buffer */
+struct dmabuf_exp_attach {
+    struct list_head node;
+    struct device *dev;
+    struct sg_table *sgt;           /* Set while the attachment is mapped */
+    enum dma_data_direction dir;
+};
+
+/* a dma-buf attached to and mapped for this device */
+struct dmabuf_import {
+    struct dma_buf *dmabuf;
+    struct dma_buf_attachment *attach;
+    struct sg_table *sgt;
+};
+
+/*
+ * Device data holder. Only what every opener has to share lives here: the
+ * device itself, the streaming buffer cache and the DMA mask. Buffers,
+ * mappings and pools belong to the struct dma_file_ctx of the file that
+ * created them.
+ */
 struct m_chr_device_data {
     struct cdev cdev;
     struct device *dev;
 
-    /* Coherent DMA buffers */
-    void *coherent_buf;
-    dma_addr_t coherent_dma;
-    size_t coherent_size;
+    /* Pre-mapped streaming buffers, shared by all files */
+    struct dma_buf_cache cache;
+
+    struct mutex lock;          /* Protects dma_mask and open_count */
+    u64 dma_mask;
+    unsigned int open_count;    /* SET_MASK needs this to be 1 */
+};
+
+/*
+ * Per-open-file DMA state, allocated in open() and torn down in release().
+ * Separate files never share a lock; threads sharing one file only
+ * contend on the resource they touch, and coherent buffer lookups take
+ * no lock at all.
+ */
+struct dma_file_ctx {
+    struct m_chr_device_data *dd;
+
+    /* Coherent DMA buffers, handle -> struct dma_coherent_buf */
+    struct idr coherent_idr;
+    struct mutex coherent_lock;     /* Serialises idr updates, lookups use RCU */
 
     /* Streaming DMA single mapping */
+    struct mutex single_lock;
     void *single_buf;
     dma_addr_t single_dma;
     size_t single_size;
     enum dma_data_direction single_dir;
     bool single_mapped;
+    int single_nid;
+    struct dma_cache_buf *single_cbuf;  /* Set when single_buf came from the cache */
 
     /* Scatter-gather DMA */
+    struct mutex sg_lock;
     struct page **sg_pages;
-    struct sg_table sg_table;
-    int sg_nents;               /* Original number of SG entries before mapping */
+    struct sg_table sg_table;   /* orig_nents: merged segments, nents: DMA segments */
+    int sg_nents;               /* Number of pages backing the table */
+    unsigned int sg_max_order;  /* Largest chunk the pages came in */
     dma_addr_t sg_dma;
     enum dma_data_direction sg_dir;
     bool sg_mapped;
+    int sg_nid;                 /* Node of all pages, NUMA_NO_NODE if spread */
+
+    /* Pinned user memory mappings, handle -> struct dma_user_map */
+    struct idr user_map_idr;
+    struct mutex user_map_lock;
 
     /* DMA pool */
+    struct mutex dma_pool_lock;
     struct dma_pool *dma_pool;
     void *pool_buf;
     dma_addr_t pool_dma;
 
-    /* DMA mask */
-    u64 dma_mask;
+    /* Handle-based DMA pools, handle -> struct dma_pool_ctx */
+    struct idr pool_idr;
+    struct mutex pool_lock;
+
+    /* Imported dma-bufs, handle -> struct dmabuf_import */
+    struct idr import_idr;
+    struct mutex import_lock;
 
-    /* Statistics */
-    atomic_t ioctl_count;
+    /* Asynchronous job queue, set up at most once */
+    struct dma_job_queue *job_queue;
 };
 
 /* global storage for device Major number */
@@ -151,7 +582,7 @@ static struct class *m_chrdev_class = NULL;
 /* array of m_chr_device_data for */
 static struct m_chr_device_data m_chrdev_data[MAX_DEV];
 
-static int m_chrdev_uevent(const struct device *dev, struct kobj_uevent_env *env)
+static int m_chrdev_uevent(DMA_UEVENT_CONST struct device *dev, struct kobj_uevent_env *env)
 {
     add_uevent_var(env, "DEVMODE=%#o", 0666);
     return 0;
@@ -176,502 +607,3141 @@ static enum dma_data_direction user_to_kernel_dir(int user_dir)
     }
 }
 
+/*==============================================================================
+ * NUMA Placement
+ *==============================================================================*/
+
+/* Turn a DMA_NODE_* policy into a node id, NUMA_NO_NODE for no preference */
+static int dma_resolve_node(struct device *dev, int policy, int node)
+{
+    switch (policy) {
+    case DMA_NODE_DEFAULT:
+        return NUMA_NO_NODE;
+    case DMA_NODE_LOCAL:
+        return numa_node_id();
+    case DMA_NODE_DEVICE:
+        return dev_to_node(dev);
+    case DMA_NODE_EXPLICIT:
+        if (node < 0 || node >= MAX_NUMNODES || !node_online(node)) {
+            printk(KERN_WARNING "DMA: Node %d is not online\n", node);
+            return -EINVAL;
+        }
+        return node;
+    default:
+        return -EINVAL;
+    }
+}
+
+/* Node backing a kernel virtual address, linear map or vmalloc remap */
+static int dma_vaddr_node(void *vaddr)
+{
+    struct page *page;
+
+    page = is_vmalloc_addr(vaddr) ? vmalloc_to_page(vaddr) : virt_to_page(vaddr);
+
+    return page ? page_to_nid(page) : NUMA_NO_NODE;
+}
+
+/*
+ * SG pages only need the 32-bit zone while the mask is 32 bits. Asking for
+ * it under a 64-bit mask would also pin every page to the node that owns
+ * that zone, whatever node the caller asked for.
+ */
+static gfp_t dma_sg_gfp(struct m_chr_device_data *dd)
+{
+    return READ_ONCE(dd->dma_mask) == DMA_ARCH_MASK_64 ? GFP_KERNEL
+                                                       : GFP_KERNEL | DMA_ARCH_GFP_32BIT;
+}
+
 /*==============================================================================
  * Coherent DMA Operations
  *==============================================================================*/
 
-static int dma_alloc_coherent_dev(struct device *dev, struct m_chr_device_data *dd,
-                                   size_t size)
+/*
+ * Look up a buffer by handle and take a reference, without any lock: the
+ * idr is RCU-safe for readers and buffers are freed after a grace period,
+ * so the only race left is with the final put, which the refcount catches.
+ */
+static struct dma_coherent_buf *dma_coherent_get(struct dma_file_ctx *fctx, int handle)
 {
-    printk(KERN_INFO "DMA: Allocating coherent buffer, size: %zu\n", size);
+    struct dma_coherent_buf *buf;
 
-    if (dd->coherent_buf) {
-        printk(KERN_WARNING "DMA: Coherent buffer already allocated\n");
-        return -EBUSY;
+    rcu_read_lock();
+    buf = idr_find(&fctx->coherent_idr, handle);
+    if (buf && !kref_get_unless_zero(&buf->ref)) {
+        buf = NULL;
+    }
+    rcu_read_unlock();
+
+    if (!buf) {
+        printk(KERN_WARNING "DMA: No coherent buffer with handle %d\n", handle);
+    }
+
+    return buf;
+}
+
+static void dma_coherent_buf_release(struct kref *ref)
+{
+    struct dma_coherent_buf *buf = container_of(ref, struct dma_coherent_buf, ref);
+
+    dma_free_coherent(buf->dev, buf->size, buf->vaddr, buf->dma);
+    kfree_rcu(buf, rcu);
+}
+
+static void dma_coherent_put(struct dma_coherent_buf *buf)
+{
+    kref_put(&buf->ref, dma_coherent_buf_release);
+}
+
+/*
+ * Returns the new buffer handle, or a negative error code.
+ *
+ * dma_alloc_coherent() has no node argument and places memory on the
+ * device's node. Coherent buffers therefore stay there whatever nid asks
+ * for, and *out_nid reports where the buffer actually is. Streaming and SG
+ * buffers do honour nid.
+ */
+static int dma_alloc_coherent_dev(struct dma_file_ctx *fctx, size_t size, int nid,
+                                  dma_addr_t *dma_addr, int *out_nid)
+{
+    struct device *dev = fctx->dd->dev;
+    struct dma_coherent_buf *buf;
+    int handle;
+
+    dma_log("Allocating coherent buffer, size: %zu, node: %d\n", size, nid);
+
+    if (size == 0) {
+        return -EINVAL;
+    }
+
+    buf = kzalloc(sizeof(*buf), GFP_KERNEL);
+    if (!buf) {
+        return -ENOMEM;
     }
 
-    dd->coherent_buf = dma_alloc_coherent(dev, size, &dd->coherent_dma,
-                                          GFP_KERNEL);
-    if (!dd->coherent_buf) {
+    buf->vaddr = dma_alloc_coherent(dev, size, &buf->dma, GFP_KERNEL);
+    if (!buf->vaddr) {
         printk(KERN_ERR "DMA: Failed to allocate coherent buffer\n");
+        kfree(buf);
         return -ENOMEM;
     }
 
-    dd->coherent_size = size;
+    kref_init(&buf->ref);
+    buf->dev = dev;
+    buf->size = size;
+    buf->nid = dma_vaddr_node(buf->vaddr);
+    if (nid != NUMA_NO_NODE && buf->nid != nid) {
+        dma_log("Coherent buffer asked for node %d, on node %d with the device\n",
+                nid, buf->nid);
+    }
 
     /* Initialize buffer with pattern */
-    memset(dd->coherent_buf, 0xAA, size);
+    memset(buf->vaddr, 0xAA, size);
+
+    /* Handles start at 1 so a zeroed parameter never names a buffer */
+    mutex_lock(&fctx->coherent_lock);
+    handle = idr_alloc(&fctx->coherent_idr, buf, 1, DMA_MAX_COHERENT_BUFS + 1,
+                       GFP_KERNEL);
+    mutex_unlock(&fctx->coherent_lock);
+    if (handle < 0) {
+        printk(KERN_WARNING "DMA: No free coherent buffer handle\n");
+        dma_coherent_put(buf);
+        return handle == -ENOSPC ? -EBUSY : handle;
+    }
 
-    printk(KERN_INFO "DMA: Coherent buffer allocated\n");
-    printk(KERN_INFO "DMA:   virt addr = %p\n", dd->coherent_buf);
-    printk(KERN_INFO "DMA:   dma addr  = %#llx\n", (u64)dd->coherent_dma);
+    *dma_addr = buf->dma;
+    *out_nid = buf->nid;
 
-    return 0;
+    dma_log("Coherent buffer %d allocated on node %d\n", handle, buf->nid);
+    dma_log("  virt addr = %p\n", buf->vaddr);
+    dma_log("  dma addr  = %#llx\n", (u64)buf->dma);
+
+    return handle;
 }
 
-static int dma_free_coherent_dev(struct device *dev, struct m_chr_device_data *dd)
+static int dma_free_coherent_dev(struct dma_file_ctx *fctx, int handle)
 {
-    if (!dd->coherent_buf) {
-        printk(KERN_WARNING "DMA: No coherent buffer to free\n");
+    struct dma_coherent_buf *buf;
+
+    mutex_lock(&fctx->coherent_lock);
+    buf = idr_remove(&fctx->coherent_idr, handle);
+    mutex_unlock(&fctx->coherent_lock);
+
+    if (!buf) {
+        printk(KERN_WARNING "DMA: No coherent buffer with handle %d\n", handle);
         return -EINVAL;
     }
 
-    printk(KERN_INFO "DMA: Freeing coherent buffer\n");
-    dma_free_coherent(dev, dd->coherent_size, dd->coherent_buf, dd->coherent_dma);
-
-    dd->coherent_buf = NULL;
-    dd->coherent_dma = 0;
-    dd->coherent_size = 0;
+    dma_log("Freeing coherent buffer %d\n", handle);
+    dma_coherent_put(buf);
 
     return 0;
 }
 
-static int dma_read_coherent(struct m_chr_device_data *dd,
-                              struct dma_ioctl_param __user *uparam)
+/* Free every coherent buffer of a file that is going away */
+static void dma_free_coherent_all(struct dma_file_ctx *fctx)
+{
+    struct dma_coherent_buf *buf;
+    int handle;
+
+    mutex_lock(&fctx->coherent_lock);
+    idr_for_each_entry(&fctx->coherent_idr, buf, handle) {
+        printk(KERN_INFO "DMA: Reclaiming coherent buffer %d\n", handle);
+        idr_remove(&fctx->coherent_idr, handle);
+        dma_coherent_put(buf);
+    }
+    mutex_unlock(&fctx->coherent_lock);
+}
+
+static int dma_read_coherent(struct dma_file_ctx *fctx,
+                             struct dma_ioctl_param __user *uparam)
 {
     struct dma_ioctl_param param;
+    struct dma_coherent_buf *buf;
     size_t copy_size;
-
-    if (!dd->coherent_buf) {
-        printk(KERN_WARNING "DMA: No coherent buffer allocated\n");
-        return -EINVAL;
-    }
+    int ret = 0;
 
     if (copy_from_user(&param, uparam, sizeof(param))) {
         return -EFAULT;
     }
 
-    copy_size = min(param.size, dd->coherent_size);
+    /* The reference keeps the buffer alive across the copy */
+    buf = dma_coherent_get(fctx, param.handle);
+    if (!buf) {
+        return -EINVAL;
+    }
 
-    if (copy_to_user((void __user *)param.user_addr, dd->coherent_buf, copy_size)) {
-        return -EFAULT;
+    copy_size = min(param.size, buf->size);
+
+    if (copy_to_user((void __user *)param.user_addr, buf->vaddr, copy_size)) {
+        ret = -EFAULT;
+        goto out_put;
     }
 
     param.size = copy_size;
     param.result = 0;
 
     if (copy_to_user(uparam, &param, sizeof(param))) {
-        return -EFAULT;
+        ret = -EFAULT;
+        goto out_put;
     }
 
-    printk(KERN_INFO "DMA: Read %zu bytes from coherent buffer to user\n", copy_size);
+    dma_log("Read %zu bytes from coherent buffer %d to user\n",
+            copy_size, param.handle);
 
-    return 0;
+out_put:
+    dma_coherent_put(buf);
+    return ret;
 }
 
-static int dma_write_coherent(struct m_chr_device_data *dd,
-                               struct dma_ioctl_param __user *uparam)
+static int dma_write_coherent(struct dma_file_ctx *fctx,
+                              struct dma_ioctl_param __user *uparam)
 {
     struct dma_ioctl_param param;
+    struct dma_coherent_buf *buf;
     size_t copy_size;
-
-    if (!dd->coherent_buf) {
-        printk(KERN_WARNING "DMA: No coherent buffer allocated\n");
-        return -EINVAL;
-    }
+    int ret = 0;
 
     if (copy_from_user(&param, uparam, sizeof(param))) {
         return -EFAULT;
     }
 
-    copy_size = min(param.size, dd->coherent_size);
+    buf = dma_coherent_get(fctx, param.handle);
+    if (!buf) {
+        return -EINVAL;
+    }
 
-    if (copy_from_user(dd->coherent_buf, (void __user *)param.user_addr, copy_size)) {
-        return -EFAULT;
+    copy_size = min(param.size, buf->size);
+
+    if (copy_from_user(buf->vaddr, (void __user *)param.user_addr, copy_size)) {
+        ret = -EFAULT;
+        goto out_put;
     }
 
     param.size = copy_size;
     param.result = 0;
 
     if (copy_to_user(uparam, &param, sizeof(param))) {
-        return -EFAULT;
+        ret = -EFAULT;
+        goto out_put;
     }
 
-    printk(KERN_INFO "DMA: Wrote %zu bytes from user to coherent buffer\n", copy_size);
+    dma_log("Wrote %zu bytes from user to coherent buffer %d\n",
+            copy_size, param.handle);
 
-    return 0;
+out_put:
+    dma_coherent_put(buf);
+    return ret;
 }
 
-/*==============================================================================
- * Streaming DMA Single Mapping Operations
- *==============================================================================*/
+/*
+ * mmap() of a coherent buffer: the page offset selects the buffer handle,
+ * i.e. userspace maps handle N at offset N * PAGE_SIZE and then accesses
+ * the memory directly instead of going through READ/WRITE_COHERENT.
+ */
+static void dma_coherent_vm_open(struct vm_area_struct *vma)
+{
+    struct dma_coherent_buf *buf = vma->vm_private_data;
 
-static int dma_map_single_dev(struct device *dev, struct m_chr_device_data *dd,
-                               unsigned long size, int direction)
+    kref_get(&buf->ref);
+}
+
+static void dma_coherent_vm_close(struct vm_area_struct *vma)
 {
-    enum dma_data_direction dir = user_to_kernel_dir(direction);
+    dma_coherent_put(vma->vm_private_data);
+}
 
-    printk(KERN_INFO "DMA: Mapping single buffer, size: %lu, dir: %d\n", size, dir);
+static const struct vm_operations_struct dma_coherent_vm_ops = {
+    .open   = dma_coherent_vm_open,
+    .close  = dma_coherent_vm_close,
+};
 
-    if (dd->single_mapped) {
-        printk(KERN_WARNING "DMA: Single buffer already mapped\n");
-        return -EBUSY;
+/*
+ * mmap() at offset 0, which no coherent handle uses, maps the file's SG
+ * buffer. The mapping holds its own page references, so UNMAP_SG while it
+ * is mapped leaves the memory alone until munmap(). Pages are inserted at
+ * fault time, a whole PMD at once where a 2MB chunk backs it.
+ */
+struct dma_sg_vma {
+    struct kref ref;
+    struct page **pages;
+    unsigned long nr_pages;
+};
+
+static void dma_sg_vma_release(struct kref *ref)
+{
+    struct dma_sg_vma *m = container_of(ref, struct dma_sg_vma, ref);
+    unsigned long i;
+
+    for (i = 0; i < m->nr_pages; i++) {
+        put_page(m->pages[i]);
     }
+    kvfree(m->pages);
+    kfree(m);
+}
 
-    dd->single_buf = kmalloc(size, GFP_KERNEL);
-    if (!dd->single_buf) {
-        printk(KERN_ERR "DMA: Failed to allocate single buffer\n");
-        return -ENOMEM;
+static void dma_sg_vm_open(struct vm_area_struct *vma)
+{
+    struct dma_sg_vma *m = vma->vm_private_data;
+
+    kref_get(&m->ref);
+}
+
+static void dma_sg_vm_close(struct vm_area_struct *vma)
+{
+    struct dma_sg_vma *m = vma->vm_private_data;
+
+    kref_put(&m->ref, dma_sg_vma_release);
+}
+
+static vm_fault_t dma_sg_vm_fault(struct vm_fault *vmf)
+{
+    struct dma_sg_vma *m = vmf->vma->vm_private_data;
+
+    if (vmf->pgoff >= m->nr_pages) {
+        return VM_FAULT_SIGBUS;
     }
 
-    dd->single_dma = dma_map_single(dev, dd->single_buf, size, dir);
-    if (dma_mapping_error(dev, dd->single_dma)) {
-        printk(KERN_ERR "DMA: Failed to map single buffer\n");
-        kfree(dd->single_buf);
-        dd->single_buf = NULL;
-        return -EIO;
+    return vmf_insert_pfn(vmf->vma, vmf->address, page_to_pfn(m->pages[vmf->pgoff]));
+}
+
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 6, 0)
+static vm_fault_t dma_sg_vm_huge_fault(struct vm_fault *vmf, unsigned int order)
+#else
+static vm_fault_t dma_sg_vm_huge_fault(struct vm_fault *vmf, enum page_entry_size pe_size)
+#endif
+{
+    struct vm_area_struct *vma = vmf->vma;
+    struct dma_sg_vma *m = vma->vm_private_data;
+    unsigned long addr = vmf->address & PMD_MASK;
+    unsigned long nr = PMD_SIZE >> PAGE_SHIFT;
+    unsigned long first, pfn;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 6, 0)
+    if (order != PMD_SHIFT - PAGE_SHIFT) {
+#else
+    if (pe_size != PE_SIZE_PMD) {
+#endif
+        return VM_FAULT_FALLBACK;
+    }
+    if (addr < vma->vm_start || addr + PMD_SIZE > vma->vm_end) {
+        return VM_FAULT_FALLBACK;
     }
 
-    dd->single_size = size;
-    dd->single_dir = dir;
-    dd->single_mapped = true;
+    first = (addr - vma->vm_start) >> PAGE_SHIFT;
+    if (first + nr > m->nr_pages) {
+        return VM_FAULT_FALLBACK;
+    }
 
-    printk(KERN_INFO "DMA: Single buffer mapped\n");
-    printk(KERN_INFO "DMA:   virt addr = %p\n", dd->single_buf);
-    printk(KERN_INFO "DMA:   dma addr  = %#llx\n", (u64)dd->single_dma);
+    /* Pages are sorted by PFN, so aligned ends mean one aligned 2MB run */
+    pfn = page_to_pfn(m->pages[first]);
+    if (!IS_ALIGNED(pfn, nr) || page_to_pfn(m->pages[first + nr - 1]) != pfn + nr - 1) {
+        return VM_FAULT_FALLBACK;
+    }
 
-    return 0;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 17, 0)
+    return vmf_insert_pfn_pmd(vmf, pfn, vmf->flags & FAULT_FLAG_WRITE);
+#else
+    return vmf_insert_pfn_pmd(vmf, pfn_to_pfn_t(pfn), vmf->flags & FAULT_FLAG_WRITE);
+#endif
 }
+#endif
+
+static const struct vm_operations_struct dma_sg_vm_ops = {
+    .open       = dma_sg_vm_open,
+    .close      = dma_sg_vm_close,
+    .fault      = dma_sg_vm_fault,
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+    .huge_fault = dma_sg_vm_huge_fault,
+#endif
+};
 
-static int dma_unmap_single_dev(struct device *dev, struct m_chr_device_data *dd)
+static int dma_sg_mmap(struct dma_file_ctx *fctx, struct vm_area_struct *vma)
 {
-    if (!dd->single_mapped) {
-        printk(KERN_WARNING "DMA: No single buffer to unmap\n");
+    unsigned long nr = vma_pages(vma);
+    struct dma_sg_vma *m;
+    unsigned long i;
+
+    /* A private writable PFN mapping would need copy-on-write */
+    if (!(vma->vm_flags & VM_SHARED)) {
+        return -EINVAL;
+    }
+
+    m = kzalloc(sizeof(*m), GFP_KERNEL);
+    if (!m) {
+        return -ENOMEM;
+    }
+
+    mutex_lock(&fctx->sg_lock);
+    if (!fctx->sg_mapped || nr > fctx->sg_nents) {
+        mutex_unlock(&fctx->sg_lock);
+        kfree(m);
         return -EINVAL;
     }
+    m->pages = kvmalloc_array(nr, sizeof(*m->pages), GFP_KERNEL);
+    if (!m->pages) {
+        mutex_unlock(&fctx->sg_lock);
+        kfree(m);
+        return -ENOMEM;
+    }
+    for (i = 0; i < nr; i++) {
+        m->pages[i] = fctx->sg_pages[i];
+        get_page(m->pages[i]);
+    }
+    m->nr_pages = nr;
+    mutex_unlock(&fctx->sg_lock);
 
-    printk(KERN_INFO "DMA: Unmapping single buffer\n");
-    dma_unmap_single(dev, dd->single_dma, dd->single_size, dd->single_dir);
-    kfree(dd->single_buf);
+    kref_init(&m->ref);
+    vma->vm_private_data = m;
+    vma->vm_ops = &dma_sg_vm_ops;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+    vm_flags_set(vma, VM_PFNMAP | VM_DONTEXPAND | VM_DONTDUMP | VM_HUGEPAGE);
+#else
+    vma->vm_flags |= VM_PFNMAP | VM_DONTEXPAND | VM_DONTDUMP | VM_HUGEPAGE;
+#endif
 
-    dd->single_buf = NULL;
-    dd->single_dma = 0;
-    dd->single_size = 0;
-    dd->single_mapped = false;
+    printk(KERN_INFO "DMA: Mapped SG buffer, %lu bytes at %#lx\n",
+           nr << PAGE_SHIFT, vma->vm_start);
 
     return 0;
 }
 
-static int dma_sync_single_dev(struct device *dev, struct m_chr_device_data *dd,
-                                int direction)
+static int m_chrdev_mmap(struct file *file, struct vm_area_struct *vma)
 {
-    enum dma_data_direction dir = user_to_kernel_dir(direction);
+    struct dma_file_ctx *fctx = file->private_data;
+    struct dma_coherent_buf *buf;
+    unsigned long len = vma->vm_end - vma->vm_start;
+    int handle = vma->vm_pgoff;
+    int ret;
 
-    if (!dd->single_mapped) {
-        printk(KERN_WARNING "DMA: No single buffer to sync\n");
-        return -EINVAL;
+    if (handle == 0) {
+        return dma_sg_mmap(fctx, vma);
     }
 
-    printk(KERN_INFO "DMA: Syncing single buffer, dir: %d\n", dir);
+    buf = dma_coherent_get(fctx, handle);
+    if (!buf) {
+        return -EINVAL;
+    }
 
-    if (dir == DMA_TO_DEVICE || dir == DMA_BIDIRECTIONAL) {
-        dma_sync_single_for_device(dev, dd->single_dma, dd->single_size, dir);
-        printk(KERN_INFO "DMA: Synced for device\n");
+    if (len > PAGE_ALIGN(buf->size)) {
+        dma_coherent_put(buf);
+        return -EINVAL;
     }
 
-    if (dir == DMA_FROM_DEVICE || dir == DMA_BIDIRECTIONAL) {
-        dma_sync_single_for_cpu(dev, dd->single_dma, dd->single_size, dir);
-        printk(KERN_INFO "DMA: Synced for CPU\n");
+    /* The offset named the buffer, the mapping itself starts at byte 0 */
+    vma->vm_pgoff = 0;
+    ret = dma_mmap_coherent(buf->dev, vma, buf->vaddr, buf->dma, buf->size);
+    if (ret) {
+        dma_coherent_put(buf);
+        return ret;
     }
 
+    /* The lookup reference now belongs to the mapping */
+    vma->vm_private_data = buf;
+    vma->vm_ops = &dma_coherent_vm_ops;
+    printk(KERN_INFO "DMA: Mapped coherent buffer %d, %lu bytes\n", handle, len);
+
     return 0;
 }
 
 /*==============================================================================
- * Scatter-Gather DMA Operations
+ * Streaming DMA Single Mapping Operations
  *==============================================================================*/
 
-static int dma_map_sg_dev(struct device *dev, struct m_chr_device_data *dd,
-                           int nents, int direction)
+static size_t dma_cache_class_size(int cls)
 {
-    enum dma_data_direction dir = user_to_kernel_dir(direction);
-    int i, ret;
+    return PAGE_SIZE << (2 * cls);
+}
 
-    printk(KERN_INFO "DMA: Mapping scatter-gather, nents: %d, dir: %d\n", nents, dir);
+static int dma_cache_class(size_t size)
+{
+    int cls;
 
-    if (dd->sg_mapped) {
-        printk(KERN_WARNING "DMA: SG already mapped\n");
-        return -EBUSY;
+    for (cls = 0; cls < DMA_CACHE_CLASSES; cls++) {
+        if (size <= dma_cache_class_size(cls)) {
+            return cls;
+        }
     }
 
-    /* Allocate pages for scatter-gather */
-    dd->sg_pages = kmalloc_array(nents, sizeof(struct page *), GFP_KERNEL);
-    if (!dd->sg_pages) {
-        printk(KERN_ERR "DMA: Failed to allocate sg_pages array\n");
-        return -ENOMEM;
+    return -1;
+}
+
+static void dma_cache_buf_free(struct device *dev, struct dma_cache_buf *cbuf)
+{
+    dma_unmap_single(dev, cbuf->dma, dma_cache_class_size(cbuf->cls),
+                     DMA_BIDIRECTIONAL);
+    kfree(cbuf->vaddr);
+    kfree(cbuf);
+}
+
+/*
+ * Get a mapped buffer for size bytes on node nid, any node for NUMA_NO_NODE.
+ * Returns NULL when the cache is off or size is beyond the largest class,
+ * so the caller maps a buffer itself.
+ */
+static struct dma_cache_buf *dma_cache_get(struct device *dev,
+                                           struct m_chr_device_data *dd,
+                                           size_t size, int nid)
+{
+    struct dma_buf_cache *cache = &dd->cache;
+    struct dma_cache_buf *cbuf = NULL, *tmp;
+    int cls = dma_cache_class(size);
+
+    if (cls < 0) {
+        return NULL;
     }
 
-    for (i = 0; i < nents; i++) {
-        /* GFP_DMA32 ensures allocation is below 4GB on x86_64 */
-        dd->sg_pages[i] = alloc_page(GFP_KERNEL | GFP_DMA32);
-        if (!dd->sg_pages[i]) {
-            printk(KERN_ERR "DMA: Failed to allocate page %d\n", i);
-            /* Free previously allocated pages */
-            while (--i >= 0) {
-                __free_page(dd->sg_pages[i]);
-            }
-            kfree(dd->sg_pages);
-            dd->sg_pages = NULL;
-            return -ENOMEM;
+    spin_lock(&cache->lock);
+    if (!cache->enabled) {
+        spin_unlock(&cache->lock);
+        return NULL;
+    }
+    /* A class holds at most DMA_CACHE_MAX_FREE buffers, a walk is cheap */
+    list_for_each_entry(tmp, &cache->free[cls], node) {
+        if (nid == NUMA_NO_NODE || tmp->nid == nid) {
+            cbuf = tmp;
+            break;
         }
-        /* Initialize page with pattern */
-        memset(page_address(dd->sg_pages[i]), 0xBB, PAGE_SIZE);
     }
+    if (cbuf) {
+        list_del(&cbuf->node);
+        cache->nr_free[cls]--;
+        cache->hits++;
+    } else {
+        cache->misses++;
+    }
+    spin_unlock(&cache->lock);
 
-    /* Initialize scatter-gather table */
-    ret = sg_alloc_table(&dd->sg_table, nents, GFP_KERNEL);
-    if (ret) {
-        printk(KERN_ERR "DMA: Failed to allocate sg table\n");
-        for (i = 0; i < nents; i++) {
-            __free_page(dd->sg_pages[i]);
-        }
-        kfree(dd->sg_pages);
-        dd->sg_pages = NULL;
-        return ret;
+    if (cbuf) {
+        return cbuf;
     }
 
-    /* Set up scatter-gather entries using sg_assign_page */
-    {
-        struct scatterlist *sg;
-        int i;
-        for_each_sg(dd->sg_table.sgl, sg, nents, i) {
-            sg_assign_page(sg, dd->sg_pages[i]);
-            sg->length = PAGE_SIZE;
-        }
+    cbuf = kzalloc(sizeof(*cbuf), GFP_KERNEL);
+    if (!cbuf) {
+        return ERR_PTR(-ENOMEM);
     }
 
-    /* Map scatter-gather */
-    ret = dma_map_sg(dev, dd->sg_table.sgl, nents, dir);
-    if (ret == 0) {
-        printk(KERN_ERR "DMA: Failed to map sg\n");
-        sg_free_table(&dd->sg_table);
-        for (i = 0; i < nents; i++) {
-            __free_page(dd->sg_pages[i]);
-        }
-        kfree(dd->sg_pages);
-        dd->sg_pages = NULL;
-        return -EIO;
+    cbuf->cls = cls;
+    cbuf->vaddr = kmalloc_node(dma_cache_class_size(cls), GFP_KERNEL, nid);
+    if (!cbuf->vaddr) {
+        kfree(cbuf);
+        return ERR_PTR(-ENOMEM);
+    }
+    cbuf->nid = dma_vaddr_node(cbuf->vaddr);
+
+    cbuf->dma = dma_map_single(dev, cbuf->vaddr, dma_cache_class_size(cls),
+                               DMA_BIDIRECTIONAL);
+    if (dma_mapping_error(dev, cbuf->dma)) {
+        kfree(cbuf->vaddr);
+        kfree(cbuf);
+        return ERR_PTR(-EIO);
     }
 
-    /* Save the original nents before it gets modified by dma_map_sg */
-    dd->sg_nents = nents;
-    dd->sg_dir = dir;
-    dd->sg_mapped = true;
+    return cbuf;
+}
 
-    printk(KERN_INFO "DMA: SG mapped, %d entries\n", ret);
-    {
-        struct scatterlist *sg;
-        int i;
-        for_each_sg(dd->sg_table.sgl, sg, ret, i) {
-            phys_addr_t phys_addr = sg_phys(sg);
-            dma_addr_t dma_addr = sg_dma_address(sg);
-            unsigned int sg_len = sg_dma_len(sg);
+/* Return a buffer to its class, or free it if the class is full */
+static void dma_cache_put(struct device *dev, struct m_chr_device_data *dd,
+                          struct dma_cache_buf *cbuf)
+{
+    struct dma_buf_cache *cache = &dd->cache;
+
+    spin_lock(&cache->lock);
+    if (cache->enabled && cache->nr_free[cbuf->cls] < DMA_CACHE_MAX_FREE) {
+        /* LIFO, the most recently used buffer is the most cache-hot */
+        list_add(&cbuf->node, &cache->free[cbuf->cls]);
+        cache->nr_free[cbuf->cls]++;
+        cbuf = NULL;
+    }
+    spin_unlock(&cache->lock);
+
+    if (cbuf) {
+        dma_cache_buf_free(dev, cbuf);
+    }
+}
+
+/* Free up to nr idle buffers, largest class first; returns how many */
+static unsigned long dma_cache_drain(struct device *dev, struct m_chr_device_data *dd,
+                                     unsigned long nr)
+{
+    struct dma_buf_cache *cache = &dd->cache;
+    struct dma_cache_buf *cbuf, *tmp;
+    unsigned long freed = 0;
+    LIST_HEAD(reap);
+    int cls;
+
+    spin_lock(&cache->lock);
+    for (cls = DMA_CACHE_CLASSES - 1; cls >= 0 && freed < nr; cls--) {
+        while (!list_empty(&cache->free[cls]) && freed < nr) {
+            cbuf = list_first_entry(&cache->free[cls], struct dma_cache_buf, node);
+            list_move(&cbuf->node, &reap);
+            cache->nr_free[cls]--;
+            freed++;
+        }
+    }
+    cache->reaped += freed;
+    spin_unlock(&cache->lock);
+
+    /* Unmap outside the lock */
+    list_for_each_entry_safe(cbuf, tmp, &reap, node) {
+        dma_cache_buf_free(dev, cbuf);
+    }
+
+    return freed;
+}
+
+static struct m_chr_device_data *dma_cache_shrinker_dd(struct shrinker *shrink)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+    return shrink->private_data;
+#else
+    return container_of(shrink, struct m_chr_device_data, cache.shrinker);
+#endif
+}
+
+static unsigned long dma_cache_shrink_count(struct shrinker *shrink,
+                                            struct shrink_control *sc)
+{
+    struct m_chr_device_data *dd = dma_cache_shrinker_dd(shrink);
+    unsigned long count = 0;
+    int cls;
+
+    for (cls = 0; cls < DMA_CACHE_CLASSES; cls++) {
+        count += READ_ONCE(dd->cache.nr_free[cls]);
+    }
+
+    return count ? count : SHRINK_EMPTY;
+}
+
+static unsigned long dma_cache_shrink_scan(struct shrinker *shrink,
+                                           struct shrink_control *sc)
+{
+    struct m_chr_device_data *dd = dma_cache_shrinker_dd(shrink);
+    unsigned long freed = dma_cache_drain(dd->dev, dd, sc->nr_to_scan);
+
+    return freed ? freed : SHRINK_STOP;
+}
+
+static int dma_cache_init(struct m_chr_device_data *dd, int idx)
+{
+    struct dma_buf_cache *cache = &dd->cache;
+    int cls;
+
+    spin_lock_init(&cache->lock);
+    for (cls = 0; cls < DMA_CACHE_CLASSES; cls++) {
+        INIT_LIST_HEAD(&cache->free[cls]);
+    }
+    cache->enabled = buf_cache;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+    cache->shrinker = shrinker_alloc(0, "m_chrdev_%d-dma-cache", idx);
+    if (!cache->shrinker) {
+        return -ENOMEM;
+    }
+    cache->shrinker->count_objects = dma_cache_shrink_count;
+    cache->shrinker->scan_objects = dma_cache_shrink_scan;
+    cache->shrinker->private_data = dd;
+    shrinker_register(cache->shrinker);
+    return 0;
+#else
+    cache->shrinker.count_objects = dma_cache_shrink_count;
+    cache->shrinker.scan_objects = dma_cache_shrink_scan;
+    cache->shrinker.seeks = DEFAULT_SEEKS;
+    return dma_register_shrinker(&cache->shrinker, "m_chrdev_%d-dma-cache", idx);
+#endif
+}
+
+static void dma_cache_exit(struct m_chr_device_data *dd)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+    shrinker_free(dd->cache.shrinker);
+#else
+    unregister_shrinker(&dd->cache.shrinker);
+#endif
+    dma_cache_drain(dd->dev, dd, ULONG_MAX);
+}
+
+static int dma_cache_ctl(struct m_chr_device_data *dd,
+                         struct dma_cache_ctl __user *uctl)
+{
+    struct dma_buf_cache *cache = &dd->cache;
+    struct dma_cache_ctl ctl;
+    int cls;
+
+    if (copy_from_user(&ctl, uctl, sizeof(ctl))) {
+        return -EFAULT;
+    }
+
+    spin_lock(&cache->lock);
+    if (ctl.enable >= 0) {
+        cache->enabled = ctl.enable;
+    }
+    spin_unlock(&cache->lock);
+
+    /* A disabled cache keeps no idle buffers */
+    if (ctl.enable == 0) {
+        dma_cache_drain(dd->dev, dd, ULONG_MAX);
+    }
+
+    spin_lock(&cache->lock);
+    ctl.enable = cache->enabled;
+    ctl.nr_free = 0;
+    for (cls = 0; cls < DMA_CACHE_CLASSES; cls++) {
+        ctl.nr_free += cache->nr_free[cls];
+    }
+    ctl.hits = cache->hits;
+    ctl.misses = cache->misses;
+    ctl.reaped = cache->reaped;
+    spin_unlock(&cache->lock);
+
+    printk(KERN_INFO "DMA: Buffer cache %s, %u idle, hits %llu, misses %llu, reaped %llu\n",
+           ctl.enable ? "on" : "off", ctl.nr_free, ctl.hits, ctl.misses, ctl.reaped);
+
+    if (copy_to_user(uctl, &ctl, sizeof(ctl))) {
+        return -EFAULT;
+    }
+
+    return 0;
+}
+
+/* Map a streaming buffer as the file's single mapping, single_lock must be held */
+static int dma_map_single_dev(struct dma_file_ctx *fctx, unsigned long size,
+                              int direction, int nid)
+{
+    struct device *dev = fctx->dd->dev;
+    enum dma_data_direction dir = user_to_kernel_dir(direction);
+    struct dma_cache_buf *cbuf;
+
+    dma_log("Mapping single buffer, size: %lu, dir: %d, node: %d\n", size, dir, nid);
+
+    if (fctx->single_mapped) {
+        printk(KERN_WARNING "DMA: Single buffer already mapped\n");
+        return -EBUSY;
+    }
+
+    if (dir == DMA_NONE || size == 0) {
+        return -EINVAL;
+    }
+
+    cbuf = dma_cache_get(dev, fctx->dd, size, nid);
+    if (IS_ERR(cbuf)) {
+        printk(KERN_ERR "DMA: Failed to get cached single buffer\n");
+        return PTR_ERR(cbuf);
+    }
+
+    if (cbuf) {
+        /* Already mapped, only hand ownership to the device */
+        dma_sync_single_for_device(dev, cbuf->dma, size, dir);
+        fctx->single_cbuf = cbuf;
+        fctx->single_buf = cbuf->vaddr;
+        fctx->single_dma = cbuf->dma;
+    } else {
+        fctx->single_buf = kmalloc_node(size, GFP_KERNEL, nid);
+        if (!fctx->single_buf) {
+            printk(KERN_ERR "DMA: Failed to allocate single buffer\n");
+            return -ENOMEM;
+        }
+
+        fctx->single_dma = dma_map_single(dev, fctx->single_buf, size, dir);
+        if (dma_mapping_error(dev, fctx->single_dma)) {
+            printk(KERN_ERR "DMA: Failed to map single buffer\n");
+            kfree(fctx->single_buf);
+            fctx->single_buf = NULL;
+            return -EIO;
+        }
+    }
+
+    fctx->single_size = size;
+    fctx->single_dir = dir;
+    fctx->single_nid = dma_vaddr_node(fctx->single_buf);
+    fctx->single_mapped = true;
+
+    dma_log("Single buffer mapped%s on node %d\n", cbuf ? " (cached)" : "",
+            fctx->single_nid);
+    dma_log("  virt addr = %p\n", fctx->single_buf);
+    dma_log("  dma addr  = %#llx\n", (u64)fctx->single_dma);
+
+    return 0;
+}
+
+static int dma_unmap_single_dev(struct dma_file_ctx *fctx)
+{
+    struct device *dev = fctx->dd->dev;
+
+    if (!fctx->single_mapped) {
+        printk(KERN_WARNING "DMA: No single buffer to unmap\n");
+        return -EINVAL;
+    }
+
+    dma_log("Unmapping single buffer\n");
+    if (fctx->single_cbuf) {
+        /* Take ownership back for the CPU and keep the mapping */
+        dma_sync_single_for_cpu(dev, fctx->single_dma, fctx->single_size, fctx->single_dir);
+        dma_cache_put(dev, fctx->dd, fctx->single_cbuf);
+        fctx->single_cbuf = NULL;
+    } else {
+        dma_unmap_single(dev, fctx->single_dma, fctx->single_size, fctx->single_dir);
+        kfree(fctx->single_buf);
+    }
+
+    fctx->single_buf = NULL;
+    fctx->single_dma = 0;
+    fctx->single_size = 0;
+    fctx->single_mapped = false;
+
+    return 0;
+}
+
+static int dma_sync_single_dev(struct dma_file_ctx *fctx, int direction)
+{
+    struct device *dev = fctx->dd->dev;
+    enum dma_data_direction dir = user_to_kernel_dir(direction);
+
+    if (!fctx->single_mapped) {
+        printk(KERN_WARNING "DMA: No single buffer to sync\n");
+        return -EINVAL;
+    }
+
+    dma_log("Syncing single buffer, dir: %d\n", dir);
+
+    if (dir == DMA_TO_DEVICE || dir == DMA_BIDIRECTIONAL) {
+        dma_sync_single_for_device(dev, fctx->single_dma, fctx->single_size, dir);
+        dma_log("Synced for device\n");
+    }
+
+    if (dir == DMA_FROM_DEVICE || dir == DMA_BIDIRECTIONAL) {
+        dma_sync_single_for_cpu(dev, fctx->single_dma, fctx->single_size, dir);
+        dma_log("Synced for CPU\n");
+    }
+
+    return 0;
+}
+
+/*==============================================================================
+ * Scatter-Gather DMA Operations
+ *==============================================================================*/
+
+static int dma_sg_page_cmp(const void *a, const void *b)
+{
+    unsigned long pfn_a = page_to_pfn(*(struct page * const *)a);
+    unsigned long pfn_b = page_to_pfn(*(struct page * const *)b);
+
+    return pfn_a < pfn_b ? -1 : pfn_a > pfn_b;
+}
+
+/*
+ * sg_pages lists every PAGE_SIZE page, also those inside a compound chunk.
+ * A chunk holds a single reference, dropped through its head page.
+ */
+static void dma_sg_free_pages(struct dma_file_ctx *fctx, int nr_pages)
+{
+    int i;
+
+    for (i = 0; i < nr_pages; i++) {
+        if (!PageTail(fctx->sg_pages[i])) {
+            put_page(fctx->sg_pages[i]);
+        }
+    }
+    kvfree(fctx->sg_pages);
+    fctx->sg_pages = NULL;
+}
+
+/*
+ * Fill sg_pages with nr_pages pages. With high_order the pages come in
+ * compound chunks of up to DMA_SG_MAX_ORDER, each one physically
+ * contiguous and so one segment and, mapped to userspace, one PMD. When a
+ * chunk size can't be had the order drops and stays down, rather than
+ * paying for a failed high-order attempt on every chunk.
+ */
+static int dma_sg_alloc_pages(struct dma_file_ctx *fctx, int nr_pages, int nid,
+                              bool high_order)
+{
+    gfp_t gfp = dma_sg_gfp(fctx->dd);
+    unsigned int order = high_order ? DMA_SG_MAX_ORDER : 0;
+    struct page *page;
+    int i = 0, j;
+
+    fctx->sg_max_order = 0;
+    while (i < nr_pages) {
+        while (order && (1 << order) > nr_pages - i) {
+            order--;
+        }
+
+        /* NUMA_NO_NODE makes this plain alloc_pages() */
+        page = alloc_pages_node(nid, order ? gfp | __GFP_COMP | __GFP_NOWARN |
+                                             __GFP_NORETRY : gfp, order);
+        if (!page) {
+            if (order) {
+                order--;
+                continue;
+            }
+            printk(KERN_ERR "DMA: Failed to allocate page %d\n", i);
+            dma_sg_free_pages(fctx, i);
+            return -ENOMEM;
+        }
+
+        fctx->sg_max_order = max(fctx->sg_max_order, order);
+        for (j = 0; j < (1 << order); j++) {
+            fctx->sg_pages[i++] = nth_page(page, j);
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Map nr_pages driver-owned pages. The pages are sorted by PFN before the
+ * table is built so that physically adjacent pages land next to each other
+ * and sg_alloc_table_from_pages() can merge them into one segment. The
+ * table chains itself once it outgrows a single scatterlist chunk, so the
+ * size is only bounded by DMA_MAX_SG_SIZE. sg_lock must be held.
+ */
+static int dma_map_sg_dev(struct dma_file_ctx *fctx, int nr_pages, int direction,
+                          int nid, unsigned int flags)
+{
+    struct device *dev = fctx->dd->dev;
+    enum dma_data_direction dir = user_to_kernel_dir(direction);
+    int i, ret, off_node = 0;
+
+    dma_log("Mapping scatter-gather, pages: %d, dir: %d, node: %d\n",
+            nr_pages, dir, nid);
+
+    if (fctx->sg_mapped) {
+        printk(KERN_WARNING "DMA: SG already mapped\n");
+        return -EBUSY;
+    }
+
+    if (dir == DMA_NONE || nr_pages <= 0 ||
+        nr_pages > DMA_MAX_SG_SIZE / SG_PAGE_SIZE) {
+        return -EINVAL;
+    }
+
+    /* Allocate pages for scatter-gather */
+    fctx->sg_pages = kvmalloc_array(nr_pages, sizeof(struct page *), GFP_KERNEL);
+    if (!fctx->sg_pages) {
+        printk(KERN_ERR "DMA: Failed to allocate sg_pages array\n");
+        return -ENOMEM;
+    }
+
+    ret = dma_sg_alloc_pages(fctx, nr_pages, nid, flags & DMA_ALLOC_HIGH_ORDER);
+    if (ret) {
+        return ret;
+    }
+
+    for (i = 0; i < nr_pages; i++) {
+        if (page_to_nid(fctx->sg_pages[i]) != page_to_nid(fctx->sg_pages[0])) {
+            off_node++;
+        }
+        /* Initialize page with pattern */
+        memset(page_address(fctx->sg_pages[i]), 0xBB, PAGE_SIZE);
+    }
+
+    sort(fctx->sg_pages, nr_pages, sizeof(struct page *), dma_sg_page_cmp, NULL);
+
+    /* Build the table, merging physically contiguous pages */
+    ret = sg_alloc_table_from_pages(&fctx->sg_table, fctx->sg_pages, nr_pages, 0,
+                                    (unsigned long)nr_pages * SG_PAGE_SIZE,
+                                    GFP_KERNEL);
+    if (ret) {
+        printk(KERN_ERR "DMA: Failed to allocate sg table\n");
+        dma_sg_free_pages(fctx, nr_pages);
+        return ret;
+    }
+
+    /* Map scatter-gather, sg_table.nents becomes the DMA segment count */
+    ret = dma_map_sgtable(dev, &fctx->sg_table, dir, 0);
+    if (ret) {
+        printk(KERN_ERR "DMA: Failed to map sg\n");
+        sg_free_table(&fctx->sg_table);
+        dma_sg_free_pages(fctx, nr_pages);
+        return ret;
+    }
+
+    fctx->sg_nents = nr_pages;
+    fctx->sg_dir = dir;
+    /* The allocator falls back to other nodes when nid runs short */
+    fctx->sg_nid = off_node ? NUMA_NO_NODE : page_to_nid(fctx->sg_pages[0]);
+    fctx->sg_mapped = true;
+
+    dma_log("SG mapped, %d pages up to order %u, %u segments, %u DMA entries, node %d\n",
+            nr_pages, fctx->sg_max_order, fctx->sg_table.orig_nents, fctx->sg_table.nents,
+            fctx->sg_nid);
+    {
+        struct scatterlist *sg;
+        unsigned int nr_print = min_t(unsigned int, fctx->sg_table.nents, SG_PRINT_MAX);
+        int i;
+        for_each_sg(fctx->sg_table.sgl, sg, nr_print, i) {
+            phys_addr_t phys_addr = sg_phys(sg);
+            dma_addr_t dma_addr = sg_dma_address(sg);
+            unsigned int sg_len = sg_dma_len(sg);
+
+            dma_log("  sg[%d]: phys_addr=0x%pa (below 4G: %s), dma_addr/iova=0x%pad, len=0x%x\n",
+                    i, &phys_addr, phys_addr < SZ_4G ? "yes" : "no",
+                    &dma_addr, sg_len);
+        }
+    }
+
+    return 0;
+}
+
+static int dma_unmap_sg_dev(struct dma_file_ctx *fctx)
+{
+    struct device *dev = fctx->dd->dev;
+
+    if (!fctx->sg_mapped) {
+        printk(KERN_WARNING "DMA: No SG to unmap\n");
+        return -EINVAL;
+    }
+
+    dma_log("Unmapping scatter-gather\n");
+
+    dma_unmap_sgtable(dev, &fctx->sg_table, fctx->sg_dir, 0);
+    sg_free_table(&fctx->sg_table);
+    dma_sg_free_pages(fctx, fctx->sg_nents);
+
+    fctx->sg_mapped = false;
+
+    return 0;
+}
+
+static int dma_sync_sg_dev(struct dma_file_ctx *fctx, int direction)
+{
+    struct device *dev = fctx->dd->dev;
+    enum dma_data_direction dir = user_to_kernel_dir(direction);
+
+    if (!fctx->sg_mapped) {
+        printk(KERN_WARNING "DMA: No SG to sync\n");
+        return -EINVAL;
+    }
+
+    dma_log("Syncing scatter-gather, dir: %d\n", dir);
+
+    if (dir == DMA_TO_DEVICE || dir == DMA_BIDIRECTIONAL) {
+        dma_sync_sgtable_for_device(dev, &fctx->sg_table, dir);
+        dma_log("Synced SG for device\n");
+    }
+
+    if (dir == DMA_FROM_DEVICE || dir == DMA_BIDIRECTIONAL) {
+        dma_sync_sgtable_for_cpu(dev, &fctx->sg_table, dir);
+        dma_log("Synced SG for CPU\n");
+    }
+
+    return 0;
+}
+
+/*==============================================================================
+ * User Memory (Zero-Copy) DMA Operations
+ *==============================================================================*/
+
+/*
+ * Pin the pages behind a user buffer and map them for DMA in place, so the
+ * data never has to be copied into a kernel buffer first.
+ */
+static int dma_map_user_dev(struct dma_file_ctx *fctx, struct dma_ioctl_param *param)
+{
+    struct device *dev = fctx->dd->dev;
+    enum dma_data_direction dir = user_to_kernel_dir(param->direction);
+    unsigned long uaddr = param->user_addr;
+    unsigned int gup_flags = FOLL_LONGTERM;
+    struct dma_user_map *map;
+    int pinned;
+    int handle;
+    int ret;
+
+    printk(KERN_INFO "DMA: Mapping user buffer %#lx, size: %lu, dir: %d\n",
+           uaddr, param->size, dir);
+
+    if (dir == DMA_NONE || param->size == 0 ||
+        param->size > DMA_MAX_USER_MAP_SIZE) {
+        return -EINVAL;
+    }
+
+    map = kzalloc(sizeof(*map), GFP_KERNEL);
+    if (!map) {
+        return -ENOMEM;
+    }
+
+    map->nr_pages = DIV_ROUND_UP(offset_in_page(uaddr) + param->size, PAGE_SIZE);
+    map->pages = kvmalloc_array(map->nr_pages, sizeof(struct page *), GFP_KERNEL);
+    if (!map->pages) {
+        ret = -ENOMEM;
+        goto err_free_map;
+    }
+
+    /* The device writes into the pages unless it only reads from them */
+    if (dir != DMA_TO_DEVICE) {
+        gup_flags |= FOLL_WRITE;
+    }
+
+    pinned = pin_user_pages_fast(uaddr & PAGE_MASK, map->nr_pages, gup_flags,
+                                 map->pages);
+    if (pinned != map->nr_pages) {
+        printk(KERN_ERR "DMA: Pinned %d of %d user pages\n", pinned, map->nr_pages);
+        if (pinned > 0) {
+            unpin_user_pages(map->pages, pinned);
+        }
+        ret = pinned < 0 ? pinned : -EFAULT;
+        goto err_free_pages;
+    }
+
+    ret = sg_alloc_table_from_pages(&map->sgt, map->pages, map->nr_pages,
+                                    offset_in_page(uaddr), param->size,
+                                    GFP_KERNEL);
+    if (ret) {
+        printk(KERN_ERR "DMA: Failed to build sg table for user buffer\n");
+        goto err_unpin;
+    }
+
+    ret = dma_map_sgtable(dev, &map->sgt, dir, 0);
+    if (ret) {
+        printk(KERN_ERR "DMA: Failed to map user buffer\n");
+        goto err_free_table;
+    }
+
+    map->dev = dev;
+    map->dir = dir;
+
+    mutex_lock(&fctx->user_map_lock);
+    handle = idr_alloc(&fctx->user_map_idr, map, 1, DMA_MAX_USER_MAPS + 1,
+                       GFP_KERNEL);
+    mutex_unlock(&fctx->user_map_lock);
+    if (handle < 0) {
+        printk(KERN_WARNING "DMA: No free user mapping handle\n");
+        ret = handle == -ENOSPC ? -EBUSY : handle;
+        goto err_unmap;
+    }
+
+    param->handle = handle;
+    param->dma_addr = sg_dma_address(map->sgt.sgl);
+    param->count = map->sgt.nents;
+
+    printk(KERN_INFO "DMA: User buffer %d mapped, %d pages in %u sg entries\n",
+           handle, map->nr_pages, map->sgt.nents);
+
+    return 0;
+
+err_unmap:
+    dma_unmap_sgtable(dev, &map->sgt, dir, 0);
+err_free_table:
+    sg_free_table(&map->sgt);
+err_unpin:
+    unpin_user_pages(map->pages, map->nr_pages);
+err_free_pages:
+    kvfree(map->pages);
+err_free_map:
+    kfree(map);
+    return ret;
+}
+
+static void dma_user_map_release(struct dma_user_map *map)
+{
+    dma_unmap_sgtable(map->dev, &map->sgt, map->dir, 0);
+    sg_free_table(&map->sgt);
+    /* Pages the device may have written to must be marked dirty */
+    unpin_user_pages_dirty_lock(map->pages, map->nr_pages,
+                                map->dir != DMA_TO_DEVICE);
+    kvfree(map->pages);
+    kfree(map);
+}
+
+static int dma_unmap_user_dev(struct dma_file_ctx *fctx, int handle)
+{
+    struct dma_user_map *map;
+
+    mutex_lock(&fctx->user_map_lock);
+    map = idr_remove(&fctx->user_map_idr, handle);
+    mutex_unlock(&fctx->user_map_lock);
+
+    if (!map) {
+        printk(KERN_WARNING "DMA: No user mapping with handle %d\n", handle);
+        return -EINVAL;
+    }
+
+    printk(KERN_INFO "DMA: Unmapping user buffer %d\n", handle);
+    dma_user_map_release(map);
+
+    return 0;
+}
+
+/* Unmap every user mapping of a file that is going away */
+static void dma_unmap_user_all(struct dma_file_ctx *fctx)
+{
+    struct dma_user_map *map;
+    int handle;
+
+    mutex_lock(&fctx->user_map_lock);
+    idr_for_each_entry(&fctx->user_map_idr, map, handle) {
+        printk(KERN_INFO "DMA: Reclaiming user mapping %d\n", handle);
+        idr_remove(&fctx->user_map_idr, handle);
+        dma_user_map_release(map);
+    }
+    mutex_unlock(&fctx->user_map_lock);
+}
+
+/*==============================================================================
+ * Partial and Batched Sync
+ *==============================================================================*/
+
+/*
+ * Sync [offset, offset + len) of an sgtable mapping. Behind an IOMMU one DMA
+ * segment can cover physically scattered pages, so the range is located in
+ * the CPU entries and the run of entries it overlaps is synced through the
+ * sg API. The sync granularity is therefore whole entries.
+ */
+static void dma_sync_sgtable_range(struct device *dev, struct sg_table *sgt,
+                                   u64 offset, u64 len, enum dma_data_direction dir,
+                                   bool for_device)
+{
+    struct scatterlist *sg, *first = NULL;
+    u64 pos = 0;
+    int i, nents = 0;
+
+    for_each_sgtable_sg(sgt, sg, i) {
+        if (pos >= offset + len) {
+            break;
+        }
+        if (pos + sg->length > offset) {
+            if (!first) {
+                first = sg;
+            }
+            nents++;
+        }
+        pos += sg->length;
+    }
+
+    if (!first) {
+        return;
+    }
+
+    if (for_device) {
+        dma_sync_sg_for_device(dev, first, nents, dir);
+    } else {
+        dma_sync_sg_for_cpu(dev, first, nents, dir);
+    }
+}
+
+/* Bytes the CPU entries of a mapping cover */
+static u64 dma_sgtable_cpu_len(struct sg_table *sgt)
+{
+    struct scatterlist *sg;
+    u64 len = 0;
+    int i;
+
+    for_each_sgtable_sg(sgt, sg, i) {
+        len += sg->length;
+    }
+
+    return len;
+}
+
+/*
+ * Sync one range; user_map_lock must be held for DMA_SYNC_USER. The single
+ * and SG mappings are locked here, only for as long as the sync takes.
+ */
+static int dma_sync_range_dev(struct dma_file_ctx *fctx, struct dma_sync_range *range)
+{
+    struct device *dev = fctx->dd->dev;
+    enum dma_data_direction map_dir;
+    struct dma_user_map *map = NULL;
+    struct mutex *lock = NULL;
+    bool to_dev, to_cpu;
+    u64 size;
+    int ret = 0;
+
+    switch (range->direction) {
+    case DMA_USER_TO_DEVICE:
+        to_dev = true;
+        to_cpu = false;
+        break;
+    case DMA_USER_FROM_DEVICE:
+        to_dev = false;
+        to_cpu = true;
+        break;
+    case DMA_USER_BIDIRECTIONAL:
+        to_dev = true;
+        to_cpu = true;
+        break;
+    default:
+        return -EINVAL;
+    }
+
+    switch (range->target) {
+    case DMA_SYNC_SINGLE:
+        lock = &fctx->single_lock;
+        mutex_lock(lock);
+        if (!fctx->single_mapped) {
+            ret = -EINVAL;
+            goto out_unlock;
+        }
+        size = fctx->single_size;
+        map_dir = fctx->single_dir;
+        break;
+    case DMA_SYNC_SG:
+        lock = &fctx->sg_lock;
+        mutex_lock(lock);
+        if (!fctx->sg_mapped) {
+            ret = -EINVAL;
+            goto out_unlock;
+        }
+        size = dma_sgtable_cpu_len(&fctx->sg_table);
+        map_dir = fctx->sg_dir;
+        break;
+    case DMA_SYNC_USER:
+        map = idr_find(&fctx->user_map_idr, range->handle);
+        if (!map) {
+            return -EINVAL;
+        }
+        size = dma_sgtable_cpu_len(&map->sgt);
+        map_dir = map->dir;
+        dev = map->dev;
+        break;
+    default:
+        return -EINVAL;
+    }
+
+    if (range->offset >= size || range->length > size - range->offset) {
+        ret = -EINVAL;
+        goto out_unlock;
+    }
+    if (range->length == 0) {
+        range->length = size - range->offset;
+    }
+
+    /* The sync must use the direction the mapping was made with */
+    if (range->target == DMA_SYNC_SINGLE) {
+        if (to_dev) {
+            dma_sync_single_range_for_device(dev, fctx->single_dma, range->offset,
+                                             range->length, map_dir);
+        }
+        if (to_cpu) {
+            dma_sync_single_range_for_cpu(dev, fctx->single_dma, range->offset,
+                                          range->length, map_dir);
+        }
+    } else {
+        struct sg_table *sgt = map ? &map->sgt : &fctx->sg_table;
+
+        if (to_dev) {
+            dma_sync_sgtable_range(dev, sgt, range->offset, range->length,
+                                   map_dir, true);
+        }
+        if (to_cpu) {
+            dma_sync_sgtable_range(dev, sgt, range->offset, range->length,
+                                   map_dir, false);
+        }
+    }
+
+    dma_log("Synced %llu bytes at %llu of target %d%s%s\n", range->length,
+            range->offset, range->target, to_dev ? " for device" : "",
+            to_cpu ? " for CPU" : "");
+
+out_unlock:
+    if (lock) {
+        mutex_unlock(lock);
+    }
+    return ret;
+}
+
+/*
+ * Sync every range in the array in one call, stopping at the first bad
+ * one; batch->count reports how many were synced before it.
+ */
+static int dma_sync_batch_dev(struct dma_file_ctx *fctx, struct dma_sync_batch *batch)
+{
+    struct dma_sync_range *ranges;
+    unsigned int i;
+    int ret = 0;
+
+    if (batch->count == 0 || batch->count > DMA_SYNC_BATCH_MAX) {
+        return -EINVAL;
+    }
+
+    ranges = kvmalloc_array(batch->count, sizeof(*ranges), GFP_KERNEL);
+    if (!ranges) {
+        return -ENOMEM;
+    }
+
+    if (copy_from_user(ranges, u64_to_user_ptr(batch->ranges),
+                       (size_t)batch->count * sizeof(*ranges))) {
+        kvfree(ranges);
+        return -EFAULT;
+    }
+
+    /* One lock round trip for the whole batch rather than per range */
+    mutex_lock(&fctx->user_map_lock);
+    for (i = 0; i < batch->count; i++) {
+        ret = dma_sync_range_dev(fctx, &ranges[i]);
+        if (ret) {
+            printk(KERN_WARNING "DMA: Sync range %u of %u rejected\n",
+                   i, batch->count);
+            break;
+        }
+    }
+    mutex_unlock(&fctx->user_map_lock);
+
+    batch->count = i;
+    kvfree(ranges);
+
+    return ret;
+}
+
+/*==============================================================================
+ * DMA Pool Operations
+ *==============================================================================*/
+
+/* The default pool calls below expect dma_pool_lock to be held */
+static int dma_pool_create_dev(struct dma_file_ctx *fctx)
+{
+    printk(KERN_INFO "DMA: Creating DMA pool\n");
+
+    if (fctx->dma_pool) {
+        printk(KERN_WARNING "DMA: Pool already created\n");
+        return -EBUSY;
+    }
+
+    fctx->dma_pool = dma_pool_create("demo_dma_pool", fctx->dd->dev, DMA_POOL_SIZE,
+                                      DMA_POOL_BOUNDARY, 0);
+    if (!fctx->dma_pool) {
+        printk(KERN_ERR "DMA: Failed to create pool\n");
+        return -ENOMEM;
+    }
+
+    printk(KERN_INFO "DMA: Pool created, size: %d\n", DMA_POOL_SIZE);
+
+    return 0;
+}
+
+static int dma_pool_alloc_dev(struct dma_file_ctx *fctx)
+{
+    printk(KERN_INFO "DMA: Allocating from pool\n");
+
+    if (!fctx->dma_pool) {
+        printk(KERN_WARNING "DMA: Pool not created\n");
+        return -EINVAL;
+    }
+
+    if (fctx->pool_buf) {
+        printk(KERN_WARNING "DMA: Pool buffer already allocated\n");
+        return -EBUSY;
+    }
+
+    fctx->pool_buf = dma_pool_alloc(fctx->dma_pool, GFP_KERNEL, &fctx->pool_dma);
+    if (!fctx->pool_buf) {
+        printk(KERN_ERR "DMA: Failed to allocate from pool\n");
+        return -ENOMEM;
+    }
+
+    /* Initialize buffer */
+    memset(fctx->pool_buf, 0xCC, DMA_POOL_SIZE);
+
+    printk(KERN_INFO "DMA: Allocated from pool\n");
+    printk(KERN_INFO "DMA:   virt addr = %p\n", fctx->pool_buf);
+    printk(KERN_INFO "DMA:   dma addr  = %#llx\n", (u64)fctx->pool_dma);
+
+    return 0;
+}
+
+static int dma_pool_free_dev(struct dma_file_ctx *fctx)
+{
+    if (!fctx->pool_buf || !fctx->dma_pool) {
+        printk(KERN_WARNING "DMA: No pool buffer to free\n");
+        return -EINVAL;
+    }
+
+    printk(KERN_INFO "DMA: Freeing pool buffer\n");
+    dma_pool_free(fctx->dma_pool, fctx->pool_buf, fctx->pool_dma);
+
+    fctx->pool_buf = NULL;
+    fctx->pool_dma = 0;
+
+    return 0;
+}
+
+static int dma_pool_destroy_dev(struct dma_file_ctx *fctx)
+{
+    if (!fctx->dma_pool) {
+        printk(KERN_WARNING "DMA: No pool to destroy\n");
+        return -EINVAL;
+    }
+
+    if (fctx->pool_buf) {
+        printk(KERN_WARNING "DMA: Pool buffer still allocated, freeing\n");
+        dma_pool_free(fctx->dma_pool, fctx->pool_buf, fctx->pool_dma);
+        fctx->pool_buf = NULL;
+        fctx->pool_dma = 0;
+    }
+
+    printk(KERN_INFO "DMA: Destroying pool\n");
+    dma_pool_destroy(fctx->dma_pool);
+    fctx->dma_pool = NULL;
+
+    return 0;
+}
+
+/*==============================================================================
+ * Handle-Based DMA Pools with Bulk Operations
+ *==============================================================================*/
+
+/*
+ * Unlike the single default pool above, these pools are created with a
+ * caller-chosen block size, alignment and boundary, and hand out blocks in
+ * bulk. Every outstanding block sits in a slot so it can be freed by id;
+ * the free ids form a stack, so alloc and free are O(1) per block.
+ */
+static void dma_pool_ctx_free(struct dma_pool_ctx *ctx)
+{
+    unsigned int id;
+
+    for (id = 0; id < ctx->max_blocks; id++) {
+        if (ctx->slots[id].vaddr) {
+            dma_pool_free(ctx->pool, ctx->slots[id].vaddr, ctx->slots[id].dma);
+        }
+    }
+    dma_pool_destroy(ctx->pool);
+    kvfree(ctx->free_ids);
+    kvfree(ctx->slots);
+    kfree(ctx);
+}
+
+static int dma_pool_open_dev(struct dma_file_ctx *fctx, struct dma_pool_open *op)
+{
+    struct dma_pool_ctx *ctx;
+    char name[32];
+    unsigned int id;
+    int handle;
+    int ret;
+
+    if (op->size == 0 || op->size > PAGE_SIZE ||
+        (op->align && !is_power_of_2(op->align)) ||
+        (op->boundary && (!is_power_of_2(op->boundary) || op->boundary < op->size))) {
+        return -EINVAL;
+    }
+
+    if (op->max_blocks == 0) {
+        op->max_blocks = DMA_POOL_DEF_BLOCKS;
+    }
+    if (op->max_blocks > DMA_POOL_MAX_BLOCKS) {
+        return -EINVAL;
+    }
+
+    /* The node is 0666, charge the bookkeeping to the opener's memcg */
+    ctx = kzalloc(sizeof(*ctx), GFP_KERNEL_ACCOUNT);
+    if (!ctx) {
+        return -ENOMEM;
+    }
+
+    ctx->slots = kvcalloc(op->max_blocks, sizeof(*ctx->slots), GFP_KERNEL_ACCOUNT);
+    ctx->free_ids = kvmalloc_array(op->max_blocks, sizeof(*ctx->free_ids),
+                                   GFP_KERNEL_ACCOUNT);
+    if (!ctx->slots || !ctx->free_ids) {
+        ret = -ENOMEM;
+        goto err_free;
+    }
+
+    /* Hand out low ids first */
+    for (id = 0; id < op->max_blocks; id++) {
+        ctx->free_ids[id] = op->max_blocks - 1 - id;
+    }
+    ctx->nr_free_ids = op->max_blocks;
+
+    snprintf(name, sizeof(name), "demo_pool_%u", op->size);
+    ctx->pool = dma_pool_create(name, fctx->dd->dev, op->size, op->align ? op->align : 1,
+                                op->boundary);
+    if (!ctx->pool) {
+        printk(KERN_ERR "DMA: Failed to create pool\n");
+        ret = -ENOMEM;
+        goto err_free;
+    }
+
+    mutex_init(&ctx->lock);
+    ctx->size = op->size;
+    ctx->max_blocks = op->max_blocks;
+
+    mutex_lock(&fctx->pool_lock);
+    handle = idr_alloc(&fctx->pool_idr, ctx, 1, DMA_MAX_POOLS + 1, GFP_KERNEL);
+    mutex_unlock(&fctx->pool_lock);
+    if (handle < 0) {
+        ret = handle == -ENOSPC ? -EBUSY : handle;
+        dma_pool_destroy(ctx->pool);
+        goto err_free;
+    }
+
+    op->handle = handle;
+    printk(KERN_INFO "DMA: Pool %d created, size: %u, align: %u, boundary: %u, blocks: %u\n",
+           handle, op->size, op->align, op->boundary, op->max_blocks);
+
+    return 0;
+
+err_free:
+    kvfree(ctx->free_ids);
+    kvfree(ctx->slots);
+    kfree(ctx);
+    return ret;
+}
+
+static int dma_pool_close_dev(struct dma_file_ctx *fctx, int handle)
+{
+    struct dma_pool_ctx *ctx;
+
+    mutex_lock(&fctx->pool_lock);
+    ctx = idr_remove(&fctx->pool_idr, handle);
+    if (!ctx) {
+        mutex_unlock(&fctx->pool_lock);
+        printk(KERN_WARNING "DMA: No pool with handle %d\n", handle);
+        return -EINVAL;
+    }
+    /* Wait for a bulk operation that found the pool before we removed it */
+    mutex_lock(&ctx->lock);
+    mutex_unlock(&ctx->lock);
+    mutex_unlock(&fctx->pool_lock);
+
+    printk(KERN_INFO "DMA: Pool %d destroyed, %u blocks still out\n",
+           handle, ctx->max_blocks - ctx->nr_free_ids);
+    dma_pool_ctx_free(ctx);
+
+    return 0;
+}
+
+/* Close every pool of a file that is going away */
+static void dma_pool_close_all(struct dma_file_ctx *fctx)
+{
+    struct dma_pool_ctx *ctx;
+    int handle;
+
+    mutex_lock(&fctx->pool_lock);
+    idr_for_each_entry(&fctx->pool_idr, ctx, handle) {
+        idr_remove(&fctx->pool_idr, handle);
+        dma_pool_ctx_free(ctx);
+    }
+    mutex_unlock(&fctx->pool_lock);
+}
+
+/* Find the pool and return it with ctx->lock held */
+static struct dma_pool_ctx *dma_pool_ctx_get(struct dma_file_ctx *fctx, int handle)
+{
+    struct dma_pool_ctx *ctx;
+
+    mutex_lock(&fctx->pool_lock);
+    ctx = idr_find(&fctx->pool_idr, handle);
+    if (ctx) {
+        mutex_lock(&ctx->lock);
+    }
+    mutex_unlock(&fctx->pool_lock);
+
+    return ctx;
+}
+
+static int dma_pool_bulk_alloc_dev(struct dma_file_ctx *fctx, struct dma_pool_bulk *bulk)
+{
+    struct dma_pool_block *blocks;
+    struct dma_pool_ctx *ctx;
+    unsigned int i, id;
+    int ret = 0;
+
+    if (bulk->count == 0 || bulk->count > DMA_POOL_BULK_MAX) {
+        return -EINVAL;
+    }
+
+    blocks = kvmalloc_array(bulk->count, sizeof(*blocks), GFP_KERNEL);
+    if (!blocks) {
+        return -ENOMEM;
+    }
+
+    ctx = dma_pool_ctx_get(fctx, bulk->handle);
+    if (!ctx) {
+        kvfree(blocks);
+        return -EINVAL;
+    }
+
+    if (bulk->count > ctx->nr_free_ids) {
+        ret = -ENOSPC;
+        goto out_unlock;
+    }
+
+    for (i = 0; i < bulk->count; i++) {
+        id = ctx->free_ids[--ctx->nr_free_ids];
+        ctx->slots[id].vaddr = dma_pool_alloc(ctx->pool, GFP_KERNEL,
+                                              &ctx->slots[id].dma);
+        if (!ctx->slots[id].vaddr) {
+            ctx->nr_free_ids++;
+            ret = -ENOMEM;
+            break;
+        }
+        blocks[i].dma_addr = ctx->slots[id].dma;
+        blocks[i].id = id;
+        blocks[i].pad = 0;
+    }
+
+    if (ret == 0 &&
+        copy_to_user(u64_to_user_ptr(bulk->blocks), blocks,
+                     (size_t)bulk->count * sizeof(*blocks))) {
+        ret = -EFAULT;
+    }
+
+    /* All or nothing: give back what this call took if anything failed */
+    if (ret) {
+        while (i-- > 0) {
+            id = blocks[i].id;
+            dma_pool_free(ctx->pool, ctx->slots[id].vaddr, ctx->slots[id].dma);
+            ctx->slots[id].vaddr = NULL;
+            ctx->free_ids[ctx->nr_free_ids++] = id;
+        }
+    }
+
+    dma_log("Pool %d: allocated %u blocks, %u free ids left\n",
+            bulk->handle, ret ? 0 : bulk->count, ctx->nr_free_ids);
+
+out_unlock:
+    mutex_unlock(&ctx->lock);
+    kvfree(blocks);
+    return ret;
+}
+
+static int dma_pool_bulk_free_dev(struct dma_file_ctx *fctx, struct dma_pool_bulk *bulk)
+{
+    struct dma_pool_block *blocks;
+    struct dma_pool_ctx *ctx;
+    unsigned int i, id, done = 0;
+    int ret = 0;
+
+    if (bulk->count == 0 || bulk->count > DMA_POOL_BULK_MAX) {
+        return -EINVAL;
+    }
+
+    blocks = kvmalloc_array(bulk->count, sizeof(*blocks), GFP_KERNEL);
+    if (!blocks) {
+        return -ENOMEM;
+    }
+
+    if (copy_from_user(blocks, u64_to_user_ptr(bulk->blocks),
+                       (size_t)bulk->count * sizeof(*blocks))) {
+        kvfree(blocks);
+        return -EFAULT;
+    }
+
+    ctx = dma_pool_ctx_get(fctx, bulk->handle);
+    if (!ctx) {
+        kvfree(blocks);
+        return -EINVAL;
+    }
+
+    /* Stop at the first bad id; count tells the caller how far we got */
+    for (i = 0; i < bulk->count; i++) {
+        id = blocks[i].id;
+        if (id >= ctx->max_blocks || !ctx->slots[id].vaddr ||
+            ctx->slots[id].dma != blocks[i].dma_addr) {
+            printk(KERN_WARNING "DMA: Pool %d: bad block id %u\n", bulk->handle, id);
+            ret = -EINVAL;
+            break;
+        }
+        dma_pool_free(ctx->pool, ctx->slots[id].vaddr, ctx->slots[id].dma);
+        ctx->slots[id].vaddr = NULL;
+        ctx->free_ids[ctx->nr_free_ids++] = id;
+        done++;
+    }
+    bulk->count = done;
+
+    dma_log("Pool %d: freed %u blocks, %u free ids left\n",
+            bulk->handle, done, ctx->nr_free_ids);
+
+    mutex_unlock(&ctx->lock);
+    kvfree(blocks);
+    return ret;
+}
+
+/*==============================================================================
+ * Transfer Engines: dmaengine memcpy and kthread software copier
+ *==============================================================================*/
+
+/*
+ * A source or destination buffer of one of the four kinds the demo knows,
+ * described as nr_segs segments of seg_len bytes. SG buffers are split per
+ * page so source and destination segments always line up.
+ */
+struct dma_xfer_buf {
+    int type;
+    size_t size;
+    enum dma_data_direction dir;
+    unsigned int nr_segs;
+    size_t seg_len;
+    void *vaddr;                /* COHERENT, SINGLE, POOL */
+    dma_addr_t dma;
+    struct dma_pool *pool;      /* POOL */
+    struct page **pages;        /* SG */
+    dma_addr_t *page_dma;
+    struct sg_table sgt;
+};
+
+/* Software copier: one kthread working through a descriptor queue */
+struct dma_sw_desc {
+    struct list_head node;
+    void *dst;
+    void *src;
+    size_t len;
+    void (*callback)(void *param);
+    void *param;
+};
+
+struct dma_sw_engine {
+    struct task_struct *thread;
+    spinlock_t lock;
+    struct list_head queue;
+    wait_queue_head_t wq;
+};
+
+static void *dma_xfer_seg_cpu(struct dma_xfer_buf *buf, unsigned int i)
+{
+    return buf->type == DMA_XFER_SG ? page_address(buf->pages[i]) : buf->vaddr;
+}
+
+static dma_addr_t dma_xfer_seg_dma(struct dma_xfer_buf *buf, unsigned int i)
+{
+    return buf->type == DMA_XFER_SG ? buf->page_dma[i] : buf->dma;
+}
+
+static void dma_xfer_buf_free(struct device *dev, struct dma_xfer_buf *buf)
+{
+    unsigned int i;
+
+    switch (buf->type) {
+    case DMA_XFER_COHERENT:
+        if (buf->vaddr) {
+            dma_free_coherent(dev, buf->size, buf->vaddr, buf->dma);
+        }
+        break;
+    case DMA_XFER_SINGLE:
+        if (buf->vaddr) {
+            dma_unmap_single(dev, buf->dma, buf->size, buf->dir);
+            kfree(buf->vaddr);
+        }
+        break;
+    case DMA_XFER_POOL:
+        if (buf->vaddr) {
+            dma_pool_free(buf->pool, buf->vaddr, buf->dma);
+        }
+        dma_pool_destroy(buf->pool);
+        break;
+    case DMA_XFER_SG:
+        if (buf->page_dma) {
+            dma_unmap_sgtable(dev, &buf->sgt, buf->dir, 0);
+            sg_free_table(&buf->sgt);
+            kvfree(buf->page_dma);
+        }
+        if (buf->pages) {
+            for (i = 0; i < buf->nr_segs && buf->pages[i]; i++) {
+                __free_page(buf->pages[i]);
+            }
+            kvfree(buf->pages);
+        }
+        break;
+    }
+}
+
+static int dma_xfer_buf_alloc(struct device *dev, struct dma_xfer_buf *buf,
+                              int type, size_t size, enum dma_data_direction dir)
+{
+    struct sg_dma_page_iter iter;
+    unsigned int i;
+    int ret;
+
+    memset(buf, 0, sizeof(*buf));
+    buf->type = type;
+    buf->size = size;
+    buf->dir = dir;
+    buf->nr_segs = 1;
+    buf->seg_len = size;
+
+    switch (type) {
+    case DMA_XFER_COHERENT:
+        buf->vaddr = dma_alloc_coherent(dev, size, &buf->dma, GFP_KERNEL);
+        return buf->vaddr ? 0 : -ENOMEM;
+
+    case DMA_XFER_SINGLE:
+        buf->vaddr = kmalloc(size, GFP_KERNEL);
+        if (!buf->vaddr) {
+            return -ENOMEM;
+        }
+        buf->dma = dma_map_single(dev, buf->vaddr, size, dir);
+        if (dma_mapping_error(dev, buf->dma)) {
+            kfree(buf->vaddr);
+            buf->vaddr = NULL;
+            return -EIO;
+        }
+        return 0;
+
+    case DMA_XFER_POOL:
+        if (size > PAGE_SIZE) {
+            return -EINVAL;
+        }
+        buf->pool = dma_pool_create("demo_xfer_pool", dev, size, 64, 0);
+        if (!buf->pool) {
+            return -ENOMEM;
+        }
+        buf->vaddr = dma_pool_alloc(buf->pool, GFP_KERNEL, &buf->dma);
+        return buf->vaddr ? 0 : -ENOMEM;
+
+    case DMA_XFER_SG:
+        buf->size = PAGE_ALIGN(size);
+        buf->seg_len = PAGE_SIZE;
+        buf->nr_segs = buf->size >> PAGE_SHIFT;
+        buf->pages = kvcalloc(buf->nr_segs, sizeof(struct page *), GFP_KERNEL);
+        if (!buf->pages) {
+            return -ENOMEM;
+        }
+        for (i = 0; i < buf->nr_segs; i++) {
+            buf->pages[i] = alloc_page(GFP_KERNEL | DMA_ARCH_GFP_32BIT);
+            if (!buf->pages[i]) {
+                return -ENOMEM;
+            }
+        }
+        ret = sg_alloc_table_from_pages(&buf->sgt, buf->pages, buf->nr_segs, 0,
+                                        buf->size, GFP_KERNEL);
+        if (ret) {
+            return ret;
+        }
+        ret = dma_map_sgtable(dev, &buf->sgt, dir, 0);
+        if (ret) {
+            sg_free_table(&buf->sgt);
+            return ret;
+        }
+        buf->page_dma = kvmalloc_array(buf->nr_segs, sizeof(dma_addr_t), GFP_KERNEL);
+        if (!buf->page_dma) {
+            dma_unmap_sgtable(dev, &buf->sgt, dir, 0);
+            sg_free_table(&buf->sgt);
+            return -ENOMEM;
+        }
+        /* The IOMMU may have merged entries, walk the mapping page by page */
+        i = 0;
+        for_each_sgtable_dma_page(&buf->sgt, &iter, 0) {
+            buf->page_dma[i++] = sg_page_iter_dma_address(&iter);
+        }
+        return 0;
+    }
+
+    return -EINVAL;
+}
+
+static void dma_xfer_sync(struct device *dev, struct dma_xfer_buf *buf, bool for_device)
+{
+    if (buf->type == DMA_XFER_SINGLE) {
+        if (for_device) {
+            dma_sync_single_for_device(dev, buf->dma, buf->size, buf->dir);
+        } else {
+            dma_sync_single_for_cpu(dev, buf->dma, buf->size, buf->dir);
+        }
+    } else if (buf->type == DMA_XFER_SG) {
+        if (for_device) {
+            dma_sync_sgtable_for_device(dev, &buf->sgt, buf->dir);
+        } else {
+            dma_sync_sgtable_for_cpu(dev, &buf->sgt, buf->dir);
+        }
+    }
+}
+
+static int dma_sw_engine_fn(void *data)
+{
+    struct dma_sw_engine *eng = data;
+    struct dma_sw_desc *desc, *tmp;
+    LIST_HEAD(work);
+
+    while (!kthread_should_stop()) {
+        wait_event_interruptible(eng->wq, !list_empty(&eng->queue) ||
+                                 kthread_should_stop());
+
+        spin_lock(&eng->lock);
+        list_splice_init(&eng->queue, &work);
+        spin_unlock(&eng->lock);
+
+        list_for_each_entry_safe(desc, tmp, &work, node) {
+            list_del(&desc->node);
+            memcpy(desc->dst, desc->src, desc->len);
+            if (desc->callback) {
+                desc->callback(desc->param);
+            }
+        }
+    }
+
+    return 0;
+}
+
+static void dma_sw_engine_submit(struct dma_sw_engine *eng, struct dma_sw_desc *descs,
+                                 unsigned int nr)
+{
+    unsigned int i;
+
+    spin_lock(&eng->lock);
+    for (i = 0; i < nr; i++) {
+        list_add_tail(&descs[i].node, &eng->queue);
+    }
+    spin_unlock(&eng->lock);
+    wake_up(&eng->wq);
+}
+
+static void dma_xfer_done(void *param)
+{
+    complete(param);
+}
+
+/* Queue one src -> dst copy on the channel, the last segment signals done */
+static int dma_xfer_submit_chan(struct dma_chan *chan, struct dma_xfer_buf *dst,
+                                struct dma_xfer_buf *src, struct completion *done)
+{
+    struct dma_async_tx_descriptor *tx;
+    unsigned long flags;
+    dma_cookie_t cookie;
+    unsigned int i;
+
+    for (i = 0; i < src->nr_segs; i++) {
+        bool last = i == src->nr_segs - 1;
+
+        flags = DMA_CTRL_ACK | (last ? DMA_PREP_INTERRUPT : 0);
+        tx = dmaengine_prep_dma_memcpy(chan, dma_xfer_seg_dma(dst, i),
+                                       dma_xfer_seg_dma(src, i), src->seg_len, flags);
+        if (!tx) {
+            return -EIO;
+        }
+        if (last) {
+            tx->callback = dma_xfer_done;
+            tx->callback_param = done;
+        }
+        cookie = dmaengine_submit(tx);
+        if (dma_submit_error(cookie)) {
+            return -EIO;
+        }
+    }
+    dma_async_issue_pending(chan);
+
+    return 0;
+}
+
+/*
+ * Copy a freshly allocated source buffer of the requested kind into a
+ * destination of the same kind, iterations times, one transfer in flight,
+ * and time each from submission to its completion callback. Buffers are
+ * allocated for the channel's device so its DMA addresses are usable by
+ * the engine; with no DMA_MEMCPY channel a kthread does the copies.
+ */
+static int dma_xfer_bench_dev(struct device *dev, struct dma_xfer_bench *xb)
+{
+    struct dma_xfer_buf src, dst;
+    struct dma_sw_engine eng;
+    struct dma_sw_desc *descs = NULL;
+    struct dma_chan *chan = NULL;
+    struct completion done;
+    struct device *xdev = dev;
+    dma_cap_mask_t mask;
+    u64 t0, t, lat, lat_sum = 0;
+    unsigned int i, n;
+    long left;
+    int ret;
+
+    if (xb->type < DMA_XFER_COHERENT || xb->type > DMA_XFER_POOL ||
+        xb->size == 0 || xb->size > DMA_XFER_MAX_SIZE ||
+        xb->iterations == 0 || xb->iterations > DMA_XFER_MAX_ITERS) {
+        return -EINVAL;
+    }
+
+    if (xb->engine != 0) {
+        dma_cap_zero(mask);
+        dma_cap_set(DMA_MEMCPY, mask);
+        chan = dma_request_chan_by_mask(&mask);
+        if (IS_ERR(chan)) {
+            if (xb->engine == 1) {
+                printk(KERN_WARNING "DMA: No DMA_MEMCPY channel available\n");
+                return PTR_ERR(chan);
+            }
+            chan = NULL;
+        }
+    }
+
+    memset(&eng, 0, sizeof(eng));
+    if (chan) {
+        xdev = dmaengine_get_dma_device(chan);
+        xb->engine = 1;
+        strscpy(xb->chan_name, dma_chan_name(chan), sizeof(xb->chan_name));
+    } else {
+        xb->engine = 0;
+        strscpy(xb->chan_name, "kthread", sizeof(xb->chan_name));
+    }
+
+    ret = dma_xfer_buf_alloc(xdev, &src, xb->type, xb->size, DMA_TO_DEVICE);
+    if (ret) {
+        goto out_free_src;
+    }
+    ret = dma_xfer_buf_alloc(xdev, &dst, xb->type, xb->size, DMA_FROM_DEVICE);
+    if (ret) {
+        goto out_free_dst;
+    }
+    xb->segments = src.nr_segs;
+
+    /*
+     * The kthread copies through the CPU addresses, so without a channel
+     * the CPU takes both streaming buffers for the whole run and they are
+     * never handed to the device.
+     */
+    if (!chan) {
+        dma_xfer_sync(xdev, &src, false);
+        dma_xfer_sync(xdev, &dst, false);
+    }
+    for (i = 0; i < src.nr_segs; i++) {
+        memset(dma_xfer_seg_cpu(&src, i), 0x5A + i, src.seg_len);
+        memset(dma_xfer_seg_cpu(&dst, i), 0, dst.seg_len);
+    }
+    if (chan) {
+        dma_xfer_sync(xdev, &src, true);
+        dma_xfer_sync(xdev, &dst, true);
+    }
+
+    if (!chan) {
+        descs = kvcalloc(src.nr_segs, sizeof(*descs), GFP_KERNEL);
+        if (!descs) {
+            ret = -ENOMEM;
+            goto out_free_dst;
+        }
+        for (i = 0; i < src.nr_segs; i++) {
+            descs[i].dst = dma_xfer_seg_cpu(&dst, i);
+            descs[i].src = dma_xfer_seg_cpu(&src, i);
+            descs[i].len = src.seg_len;
+        }
+        descs[src.nr_segs - 1].callback = dma_xfer_done;
+        descs[src.nr_segs - 1].param = &done;
+
+        spin_lock_init(&eng.lock);
+        INIT_LIST_HEAD(&eng.queue);
+        init_waitqueue_head(&eng.wq);
+        eng.thread = kthread_run(dma_sw_engine_fn, &eng, "dma_demo_copy");
+        if (IS_ERR(eng.thread)) {
+            ret = PTR_ERR(eng.thread);
+            eng.thread = NULL;
+            goto out_free_descs;
+        }
+    }
+
+    xb->lat_min_ns = U64_MAX;
+    xb->lat_max_ns = 0;
+    t0 = ktime_get_ns();
+    for (n = 0; n < xb->iterations; n++) {
+        init_completion(&done);
+        t = ktime_get_ns();
+        if (chan) {
+            ret = dma_xfer_submit_chan(chan, &dst, &src, &done);
+            if (ret) {
+                break;
+            }
+        } else {
+            dma_sw_engine_submit(&eng, descs, src.nr_segs);
+        }
+
+        left = wait_for_completion_timeout(&done, msecs_to_jiffies(DMA_XFER_TIMEOUT_MS));
+        if (!left) {
+            printk(KERN_ERR "DMA: Transfer %u timed out\n", n);
+            ret = -ETIMEDOUT;
+            break;
+        }
+
+        lat = ktime_get_ns() - t;
+        lat_sum += lat;
+        xb->lat_min_ns = min(xb->lat_min_ns, lat);
+        xb->lat_max_ns = max(xb->lat_max_ns, lat);
+    }
+    xb->total_ns = ktime_get_ns() - t0;
+    xb->lat_avg_ns = n ? lat_sum / n : 0;
+
+    if (chan && ret) {
+        dmaengine_terminate_sync(chan);
+    }
+
+    /* Check the last copy landed */
+    if (chan) {
+        dma_xfer_sync(xdev, &dst, false);
+    }
+    for (i = 0; ret == 0 && i < src.nr_segs; i++) {
+        if (memcmp(dma_xfer_seg_cpu(&dst, i), dma_xfer_seg_cpu(&src, i), src.seg_len)) {
+            printk(KERN_ERR "DMA: Transfer data mismatch in segment %u\n", i);
+            ret = -EIO;
+        }
+    }
+
+    printk(KERN_INFO "DMA: Transfer bench type %d via %s: %u x %u bytes in %llu ns, "
+           "latency min/avg/max %llu/%llu/%llu ns\n",
+           xb->type, xb->chan_name, n, xb->size, xb->total_ns,
+           xb->lat_min_ns, xb->lat_avg_ns, xb->lat_max_ns);
+
+    if (eng.thread) {
+        kthread_stop(eng.thread);
+    }
+out_free_descs:
+    kvfree(descs);
+out_free_dst:
+    dma_xfer_buf_free(xdev, &dst);
+out_free_src:
+    dma_xfer_buf_free(xdev, &src);
+    if (chan) {
+        dma_release_channel(chan);
+    }
+
+    return ret;
+}
+
+/*==============================================================================
+ * Asynchronous Job Queue
+ *==============================================================================*/
+
+/*
+ * Find the job queue of a file, NULL if it never set one up. Setup
+ * publishes the queue once and it stays until release, so no lock.
+ */
+static struct dma_job_queue *dma_job_queue_find(struct dma_file_ctx *fctx)
+{
+    return smp_load_acquire(&fctx->job_queue);
+}
+
+static int dma_job_copy(struct dma_file_ctx *fctx, struct dma_job_desc *job)
+{
+    struct dma_coherent_buf *dst, *src = NULL;
+    int ret = 0;
+
+    dst = dma_coherent_get(fctx, job->handle);
+    if (!dst) {
+        return -EINVAL;
+    }
+    if (job->op == DMA_JOB_COPY) {
+        src = dma_coherent_get(fctx, job->src_handle);
+        if (!src) {
+            dma_coherent_put(dst);
+            return -EINVAL;
+        }
+    }
+
+    if (job->offset > dst->size || job->size > dst->size - job->offset ||
+        (src && (job->src_offset > src->size ||
+                 job->size > src->size - job->src_offset))) {
+        ret = -EINVAL;
+    } else if (src) {
+        memmove(dst->vaddr + job->offset, src->vaddr + job->src_offset, job->size);
+    } else {
+        memset(dst->vaddr + job->offset, job->arg & 0xff, job->size);
+    }
+
+    if (src) {
+        dma_coherent_put(src);
+    }
+    dma_coherent_put(dst);
+
+    return ret;
+}
+
+static int dma_job_sync_user(struct dma_file_ctx *fctx, struct dma_job_desc *job)
+{
+    struct dma_user_map *map;
+    int ret = 0;
+
+    mutex_lock(&fctx->user_map_lock);
+    map = idr_find(&fctx->user_map_idr, job->handle);
+    if (!map) {
+        ret = -EINVAL;
+    } else if (job->arg) {
+        dma_sync_sgtable_for_device(map->dev, &map->sgt, map->dir);
+    } else {
+        dma_sync_sgtable_for_cpu(map->dev, &map->sgt, map->dir);
+    }
+    mutex_unlock(&fctx->user_map_lock);
+
+    return ret;
+}
+
+/* A streaming buffer hand-off, served from the buffer cache when possible */
+static int dma_job_map_stream(struct device *dev, struct m_chr_device_data *dd,
+                              struct dma_job_desc *job)
+{
+    struct dma_cache_buf *cbuf;
+    dma_addr_t dma;
+    void *vaddr;
+
+    if (job->size == 0 || job->size > DMA_XFER_MAX_SIZE) {
+        return -EINVAL;
+    }
+
+    cbuf = dma_cache_get(dev, dd, job->size, NUMA_NO_NODE);
+    if (IS_ERR(cbuf)) {
+        return PTR_ERR(cbuf);
+    }
+    if (cbuf) {
+        dma_sync_single_for_device(dev, cbuf->dma, job->size, DMA_BIDIRECTIONAL);
+        dma_sync_single_for_cpu(dev, cbuf->dma, job->size, DMA_BIDIRECTIONAL);
+        dma_cache_put(dev, dd, cbuf);
+        return 0;
+    }
+
+    vaddr = kmalloc(job->size, GFP_KERNEL);
+    if (!vaddr) {
+        return -ENOMEM;
+    }
+    dma = dma_map_single(dev, vaddr, job->size, DMA_BIDIRECTIONAL);
+    if (dma_mapping_error(dev, dma)) {
+        kfree(vaddr);
+        return -EIO;
+    }
+    dma_unmap_single(dev, dma, job->size, DMA_BIDIRECTIONAL);
+    kfree(vaddr);
+
+    return 0;
+}
+
+static int dma_job_run(struct dma_job_queue *q, struct dma_job_desc *job)
+{
+    struct m_chr_device_data *dd = q->fctx->dd;
+
+    switch (job->op) {
+    case DMA_JOB_NOP:
+        return 0;
+    case DMA_JOB_COPY:
+    case DMA_JOB_FILL:
+        return dma_job_copy(q->fctx, job);
+    case DMA_JOB_SYNC_USER:
+        return dma_job_sync_user(q->fctx, job);
+    case DMA_JOB_MAP_STREAM:
+        return dma_job_map_stream(dd->dev, dd, job);
+    default:
+        return -EOPNOTSUPP;
+    }
+}
+
+static void dma_job_signal(struct dma_job_queue *q)
+{
+    wake_up_interruptible(&q->wait);
+    if (q->eventfd) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 8, 0)
+        eventfd_signal(q->eventfd);
+#else
+        eventfd_signal(q->eventfd, 1);
+#endif
+    }
+}
+
+/*
+ * Run everything in the submission ring. Waiters are woken once per
+ * DMA_JOB_SIGNAL_BATCH completions rather than per job, so a deep queue
+ * costs the reaper one wakeup per batch.
+ */
+static void dma_job_work(struct work_struct *work)
+{
+    struct dma_job_queue *q = container_of(work, struct dma_job_queue, work);
+    struct dma_job_desc job;
+    struct dma_job_cqe *cqe;
+    unsigned int posted = 0;
+
+    spin_lock(&q->lock);
+    while (q->sq_head != q->sq_tail) {
+        job = q->sq[q->sq_head & q->mask];
+        spin_unlock(&q->lock);
+
+        cqe = &q->cq[q->cq_tail & q->mask];
+        cqe->user_data = job.user_data;
+        cqe->result = dma_job_run(q, &job);
+        cqe->pad = 0;
+
+        spin_lock(&q->lock);
+        q->sq_head++;
+        q->cq_tail++;
+        if (++posted == DMA_JOB_SIGNAL_BATCH) {
+            spin_unlock(&q->lock);
+            dma_job_signal(q);
+            posted = 0;
+            spin_lock(&q->lock);
+        }
+    }
+    spin_unlock(&q->lock);
+
+    if (posted) {
+        dma_job_signal(q);
+    }
+}
+
+static int dma_job_setup_dev(struct dma_file_ctx *fctx, struct dma_job_setup *setup)
+{
+    struct dma_job_queue *q;
+    unsigned int entries = setup->entries ? setup->entries : DMA_JOB_DEF_ENTRIES;
+    int ret;
+
+    if (entries > DMA_JOB_MAX_ENTRIES) {
+        return -EINVAL;
+    }
+    entries = roundup_pow_of_two(entries);
+
+    q = kzalloc(sizeof(*q), GFP_KERNEL);
+    if (!q) {
+        return -ENOMEM;
+    }
+
+    q->sq = kvcalloc(entries, sizeof(*q->sq), GFP_KERNEL);
+    q->cq = kvcalloc(entries, sizeof(*q->cq), GFP_KERNEL);
+    if (!q->sq || !q->cq) {
+        ret = -ENOMEM;
+        goto err_free;
+    }
+
+    if (setup->eventfd >= 0) {
+        q->eventfd = eventfd_ctx_fdget(setup->eventfd);
+        if (IS_ERR(q->eventfd)) {
+            ret = PTR_ERR(q->eventfd);
+            q->eventfd = NULL;
+            goto err_free;
+        }
+    }
+
+    q->fctx = fctx;
+    q->mask = entries - 1;
+    INIT_WORK(&q->work, dma_job_work);
+    mutex_init(&q->submit_lock);
+    mutex_init(&q->reap_lock);
+    spin_lock_init(&q->lock);
+    init_waitqueue_head(&q->wait);
+
+    /*
+     * A queue lives as long as the file, so poll() never sees it go away
+     * under its wait queue entry. The first setup to publish one wins.
+     */
+    if (cmpxchg(&fctx->job_queue, NULL, q)) {
+        ret = -EBUSY;
+        goto err_free;
+    }
+
+    setup->entries = entries;
+    printk(KERN_INFO "DMA: Job queue set up, %u entries%s\n", entries,
+           q->eventfd ? ", eventfd" : "");
+
+    return 0;
+
+err_free:
+    if (q->eventfd) {
+        eventfd_ctx_put(q->eventfd);
+    }
+    kvfree(q->cq);
+    kvfree(q->sq);
+    kfree(q);
+    return ret;
+}
+
+/* Queue up to batch->count jobs, as many as the rings have room for */
+static int dma_job_submit_dev(struct dma_file_ctx *fctx, struct dma_job_batch *batch)
+{
+    struct dma_job_desc __user *ujobs = u64_to_user_ptr(batch->ptr);
+    struct dma_job_queue *q = dma_job_queue_find(fctx);
+    unsigned int n, first, tail, entries;
+    int ret = 0;
+
+    if (!q) {
+        return -ENXIO;
+    }
+    entries = q->mask + 1;
+
+    mutex_lock(&q->submit_lock);
+
+    /* Slots past sq_tail stay free until this submitter publishes them */
+    spin_lock(&q->lock);
+    n = min(batch->count, entries - q->inflight);
+    tail = q->sq_tail;
+    spin_unlock(&q->lock);
+
+    if (n == 0) {
+        ret = batch->count ? -EAGAIN : 0;
+        goto out;
+    }
+
+    first = min(n, entries - (tail & q->mask));
+    if (copy_from_user(&q->sq[tail & q->mask], ujobs, first * sizeof(*ujobs)) ||
+        copy_from_user(q->sq, ujobs + first, (n - first) * sizeof(*ujobs))) {
+        ret = -EFAULT;
+        goto out;
+    }
+
+    spin_lock(&q->lock);
+    q->sq_tail += n;
+    q->inflight += n;
+    spin_unlock(&q->lock);
+
+    queue_work(system_unbound_wq, &q->work);
+
+out:
+    mutex_unlock(&q->submit_lock);
+    batch->count = ret ? 0 : n;
+
+    return ret;
+}
+
+/* Hand back up to batch->count completions, waiting for min_complete of them */
+static int dma_job_reap_dev(struct dma_file_ctx *fctx, struct dma_job_batch *batch)
+{
+    struct dma_job_cqe __user *ucqes = u64_to_user_ptr(batch->ptr);
+    struct dma_job_queue *q = dma_job_queue_find(fctx);
+    unsigned int n = 0, first, head, ready, want;
+    int ret = 0;
+
+    if (!q) {
+        return -ENXIO;
+    }
+
+    mutex_lock(&q->reap_lock);
+
+    /* Never wait for more than is actually in flight */
+    spin_lock(&q->lock);
+    want = min3(batch->min_complete, batch->count, q->inflight);
+    spin_unlock(&q->lock);
+
+    ret = wait_event_interruptible(q->wait,
+                                   READ_ONCE(q->cq_tail) - q->cq_head >= want);
+    if (ret) {
+        goto out;
+    }
+
+    spin_lock(&q->lock);
+    head = q->cq_head;
+    ready = q->cq_tail - head;
+    spin_unlock(&q->lock);
+
+    /* The worker never writes behind cq_tail, so these entries are stable */
+    n = min(batch->count, ready);
+    first = min(n, q->mask + 1 - (head & q->mask));
+    if (copy_to_user(ucqes, &q->cq[head & q->mask], first * sizeof(*ucqes)) ||
+        copy_to_user(ucqes + first, q->cq, (n - first) * sizeof(*ucqes))) {
+        ret = -EFAULT;
+        goto out;
+    }
+
+    spin_lock(&q->lock);
+    q->cq_head += n;
+    q->inflight -= n;
+    spin_unlock(&q->lock);
+
+out:
+    mutex_unlock(&q->reap_lock);
+    batch->count = ret ? 0 : n;
+
+    return ret;
+}
+
+/* Tear down the job queue of a file once its last job has run */
+static void dma_job_queue_release(struct dma_file_ctx *fctx)
+{
+    struct dma_job_queue *q = fctx->job_queue;
+
+    if (!q) {
+        return;
+    }
+    fctx->job_queue = NULL;
+
+    /* Nothing can submit any more, so one flush drains the ring */
+    flush_work(&q->work);
+
+    dma_log("Job queue released, %u completions never reaped\n", q->inflight);
+    if (q->eventfd) {
+        eventfd_ctx_put(q->eventfd);
+    }
+    kvfree(q->cq);
+    kvfree(q->sq);
+    kfree(q);
+}
+
+static __poll_t m_chrdev_poll(struct file *file, struct poll_table_struct *wait)
+{
+    struct dma_file_ctx *fctx = file->private_data;
+    struct dma_job_queue *q = dma_job_queue_find(fctx);
+    __poll_t mask = 0;
+
+    if (!q) {
+        return EPOLLERR;
+    }
+
+    poll_wait(file, &q->wait, wait);
+    if (READ_ONCE(q->cq_tail) != READ_ONCE(q->cq_head)) {
+        mask |= EPOLLIN | EPOLLRDNORM;
+    }
+
+    return mask;
+}
+
+/*==============================================================================
+ * dma-buf Exporter and Importer
+ *==============================================================================*/
+
+static int dmabuf_exp_attach(struct dma_buf *dmabuf, struct dma_buf_attachment *attach)
+{
+    struct dmabuf_exp *exp = dmabuf->priv;
+    struct dmabuf_exp_attach *a;
+
+    a = kzalloc(sizeof(*a), GFP_KERNEL);
+    if (!a) {
+        return -ENOMEM;
+    }
+
+    a->dev = attach->dev;
+    a->dir = DMA_NONE;
+    attach->priv = a;
+
+    mutex_lock(&exp->lock);
+    list_add(&a->node, &exp->attachments);
+    mutex_unlock(&exp->lock);
+
+    dma_log("dma-buf attached by %s\n", dev_name(attach->dev));
+
+    return 0;
+}
+
+static void dmabuf_exp_detach(struct dma_buf *dmabuf, struct dma_buf_attachment *attach)
+{
+    struct dmabuf_exp *exp = dmabuf->priv;
+    struct dmabuf_exp_attach *a = attach->priv;
+
+    mutex_lock(&exp->lock);
+    list_del(&a->node);
+    mutex_unlock(&exp->lock);
+
+    kfree(a);
+}
+
+/* Build a table of the exported memory and map it for the importer's device */
+static struct sg_table *dmabuf_exp_map(struct dma_buf_attachment *attach,
+                                       enum dma_data_direction dir)
+{
+    struct dmabuf_exp *exp = attach->dmabuf->priv;
+    struct dmabuf_exp_attach *a = attach->priv;
+    struct sg_table *sgt;
+    int ret;
+
+    sgt = kzalloc(sizeof(*sgt), GFP_KERNEL);
+    if (!sgt) {
+        return ERR_PTR(-ENOMEM);
+    }
+
+    if (exp->cbuf) {
+        ret = dma_get_sgtable(exp->cbuf->dev, sgt, exp->cbuf->vaddr,
+                              exp->cbuf->dma, exp->size);
+    } else {
+        ret = sg_alloc_table_from_pages(sgt, exp->pages, exp->nr_pages, 0,
+                                        exp->size, GFP_KERNEL);
+    }
+    if (ret) {
+        goto err_free;
+    }
+
+    ret = dma_map_sgtable(attach->dev, sgt, dir, 0);
+    if (ret) {
+        goto err_table;
+    }
+
+    mutex_lock(&exp->lock);
+    a->sgt = sgt;
+    a->dir = dir;
+    mutex_unlock(&exp->lock);
+
+    dma_log("dma-buf mapped for %s, %u segments\n", dev_name(attach->dev), sgt->nents);
+
+    return sgt;
+
+err_table:
+    sg_free_table(sgt);
+err_free:
+    kfree(sgt);
+    return ERR_PTR(ret);
+}
+
+static void dmabuf_exp_unmap(struct dma_buf_attachment *attach, struct sg_table *sgt,
+                             enum dma_data_direction dir)
+{
+    struct dmabuf_exp *exp = attach->dmabuf->priv;
+    struct dmabuf_exp_attach *a = attach->priv;
+
+    mutex_lock(&exp->lock);
+    a->sgt = NULL;
+    mutex_unlock(&exp->lock);
+
+    dma_unmap_sgtable(attach->dev, sgt, dir, 0);
+    sg_free_table(sgt);
+    kfree(sgt);
+}
+
+static void dmabuf_exp_free(struct dmabuf_exp *exp)
+{
+    unsigned int i;
+
+    if (exp->cbuf) {
+        dma_coherent_put(exp->cbuf);
+    }
+    for (i = 0; i < exp->nr_pages; i++) {
+        put_page(exp->pages[i]);
+    }
+    kvfree(exp->pages);
+    kfree(exp);
+}
+
+static void dmabuf_exp_release(struct dma_buf *dmabuf)
+{
+    dma_log("dma-buf released\n");
+    dmabuf_exp_free(dmabuf->priv);
+}
+
+/*
+ * The CPU is about to touch the buffer: every mapped attachment hands it
+ * back, in the direction that attachment was mapped with.
+ */
+static int dmabuf_exp_begin_cpu_access(struct dma_buf *dmabuf,
+                                       enum dma_data_direction dir)
+{
+    struct dmabuf_exp *exp = dmabuf->priv;
+    struct dmabuf_exp_attach *a;
+
+    mutex_lock(&exp->lock);
+    list_for_each_entry(a, &exp->attachments, node) {
+        if (a->sgt) {
+            dma_sync_sgtable_for_cpu(a->dev, a->sgt, a->dir);
+        }
+    }
+    mutex_unlock(&exp->lock);
+
+    return 0;
+}
+
+static int dmabuf_exp_end_cpu_access(struct dma_buf *dmabuf,
+                                     enum dma_data_direction dir)
+{
+    struct dmabuf_exp *exp = dmabuf->priv;
+    struct dmabuf_exp_attach *a;
 
-            printk(KERN_INFO "DMA:   sg[%d]: phys_addr=0x%pa (below 4G: %s), dma_addr/iova=0x%pad, len=0x%x\n",
-                   i, &phys_addr, phys_addr < SZ_4G ? "yes" : "no",
-                   &dma_addr, sg_len);
+    mutex_lock(&exp->lock);
+    list_for_each_entry(a, &exp->attachments, node) {
+        if (a->sgt) {
+            dma_sync_sgtable_for_device(a->dev, a->sgt, a->dir);
         }
     }
+    mutex_unlock(&exp->lock);
 
     return 0;
 }
 
-static int dma_unmap_sg_dev(struct device *dev, struct m_chr_device_data *dd)
+static int dmabuf_exp_vmap(struct dma_buf *dmabuf, struct iosys_map *map)
 {
-    int i;
+    struct dmabuf_exp *exp = dmabuf->priv;
+    void *vaddr;
 
-    if (!dd->sg_mapped) {
-        printk(KERN_WARNING "DMA: No SG to unmap\n");
-        return -EINVAL;
+    /* A coherent buffer already has a kernel mapping */
+    if (exp->cbuf) {
+        iosys_map_set_vaddr(map, exp->cbuf->vaddr);
+        return 0;
     }
 
-    printk(KERN_INFO "DMA: Unmapping scatter-gather\n");
+    vaddr = vmap(exp->pages, exp->nr_pages, VM_MAP, PAGE_KERNEL);
+    if (!vaddr) {
+        return -ENOMEM;
+    }
+    iosys_map_set_vaddr(map, vaddr);
 
-    /* Use the mapped nents from sg_table for unmap */
-    dma_unmap_sg(dev, dd->sg_table.sgl, dd->sg_table.nents, dd->sg_dir);
+    return 0;
+}
 
-    sg_free_table(&dd->sg_table);
+static void dmabuf_exp_vunmap(struct dma_buf *dmabuf, struct iosys_map *map)
+{
+    struct dmabuf_exp *exp = dmabuf->priv;
 
-    /* Use the original nents for freeing pages */
-    for (i = 0; i < dd->sg_nents; i++) {
-        __free_page(dd->sg_pages[i]);
+    if (!exp->cbuf) {
+        vunmap(map->vaddr);
     }
-    kfree(dd->sg_pages);
-    dd->sg_pages = NULL;
+}
 
-    dd->sg_mapped = false;
+static int dmabuf_exp_mmap(struct dma_buf *dmabuf, struct vm_area_struct *vma)
+{
+    struct dmabuf_exp *exp = dmabuf->priv;
 
-    return 0;
+    if (exp->cbuf) {
+        return dma_mmap_coherent(exp->cbuf->dev, vma, exp->cbuf->vaddr,
+                                 exp->cbuf->dma, exp->size);
+    }
+
+    return vm_map_pages(vma, exp->pages, exp->nr_pages);
 }
 
-static int dma_sync_sg_dev(struct device *dev, struct m_chr_device_data *dd,
-                           int direction)
+static const struct dma_buf_ops dmabuf_exp_ops = {
+    .attach           = dmabuf_exp_attach,
+    .detach           = dmabuf_exp_detach,
+    .map_dma_buf      = dmabuf_exp_map,
+    .unmap_dma_buf    = dmabuf_exp_unmap,
+    .release          = dmabuf_exp_release,
+    .begin_cpu_access = dmabuf_exp_begin_cpu_access,
+    .end_cpu_access   = dmabuf_exp_end_cpu_access,
+    .vmap             = dmabuf_exp_vmap,
+    .vunmap           = dmabuf_exp_vunmap,
+    .mmap             = dmabuf_exp_mmap,
+};
+
+/* Export a coherent buffer or the SG pages; returns the new dma-buf fd in req */
+static int dmabuf_export_dev(struct dma_file_ctx *fctx, struct dmabuf_export_req *req)
 {
-    enum dma_data_direction dir = user_to_kernel_dir(direction);
+    DEFINE_DMA_BUF_EXPORT_INFO(info);
+    struct dmabuf_exp *exp;
+    struct dma_buf *dmabuf;
+    unsigned int i;
+    int fd;
+
+    exp = kzalloc(sizeof(*exp), GFP_KERNEL);
+    if (!exp) {
+        return -ENOMEM;
+    }
+    mutex_init(&exp->lock);
+    INIT_LIST_HEAD(&exp->attachments);
+
+    switch (req->target) {
+    case DMABUF_EXPORT_COHERENT:
+        /* The lookup reference becomes the export's */
+        exp->cbuf = dma_coherent_get(fctx, req->handle);
+        if (!exp->cbuf) {
+            kfree(exp);
+            return -EINVAL;
+        }
+        exp->size = exp->cbuf->size;
+        break;
 
-    if (!dd->sg_mapped) {
-        printk(KERN_WARNING "DMA: No SG to sync\n");
+    case DMABUF_EXPORT_SG:
+        mutex_lock(&fctx->sg_lock);
+        if (!fctx->sg_mapped) {
+            mutex_unlock(&fctx->sg_lock);
+            printk(KERN_WARNING "DMA: No SG mapping to export\n");
+            kfree(exp);
+            return -EINVAL;
+        }
+        exp->pages = kvmalloc_array(fctx->sg_nents, sizeof(*exp->pages), GFP_KERNEL);
+        if (!exp->pages) {
+            mutex_unlock(&fctx->sg_lock);
+            kfree(exp);
+            return -ENOMEM;
+        }
+        /* UNMAP_SG frees the driver's references, ours keep the pages */
+        for (i = 0; i < fctx->sg_nents; i++) {
+            exp->pages[i] = fctx->sg_pages[i];
+            get_page(exp->pages[i]);
+        }
+        exp->nr_pages = fctx->sg_nents;
+        mutex_unlock(&fctx->sg_lock);
+        exp->size = (size_t)exp->nr_pages * PAGE_SIZE;
+        break;
+
+    default:
+        kfree(exp);
         return -EINVAL;
     }
 
-    printk(KERN_INFO "DMA: Syncing scatter-gather, dir: %d\n", dir);
+    info.ops = &dmabuf_exp_ops;
+    info.size = exp->size;
+    info.flags = O_RDWR;
+    info.priv = exp;
 
-    /* Use the mapped nents from sg_table for sync */
-    if (dir == DMA_TO_DEVICE || dir == DMA_BIDIRECTIONAL) {
-        dma_sync_sg_for_device(dev, dd->sg_table.sgl, dd->sg_table.nents, dir);
-        printk(KERN_INFO "DMA: Synced SG for device\n");
+    dmabuf = dma_buf_export(&info);
+    if (IS_ERR(dmabuf)) {
+        dmabuf_exp_free(exp);
+        return PTR_ERR(dmabuf);
     }
 
-    if (dir == DMA_FROM_DEVICE || dir == DMA_BIDIRECTIONAL) {
-        dma_sync_sg_for_cpu(dev, dd->sg_table.sgl, dd->sg_table.nents, dir);
-        printk(KERN_INFO "DMA: Synced SG for CPU\n");
+    fd = dma_buf_fd(dmabuf, O_CLOEXEC);
+    if (fd < 0) {
+        /* Dropping the last reference releases exp as well */
+        dma_buf_put(dmabuf);
+        return fd;
     }
 
+    req->fd = fd;
+    req->size = exp->size;
+
+    printk(KERN_INFO "DMA: Exported %s as dma-buf fd %d, %zu bytes\n",
+           exp->cbuf ? "coherent buffer" : "SG pages", fd, exp->size);
+
     return 0;
 }
 
-/*==============================================================================
- * DMA Pool Operations
- *==============================================================================*/
-
-static int dma_pool_create_dev(struct device *dev, struct m_chr_device_data *dd)
+static void dmabuf_import_free(struct dmabuf_import *imp)
 {
-    printk(KERN_INFO "DMA: Creating DMA pool\n");
+    dma_buf_unmap_attachment_unlocked(imp->attach, imp->sgt, DMA_BIDIRECTIONAL);
+    dma_buf_detach(imp->dmabuf, imp->attach);
+    dma_buf_put(imp->dmabuf);
+    kfree(imp);
+}
 
-    if (dd->dma_pool) {
-        printk(KERN_WARNING "DMA: Pool already created\n");
-        return -EBUSY;
-    }
+/*
+ * Attach this device to a dma-buf from any exporter - another instance of
+ * this driver, udmabuf, a dma-heap - and map it bidirectionally.
+ */
+static int dmabuf_import_dev(struct dma_file_ctx *fctx, struct dmabuf_import_req *req)
+{
+    struct dmabuf_import *imp;
+    int handle, ret;
 
-    dd->dma_pool = dma_pool_create("demo_dma_pool", dev, DMA_POOL_SIZE,
-                                    DMA_POOL_BOUNDARY, 0);
-    if (!dd->dma_pool) {
-        printk(KERN_ERR "DMA: Failed to create pool\n");
+    imp = kzalloc(sizeof(*imp), GFP_KERNEL);
+    if (!imp) {
         return -ENOMEM;
     }
 
-    printk(KERN_INFO "DMA: Pool created, size: %d\n", DMA_POOL_SIZE);
-
-    return 0;
-}
-
-static int dma_pool_alloc_dev(struct device *dev, struct m_chr_device_data *dd)
-{
-    printk(KERN_INFO "DMA: Allocating from pool\n");
+    imp->dmabuf = dma_buf_get(req->fd);
+    if (IS_ERR(imp->dmabuf)) {
+        ret = PTR_ERR(imp->dmabuf);
+        goto err_free;
+    }
 
-    if (!dd->dma_pool) {
-        printk(KERN_WARNING "DMA: Pool not created\n");
-        return -EINVAL;
+    imp->attach = dma_buf_attach(imp->dmabuf, fctx->dd->dev);
+    if (IS_ERR(imp->attach)) {
+        ret = PTR_ERR(imp->attach);
+        goto err_put;
     }
 
-    if (dd->pool_buf) {
-        printk(KERN_WARNING "DMA: Pool buffer already allocated\n");
-        return -EBUSY;
+    imp->sgt = dma_buf_map_attachment_unlocked(imp->attach, DMA_BIDIRECTIONAL);
+    if (IS_ERR(imp->sgt)) {
+        ret = PTR_ERR(imp->sgt);
+        goto err_detach;
     }
 
-    dd->pool_buf = dma_pool_alloc(dd->dma_pool, GFP_KERNEL, &dd->pool_dma);
-    if (!dd->pool_buf) {
-        printk(KERN_ERR "DMA: Failed to allocate from pool\n");
-        return -ENOMEM;
+    mutex_lock(&fctx->import_lock);
+    handle = idr_alloc(&fctx->import_idr, imp, 1, DMA_MAX_IMPORTS + 1, GFP_KERNEL);
+    mutex_unlock(&fctx->import_lock);
+    if (handle < 0) {
+        printk(KERN_WARNING "DMA: No free dma-buf import handle\n");
+        dmabuf_import_free(imp);
+        return handle == -ENOSPC ? -EBUSY : handle;
     }
 
-    /* Initialize buffer */
-    memset(dd->pool_buf, 0xCC, DMA_POOL_SIZE);
+    req->handle = handle;
+    req->size = imp->dmabuf->size;
+    req->dma_addr = sg_dma_address(imp->sgt->sgl);
+    req->nr_segs = imp->sgt->nents;
 
-    printk(KERN_INFO "DMA: Allocated from pool\n");
-    printk(KERN_INFO "DMA:   virt addr = %p\n", dd->pool_buf);
-    printk(KERN_INFO "DMA:   dma addr  = %#llx\n", (u64)dd->pool_dma);
+    printk(KERN_INFO "DMA: Imported dma-buf %d from %s, %zu bytes, %u segments at %#llx\n",
+           handle, imp->dmabuf->exp_name, imp->dmabuf->size, imp->sgt->nents,
+           (u64)sg_dma_address(imp->sgt->sgl));
 
     return 0;
+
+err_detach:
+    dma_buf_detach(imp->dmabuf, imp->attach);
+err_put:
+    dma_buf_put(imp->dmabuf);
+err_free:
+    kfree(imp);
+    return ret;
 }
 
-static int dma_pool_free_dev(struct device *dev, struct m_chr_device_data *dd)
+static int dmabuf_release_dev(struct dma_file_ctx *fctx, int handle)
 {
-    if (!dd->pool_buf || !dd->dma_pool) {
-        printk(KERN_WARNING "DMA: No pool buffer to free\n");
+    struct dmabuf_import *imp;
+
+    mutex_lock(&fctx->import_lock);
+    imp = idr_remove(&fctx->import_idr, handle);
+    mutex_unlock(&fctx->import_lock);
+
+    if (!imp) {
+        printk(KERN_WARNING "DMA: No dma-buf import with handle %d\n", handle);
         return -EINVAL;
     }
 
-    printk(KERN_INFO "DMA: Freeing pool buffer\n");
-    dma_pool_free(dd->dma_pool, dd->pool_buf, dd->pool_dma);
-
-    dd->pool_buf = NULL;
-    dd->pool_dma = 0;
+    printk(KERN_INFO "DMA: Releasing dma-buf import %d\n", handle);
+    dmabuf_import_free(imp);
 
     return 0;
 }
 
-static int dma_pool_destroy_dev(struct device *dev, struct m_chr_device_data *dd)
+/* Release every import of a file that is going away */
+static void dmabuf_release_all(struct dma_file_ctx *fctx)
 {
-    if (!dd->dma_pool) {
-        printk(KERN_WARNING "DMA: No pool to destroy\n");
-        return -EINVAL;
+    struct dmabuf_import *imp;
+    int handle;
+
+    mutex_lock(&fctx->import_lock);
+    idr_for_each_entry(&fctx->import_idr, imp, handle) {
+        printk(KERN_INFO "DMA: Reclaiming dma-buf import %d\n", handle);
+        idr_remove(&fctx->import_idr, handle);
+        dmabuf_import_free(imp);
     }
+    mutex_unlock(&fctx->import_lock);
+}
 
-    if (dd->pool_buf) {
-        printk(KERN_WARNING "DMA: Pool buffer still allocated, freeing\n");
-        dma_pool_free(dd->dma_pool, dd->pool_buf, dd->pool_dma);
-        dd->pool_buf = NULL;
-        dd->pool_dma = 0;
+/*
+ * Copy between a user buffer and an imported dma-buf through its kernel
+ * mapping, bracketed by begin/end_cpu_access so the exporter can hand the
+ * memory over from and back to the devices that have it mapped.
+ */
+static int dmabuf_access_dev(struct dma_file_ctx *fctx, struct dmabuf_access *acc)
+{
+    enum dma_data_direction dir = acc->write ? DMA_TO_DEVICE : DMA_FROM_DEVICE;
+    void __user *ubuf = u64_to_user_ptr(acc->user_addr);
+    struct dmabuf_import *imp;
+    struct iosys_map map;
+    int ret;
+
+    mutex_lock(&fctx->import_lock);
+    imp = idr_find(&fctx->import_idr, acc->handle);
+    if (!imp) {
+        ret = -EINVAL;
+        goto out_unlock;
+    }
+    if (acc->offset > imp->dmabuf->size ||
+        acc->size > imp->dmabuf->size - acc->offset) {
+        ret = -EINVAL;
+        goto out_unlock;
     }
 
-    printk(KERN_INFO "DMA: Destroying pool\n");
-    dma_pool_destroy(dd->dma_pool);
-    dd->dma_pool = NULL;
+    ret = dma_buf_begin_cpu_access(imp->dmabuf, dir);
+    if (ret) {
+        goto out_unlock;
+    }
 
-    return 0;
+    ret = dma_buf_vmap_unlocked(imp->dmabuf, &map);
+    if (ret) {
+        goto out_end;
+    }
+
+    if (map.is_iomem) {
+        ret = -EOPNOTSUPP;
+    } else if (acc->write) {
+        if (copy_from_user(map.vaddr + acc->offset, ubuf, acc->size)) {
+            ret = -EFAULT;
+        }
+    } else {
+        if (copy_to_user(ubuf, map.vaddr + acc->offset, acc->size)) {
+            ret = -EFAULT;
+        }
+    }
+
+    dma_buf_vunmap_unlocked(imp->dmabuf, &map);
+out_end:
+    dma_buf_end_cpu_access(imp->dmabuf, dir);
+out_unlock:
+    mutex_unlock(&fctx->import_lock);
+
+    dma_log("dma-buf import %d: %s %llu bytes at %llu, ret %d\n", acc->handle,
+            acc->write ? "wrote" : "read", acc->size, acc->offset, ret);
+
+    return ret;
 }
 
 /*==============================================================================
  * DMA Information and Mask Configuration
  *==============================================================================*/
 
-static int dma_get_info(struct m_chr_device_data *dd,
-                        struct dma_ioctl_param __user *uparam)
+static int dma_get_info(struct dma_file_ctx *fctx, struct dma_ioctl_param __user *uparam)
 {
+    struct m_chr_device_data *dd = fctx->dd;
     struct dma_ioctl_param param;
+    struct dma_coherent_buf *buf;
+    int handle;
 
     if (copy_from_user(&param, uparam, sizeof(param))) {
         return -EFAULT;
     }
 
     param.dma_addr = 0;
+    param.node = NUMA_NO_NODE;
     param.result = 0;
 
-    /* Coherent DMA info */
-    if (dd->coherent_buf) {
-        param.dma_addr = dd->coherent_dma;
-        param.size = dd->coherent_size;
-        printk(KERN_INFO "DMA: Coherent: %#llx, size: %zu\n",
-               (u64)dd->coherent_dma, dd->coherent_size);
+    /* A handle asks about that one coherent buffer and nothing else */
+    if (param.handle) {
+        buf = dma_coherent_get(fctx, param.handle);
+        if (!buf) {
+            return -EINVAL;
+        }
+        param.dma_addr = buf->dma;
+        param.size = buf->size;
+        param.node = buf->nid;
+        printk(KERN_INFO "DMA: Coherent %d: %#llx, size: %zu, node: %d\n",
+               param.handle, (u64)buf->dma, buf->size, buf->nid);
+        dma_coherent_put(buf);
+        goto out_mask;
+    }
+
+    /* Otherwise list everything, the last active resource is returned */
+    mutex_lock(&fctx->coherent_lock);
+    idr_for_each_entry(&fctx->coherent_idr, buf, handle) {
+        param.dma_addr = buf->dma;
+        param.size = buf->size;
+        param.node = buf->nid;
+        printk(KERN_INFO "DMA: Coherent %d: %#llx, size: %zu, node: %d\n",
+               handle, (u64)buf->dma, buf->size, buf->nid);
     }
+    mutex_unlock(&fctx->coherent_lock);
 
     /* Single mapping info */
-    if (dd->single_mapped) {
-        param.dma_addr = dd->single_dma;
-        param.size = dd->single_size;
-        printk(KERN_INFO "DMA: Single: %#llx, size: %zu\n",
-               (u64)dd->single_dma, dd->single_size);
+    mutex_lock(&fctx->single_lock);
+    if (fctx->single_mapped) {
+        param.dma_addr = fctx->single_dma;
+        param.size = fctx->single_size;
+        param.node = fctx->single_nid;
+        printk(KERN_INFO "DMA: Single: %#llx, size: %zu, node: %d\n",
+               (u64)fctx->single_dma, fctx->single_size, fctx->single_nid);
     }
+    mutex_unlock(&fctx->single_lock);
 
     /* SG info */
-    if (dd->sg_mapped) {
-        param.count = dd->sg_table.nents;
-        param.dma_addr = sg_dma_address(dd->sg_table.sgl);
-        printk(KERN_INFO "DMA: SG: %#llx, nents: %d\n",
-               (u64)sg_dma_address(dd->sg_table.sgl), dd->sg_table.nents);
+    mutex_lock(&fctx->sg_lock);
+    if (fctx->sg_mapped) {
+        param.count = fctx->sg_table.nents;
+        param.dma_addr = sg_dma_address(fctx->sg_table.sgl);
+        param.node = fctx->sg_nid;
+        printk(KERN_INFO "DMA: SG: %#llx, nents: %d, node: %d\n",
+               (u64)sg_dma_address(fctx->sg_table.sgl), fctx->sg_table.nents,
+               fctx->sg_nid);
     }
+    mutex_unlock(&fctx->sg_lock);
 
     /* Pool info */
-    if (dd->pool_buf) {
-        param.dma_addr = dd->pool_dma;
+    mutex_lock(&fctx->dma_pool_lock);
+    if (fctx->pool_buf) {
+        param.dma_addr = fctx->pool_dma;
         param.size = DMA_POOL_SIZE;
-        printk(KERN_INFO "DMA: Pool: %#llx, size: %d\n",
-               (u64)dd->pool_dma, DMA_POOL_SIZE);
+        param.node = dma_vaddr_node(fctx->pool_buf);
+        printk(KERN_INFO "DMA: Pool: %#llx, size: %d, node: %d\n",
+               (u64)fctx->pool_dma, DMA_POOL_SIZE, param.node);
     }
+    mutex_unlock(&fctx->dma_pool_lock);
 
+out_mask:
     /* DMA mask info */
-    param.mask_bits = (dd->dma_mask == DMA_BIT_MASK(64)) ? 64 : 32;
+    mutex_lock(&dd->lock);
+    param.mask_bits = (dd->dma_mask == DMA_ARCH_MASK_64) ? 64 : 32;
+    mutex_unlock(&dd->lock);
     printk(KERN_INFO "DMA: DMA mask: %u bits\n", param.mask_bits);
 
     if (copy_to_user(uparam, &param, sizeof(param))) {
@@ -681,26 +3751,89 @@ static int dma_get_info(struct m_chr_device_data *dd,
     return 0;
 }
 
-static int m_chrdev_dma_set_mask(struct device *dev, struct m_chr_device_data *dd,
-                                  unsigned int mask_bits)
+/*
+ * Whether the file holds memory mapped for the device. Each resource is
+ * checked under its own lock, so this is a snapshot: a thread mapping
+ * concurrently with SET_MASK gets whichever mask wins. Exported dma-bufs
+ * do not count, they are mapped per importer when attached.
+ */
+static bool dma_file_has_mappings(struct dma_file_ctx *fctx)
+{
+    bool busy;
+
+    mutex_lock(&fctx->coherent_lock);
+    busy = !idr_is_empty(&fctx->coherent_idr);
+    mutex_unlock(&fctx->coherent_lock);
+
+    mutex_lock(&fctx->single_lock);
+    busy |= fctx->single_mapped;
+    mutex_unlock(&fctx->single_lock);
+
+    mutex_lock(&fctx->sg_lock);
+    busy |= fctx->sg_mapped;
+    mutex_unlock(&fctx->sg_lock);
+
+    mutex_lock(&fctx->user_map_lock);
+    busy |= !idr_is_empty(&fctx->user_map_idr);
+    mutex_unlock(&fctx->user_map_lock);
+
+    mutex_lock(&fctx->dma_pool_lock);
+    busy |= fctx->dma_pool != NULL;
+    mutex_unlock(&fctx->dma_pool_lock);
+
+    mutex_lock(&fctx->pool_lock);
+    busy |= !idr_is_empty(&fctx->pool_idr);
+    mutex_unlock(&fctx->pool_lock);
+
+    mutex_lock(&fctx->import_lock);
+    busy |= !idr_is_empty(&fctx->import_idr);
+    mutex_unlock(&fctx->import_lock);
+
+    return busy;
+}
+
+/*
+ * The mask is a property of the device, so it is shared by every open file.
+ * Changing it under live mappings would leave them with addresses the new
+ * mask may not allow; only a sole opener with nothing mapped may change it.
+ * The shared cache was mapped under the old mask and is drained.
+ */
+static int m_chrdev_dma_set_mask(struct dma_file_ctx *fctx, unsigned int mask_bits)
 {
+    struct m_chr_device_data *dd = fctx->dd;
     u64 mask;
     int ret;
 
     printk(KERN_INFO "DMA: Setting mask to %u bits\n", mask_bits);
 
-    mask = (mask_bits == 64) ? DMA_BIT_MASK(64) : DMA_BIT_MASK(32);
+    mask = (mask_bits == 64) ? DMA_ARCH_MASK_64 : DMA_BIT_MASK(32);
+
+    mutex_lock(&dd->lock);
+    if (dd->open_count > 1) {
+        printk(KERN_WARNING "DMA: Device open %u times, not changing the mask\n",
+               dd->open_count);
+        ret = -EBUSY;
+        goto out_unlock;
+    }
+    if (dma_file_has_mappings(fctx)) {
+        printk(KERN_WARNING "DMA: Release all mappings before changing the mask\n");
+        ret = -EBUSY;
+        goto out_unlock;
+    }
 
-    ret = dma_set_mask_and_coherent(dev, mask);
+    ret = dma_set_mask_and_coherent(dd->dev, mask);
     if (ret) {
         printk(KERN_ERR "DMA: Failed to set mask\n");
-        return ret;
+        goto out_unlock;
     }
 
     dd->dma_mask = mask;
+    dma_cache_drain(dd->dev, dd, ULONG_MAX);
     printk(KERN_INFO "DMA: DMA mask set to %#llx\n", mask);
 
-    return 0;
+out_unlock:
+    mutex_unlock(&dd->lock);
+    return ret;
 }
 
 /*==============================================================================
@@ -710,6 +3843,7 @@ static int m_chrdev_dma_set_mask(struct device *dev, struct m_chr_device_data *d
 static int m_chrdev_open(struct inode *inode, struct file *file)
 {
     struct m_chr_device_data *dd;
+    struct dma_file_ctx *fctx;
     int minor = MINOR(inode->i_rdev);
 
     printk(KERN_INFO "DMA: Device open, minor: %d\n", minor);
@@ -718,33 +3852,88 @@ static int m_chrdev_open(struct inode *inode, struct file *file)
         return -ENODEV;
     }
 
+    fctx = kzalloc(sizeof(*fctx), GFP_KERNEL);
+    if (!fctx) {
+        return -ENOMEM;
+    }
+
     dd = &m_chrdev_data[minor];
-    file->private_data = dd;
-    atomic_inc(&dd->ioctl_count);
+    fctx->dd = dd;
+    idr_init(&fctx->coherent_idr);
+    mutex_init(&fctx->coherent_lock);
+    mutex_init(&fctx->single_lock);
+    mutex_init(&fctx->sg_lock);
+    idr_init(&fctx->user_map_idr);
+    mutex_init(&fctx->user_map_lock);
+    mutex_init(&fctx->dma_pool_lock);
+    idr_init(&fctx->pool_idr);
+    mutex_init(&fctx->pool_lock);
+    idr_init(&fctx->import_idr);
+    mutex_init(&fctx->import_lock);
+    file->private_data = fctx;
+
+    mutex_lock(&dd->lock);
+    dd->open_count++;
+    mutex_unlock(&dd->lock);
 
     return 0;
 }
 
+/*
+ * Last close of a file: nothing else can reach its context any more, so
+ * everything it still holds is given back here.
+ */
 static int m_chrdev_release(struct inode *inode, struct file *file)
 {
-    struct m_chr_device_data *dd = file->private_data;
+    struct dma_file_ctx *fctx = file->private_data;
+    struct m_chr_device_data *dd = fctx->dd;
+    struct device *dev = dd->dev;
 
     printk(KERN_INFO "DMA: Device close\n");
 
-    atomic_dec(&dd->ioctl_count);
+    /* Queued jobs use the resources below, let them finish first */
+    dma_job_queue_release(fctx);
+    dmabuf_release_all(fctx);
+
+    dma_free_coherent_all(fctx);
+    dma_unmap_user_all(fctx);
+    dma_pool_close_all(fctx);
+
+    if (fctx->single_mapped) {
+        dma_unmap_single_dev(fctx);
+    }
+    if (fctx->sg_mapped) {
+        dma_unmap_sg_dev(fctx);
+    }
+    if (fctx->dma_pool) {
+        dma_pool_destroy_dev(fctx);
+    }
+
+    idr_destroy(&fctx->coherent_idr);
+    idr_destroy(&fctx->user_map_idr);
+    idr_destroy(&fctx->pool_idr);
+    idr_destroy(&fctx->import_idr);
+    kfree(fctx);
+
+    mutex_lock(&dd->lock);
+    dd->open_count--;
+    mutex_unlock(&dd->lock);
+
+    dev_dbg(dev, "DMA context released\n");
 
     return 0;
 }
 
 static long m_chrdev_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 {
-    struct m_chr_device_data *dd = file->private_data;
-    struct device *dev = dd->dev;
+    struct dma_file_ctx *fctx = file->private_data;
+    struct m_chr_device_data *dd = fctx->dd;
     struct dma_ioctl_param param;
-    int ret = 0;
+    dma_addr_t dma_addr;
+    int ret = 0, nid;
     void __user *argp = (void __user *)arg;
 
-    printk(KERN_INFO "DMA: IOCTL cmd: %u\n", cmd);
+    dma_log("IOCTL cmd: %u\n", cmd);
 
     if (_IOC_TYPE(cmd) != DMA_MAGIC) {
         return -ENOTTY;
@@ -755,35 +3944,52 @@ static long m_chrdev_ioctl(struct file *file, unsigned int cmd, unsigned long ar
         if (copy_from_user(&param, argp, sizeof(param))) {
             return -EFAULT;
         }
-        ret = dma_alloc_coherent_dev(dev, dd, param.size);
-        if (ret == 0) {
-            param.dma_addr = dd->coherent_dma;
+        nid = dma_resolve_node(dd->dev, param.node_policy, param.node);
+        if (nid < NUMA_NO_NODE) {
+            return nid;
+        }
+        ret = dma_alloc_coherent_dev(fctx, param.size, nid, &dma_addr, &param.node);
+        if (ret > 0) {
+            param.handle = ret;
+            param.dma_addr = dma_addr;
             param.result = 0;
+            ret = 0;
             if (copy_to_user(argp, &param, sizeof(param))) {
+                dma_free_coherent_dev(fctx, param.handle);
                 return -EFAULT;
             }
         }
         break;
 
     case DMA_IOCTL_FREE_COHERENT:
-        ret = dma_free_coherent_dev(dev, dd);
+        if (copy_from_user(&param, argp, sizeof(param))) {
+            return -EFAULT;
+        }
+        ret = dma_free_coherent_dev(fctx, param.handle);
         break;
 
     case DMA_IOCTL_READ_COHERENT:
-        ret = dma_read_coherent(dd, argp);
+        ret = dma_read_coherent(fctx, argp);
         break;
 
     case DMA_IOCTL_WRITE_COHERENT:
-        ret = dma_write_coherent(dd, argp);
+        ret = dma_write_coherent(fctx, argp);
         break;
 
     case DMA_IOCTL_MAP_SINGLE:
         if (copy_from_user(&param, argp, sizeof(param))) {
             return -EFAULT;
         }
-        ret = dma_map_single_dev(dev, dd, param.size, param.direction);
+        nid = dma_resolve_node(dd->dev, param.node_policy, param.node);
+        if (nid < NUMA_NO_NODE) {
+            return nid;
+        }
+        mutex_lock(&fctx->single_lock);
+        ret = dma_map_single_dev(fctx, param.size, param.direction, nid);
+        param.dma_addr = fctx->single_dma;
+        param.node = fctx->single_nid;
+        mutex_unlock(&fctx->single_lock);
         if (ret == 0) {
-            param.dma_addr = dd->single_dma;
             param.result = 0;
             if (copy_to_user(argp, &param, sizeof(param))) {
                 return -EFAULT;
@@ -792,50 +3998,108 @@ static long m_chrdev_ioctl(struct file *file, unsigned int cmd, unsigned long ar
         break;
 
     case DMA_IOCTL_UNMAP_SINGLE:
-        ret = dma_unmap_single_dev(dev, dd);
+        mutex_lock(&fctx->single_lock);
+        ret = dma_unmap_single_dev(fctx);
+        mutex_unlock(&fctx->single_lock);
         break;
 
     case DMA_IOCTL_SYNC_SINGLE:
         if (copy_from_user(&param, argp, sizeof(param))) {
             return -EFAULT;
         }
-        ret = dma_sync_single_dev(dev, dd, param.direction);
+        mutex_lock(&fctx->single_lock);
+        ret = dma_sync_single_dev(fctx, param.direction);
+        mutex_unlock(&fctx->single_lock);
         break;
 
     case DMA_IOCTL_MAP_SG:
         if (copy_from_user(&param, argp, sizeof(param))) {
             return -EFAULT;
         }
-        ret = dma_map_sg_dev(dev, dd, SG_NENTS, param.direction);
+        /* size in bytes wins, else count pages, else the default */
+        if (param.size) {
+            if (param.size > DMA_MAX_SG_SIZE) {
+                return -EINVAL;
+            }
+            param.count = DIV_ROUND_UP(param.size, SG_PAGE_SIZE);
+        } else if (param.count <= 0) {
+            param.count = SG_NENTS;
+        }
+        nid = dma_resolve_node(dd->dev, param.node_policy, param.node);
+        if (nid < NUMA_NO_NODE) {
+            return nid;
+        }
+        mutex_lock(&fctx->sg_lock);
+        ret = dma_map_sg_dev(fctx, param.count, param.direction, nid, param.alloc_flags);
         if (ret == 0) {
-            param.dma_addr = sg_dma_address(dd->sg_table.sgl);
-            param.count = dd->sg_table.nents;
+            param.size = (unsigned long)fctx->sg_nents * SG_PAGE_SIZE;
+            param.dma_addr = sg_dma_address(fctx->sg_table.sgl);
+            param.nr_pages = fctx->sg_nents;
+            param.nr_segs = fctx->sg_table.orig_nents;
+            param.count = fctx->sg_table.nents;
+            param.node = fctx->sg_nid;
+            param.max_order = fctx->sg_max_order;
             param.result = 0;
-            if (copy_to_user(argp, &param, sizeof(param))) {
-                return -EFAULT;
-            }
+        }
+        mutex_unlock(&fctx->sg_lock);
+        if (ret == 0 && copy_to_user(argp, &param, sizeof(param))) {
+            return -EFAULT;
         }
         break;
 
     case DMA_IOCTL_UNMAP_SG:
-        ret = dma_unmap_sg_dev(dev, dd);
+        mutex_lock(&fctx->sg_lock);
+        ret = dma_unmap_sg_dev(fctx);
+        mutex_unlock(&fctx->sg_lock);
         break;
 
     case DMA_IOCTL_SYNC_SG:
         if (copy_from_user(&param, argp, sizeof(param))) {
             return -EFAULT;
         }
-        ret = dma_sync_sg_dev(dev, dd, param.direction);
+        mutex_lock(&fctx->sg_lock);
+        ret = dma_sync_sg_dev(fctx, param.direction);
+        mutex_unlock(&fctx->sg_lock);
+        break;
+
+    case DMA_IOCTL_SYNC_RANGE: {
+        struct dma_sync_range range;
+
+        if (copy_from_user(&range, argp, sizeof(range))) {
+            return -EFAULT;
+        }
+        mutex_lock(&fctx->user_map_lock);
+        ret = dma_sync_range_dev(fctx, &range);
+        mutex_unlock(&fctx->user_map_lock);
+        break;
+    }
+
+    case DMA_IOCTL_SYNC_BATCH: {
+        struct dma_sync_batch batch;
+
+        if (copy_from_user(&batch, argp, sizeof(batch))) {
+            return -EFAULT;
+        }
+        ret = dma_sync_batch_dev(fctx, &batch);
+        /* Report partial progress even on error */
+        if (copy_to_user(argp, &batch, sizeof(batch))) {
+            return -EFAULT;
+        }
         break;
+    }
 
     case DMA_IOCTL_POOL_CREATE:
-        ret = dma_pool_create_dev(dev, dd);
+        mutex_lock(&fctx->dma_pool_lock);
+        ret = dma_pool_create_dev(fctx);
+        mutex_unlock(&fctx->dma_pool_lock);
         break;
 
     case DMA_IOCTL_POOL_ALLOC:
-        ret = dma_pool_alloc_dev(dev, dd);
+        mutex_lock(&fctx->dma_pool_lock);
+        ret = dma_pool_alloc_dev(fctx);
+        param.dma_addr = fctx->pool_dma;
+        mutex_unlock(&fctx->dma_pool_lock);
         if (ret == 0) {
-            param.dma_addr = dd->pool_dma;
             param.size = DMA_POOL_SIZE;
             param.result = 0;
             if (copy_to_user(argp, &param, sizeof(param))) {
@@ -845,23 +4109,180 @@ static long m_chrdev_ioctl(struct file *file, unsigned int cmd, unsigned long ar
         break;
 
     case DMA_IOCTL_POOL_FREE:
-        ret = dma_pool_free_dev(dev, dd);
+        mutex_lock(&fctx->dma_pool_lock);
+        ret = dma_pool_free_dev(fctx);
+        mutex_unlock(&fctx->dma_pool_lock);
         break;
 
     case DMA_IOCTL_POOL_DESTROY:
-        ret = dma_pool_destroy_dev(dev, dd);
+        mutex_lock(&fctx->dma_pool_lock);
+        ret = dma_pool_destroy_dev(fctx);
+        mutex_unlock(&fctx->dma_pool_lock);
         break;
 
     case DMA_IOCTL_GET_INFO:
-        ret = dma_get_info(dd, argp);
+        ret = dma_get_info(fctx, argp);
         break;
 
     case DMA_IOCTL_SET_MASK:
         if (copy_from_user(&param, argp, sizeof(param))) {
             return -EFAULT;
         }
-        ret = m_chrdev_dma_set_mask(dev, dd, param.mask_bits);
+        ret = m_chrdev_dma_set_mask(fctx, param.mask_bits);
+        break;
+
+    case DMA_IOCTL_CACHE_CTL:
+        ret = dma_cache_ctl(dd, argp);
+        break;
+
+    case DMA_IOCTL_MAP_USER:
+        if (copy_from_user(&param, argp, sizeof(param))) {
+            return -EFAULT;
+        }
+        ret = dma_map_user_dev(fctx, &param);
+        if (ret == 0) {
+            param.result = 0;
+            if (copy_to_user(argp, &param, sizeof(param))) {
+                dma_unmap_user_dev(fctx, param.handle);
+                return -EFAULT;
+            }
+        }
+        break;
+
+    case DMA_IOCTL_UNMAP_USER:
+        if (copy_from_user(&param, argp, sizeof(param))) {
+            return -EFAULT;
+        }
+        ret = dma_unmap_user_dev(fctx, param.handle);
+        break;
+
+    case DMA_IOCTL_POOL_OPEN: {
+        struct dma_pool_open op;
+
+        if (copy_from_user(&op, argp, sizeof(op))) {
+            return -EFAULT;
+        }
+        ret = dma_pool_open_dev(fctx, &op);
+        if (ret == 0 && copy_to_user(argp, &op, sizeof(op))) {
+            dma_pool_close_dev(fctx, op.handle);
+            return -EFAULT;
+        }
+        break;
+    }
+
+    case DMA_IOCTL_POOL_CLOSE: {
+        struct dma_pool_open op;
+
+        if (copy_from_user(&op, argp, sizeof(op))) {
+            return -EFAULT;
+        }
+        ret = dma_pool_close_dev(fctx, op.handle);
+        break;
+    }
+
+    case DMA_IOCTL_XFER_BENCH: {
+        struct dma_xfer_bench xb;
+
+        if (copy_from_user(&xb, argp, sizeof(xb))) {
+            return -EFAULT;
+        }
+        ret = dma_xfer_bench_dev(dd->dev, &xb);
+        if (ret == 0 && copy_to_user(argp, &xb, sizeof(xb))) {
+            return -EFAULT;
+        }
+        break;
+    }
+
+    case DMA_IOCTL_POOL_BULK_ALLOC:
+    case DMA_IOCTL_POOL_BULK_FREE: {
+        struct dma_pool_bulk bulk;
+
+        if (copy_from_user(&bulk, argp, sizeof(bulk))) {
+            return -EFAULT;
+        }
+        if (cmd == DMA_IOCTL_POOL_BULK_ALLOC) {
+            ret = dma_pool_bulk_alloc_dev(fctx, &bulk);
+        } else {
+            ret = dma_pool_bulk_free_dev(fctx, &bulk);
+            /* Report partial progress even on error */
+            if (copy_to_user(argp, &bulk, sizeof(bulk))) {
+                return -EFAULT;
+            }
+        }
+        break;
+    }
+
+    case DMA_IOCTL_EXPORT_DMABUF: {
+        struct dmabuf_export_req req;
+
+        if (copy_from_user(&req, argp, sizeof(req))) {
+            return -EFAULT;
+        }
+        ret = dmabuf_export_dev(fctx, &req);
+        if (ret == 0 && copy_to_user(argp, &req, sizeof(req))) {
+            return -EFAULT;
+        }
+        break;
+    }
+
+    case DMA_IOCTL_IMPORT_DMABUF:
+    case DMA_IOCTL_RELEASE_DMABUF: {
+        struct dmabuf_import_req req;
+
+        if (copy_from_user(&req, argp, sizeof(req))) {
+            return -EFAULT;
+        }
+        if (cmd == DMA_IOCTL_RELEASE_DMABUF) {
+            ret = dmabuf_release_dev(fctx, req.handle);
+            break;
+        }
+        ret = dmabuf_import_dev(fctx, &req);
+        if (ret == 0 && copy_to_user(argp, &req, sizeof(req))) {
+            return -EFAULT;
+        }
+        break;
+    }
+
+    case DMA_IOCTL_ACCESS_DMABUF: {
+        struct dmabuf_access acc;
+
+        if (copy_from_user(&acc, argp, sizeof(acc))) {
+            return -EFAULT;
+        }
+        ret = dmabuf_access_dev(fctx, &acc);
+        break;
+    }
+
+    case DMA_IOCTL_JOB_SETUP: {
+        struct dma_job_setup setup;
+
+        if (copy_from_user(&setup, argp, sizeof(setup))) {
+            return -EFAULT;
+        }
+        ret = dma_job_setup_dev(fctx, &setup);
+        if (ret == 0 && copy_to_user(argp, &setup, sizeof(setup))) {
+            return -EFAULT;
+        }
+        break;
+    }
+
+    case DMA_IOCTL_JOB_SUBMIT:
+    case DMA_IOCTL_JOB_REAP: {
+        struct dma_job_batch batch;
+
+        if (copy_from_user(&batch, argp, sizeof(batch))) {
+            return -EFAULT;
+        }
+        if (cmd == DMA_IOCTL_JOB_SUBMIT) {
+            ret = dma_job_submit_dev(fctx, &batch);
+        } else {
+            ret = dma_job_reap_dev(fctx, &batch);
+        }
+        if (ret == 0 && copy_to_user(argp, &batch, sizeof(batch))) {
+            return -EFAULT;
+        }
         break;
+    }
 
     default:
         return -ENOTTY;
@@ -925,13 +4346,15 @@ static int __init m_chr_init(void)
 
     printk(KERN_INFO "DMA module %s init desc:%s\n", __func__, init_desc);
     printk(KERN_INFO "DMA git version:%s\n", DEMO_GIT_VERSION);
+    printk(KERN_INFO "DMA arch policy:%s, 32-bit zone gfp:%#x\n", DMA_ARCH_NAME,
+           (unsigned int)DMA_ARCH_GFP_32BIT);
 
     /* Dynamically apply for device number */
     err = alloc_chrdev_region(&devno, 0, MAX_DEV, "m_chrdev");
     dev_major = MAJOR(devno);
 
     /* create sysfs class */
-    m_chrdev_class = class_create("m_chrdev_cls");
+    m_chrdev_class = dma_class_create("m_chrdev_cls");
     m_chrdev_class->dev_uevent = m_chrdev_uevent;
 
     /* Create necessary number of the devices */
@@ -940,8 +4363,11 @@ static int __init m_chr_init(void)
 
         /* Initialize device data */
         memset(dd, 0, sizeof(*dd));
-        atomic_set(&dd->ioctl_count, 0);
-        dd->dma_mask = DMA_BIT_MASK(64); /* Default to 64-bit */
+        mutex_init(&dd->lock);
+        if (dma_cache_init(dd, idx)) {
+            printk(KERN_WARNING "DMA: No shrinker for device %d buffer cache\n", idx);
+        }
+        dd->dma_mask = DMA_ARCH_MASK_64; /* Default to 64-bit */
 
         /* init new device */
         cdev_init(&dd->cdev, &m_chrdev_fops);
@@ -984,35 +4410,8 @@ static void __exit m_chr_exit(void)
     for (idx = 0; idx < MAX_DEV; idx++) {
         struct m_chr_device_data *dd = &m_chrdev_data[idx];
 
-        /* Clean up any remaining DMA resources */
-        if (dd->coherent_buf) {
-            dma_free_coherent(dd->dev, dd->coherent_size, dd->coherent_buf,
-                              dd->coherent_dma);
-        }
-
-        if (dd->single_mapped) {
-            dma_unmap_single(dd->dev, dd->single_dma, dd->single_size, dd->single_dir);
-            kfree(dd->single_buf);
-        }
-
-        if (dd->sg_mapped) {
-            int i;
-            dma_unmap_sg(dd->dev, dd->sg_table.sgl, dd->sg_table.nents, dd->sg_dir);
-            sg_free_table(&dd->sg_table);
-            /* Use the original nents to free all allocated pages */
-            for (i = 0; i < dd->sg_nents; i++) {
-                __free_page(dd->sg_pages[i]);
-            }
-            kfree(dd->sg_pages);
-        }
-
-        if (dd->pool_buf) {
-            dma_pool_free(dd->dma_pool, dd->pool_buf, dd->pool_dma);
-        }
-
-        if (dd->dma_pool) {
-            dma_pool_destroy(dd->dma_pool);
-        }
+        /* Every file has been released by now, only the cache is left */
+        dma_cache_exit(dd);
 
         device_destroy(m_chrdev_class, MKDEV(dev_major, idx));
     }
@@ -1034,3 +4433,8 @@ MODULE_AUTHOR("Lhj <872648180@qq.com>");
 MODULE_DESCRIPTION("DMA demo for learning");
 MODULE_ALIAS("dma demo");
 MODULE_VERSION(DEMO_GIT_VERSION);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0)
+MODULE_IMPORT_NS("DMA_BUF");
+#else
+MODULE_IMPORT_NS(DMA_BUF);
+#endif
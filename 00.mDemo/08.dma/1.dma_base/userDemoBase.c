@@ -5,17 +5,27 @@
     > Created Time: Sat Oct 14 14:23:18 2023
  ************************************************************************/
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <unistd.h>
 #include <getopt.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <time.h>
+#include <errno.h>
+#include <sched.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <sys/utsname.h>
+#include <poll.h>
+#include <pthread.h>
+#include <linux/dma-buf.h>
 
 #define DEVNAME_0 "/dev/m_chrdev_0"
 #define DEVNAME_1 "/dev/m_chrdev_1"
@@ -51,6 +61,46 @@
 /* DMA mask configuration */
 #define DMA_IOCTL_SET_MASK          _IOW(DMA_MAGIC, 16, struct dma_ioctl_param)
 
+/* Streaming buffer cache control and statistics */
+#define DMA_IOCTL_CACHE_CTL         _IOWR(DMA_MAGIC, 19, struct dma_cache_ctl)
+
+/* Zero-copy mapping of user memory */
+#define DMA_IOCTL_MAP_USER          _IOWR(DMA_MAGIC, 17, struct dma_ioctl_param)
+#define DMA_IOCTL_UNMAP_USER        _IOW(DMA_MAGIC, 18, struct dma_ioctl_param)
+
+/* Handle-based DMA pools with bulk block allocation */
+#define DMA_IOCTL_POOL_OPEN         _IOWR(DMA_MAGIC, 20, struct dma_pool_open)
+#define DMA_IOCTL_POOL_CLOSE        _IOW(DMA_MAGIC, 21, struct dma_pool_open)
+#define DMA_IOCTL_POOL_BULK_ALLOC   _IOWR(DMA_MAGIC, 22, struct dma_pool_bulk)
+#define DMA_IOCTL_POOL_BULK_FREE    _IOWR(DMA_MAGIC, 23, struct dma_pool_bulk)
+
+/* End-to-end memcpy transfer benchmark */
+#define DMA_IOCTL_XFER_BENCH        _IOWR(DMA_MAGIC, 24, struct dma_xfer_bench)
+
+/* Partial and batched sync of streaming mappings */
+#define DMA_IOCTL_SYNC_RANGE        _IOW(DMA_MAGIC, 28, struct dma_sync_range)
+#define DMA_IOCTL_SYNC_BATCH        _IOWR(DMA_MAGIC, 29, struct dma_sync_batch)
+
+/* dma-buf export and import */
+#define DMA_IOCTL_EXPORT_DMABUF     _IOWR(DMA_MAGIC, 30, struct dmabuf_export_req)
+#define DMA_IOCTL_IMPORT_DMABUF     _IOWR(DMA_MAGIC, 31, struct dmabuf_import_req)
+#define DMA_IOCTL_RELEASE_DMABUF    _IOW(DMA_MAGIC, 32, struct dmabuf_import_req)
+#define DMA_IOCTL_ACCESS_DMABUF     _IOW(DMA_MAGIC, 33, struct dmabuf_access)
+
+/* Asynchronous job queue */
+#define DMA_IOCTL_JOB_SETUP         _IOWR(DMA_MAGIC, 25, struct dma_job_setup)
+#define DMA_IOCTL_JOB_SUBMIT        _IOWR(DMA_MAGIC, 26, struct dma_job_batch)
+#define DMA_IOCTL_JOB_REAP          _IOWR(DMA_MAGIC, 27, struct dma_job_batch)
+
+/* Buffer placement, dma_ioctl_param.node_policy - must match kernel side */
+#define DMA_NODE_DEFAULT    0   /* No preference, the allocator decides */
+#define DMA_NODE_LOCAL      1   /* Node of the CPU making the call */
+#define DMA_NODE_DEVICE     2   /* Node the device is attached to */
+#define DMA_NODE_EXPLICIT   3   /* The node given in dma_ioctl_param.node */
+
+/* Allocation flags, dma_ioctl_param.alloc_flags - must match kernel side */
+#define DMA_ALLOC_HIGH_ORDER (1 << 0)  /* MAP_SG: compound chunks up to 2MB, not single pages */
+
 /* IOCTL parameter structure - must match kernel side */
 struct dma_ioctl_param {
     unsigned long size;         /* Buffer size */
@@ -60,9 +110,171 @@ struct dma_ioctl_param {
     int count;                  /* Count for scatter-gather */
     unsigned int mask_bits;     /* DMA mask bits (32 or 64) */
     int result;                 /* Result code */
+    int handle;                 /* Coherent buffer / user mapping handle */
+    unsigned int nr_pages;      /* SG: pages backing the mapping */
+    unsigned int nr_segs;       /* SG: segments after merging adjacent pages */
+    int node_policy;            /* Alloc: DMA_NODE_* placement */
+    int node;                   /* In: node for DMA_NODE_EXPLICIT, out: node the buffer is on */
+    unsigned int alloc_flags;   /* DMA_ALLOC_* */
+    unsigned int max_order;     /* SG: largest chunk order actually used */
     char data[64];              /* Data buffer for small transfers */
 };
 
+/* Streaming buffer cache control parameter - must match kernel side */
+struct dma_cache_ctl {
+    int enable;                 /* In: 1 on, 0 off (drains the cache), -1 keep */
+    unsigned int nr_free;       /* Idle pre-mapped buffers in the cache */
+    unsigned long long hits;    /* MAP_SINGLE served from the cache */
+    unsigned long long misses;  /* MAP_SINGLE that had to allocate and map */
+    unsigned long long reaped;  /* Idle buffers freed by the shrinker or disable */
+};
+
+/* Pool creation parameter - must match kernel side */
+struct dma_pool_open {
+    int handle;                 /* Out: pool handle (in for CLOSE) */
+    unsigned int size;          /* Block size in bytes */
+    unsigned int align;         /* Block alignment, power of two, 0 for none */
+    unsigned int boundary;      /* Blocks don't cross this, power of two, 0 for none */
+    unsigned int max_blocks;    /* Blocks outstanding at most, 0 for the default */
+};
+
+/* One pool block - must match kernel side */
+struct dma_pool_block {
+    unsigned long long dma_addr; /* DMA address of the block */
+    unsigned int id;            /* Block id, pass it back to free the block */
+    unsigned int pad;
+};
+
+/* Bulk alloc/free parameter - must match kernel side */
+struct dma_pool_bulk {
+    int handle;                 /* Pool handle */
+    unsigned int count;         /* In: blocks requested, out: blocks done */
+    unsigned long long blocks;  /* User pointer to struct dma_pool_block[count] */
+};
+
+/* Buffer types for DMA_IOCTL_XFER_BENCH - must match kernel side */
+enum dma_xfer_type {
+    DMA_XFER_COHERENT = 0,
+    DMA_XFER_SINGLE = 1,
+    DMA_XFER_SG = 2,
+    DMA_XFER_POOL = 3,
+};
+
+/* Transfer benchmark parameter - must match kernel side */
+struct dma_xfer_bench {
+    int type;                   /* In: enum dma_xfer_type */
+    int engine;                 /* In: -1 auto, 0 kthread, 1 dmaengine; out: used */
+    unsigned int size;          /* In: bytes per transfer */
+    unsigned int iterations;    /* In: transfers to run */
+    unsigned int segments;      /* Out: memcpy descriptors per transfer */
+    unsigned int pad;
+    unsigned long long total_ns;    /* Out: wall time of all transfers */
+    unsigned long long lat_min_ns;  /* Out: submit to completion callback */
+    unsigned long long lat_avg_ns;
+    unsigned long long lat_max_ns;
+    char chan_name[32];         /* Out: dmaengine channel, or "kthread" */
+};
+
+/* Sync range targets - must match kernel side */
+enum dma_sync_target {
+    DMA_SYNC_SINGLE = 0,
+    DMA_SYNC_SG = 1,
+    DMA_SYNC_USER = 2,
+};
+
+/* One byte range to sync - must match kernel side */
+struct dma_sync_range {
+    int target;                 /* enum dma_sync_target */
+    int handle;                 /* DMA_SYNC_USER: user mapping handle */
+    unsigned long long offset;  /* Byte offset into the mapping */
+    unsigned long long length;  /* Bytes to sync, 0 for the rest of the mapping */
+    int direction;              /* TO_DEVICE: for device, FROM_DEVICE: for cpu, BIDI: both */
+    unsigned int pad;
+};
+
+/* Batched sync parameter - must match kernel side */
+struct dma_sync_batch {
+    unsigned int count;         /* In: ranges, out: ranges synced */
+    unsigned int pad;
+    unsigned long long ranges;  /* User pointer to struct dma_sync_range[count] */
+};
+
+/* dma-buf export targets - must match kernel side */
+enum dmabuf_export_target {
+    DMABUF_EXPORT_COHERENT = 0,
+    DMABUF_EXPORT_SG = 1,
+};
+
+/* dma-buf export parameter - must match kernel side */
+struct dmabuf_export_req {
+    int target;                 /* In: enum dmabuf_export_target */
+    int handle;                 /* In: coherent buffer handle */
+    int fd;                     /* Out: dma-buf file descriptor */
+    unsigned int pad;
+    unsigned long long size;    /* Out: dma-buf size in bytes */
+};
+
+/* dma-buf import parameter - must match kernel side */
+struct dmabuf_import_req {
+    int fd;                     /* In: dma-buf to import */
+    int handle;                 /* Out: import handle (in for RELEASE) */
+    unsigned long long size;    /* Out: dma-buf size in bytes */
+    unsigned long long dma_addr; /* Out: first DMA address as seen by this device */
+    unsigned int nr_segs;       /* Out: DMA segments of the attachment mapping */
+    unsigned int pad;
+};
+
+/* CPU access to an imported dma-buf - must match kernel side */
+struct dmabuf_access {
+    int handle;                 /* Import handle */
+    int write;                  /* 1: user buffer -> dma-buf, 0: dma-buf -> user buffer */
+    unsigned long long offset;  /* Byte offset into the dma-buf */
+    unsigned long long size;    /* Bytes to copy */
+    unsigned long long user_addr; /* User buffer */
+};
+
+/* Job queue operations - must match kernel side */
+enum dma_job_op {
+    DMA_JOB_NOP = 0,
+    DMA_JOB_COPY = 1,
+    DMA_JOB_FILL = 2,
+    DMA_JOB_SYNC_USER = 3,
+    DMA_JOB_MAP_STREAM = 4,
+};
+
+/* Job descriptor - must match kernel side */
+struct dma_job_desc {
+    unsigned long long user_data;   /* Returned unchanged in the completion */
+    unsigned int op;            /* enum dma_job_op */
+    int handle;                 /* Destination coherent buffer or user mapping */
+    int src_handle;             /* COPY: source coherent buffer */
+    unsigned int offset;        /* Offset into the destination */
+    unsigned int src_offset;    /* COPY: offset into the source */
+    unsigned int size;          /* Bytes to copy, fill or map */
+    unsigned int arg;           /* FILL: byte value, SYNC_USER: direction */
+    unsigned int pad;
+};
+
+/* Job completion - must match kernel side */
+struct dma_job_cqe {
+    unsigned long long user_data;
+    int result;
+    unsigned int pad;
+};
+
+/* Job queue setup parameter - must match kernel side */
+struct dma_job_setup {
+    unsigned int entries;       /* In: ring size, 0 for default; out: rounded up */
+    int eventfd;                /* In: eventfd signalled on completions, -1 for none */
+};
+
+/* Job submit/reap parameter - must match kernel side */
+struct dma_job_batch {
+    unsigned int count;         /* In: array length, out: jobs queued / reaped */
+    unsigned int min_complete;  /* REAP: wait until this many completions are ready */
+    unsigned long long ptr;     /* User pointer to dma_job_desc[] or dma_job_cqe[] */
+};
+
 /* DMA directions */
 enum dma_user_dir {
     DMA_USER_TO_DEVICE = 1,
@@ -72,6 +284,42 @@ enum dma_user_dir {
 
 #define COHERENT_BUF_SIZE  (16 * 1024)  /* 16KB */
 #define SINGLE_BUF_SIZE    (8 * 1024)   /* 8KB */
+#define COHERENT_NR_BUFS   3            /* Triple buffering */
+#define COHERENT_BW_SIZE   (1024 * 1024) /* 1MB for the bandwidth test */
+#define COHERENT_BW_LOOPS  256
+#define USER_MAP_SIZE      (1024 * 1024) /* 1MB */
+#define USER_MAP_OFFSET    100           /* Deliberately not page aligned */
+#define SG_BENCH_MIN       (4UL * 1024)         /* 4KB */
+#define SG_BENCH_MAX       (64UL * 1024 * 1024) /* 64MB */
+#define SG_BENCH_LOOPS     16
+#define CACHE_BENCH_LOOPS  2000
+#define POOL_BENCH_BLOCK   64            /* Descriptor-sized blocks */
+#define POOL_BENCH_BOUNDARY 4096
+#define POOL_BENCH_TOTAL   (256 * 1024)  /* Blocks allocated per batch size */
+#define POOL_BENCH_MAX_BATCH 4096
+#define XFER_BENCH_ITERS   1000
+#define JOB_RING_ENTRIES   256
+#define JOB_BENCH_TOTAL    (64 * 1024)   /* Jobs run per op and batch size */
+#define JOB_COPY_SIZE      4096
+#define SYNC_BENCH_SIZE    (4 * 1024 * 1024)   /* User mapping synced by the bench */
+#define SYNC_BENCH_BYTES   (256ULL << 20)      /* Bytes synced per range size */
+#define SYNC_BENCH_SLOT    4096                /* Ring slot size for batched syncs */
+#define SYNC_BENCH_MAX_BATCH 1024              /* Slots in the mapping, one batch */
+#define SYNC_BENCH_RANGES  (64 * 1024)         /* Ranges synced per batch size */
+#define DMABUF_PING_SIZE   4096                /* Bytes handed over per round */
+#define DMABUF_ROUNDS      256
+#define DMABUF_SG_SIZE     (64 * 1024)
+#define STRESS_ITERS       2000
+#define STRESS_BUF_SIZE    4096
+#define STRESS_MAX_THREADS 16
+#define NUMA_BENCH_SIZE    (64 * 1024 * 1024) /* SG buffer, well past the LLC */
+#define NUMA_BENCH_LOOPS   8
+#define NUMA_BENCH_MAX_NODES 64
+#define LARGE_BENCH_PASSES 8
+#define BENCH_ITERS        1000               /* Measured ops per thread per point */
+#define BENCH_MAX_THREADS  8
+#define DRIVER_VERSION_PARAM "/sys/module/kDemo/version"
+#define VERBOSE_PARAM      "/sys/module/kDemo/parameters/verbose"
 
 static int g_verbose = 0;
 
@@ -79,6 +327,43 @@ static int g_verbose = 0;
  * Helper Functions
  *==============================================================================*/
 
+static double now_sec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Set the driver's verbose parameter, returns the old value or -1 */
+static int set_kernel_verbose(int on)
+{
+    FILE *fp;
+    char old = 0;
+
+    fp = fopen(VERBOSE_PARAM, "r+");
+    if (!fp) {
+        return -1;
+    }
+    if (fread(&old, 1, 1, fp) != 1) {
+        fclose(fp);
+        return -1;
+    }
+    rewind(fp);
+    fputc(on ? 'Y' : 'N', fp);
+    fclose(fp);
+
+    return old == 'Y';
+}
+
 static void print_hex(const char *prefix, const uint8_t *data, size_t len)
 {
     size_t i;
@@ -130,11 +415,189 @@ int test_base(void)
  * Coherent DMA Test
  *==============================================================================*/
 
+/*
+ * Stage COHERENT_NR_BUFS buffers at once, as a double/triple buffering
+ * producer would: fill each with its own pattern, then read them all back
+ * and check that no buffer saw another one's data.
+ */
+static int test_coherent_multi(int fd)
+{
+    struct dma_ioctl_param param;
+    int handles[COHERENT_NR_BUFS];
+    uint8_t *buf;
+    int nr = 0;
+    int ret = 0;
+    int i;
+    size_t j;
+
+    printf("Staging %d coherent buffers:\n", COHERENT_NR_BUFS);
+
+    buf = malloc(COHERENT_BUF_SIZE);
+    if (!buf) {
+        perror("malloc");
+        return -1;
+    }
+
+    for (nr = 0; nr < COHERENT_NR_BUFS; nr++) {
+        memset(&param, 0, sizeof(param));
+        param.size = COHERENT_BUF_SIZE;
+        if (ioctl(fd, DMA_IOCTL_ALLOC_COHERENT, &param) < 0) {
+            perror("DMA_IOCTL_ALLOC_COHERENT");
+            ret = -1;
+            goto free_bufs;
+        }
+        handles[nr] = param.handle;
+        printf("  buffer %d: handle %d, DMA address %#lx\n",
+               nr, param.handle, param.dma_addr);
+
+        memset(buf, 0x10 + nr, COHERENT_BUF_SIZE);
+        param.user_addr = (unsigned long)buf;
+        if (ioctl(fd, DMA_IOCTL_WRITE_COHERENT, &param) < 0) {
+            perror("DMA_IOCTL_WRITE_COHERENT");
+            nr++;
+            ret = -1;
+            goto free_bufs;
+        }
+    }
+
+    for (i = 0; i < nr; i++) {
+        memset(&param, 0, sizeof(param));
+        param.size = COHERENT_BUF_SIZE;
+        param.user_addr = (unsigned long)buf;
+        param.handle = handles[i];
+        if (ioctl(fd, DMA_IOCTL_READ_COHERENT, &param) < 0) {
+            perror("DMA_IOCTL_READ_COHERENT");
+            ret = -1;
+            goto free_bufs;
+        }
+        for (j = 0; j < COHERENT_BUF_SIZE; j++) {
+            if (buf[j] != 0x10 + i) {
+                break;
+            }
+        }
+        if (j != COHERENT_BUF_SIZE) {
+            printf("  buffer %d: mismatch at offset %zu\n", i, j);
+            ret = -1;
+        }
+    }
+
+    printf("Coherent DMA multi-buffer: Data verification %s\n",
+           ret == 0 ? "PASSED" : "FAILED");
+
+free_bufs:
+    while (--nr >= 0) {
+        memset(&param, 0, sizeof(param));
+        param.handle = handles[nr];
+        if (ioctl(fd, DMA_IOCTL_FREE_COHERENT, &param) < 0) {
+            perror("DMA_IOCTL_FREE_COHERENT");
+            ret = -1;
+        }
+    }
+    free(buf);
+
+    return ret;
+}
+
+/*
+ * Move COHERENT_BW_SIZE bytes in and out of one coherent buffer
+ * COHERENT_BW_LOOPS times, once through the WRITE/READ_COHERENT copy
+ * ioctls and once through an mmap() of the buffer, and compare MB/s.
+ */
+static int test_coherent_bandwidth(int fd)
+{
+    struct dma_ioctl_param param;
+    uint8_t *src, *dst, *map;
+    double t, t_ioctl, t_mmap;
+    int handle;
+    int ret = -1;
+    int i;
+
+    printf("Coherent bandwidth, %d KB x %d loops:\n",
+           COHERENT_BW_SIZE / 1024, COHERENT_BW_LOOPS);
+
+    memset(&param, 0, sizeof(param));
+    param.size = COHERENT_BW_SIZE;
+    if (ioctl(fd, DMA_IOCTL_ALLOC_COHERENT, &param) < 0) {
+        perror("DMA_IOCTL_ALLOC_COHERENT");
+        return -1;
+    }
+    handle = param.handle;
+
+    src = malloc(COHERENT_BW_SIZE);
+    dst = malloc(COHERENT_BW_SIZE);
+    if (!src || !dst) {
+        perror("malloc");
+        goto free_buf;
+    }
+    memset(src, 0x5A, COHERENT_BW_SIZE);
+
+    /* The page offset of the mapping selects the buffer handle */
+    map = mmap(NULL, COHERENT_BW_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+               fd, (off_t)handle * sysconf(_SC_PAGESIZE));
+    if (map == MAP_FAILED) {
+        perror("mmap");
+        goto free_buf;
+    }
+
+    /* Copy path: one ioctl each way per loop */
+    t = now_sec();
+    for (i = 0; i < COHERENT_BW_LOOPS; i++) {
+        memset(&param, 0, sizeof(param));
+        param.size = COHERENT_BW_SIZE;
+        param.handle = handle;
+        param.user_addr = (unsigned long)src;
+        if (ioctl(fd, DMA_IOCTL_WRITE_COHERENT, &param) < 0) {
+            perror("DMA_IOCTL_WRITE_COHERENT");
+            goto unmap;
+        }
+        param.user_addr = (unsigned long)dst;
+        if (ioctl(fd, DMA_IOCTL_READ_COHERENT, &param) < 0) {
+            perror("DMA_IOCTL_READ_COHERENT");
+            goto unmap;
+        }
+    }
+    t_ioctl = now_sec() - t;
+
+    /* mmap path: the CPU touches the coherent buffer directly */
+    t = now_sec();
+    for (i = 0; i < COHERENT_BW_LOOPS; i++) {
+        memcpy(map, src, COHERENT_BW_SIZE);
+        memcpy(dst, map, COHERENT_BW_SIZE);
+    }
+    t_mmap = now_sec() - t;
+
+    if (memcmp(src, dst, COHERENT_BW_SIZE) != 0) {
+        printf("  mmap data verification FAILED\n");
+        goto unmap;
+    }
+
+    printf("  ioctl copy: %8.1f MB/s\n",
+           2.0 * COHERENT_BW_SIZE * COHERENT_BW_LOOPS / t_ioctl / 1e6);
+    printf("  mmap      : %8.1f MB/s\n",
+           2.0 * COHERENT_BW_SIZE * COHERENT_BW_LOOPS / t_mmap / 1e6);
+    ret = 0;
+
+unmap:
+    munmap(map, COHERENT_BW_SIZE);
+free_buf:
+    free(src);
+    free(dst);
+    memset(&param, 0, sizeof(param));
+    param.handle = handle;
+    if (ioctl(fd, DMA_IOCTL_FREE_COHERENT, &param) < 0) {
+        perror("DMA_IOCTL_FREE_COHERENT");
+        ret = -1;
+    }
+
+    return ret;
+}
+
 static int test_coherent_dma(int fd)
 {
     struct dma_ioctl_param param;
     uint8_t *write_buf;
     uint8_t *read_buf;
+    int handle;
     int ret;
     size_t i;
 
@@ -150,7 +613,9 @@ static int test_coherent_dma(int fd)
         return -1;
     }
 
+    handle = param.handle;
     printf("Coherent buffer allocated:\n");
+    printf("  Handle: %d\n", handle);
     printf("  DMA address: %#lx\n", param.dma_addr);
     printf("  Size: %lu bytes\n", param.size);
 
@@ -171,6 +636,7 @@ static int test_coherent_dma(int fd)
     memset(&param, 0, sizeof(param));
     param.size = COHERENT_BUF_SIZE;
     param.user_addr = (unsigned long)write_buf;
+    param.handle = handle;
 
     ret = ioctl(fd, DMA_IOCTL_WRITE_COHERENT, &param);
     if (ret < 0) {
@@ -194,6 +660,7 @@ static int test_coherent_dma(int fd)
     memset(&param, 0, sizeof(param));
     param.size = COHERENT_BUF_SIZE;
     param.user_addr = (unsigned long)read_buf;
+    param.handle = handle;
 
     ret = ioctl(fd, DMA_IOCTL_READ_COHERENT, &param);
     if (ret < 0) {
@@ -219,12 +686,22 @@ static int test_coherent_dma(int fd)
     free(read_buf);
 
     /* Free coherent buffer */
+    memset(&param, 0, sizeof(param));
+    param.handle = handle;
     ret = ioctl(fd, DMA_IOCTL_FREE_COHERENT, &param);
     if (ret < 0) {
         perror("DMA_IOCTL_FREE_COHERENT");
         return -1;
     }
 
+    if (test_coherent_multi(fd) < 0) {
+        return -1;
+    }
+
+    if (test_coherent_bandwidth(fd) < 0) {
+        return -1;
+    }
+
     printf("Coherent DMA test completed\n");
 
     return 0;
@@ -292,6 +769,105 @@ static int test_single_mapping(int fd)
     return 0;
 }
 
+/*==============================================================================
+ * Streaming Buffer Cache Benchmark
+ *==============================================================================*/
+
+static double cache_bench_run(int fd, unsigned long size)
+{
+    struct dma_ioctl_param param;
+    double t;
+    int i;
+
+    t = now_sec();
+    for (i = 0; i < CACHE_BENCH_LOOPS; i++) {
+        memset(&param, 0, sizeof(param));
+        param.size = size;
+        param.direction = DMA_USER_TO_DEVICE;
+        if (ioctl(fd, DMA_IOCTL_MAP_SINGLE, &param) < 0) {
+            perror("DMA_IOCTL_MAP_SINGLE");
+            return -1;
+        }
+        if (ioctl(fd, DMA_IOCTL_UNMAP_SINGLE, &param) < 0) {
+            perror("DMA_IOCTL_UNMAP_SINGLE");
+            return -1;
+        }
+    }
+
+    return (now_sec() - t) / CACHE_BENCH_LOOPS * 1e6;
+}
+
+/*
+ * Time MAP_SINGLE + UNMAP_SINGLE pairs with the driver's pre-mapped buffer
+ * cache off and on, for a few sizes, and report the cache hit/miss counts.
+ */
+static int test_cache_bench(int fd)
+{
+    static const unsigned long sizes[] = { 4096, 65536, 262144 };
+    struct dma_cache_ctl ctl, before;
+    double us_off, us_on;
+    int old_enable;
+    int old_verbose;
+    int ret = 0;
+    int i;
+
+    printf("\n======> Streaming Buffer Cache Benchmark <======\n");
+
+    /* Per-op printk would dominate the numbers */
+    old_verbose = set_kernel_verbose(0);
+    if (old_verbose < 0) {
+        printf("Cannot write %s, kernel logging stays on\n", VERBOSE_PARAM);
+    }
+
+    memset(&before, 0, sizeof(before));
+    before.enable = -1;
+    if (ioctl(fd, DMA_IOCTL_CACHE_CTL, &before) < 0) {
+        perror("DMA_IOCTL_CACHE_CTL");
+        ret = -1;
+        goto out;
+    }
+    old_enable = before.enable;
+
+    printf("%10s %14s %14s %10s %10s\n",
+           "size", "off(us/op)", "on(us/op)", "hits", "misses");
+
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        memset(&ctl, 0, sizeof(ctl));
+        ctl.enable = 0;
+        ioctl(fd, DMA_IOCTL_CACHE_CTL, &ctl);
+        us_off = cache_bench_run(fd, sizes[i]);
+
+        ctl.enable = 1;
+        ioctl(fd, DMA_IOCTL_CACHE_CTL, &ctl);
+        before = ctl;
+        us_on = cache_bench_run(fd, sizes[i]);
+
+        ctl.enable = -1;
+        ioctl(fd, DMA_IOCTL_CACHE_CTL, &ctl);
+
+        if (us_off < 0 || us_on < 0) {
+            ret = -1;
+            break;
+        }
+
+        printf("%9luK %14.2f %14.2f %10llu %10llu\n", sizes[i] / 1024,
+               us_off, us_on, ctl.hits - before.hits, ctl.misses - before.misses);
+    }
+
+    printf("Cache: %u idle buffers, %llu reaped so far\n", ctl.nr_free, ctl.reaped);
+
+    ctl.enable = old_enable;
+    ioctl(fd, DMA_IOCTL_CACHE_CTL, &ctl);
+    printf("Buffer cache benchmark completed\n");
+
+out:
+    if (old_verbose > 0) {
+        set_kernel_verbose(1);
+    }
+
+    return ret;
+}
+
 /*==============================================================================
  * Scatter-Gather DMA Test
  *==============================================================================*/
@@ -315,6 +891,8 @@ static int test_scatter_gather(int fd)
 
     printf("Scatter-gather mapped:\n");
     printf("  First DMA address: %#lx\n", param.dma_addr);
+    printf("  Size: %lu bytes in %u pages\n", param.size, param.nr_pages);
+    printf("  Segments after merging: %u\n", param.nr_segs);
     printf("  Number of entries: %d\n", param.count);
     printf("  Direction: %d (BIDIRECTIONAL)\n", param.direction);
 
@@ -347,6 +925,55 @@ static int test_scatter_gather(int fd)
     return 0;
 }
 
+/*
+ * Map and unmap SG buffers from SG_BENCH_MIN to SG_BENCH_MAX, growing by
+ * 4x, and report the average latency of each (map includes allocating and
+ * filling the pages) together with the segment counts the driver built.
+ */
+static int test_sg_bench(int fd)
+{
+    struct dma_ioctl_param param;
+    double t, t_map, t_unmap;
+    unsigned long size;
+    int i;
+
+    printf("\n======> Scatter-Gather Map/Unmap Benchmark <======\n");
+    printf("%10s %12s %12s %8s %8s %8s\n",
+           "size", "map(us)", "unmap(us)", "pages", "segs", "dma_ents");
+
+    for (size = SG_BENCH_MIN; size <= SG_BENCH_MAX; size *= 4) {
+        t_map = 0;
+        t_unmap = 0;
+        for (i = 0; i < SG_BENCH_LOOPS; i++) {
+            memset(&param, 0, sizeof(param));
+            param.size = size;
+            param.direction = DMA_USER_BIDIRECTIONAL;
+
+            t = now_sec();
+            if (ioctl(fd, DMA_IOCTL_MAP_SG, &param) < 0) {
+                perror("DMA_IOCTL_MAP_SG");
+                return -1;
+            }
+            t_map += now_sec() - t;
+
+            t = now_sec();
+            if (ioctl(fd, DMA_IOCTL_UNMAP_SG, &param) < 0) {
+                perror("DMA_IOCTL_UNMAP_SG");
+                return -1;
+            }
+            t_unmap += now_sec() - t;
+        }
+
+        printf("%9luK %12.1f %12.1f %8u %8u %8d\n", size / 1024,
+               t_map / SG_BENCH_LOOPS * 1e6, t_unmap / SG_BENCH_LOOPS * 1e6,
+               param.nr_pages, param.nr_segs, param.count);
+    }
+
+    printf("Scatter-gather benchmark completed\n");
+
+    return 0;
+}
+
 /*==============================================================================
  * DMA Pool Test
  *==============================================================================*/
@@ -421,98 +1048,1857 @@ destroy_pool:
 }
 
 /*==============================================================================
- * DMA Information Test
+ * DMA Pool Bulk Benchmark
  *==============================================================================*/
 
-static int test_dma_info(int fd)
+/*
+ * Create a pool of 64-byte, 64-byte aligned blocks that never cross a 4KB
+ * boundary, like a descriptor ring would, then allocate and free
+ * POOL_BENCH_TOTAL blocks in batches of 1 to 4096 and report blocks/s.
+ */
+static int test_pool_bench(int fd)
 {
-    struct dma_ioctl_param param;
-    int ret;
+    static const unsigned int batches[] = { 1, 16, 256, POOL_BENCH_MAX_BATCH };
+    struct dma_pool_block *blocks;
+    struct dma_pool_bulk bulk;
+    struct dma_pool_open op;
+    unsigned int done, i, j;
+    int old_verbose;
+    double t;
+    int ret = 0;
 
-    printf("\n======> DMA Information Test <======\n");
+    printf("\n======> DMA Pool Bulk Benchmark <======\n");
 
-    memset(&param, 0, sizeof(param));
-    ret = ioctl(fd, DMA_IOCTL_GET_INFO, &param);
-    if (ret < 0) {
-        perror("DMA_IOCTL_GET_INFO");
+    blocks = calloc(POOL_BENCH_MAX_BATCH, sizeof(*blocks));
+    if (!blocks) {
+        perror("calloc");
         return -1;
     }
 
-    printf("DMA Information:\n");
-    printf("  DMA mask: %u bits\n", param.mask_bits);
-    printf("  Active DMA address: %#lx\n", param.dma_addr);
-    printf("  Size/count: %lu\n", param.size);
+    memset(&op, 0, sizeof(op));
+    op.size = POOL_BENCH_BLOCK;
+    op.align = POOL_BENCH_BLOCK;
+    op.boundary = POOL_BENCH_BOUNDARY;
+    op.max_blocks = POOL_BENCH_MAX_BATCH;
+    if (ioctl(fd, DMA_IOCTL_POOL_OPEN, &op) < 0) {
+        perror("DMA_IOCTL_POOL_OPEN");
+        free(blocks);
+        return -1;
+    }
+    printf("Pool %d: %u byte blocks, align %u, boundary %u\n",
+           op.handle, op.size, op.align, op.boundary);
+
+    old_verbose = set_kernel_verbose(0);
+
+    printf("%8s %14s %14s\n", "batch", "Mblocks/s", "ns/block");
+    for (i = 0; i < sizeof(batches) / sizeof(batches[0]); i++) {
+        t = now_sec();
+        for (done = 0; done < POOL_BENCH_TOTAL; done += batches[i]) {
+            memset(&bulk, 0, sizeof(bulk));
+            bulk.handle = op.handle;
+            bulk.count = batches[i];
+            bulk.blocks = (unsigned long)blocks;
+            if (ioctl(fd, DMA_IOCTL_POOL_BULK_ALLOC, &bulk) < 0) {
+                perror("DMA_IOCTL_POOL_BULK_ALLOC");
+                ret = -1;
+                goto out;
+            }
+            if (ioctl(fd, DMA_IOCTL_POOL_BULK_FREE, &bulk) < 0) {
+                perror("DMA_IOCTL_POOL_BULK_FREE");
+                ret = -1;
+                goto out;
+            }
+        }
+        t = now_sec() - t;
 
-    return 0;
+        printf("%8u %14.2f %14.1f\n", batches[i],
+               POOL_BENCH_TOTAL / t / 1e6, t / POOL_BENCH_TOTAL * 1e9);
+    }
+
+    /* The last batch is still in blocks[], check the pool kept its promises */
+    for (j = 0; j < POOL_BENCH_MAX_BATCH; j++) {
+        unsigned long long a = blocks[j].dma_addr;
+
+        if (a % POOL_BENCH_BLOCK ||
+            a / POOL_BENCH_BOUNDARY != (a + POOL_BENCH_BLOCK - 1) / POOL_BENCH_BOUNDARY) {
+            printf("Block %u at %#llx breaks alignment/boundary\n", blocks[j].id, a);
+            ret = -1;
+            break;
+        }
+    }
+    printf("Pool block alignment/boundary check %s\n", ret ? "FAILED" : "PASSED");
+
+out:
+    if (old_verbose > 0) {
+        set_kernel_verbose(1);
+    }
+    if (ioctl(fd, DMA_IOCTL_POOL_CLOSE, &op) < 0) {
+        perror("DMA_IOCTL_POOL_CLOSE");
+        ret = -1;
+    }
+    free(blocks);
+
+    return ret;
 }
 
 /*==============================================================================
- * DMA Mask Test
+ * End-to-End Transfer Benchmark
  *==============================================================================*/
 
-static int test_dma_mask(int fd)
+/*
+ * Have the driver memcpy between two buffers of each kind through a
+ * dmaengine DMA_MEMCPY channel, or its kthread copier when the machine has
+ * none, and report throughput and per-transfer completion latency.
+ */
+static int test_xfer_bench(int fd)
 {
-    struct dma_ioctl_param param;
-    int ret;
+    static const struct {
+        int type;
+        const char *name;
+        unsigned int size;
+    } cases[] = {
+        { DMA_XFER_COHERENT, "coherent", 4096 },
+        { DMA_XFER_COHERENT, "coherent", 1024 * 1024 },
+        { DMA_XFER_SINGLE,   "single",   4096 },
+        { DMA_XFER_SINGLE,   "single",   1024 * 1024 },
+        { DMA_XFER_SG,       "sg",       64 * 1024 },
+        { DMA_XFER_SG,       "sg",       1024 * 1024 },
+        { DMA_XFER_POOL,     "pool",     256 },
+        { DMA_XFER_POOL,     "pool",     4096 },
+    };
+    struct dma_xfer_bench xb;
+    int i;
 
-    printf("\n======> DMA Mask Test <======\n");
+    printf("\n======> End-to-End Transfer Benchmark <======\n");
+    printf("%-9s %9s %-14s %5s %10s %10s %10s %10s\n", "buffer", "size",
+           "engine", "segs", "MB/s", "min(us)", "avg(us)", "max(us)");
 
-    /* Set 32-bit mask */
-    memset(&param, 0, sizeof(param));
-    param.mask_bits = 32;
+    for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        memset(&xb, 0, sizeof(xb));
+        xb.type = cases[i].type;
+        xb.engine = -1;
+        xb.size = cases[i].size;
+        xb.iterations = XFER_BENCH_ITERS;
 
-    ret = ioctl(fd, DMA_IOCTL_SET_MASK, &param);
-    if (ret < 0) {
-        printf("Setting 32-bit mask: %s\n", strerror(-ret));
-    } else {
-        printf("Set DMA mask to 32 bits\n");
-    }
+        if (ioctl(fd, DMA_IOCTL_XFER_BENCH, &xb) < 0) {
+            perror("DMA_IOCTL_XFER_BENCH");
+            return -1;
+        }
 
-    /* Set 64-bit mask */
-    param.mask_bits = 64;
-    ret = ioctl(fd, DMA_IOCTL_SET_MASK, &param);
-    if (ret < 0) {
-        printf("Setting 64-bit mask: %s\n", strerror(-ret));
-    } else {
-        printf("Set DMA mask to 64 bits\n");
+        printf("%-9s %8uK %-14s %5u %10.1f %10.1f %10.1f %10.1f\n",
+               cases[i].name, xb.size / 1024 ? xb.size / 1024 : 1, xb.chan_name,
+               xb.segments, (double)xb.size * xb.iterations / xb.total_ns * 1e3,
+               xb.lat_min_ns / 1e3, xb.lat_avg_ns / 1e3, xb.lat_max_ns / 1e3);
     }
 
-    printf("DMA mask test completed\n");
+    printf("Transfer benchmark completed\n");
 
     return 0;
 }
 
 /*==============================================================================
- * Main Entry Point
+ * Asynchronous Job Queue Benchmark
  *==============================================================================*/
 
-static void print_usage(const char *prog)
+static int job_submit(int fd, struct dma_job_desc *jobs, unsigned int count)
 {
-    printf("Usage: %s [OPTIONS]\n", prog);
-    printf("\nDMA Demo Test Program\n");
-    printf("\nOptions:\n");
-    printf("  -b              Run base test (original test)\n");
-    printf("  -a, --all       Run all DMA tests\n");
-    printf("  -c, --coherent  Run coherent DMA test\n");
-    printf("  -s, --single    Run streaming DMA single mapping test\n");
-    printf("  -g, --sg        Run scatter-gather DMA test\n");
-    printf("  -p, --pool      Run DMA pool test\n");
-    printf("  -i, --info      Get DMA information\n");
-    printf("  -m, --mask      Test DMA mask configuration\n");
-    printf("  -t N            Run specific test case (1-6)\n");
-    printf("  -v, --verbose   Enable verbose output\n");
-    printf("  -h, --help      Show this help message\n");
-    printf("\nTest cases:\n");
-    printf("  1 - Coherent DMA\n");
-    printf("  2 - Streaming DMA Single Mapping\n");
-    printf("  3 - Scatter-Gather DMA\n");
-    printf("  4 - DMA Pool\n");
-    printf("  5 - DMA Information\n");
-    printf("  6 - DMA Mask Configuration\n");
+    struct dma_job_batch batch;
+
+    memset(&batch, 0, sizeof(batch));
+    batch.count = count;
+    batch.ptr = (unsigned long)jobs;
+    if (ioctl(fd, DMA_IOCTL_JOB_SUBMIT, &batch) < 0) {
+        perror("DMA_IOCTL_JOB_SUBMIT");
+        return -1;
+    }
+
+    return batch.count;
+}
+
+/* Reap what is ready, waiting for min_complete completions first */
+static int job_reap(int fd, struct dma_job_cqe *cqes, unsigned int count,
+                    unsigned int min_complete)
+{
+    struct dma_job_batch batch;
+    unsigned int i;
+
+    memset(&batch, 0, sizeof(batch));
+    batch.count = count;
+    batch.min_complete = min_complete;
+    batch.ptr = (unsigned long)cqes;
+    if (ioctl(fd, DMA_IOCTL_JOB_REAP, &batch) < 0) {
+        perror("DMA_IOCTL_JOB_REAP");
+        return -1;
+    }
+
+    for (i = 0; i < batch.count; i++) {
+        if (cqes[i].result) {
+            printf("Job %llu failed: %d\n", cqes[i].user_data, cqes[i].result);
+            return -1;
+        }
+    }
+
+    return batch.count;
+}
+
+/*
+ * Run JOB_BENCH_TOTAL jobs of one kind, submitting batch jobs per ioctl and
+ * keeping the ring as full as it will go. Completions are picked up after
+ * the eventfd fires. batch 1 without an eventfd waits for every job in
+ * turn, which is what one synchronous ioctl per operation costs.
+ */
+static int job_bench_run(int fd, int efd, struct dma_job_desc *tmpl,
+                         unsigned int batch, unsigned int entries,
+                         double *secs, unsigned long *syscalls)
+{
+    struct dma_job_desc *jobs;
+    struct dma_job_cqe *cqes;
+    unsigned int submitted = 0, completed = 0, inflight = 0, i, n;
+    unsigned long long cnt;
+    int ret = 0, r;
+    double t;
+
+    jobs = calloc(batch, sizeof(*jobs));
+    cqes = calloc(entries, sizeof(*cqes));
+    if (!jobs || !cqes) {
+        perror("calloc");
+        free(jobs);
+        free(cqes);
+        return -1;
+    }
+
+    *syscalls = 0;
+    t = now_sec();
+    while (completed < JOB_BENCH_TOTAL) {
+        while (submitted < JOB_BENCH_TOTAL && inflight + batch <= entries) {
+            n = JOB_BENCH_TOTAL - submitted < batch ? JOB_BENCH_TOTAL - submitted : batch;
+            for (i = 0; i < n; i++) {
+                jobs[i] = *tmpl;
+                jobs[i].user_data = submitted + i;
+            }
+            r = job_submit(fd, jobs, n);
+            (*syscalls)++;
+            if (r < 0) {
+                ret = -1;
+                goto out;
+            }
+            submitted += r;
+            inflight += r;
+            if (efd < 0) {
+                break;
+            }
+        }
+
+        if (efd >= 0) {
+            if (read(efd, &cnt, sizeof(cnt)) != sizeof(cnt)) {
+                perror("read eventfd");
+                ret = -1;
+                goto out;
+            }
+            (*syscalls)++;
+            r = job_reap(fd, cqes, entries, 0);
+        } else {
+            r = job_reap(fd, cqes, entries, inflight);
+        }
+        (*syscalls)++;
+        if (r < 0) {
+            ret = -1;
+            goto out;
+        }
+        completed += r;
+        inflight -= r;
+    }
+    *secs = now_sec() - t;
+
+out:
+    free(jobs);
+    free(cqes);
+    return ret;
+}
+
+/*
+ * Queue NOP and coherent COPY jobs through the per-file job queue and
+ * compare one job per ioctl with batched, pipelined submission.
+ */
+static int test_job_bench(void)
+{
+    static const unsigned int batches[] = { 1, 16, 64, JOB_RING_ENTRIES };
+    struct dma_ioctl_param param;
+    struct dma_job_setup setup;
+    struct dma_job_desc tmpl, jobs[2];
+    struct dma_job_cqe cqes[2];
+    unsigned char check[256];
+    struct pollfd pfd;
+    unsigned long syscalls;
+    int handles[2] = { -1, -1 };
+    int jfd, efd, old_verbose, i, op;
+    unsigned int b, j;
+    double t;
+    int ret = 0;
+
+    printf("\n======> Asynchronous Job Queue Benchmark <======\n");
+
+    /* The job queue lives as long as the file, so use a file of our own */
+    jfd = open(DEVNAME_0, O_RDWR);
+    if (jfd < 0) {
+        perror("open");
+        return -1;
+    }
+    efd = eventfd(0, 0);
+    if (efd < 0) {
+        perror("eventfd");
+        close(jfd);
+        return -1;
+    }
+
+    for (i = 0; i < 2; i++) {
+        memset(&param, 0, sizeof(param));
+        param.size = COHERENT_BUF_SIZE;
+        if (ioctl(jfd, DMA_IOCTL_ALLOC_COHERENT, &param) < 0) {
+            perror("DMA_IOCTL_ALLOC_COHERENT");
+            ret = -1;
+            goto out;
+        }
+        handles[i] = param.handle;
+    }
+
+    memset(&setup, 0, sizeof(setup));
+    setup.entries = JOB_RING_ENTRIES;
+    setup.eventfd = efd;
+    if (ioctl(jfd, DMA_IOCTL_JOB_SETUP, &setup) < 0) {
+        perror("DMA_IOCTL_JOB_SETUP");
+        ret = -1;
+        goto out;
+    }
+    printf("Job queue: %u entries, eventfd %d\n", setup.entries, efd);
+
+    /* Fill one buffer, copy it into the other and check the result */
+    memset(jobs, 0, sizeof(jobs));
+    jobs[0].op = DMA_JOB_FILL;
+    jobs[0].handle = handles[0];
+    jobs[0].size = COHERENT_BUF_SIZE;
+    jobs[0].arg = 0xa5;
+    jobs[1].op = DMA_JOB_COPY;
+    jobs[1].user_data = 1;
+    jobs[1].handle = handles[1];
+    jobs[1].src_handle = handles[0];
+    jobs[1].size = COHERENT_BUF_SIZE;
+    if (job_submit(jfd, jobs, 2) != 2) {
+        ret = -1;
+        goto out;
+    }
+
+    pfd.fd = jfd;
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, 1000) != 1 || !(pfd.revents & POLLIN)) {
+        printf("Device not readable after submitting jobs\n");
+        ret = -1;
+        goto out;
+    }
+    for (j = 0; j < 2; j += i) {
+        i = job_reap(jfd, cqes, 2 - j, 2 - j);
+        if (i < 0) {
+            ret = -1;
+            goto out;
+        }
+    }
+
+    memset(&param, 0, sizeof(param));
+    param.handle = handles[1];
+    param.size = sizeof(check);
+    param.user_addr = (unsigned long)check;
+    if (ioctl(jfd, DMA_IOCTL_READ_COHERENT, &param) < 0) {
+        perror("DMA_IOCTL_READ_COHERENT");
+        ret = -1;
+        goto out;
+    }
+    for (j = 0; j < sizeof(check); j++) {
+        if (check[j] != 0xa5) {
+            break;
+        }
+    }
+    printf("Fill + copy through the job queue %s\n",
+           j == sizeof(check) ? "PASSED" : "FAILED");
+    if (j != sizeof(check)) {
+        ret = -1;
+        goto out;
+    }
+
+    old_verbose = set_kernel_verbose(0);
+
+    printf("%-5s %6s %-8s %12s %10s %12s\n", "op", "batch", "wait",
+           "Kjobs/s", "ns/job", "syscalls/job");
+    for (op = 0; op < 2 && ret == 0; op++) {
+        memset(&tmpl, 0, sizeof(tmpl));
+        if (op) {
+            tmpl.op = DMA_JOB_COPY;
+            tmpl.handle = handles[1];
+            tmpl.src_handle = handles[0];
+            tmpl.size = JOB_COPY_SIZE;
+        }
+
+        for (b = 0; b <= sizeof(batches) / sizeof(batches[0]); b++) {
+            /* The first row is the synchronous baseline */
+            unsigned int batch = b ? batches[b - 1] : 1;
+            int use_efd = b ? efd : -1;
+
+            if (job_bench_run(jfd, use_efd, &tmpl, batch, setup.entries,
+                              &t, &syscalls) < 0) {
+                ret = -1;
+                break;
+            }
+            printf("%-5s %6u %-8s %12.1f %10.1f %12.3f\n",
+                   op ? "copy" : "nop", batch, b ? "eventfd" : "sync",
+                   JOB_BENCH_TOTAL / t / 1e3, t / JOB_BENCH_TOTAL * 1e9,
+                   (double)syscalls / JOB_BENCH_TOTAL);
+        }
+    }
+
+    if (old_verbose > 0) {
+        set_kernel_verbose(1);
+    }
+
+out:
+    /* Closing the file drains the queue and frees the buffers */
+    close(efd);
+    close(jfd);
+
+    return ret;
+}
+
+/*==============================================================================
+ * Partial and Batched Sync Benchmark
+ *==============================================================================*/
+
+static int sync_batch(int fd, struct dma_sync_range *ranges, unsigned int count,
+                      unsigned int *done)
+{
+    struct dma_sync_batch batch;
+    int ret;
+
+    memset(&batch, 0, sizeof(batch));
+    batch.count = count;
+    batch.ranges = (unsigned long)ranges;
+    ret = ioctl(fd, DMA_IOCTL_SYNC_BATCH, &batch);
+    *done = batch.count;
+
+    return ret;
+}
+
+/*
+ * Sync a pinned user mapping a range at a time to show how sync cost
+ * follows the range size, then sync ring-slot sized ranges in batches to
+ * show what batching saves per range. On cache-coherent machines without
+ * bounce buffering the syncs themselves are close to free and the numbers
+ * are mostly syscall overhead.
+ */
+static int test_sync_bench(int fd)
+{
+    static const unsigned long lens[] = {
+        64, 4096, 64 * 1024, 1024 * 1024, SYNC_BENCH_SIZE
+    };
+    static const unsigned int batches[] = { 1, 16, 256, SYNC_BENCH_MAX_BATCH };
+    struct dma_sync_range *ranges;
+    struct dma_sync_range range;
+    struct dma_ioctl_param param;
+    unsigned int i, loops, done, n;
+    int old_verbose;
+    uint8_t *buf;
+    double t;
+    int ret = 0;
+
+    printf("\n======> Partial and Batched Sync Benchmark <======\n");
+
+    if (posix_memalign((void **)&buf, 4096, SYNC_BENCH_SIZE)) {
+        perror("posix_memalign");
+        return -1;
+    }
+    memset(buf, 0x6B, SYNC_BENCH_SIZE);
+
+    ranges = calloc(SYNC_BENCH_MAX_BATCH, sizeof(*ranges));
+    if (!ranges) {
+        perror("calloc");
+        free(buf);
+        return -1;
+    }
+
+    memset(&param, 0, sizeof(param));
+    param.user_addr = (unsigned long)buf;
+    param.size = SYNC_BENCH_SIZE;
+    param.direction = DMA_USER_BIDIRECTIONAL;
+    if (ioctl(fd, DMA_IOCTL_MAP_USER, &param) < 0) {
+        perror("DMA_IOCTL_MAP_USER");
+        free(ranges);
+        free(buf);
+        return -1;
+    }
+    printf("User mapping %d: %d bytes in %d DMA segments\n",
+           param.handle, SYNC_BENCH_SIZE, param.count);
+
+    /* A batch with a bad range in the middle stops there and says so */
+    for (i = 0; i < 3; i++) {
+        ranges[i].target = DMA_SYNC_USER;
+        ranges[i].handle = param.handle;
+        ranges[i].offset = (unsigned long long)i * SYNC_BENCH_SLOT;
+        ranges[i].length = SYNC_BENCH_SLOT;
+        ranges[i].direction = DMA_USER_BIDIRECTIONAL;
+    }
+    ranges[1].offset = SYNC_BENCH_SIZE;
+    if (sync_batch(fd, ranges, 3, &done) == 0 || done != 1) {
+        printf("Out of range sync not rejected (synced %u)\n", done);
+        ret = -1;
+        goto out;
+    }
+    printf("Out of range sync rejected after %u range(s)\n", done);
+
+    old_verbose = set_kernel_verbose(0);
+
+    printf("%10s %10s %12s %12s\n", "range", "syncs", "ns/sync", "MB/s");
+    for (i = 0; i < sizeof(lens) / sizeof(lens[0]) && ret == 0; i++) {
+        loops = SYNC_BENCH_BYTES / lens[i];
+        if (loops > 100000) {
+            loops = 100000;
+        }
+
+        memset(&range, 0, sizeof(range));
+        range.target = DMA_SYNC_USER;
+        range.handle = param.handle;
+        range.length = lens[i];
+        range.direction = DMA_USER_BIDIRECTIONAL;
+
+        t = now_sec();
+        for (n = 0; n < loops; n++) {
+            /* Walk the mapping so every range size touches fresh memory */
+            range.offset = (unsigned long long)n * lens[i] % SYNC_BENCH_SIZE;
+            if (ioctl(fd, DMA_IOCTL_SYNC_RANGE, &range) < 0) {
+                perror("DMA_IOCTL_SYNC_RANGE");
+                ret = -1;
+                break;
+            }
+        }
+        t = now_sec() - t;
+
+        if (ret == 0) {
+            printf("%10lu %10u %12.1f %12.1f\n", lens[i], loops,
+                   t / loops * 1e9, (double)lens[i] * loops / t / 1e6);
+        }
+    }
+
+    for (i = 0; i < SYNC_BENCH_MAX_BATCH; i++) {
+        ranges[i].target = DMA_SYNC_USER;
+        ranges[i].handle = param.handle;
+        ranges[i].offset = (unsigned long long)i * SYNC_BENCH_SLOT;
+        ranges[i].length = SYNC_BENCH_SLOT;
+        ranges[i].direction = DMA_USER_BIDIRECTIONAL;
+    }
+
+    printf("%10s %12s %14s\n", "batch", "ns/range", "syscalls/range");
+    for (i = 0; i < sizeof(batches) / sizeof(batches[0]) && ret == 0; i++) {
+        t = now_sec();
+        for (n = 0; n < SYNC_BENCH_RANGES; n += batches[i]) {
+            /* Consecutive batches move round the ring of slots */
+            unsigned int first = n % SYNC_BENCH_MAX_BATCH;
+
+            if (sync_batch(fd, ranges + first, batches[i], &done) < 0) {
+                perror("DMA_IOCTL_SYNC_BATCH");
+                ret = -1;
+                break;
+            }
+        }
+        t = now_sec() - t;
+
+        if (ret == 0) {
+            printf("%10u %12.1f %14.4f\n", batches[i],
+                   t / SYNC_BENCH_RANGES * 1e9, 1.0 / batches[i]);
+        }
+    }
+
+    if (old_verbose > 0) {
+        set_kernel_verbose(1);
+    }
+
+out:
+    if (ioctl(fd, DMA_IOCTL_UNMAP_USER, &param) < 0) {
+        perror("DMA_IOCTL_UNMAP_USER");
+        ret = -1;
+    }
+    free(ranges);
+    free(buf);
+
+    return ret;
+}
+
+/*==============================================================================
+ * dma-buf Sharing Test
+ *==============================================================================*/
+
+static int dmabuf_access(int fd, int handle, int write, uint8_t *buf, size_t size)
+{
+    struct dmabuf_access acc;
+
+    memset(&acc, 0, sizeof(acc));
+    acc.handle = handle;
+    acc.write = write;
+    acc.size = size;
+    acc.user_addr = (unsigned long)buf;
+    if (ioctl(fd, DMA_IOCTL_ACCESS_DMABUF, &acc) < 0) {
+        perror("DMA_IOCTL_ACCESS_DMABUF");
+        return -1;
+    }
+
+    return 0;
+}
+
+static int check_fill(const uint8_t *buf, size_t size, uint8_t val)
+{
+    size_t i;
+
+    for (i = 0; i < size; i++) {
+        if (buf[i] != val) {
+            printf("Byte %zu is %#x, expected %#x\n", i, buf[i], val);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Export a coherent buffer of m_chrdev_0 as a dma-buf, import it into
+ * m_chrdev_1 and hand it back and forth: device 0 writes through its own
+ * buffer, device 1 checks and answers through the import. Then export the
+ * SG pages of device 1 the other way round and check they survive
+ * UNMAP_SG.
+ */
+static int test_dmabuf(int fd)
+{
+    struct dmabuf_export_req exp, sg_exp;
+    struct dmabuf_import_req imp, sg_imp;
+    struct dma_ioctl_param param;
+    struct dma_buf_sync sync;
+    uint8_t buf[DMABUF_PING_SIZE];
+    int fd1, handle = 0, round;
+    uint8_t *view = MAP_FAILED;
+    double t;
+    int ret = -1;
+
+    printf("\n======> dma-buf Sharing Test <======\n");
+
+    exp.fd = -1;
+    sg_exp.fd = -1;
+    imp.handle = 0;
+    sg_imp.handle = 0;
+
+    fd1 = open(DEVNAME_1, O_RDWR);
+    if (fd1 < 0) {
+        perror("open " DEVNAME_1);
+        return -1;
+    }
+
+    memset(&param, 0, sizeof(param));
+    param.size = COHERENT_BUF_SIZE;
+    if (ioctl(fd, DMA_IOCTL_ALLOC_COHERENT, &param) < 0) {
+        perror("DMA_IOCTL_ALLOC_COHERENT");
+        goto out;
+    }
+    handle = param.handle;
+
+    memset(&exp, 0, sizeof(exp));
+    exp.target = DMABUF_EXPORT_COHERENT;
+    exp.handle = handle;
+    if (ioctl(fd, DMA_IOCTL_EXPORT_DMABUF, &exp) < 0) {
+        perror("DMA_IOCTL_EXPORT_DMABUF");
+        exp.fd = -1;
+        goto out;
+    }
+    printf("Coherent buffer %d exported as dma-buf fd %d, %llu bytes\n",
+           handle, exp.fd, exp.size);
+
+    memset(&imp, 0, sizeof(imp));
+    imp.fd = exp.fd;
+    if (ioctl(fd1, DMA_IOCTL_IMPORT_DMABUF, &imp) < 0) {
+        perror("DMA_IOCTL_IMPORT_DMABUF");
+        imp.handle = 0;
+        goto out;
+    }
+    printf("Imported into %s as %d: %u segment(s) at %#llx\n",
+           DEVNAME_1, imp.handle, imp.nr_segs, imp.dma_addr);
+
+    view = mmap(NULL, exp.size, PROT_READ, MAP_SHARED, exp.fd, 0);
+    if (view == MAP_FAILED) {
+        perror("mmap dma-buf");
+        goto out;
+    }
+
+    t = now_sec();
+    for (round = 0; round < DMABUF_ROUNDS; round++) {
+        /* Ping: device 0 fills, device 1 must see it */
+        memset(buf, round & 0xff, sizeof(buf));
+        memset(&param, 0, sizeof(param));
+        param.handle = handle;
+        param.size = sizeof(buf);
+        param.user_addr = (unsigned long)buf;
+        if (ioctl(fd, DMA_IOCTL_WRITE_COHERENT, &param) < 0) {
+            perror("DMA_IOCTL_WRITE_COHERENT");
+            goto out;
+        }
+        memset(buf, 0, sizeof(buf));
+        if (dmabuf_access(fd1, imp.handle, 0, buf, sizeof(buf)) < 0 ||
+            check_fill(buf, sizeof(buf), round & 0xff) < 0) {
+            goto out;
+        }
+
+        /* Pong: device 1 answers, device 0 must see it */
+        memset(buf, ~round & 0xff, sizeof(buf));
+        if (dmabuf_access(fd1, imp.handle, 1, buf, sizeof(buf)) < 0) {
+            goto out;
+        }
+        memset(buf, 0, sizeof(buf));
+        memset(&param, 0, sizeof(param));
+        param.handle = handle;
+        param.size = sizeof(buf);
+        param.user_addr = (unsigned long)buf;
+        if (ioctl(fd, DMA_IOCTL_READ_COHERENT, &param) < 0) {
+            perror("DMA_IOCTL_READ_COHERENT");
+            goto out;
+        }
+        if (check_fill(buf, sizeof(buf), ~round & 0xff) < 0) {
+            goto out;
+        }
+    }
+    t = now_sec() - t;
+    printf("%d ping-pong rounds of %d bytes: %.1f us per round\n",
+           DMABUF_ROUNDS, DMABUF_PING_SIZE, t / DMABUF_ROUNDS * 1e6);
+
+    /* The mmap()ed dma-buf is the same memory */
+    memset(&sync, 0, sizeof(sync));
+    sync.flags = DMA_BUF_SYNC_START | DMA_BUF_SYNC_READ;
+    ioctl(exp.fd, DMA_BUF_IOCTL_SYNC, &sync);
+    ret = check_fill(view, DMABUF_PING_SIZE, ~(round - 1) & 0xff);
+    sync.flags = DMA_BUF_SYNC_END | DMA_BUF_SYNC_READ;
+    ioctl(exp.fd, DMA_BUF_IOCTL_SYNC, &sync);
+    printf("dma-buf mmap view check %s\n", ret ? "FAILED" : "PASSED");
+    if (ret) {
+        goto out;
+    }
+    ret = -1;
+
+    /* Freeing the buffer only drops the handle, the export keeps it alive */
+    memset(&param, 0, sizeof(param));
+    param.handle = handle;
+    if (ioctl(fd, DMA_IOCTL_FREE_COHERENT, &param) < 0) {
+        perror("DMA_IOCTL_FREE_COHERENT");
+        goto out;
+    }
+    handle = 0;
+    if (dmabuf_access(fd1, imp.handle, 0, buf, sizeof(buf)) < 0 ||
+        check_fill(buf, sizeof(buf), ~(round - 1) & 0xff) < 0) {
+        goto out;
+    }
+    printf("Exported buffer still readable after FREE_COHERENT\n");
+
+    /* The other way round: SG pages of device 1 imported by device 0 */
+    memset(&param, 0, sizeof(param));
+    param.size = DMABUF_SG_SIZE;
+    param.direction = DMA_USER_BIDIRECTIONAL;
+    if (ioctl(fd1, DMA_IOCTL_MAP_SG, &param) < 0) {
+        perror("DMA_IOCTL_MAP_SG");
+        goto out;
+    }
+    memset(&sg_exp, 0, sizeof(sg_exp));
+    sg_exp.target = DMABUF_EXPORT_SG;
+    if (ioctl(fd1, DMA_IOCTL_EXPORT_DMABUF, &sg_exp) < 0) {
+        perror("DMA_IOCTL_EXPORT_DMABUF");
+        sg_exp.fd = -1;
+        ioctl(fd1, DMA_IOCTL_UNMAP_SG, &param);
+        goto out;
+    }
+    if (ioctl(fd1, DMA_IOCTL_UNMAP_SG, &param) < 0) {
+        perror("DMA_IOCTL_UNMAP_SG");
+        goto out;
+    }
+
+    memset(&sg_imp, 0, sizeof(sg_imp));
+    sg_imp.fd = sg_exp.fd;
+    if (ioctl(fd, DMA_IOCTL_IMPORT_DMABUF, &sg_imp) < 0) {
+        perror("DMA_IOCTL_IMPORT_DMABUF");
+        sg_imp.handle = 0;
+        goto out;
+    }
+    printf("SG pages of %s imported into %s: %llu bytes, %u segment(s)\n",
+           DEVNAME_1, DEVNAME_0, sg_imp.size, sg_imp.nr_segs);
+
+    /* MAP_SG fills its pages with 0xBB */
+    if (dmabuf_access(fd, sg_imp.handle, 0, buf, sizeof(buf)) < 0 ||
+        check_fill(buf, sizeof(buf), 0xBB) < 0) {
+        goto out;
+    }
+    printf("SG pages still readable after UNMAP_SG\n");
+
+    ret = 0;
+
+out:
+    if (sg_imp.handle > 0 && ioctl(fd, DMA_IOCTL_RELEASE_DMABUF, &sg_imp) < 0) {
+        perror("DMA_IOCTL_RELEASE_DMABUF");
+        ret = -1;
+    }
+    if (sg_exp.fd >= 0) {
+        close(sg_exp.fd);
+    }
+    if (view != MAP_FAILED) {
+        munmap(view, exp.size);
+    }
+    if (imp.handle > 0 && ioctl(fd1, DMA_IOCTL_RELEASE_DMABUF, &imp) < 0) {
+        perror("DMA_IOCTL_RELEASE_DMABUF");
+        ret = -1;
+    }
+    if (exp.fd >= 0) {
+        close(exp.fd);
+    }
+    if (handle > 0) {
+        memset(&param, 0, sizeof(param));
+        param.handle = handle;
+        ioctl(fd, DMA_IOCTL_FREE_COHERENT, &param);
+    }
+    close(fd1);
+
+    printf("dma-buf sharing test %s\n", ret ? "FAILED" : "PASSED");
+
+    return ret;
+}
+
+/*==============================================================================
+ * Multi-threaded Stress Test
+ *==============================================================================*/
+
+struct stress_arg {
+    int fd;             /* Shared file, or -1 to open one of our own */
+    int id;
+    unsigned long ops;  /* ioctls completed */
+    int err;
+};
+
+/*
+ * One worker: alloc, write, read back, verify and free a coherent buffer
+ * in a loop. With a file of its own it also cycles the single mapping,
+ * which is one per file and so can't be shared between threads.
+ */
+static void *stress_worker(void *data)
+{
+    struct stress_arg *arg = data;
+    struct dma_ioctl_param param;
+    uint8_t *src, *dst;
+    int fd = arg->fd;
+    int own = fd < 0;
+    int i;
+
+    src = malloc(STRESS_BUF_SIZE);
+    dst = malloc(STRESS_BUF_SIZE);
+    if (!src || !dst) {
+        arg->err = 1;
+        goto out_free;
+    }
+
+    if (own) {
+        fd = open(DEVNAME_0, O_RDWR);
+        if (fd < 0) {
+            perror("open");
+            arg->err = 1;
+            goto out_free;
+        }
+    }
+
+    for (i = 0; i < STRESS_ITERS && !arg->err; i++) {
+        memset(src, (arg->id * 31 + i) & 0xff, STRESS_BUF_SIZE);
+
+        memset(&param, 0, sizeof(param));
+        param.size = STRESS_BUF_SIZE;
+        if (ioctl(fd, DMA_IOCTL_ALLOC_COHERENT, &param) < 0) {
+            perror("DMA_IOCTL_ALLOC_COHERENT");
+            arg->err = 1;
+            break;
+        }
+
+        param.user_addr = (unsigned long)src;
+        if (ioctl(fd, DMA_IOCTL_WRITE_COHERENT, &param) < 0) {
+            perror("DMA_IOCTL_WRITE_COHERENT");
+            arg->err = 1;
+        }
+        param.user_addr = (unsigned long)dst;
+        if (!arg->err && ioctl(fd, DMA_IOCTL_READ_COHERENT, &param) < 0) {
+            perror("DMA_IOCTL_READ_COHERENT");
+            arg->err = 1;
+        }
+        if (!arg->err && memcmp(src, dst, STRESS_BUF_SIZE) != 0) {
+            printf("Thread %d: buffer %d came back corrupted\n", arg->id, param.handle);
+            arg->err = 1;
+        }
+        if (ioctl(fd, DMA_IOCTL_FREE_COHERENT, &param) < 0) {
+            perror("DMA_IOCTL_FREE_COHERENT");
+            arg->err = 1;
+        }
+        arg->ops += 4;
+
+        if (own && !arg->err) {
+            memset(&param, 0, sizeof(param));
+            param.size = STRESS_BUF_SIZE;
+            param.direction = DMA_USER_BIDIRECTIONAL;
+            if (ioctl(fd, DMA_IOCTL_MAP_SINGLE, &param) < 0 ||
+                ioctl(fd, DMA_IOCTL_SYNC_SINGLE, &param) < 0 ||
+                ioctl(fd, DMA_IOCTL_UNMAP_SINGLE, &param) < 0) {
+                perror("single mapping");
+                arg->err = 1;
+            }
+            arg->ops += 3;
+        }
+    }
+
+    if (own) {
+        close(fd);
+    }
+out_free:
+    free(src);
+    free(dst);
+
+    return NULL;
+}
+
+/* Run nr_threads workers to completion, returns ioctls per second or -1 */
+static double stress_run(int fd, int nr_threads)
+{
+    pthread_t tids[STRESS_MAX_THREADS];
+    struct stress_arg args[STRESS_MAX_THREADS];
+    unsigned long ops = 0;
+    double t;
+    int err = 0;
+    int i;
+
+    memset(args, 0, sizeof(args));
+    t = now_sec();
+    for (i = 0; i < nr_threads; i++) {
+        args[i].fd = fd;
+        args[i].id = i;
+        if (pthread_create(&tids[i], NULL, stress_worker, &args[i])) {
+            perror("pthread_create");
+            nr_threads = i;
+            err = 1;
+            break;
+        }
+    }
+    for (i = 0; i < nr_threads; i++) {
+        pthread_join(tids[i], NULL);
+        ops += args[i].ops;
+        err |= args[i].err;
+    }
+    t = now_sec() - t;
+
+    return err ? -1 : ops / t;
+}
+
+/*
+ * Hammer the driver from 1..STRESS_MAX_THREADS threads, first with a file
+ * per thread and then with every thread sharing one file, checking every
+ * buffer's contents and reporting aggregate ioctl throughput.
+ */
+static int test_stress(int fd)
+{
+    static const int threads[] = { 1, 2, 4, 8, STRESS_MAX_THREADS };
+    double own, shared;
+    int old_verbose;
+    int ret = 0;
+    int i;
+
+    printf("\n======> Multi-threaded Stress Test <======\n");
+
+    /* Per-op printk would serialise the threads on the console */
+    old_verbose = set_kernel_verbose(0);
+    if (old_verbose < 0) {
+        printf("Cannot write %s, kernel logging stays on\n", VERBOSE_PARAM);
+    }
+
+    printf("%d iterations of %d KB per thread\n", STRESS_ITERS, STRESS_BUF_SIZE / 1024);
+    printf("%8s %16s %16s\n", "threads", "own file(op/s)", "shared(op/s)");
+
+    for (i = 0; i < sizeof(threads) / sizeof(threads[0]); i++) {
+        own = stress_run(-1, threads[i]);
+        shared = stress_run(fd, threads[i]);
+        if (own < 0 || shared < 0) {
+            printf("%8d FAILED\n", threads[i]);
+            ret = -1;
+            break;
+        }
+        printf("%8d %16.0f %16.0f\n", threads[i], own, shared);
+    }
+
+    if (old_verbose > 0) {
+        set_kernel_verbose(1);
+    }
+
+    printf("Stress test %s\n", ret ? "FAILED" : "PASSED");
+
+    return ret;
+}
+
+/*==============================================================================
+ * NUMA Placement Benchmark
+ *==============================================================================*/
+
+/*
+ * CPU bandwidth over a NUMA_BENCH_SIZE SG buffer placed on node, as seen
+ * through mmap. SG pages honour the node; coherent memory always sits on
+ * the device's node. Returns 0 with the node the pages landed on (-1 if
+ * they are spread), 1 if node is offline and -1 on error.
+ */
+static int numa_bench_node(int fd, int node, int *landed, double *fill_mbs,
+                           double *read_mbs)
+{
+    const unsigned long size = NUMA_BENCH_SIZE;
+    struct dma_ioctl_param param;
+    volatile uint64_t sink = 0;
+    uint8_t *map;
+    double t;
+    unsigned long j;
+    int loop, ret = 0;
+
+    memset(&param, 0, sizeof(param));
+    param.size = size;
+    param.direction = DMA_USER_BIDIRECTIONAL;
+    param.node_policy = DMA_NODE_EXPLICIT;
+    param.node = node;
+    if (ioctl(fd, DMA_IOCTL_MAP_SG, &param) < 0) {
+        if (errno == EINVAL) {
+            return 1;
+        }
+        perror("DMA_IOCTL_MAP_SG");
+        return -1;
+    }
+    *landed = param.node;
+
+    /* Offset 0 maps the SG buffer */
+    map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        perror("mmap");
+        ret = -1;
+        goto out;
+    }
+
+    t = now_sec();
+    for (loop = 0; loop < NUMA_BENCH_LOOPS; loop++) {
+        memset(map, loop, size);
+    }
+    *fill_mbs = (double)size * NUMA_BENCH_LOOPS / (now_sec() - t) / 1e6;
+
+    t = now_sec();
+    for (loop = 0; loop < NUMA_BENCH_LOOPS; loop++) {
+        const uint64_t *p = (const uint64_t *)map;
+        uint64_t sum = 0;
+
+        for (j = 0; j < size / sizeof(uint64_t); j++) {
+            sum += p[j];
+        }
+        sink += sum;
+    }
+    *read_mbs = (double)size * NUMA_BENCH_LOOPS / (now_sec() - t) / 1e6;
+
+    munmap(map, size);
+out:
+    ioctl(fd, DMA_IOCTL_UNMAP_SG, &param);
+
+    return ret;
+}
+
+/*
+ * Pin ourselves to one CPU, ask the driver which node that is, then measure
+ * fill/read bandwidth for buffers on every online node. With one node there
+ * is nothing remote; under QEMU boot with e.g. "-numa node,nodeid=0
+ * -numa node,nodeid=1" or the guest kernel with "numa=fake=2".
+ */
+static int test_numa_bench(int fd)
+{
+    struct dma_ioctl_param param;
+    double fill = 0, rd = 0;
+    cpu_set_t set, old_set;
+    int cpu, local, node, landed, nr_nodes = 0;
+    int rc;
+    int old_verbose;
+    int ret = 0;
+
+    printf("\n======> NUMA Placement Benchmark <======\n");
+
+    sched_getaffinity(0, sizeof(old_set), &old_set);
+    cpu = sched_getcpu();
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) < 0) {
+        perror("sched_setaffinity");
+        return -1;
+    }
+
+    old_verbose = set_kernel_verbose(0);
+
+    /* A page mapped DMA_NODE_LOCAL tells us which node we run on */
+    memset(&param, 0, sizeof(param));
+    param.size = sysconf(_SC_PAGESIZE);
+    param.direction = DMA_USER_BIDIRECTIONAL;
+    param.node_policy = DMA_NODE_LOCAL;
+    if (ioctl(fd, DMA_IOCTL_MAP_SG, &param) < 0) {
+        perror("DMA_IOCTL_MAP_SG");
+        ret = -1;
+        goto out;
+    }
+    local = param.node;
+    ioctl(fd, DMA_IOCTL_UNMAP_SG, &param);
+
+    printf("Pinned to CPU %d on node %d, %d MB SG buffer, %d passes\n", cpu, local,
+           NUMA_BENCH_SIZE >> 20, NUMA_BENCH_LOOPS);
+    printf("%6s %8s %8s %14s %14s\n", "node", "landed", "where", "fill(MB/s)", "read(MB/s)");
+
+    for (node = 0; node < NUMA_BENCH_MAX_NODES; node++) {
+        rc = numa_bench_node(fd, node, &landed, &fill, &rd);
+        if (rc > 0) {
+            continue;
+        }
+        if (rc < 0) {
+            ret = -1;
+            break;
+        }
+        nr_nodes++;
+        printf("%6d %8d %8s %14.1f %14.1f\n", node, landed,
+               landed == local ? "local" : landed < 0 ? "spread" : "remote", fill, rd);
+    }
+
+    if (ret == 0 && nr_nodes < 2) {
+        printf("Only one NUMA node online, no remote placement to compare\n");
+    }
+
+out:
+    if (old_verbose > 0) {
+        set_kernel_verbose(1);
+    }
+    sched_setaffinity(0, sizeof(old_set), &old_set);
+
+    return ret;
+}
+
+/*==============================================================================
+ * Large Buffer (High-Order / Huge Page) Benchmark
+ *==============================================================================*/
+
+/*
+ * Map size bytes of SG memory with the given alloc flags, mmap it and time
+ * a random one-word-per-page walk, where every access is a TLB miss unless
+ * the mapping uses huge pages, and a sequential read.
+ */
+static int large_bench_run(int fd, unsigned long size, unsigned int flags,
+                           const uint32_t *perm)
+{
+    struct dma_ioctl_param param;
+    unsigned long nr = size / sysconf(_SC_PAGESIZE);
+    unsigned long pg = sysconf(_SC_PAGESIZE);
+    volatile uint64_t sink = 0;
+    double t, t_map, ns_walk, mbs_read;
+    uint8_t *map;
+    unsigned long i;
+    int pass, ret = 0;
+
+    memset(&param, 0, sizeof(param));
+    param.size = size;
+    param.direction = DMA_USER_BIDIRECTIONAL;
+    param.alloc_flags = flags;
+    t = now_sec();
+    if (ioctl(fd, DMA_IOCTL_MAP_SG, &param) < 0) {
+        perror("DMA_IOCTL_MAP_SG");
+        return -1;
+    }
+    t_map = now_sec() - t;
+
+    /* Offset 0 maps the SG buffer, PMD-aligned by the driver */
+    map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        perror("mmap");
+        ret = -1;
+        goto unmap_sg;
+    }
+
+    /* Fault everything in first so the walk only measures translation */
+    for (i = 0; i < nr; i++) {
+        map[i * pg] = 0;
+    }
+
+    t = now_sec();
+    for (pass = 0; pass < LARGE_BENCH_PASSES; pass++) {
+        for (i = 0; i < nr; i++) {
+            sink += *(volatile uint64_t *)(map + perm[i] * pg + (pass & 63) * 8);
+        }
+    }
+    ns_walk = (now_sec() - t) / ((double)nr * LARGE_BENCH_PASSES) * 1e9;
+
+    t = now_sec();
+    for (pass = 0; pass < LARGE_BENCH_PASSES; pass++) {
+        const uint64_t *p = (const uint64_t *)map;
+        uint64_t sum = 0;
+
+        for (i = 0; i < size / sizeof(uint64_t); i++) {
+            sum += p[i];
+        }
+        sink += sum;
+    }
+    mbs_read = (double)size * LARGE_BENCH_PASSES / (now_sec() - t) / 1e6;
+
+    printf("%9luM %11s %8u %8u %8d %6u %10.1f %12.2f %12.1f\n", size >> 20,
+           flags & DMA_ALLOC_HIGH_ORDER ? "high-order" : "order-0",
+           param.nr_pages, param.nr_segs, param.count, param.max_order,
+           t_map * 1e6, ns_walk, mbs_read);
+
+    munmap(map, size);
+unmap_sg:
+    if (ioctl(fd, DMA_IOCTL_UNMAP_SG, &param) < 0) {
+        perror("DMA_IOCTL_UNMAP_SG");
+        ret = -1;
+    }
+
+    return ret;
+}
+
+/*
+ * Compare order-0 and high-order SG buffers: segment count, map cost and
+ * CPU access cost through a userspace mapping that can use 2MB pages
+ * only when the memory came in 2MB chunks.
+ */
+static int test_large_bench(int fd)
+{
+    static const unsigned long sizes[] = { 4UL << 20, 32UL << 20, 128UL << 20 };
+    unsigned long pg = sysconf(_SC_PAGESIZE);
+    uint32_t *perm;
+    uint32_t x = 2463534242u;
+    unsigned long nr, i, j, tmp;
+    int old_verbose;
+    int k, ret = 0;
+
+    printf("\n======> Large Buffer (High-Order / Huge Page) Benchmark <======\n");
+
+    old_verbose = set_kernel_verbose(0);
+
+    perm = malloc(sizes[2] / pg * sizeof(*perm));
+    if (!perm) {
+        perror("malloc");
+        ret = -1;
+        goto out;
+    }
+
+    printf("%10s %11s %8s %8s %8s %6s %10s %12s %12s\n", "size", "alloc", "pages",
+           "segs", "dma_ents", "order", "map(us)", "walk(ns/pg)", "read(MB/s)");
+
+    for (k = 0; k < sizeof(sizes) / sizeof(sizes[0]) && ret == 0; k++) {
+        /* One random page order per size, shared by both allocators */
+        nr = sizes[k] / pg;
+        for (i = 0; i < nr; i++) {
+            perm[i] = i;
+        }
+        for (i = nr - 1; i > 0; i--) {
+            x ^= x << 13;
+            x ^= x >> 17;
+            x ^= x << 5;
+            j = x % (i + 1);
+            tmp = perm[i];
+            perm[i] = perm[j];
+            perm[j] = tmp;
+        }
+
+        if (large_bench_run(fd, sizes[k], 0, perm) < 0 ||
+            large_bench_run(fd, sizes[k], DMA_ALLOC_HIGH_ORDER, perm) < 0) {
+            ret = -1;
+        }
+    }
+
+    free(perm);
+    printf("Large buffer benchmark %s\n", ret ? "FAILED" : "completed");
+
+out:
+    if (old_verbose > 0) {
+        set_kernel_verbose(1);
+    }
+
+    return ret;
+}
+
+/*==============================================================================
+ * Micro-benchmark Suite
+ *==============================================================================*/
+
+enum bench_op {
+    BENCH_ALLOC_FREE,   /* ALLOC_COHERENT + FREE_COHERENT */
+    BENCH_MAP_SINGLE,   /* MAP_SINGLE + UNMAP_SINGLE */
+    BENCH_MAP_SG,       /* MAP_SG + UNMAP_SG */
+    BENCH_SYNC_SINGLE,  /* SYNC_SINGLE on a standing mapping */
+    BENCH_SYNC_SG,      /* SYNC_SG on a standing mapping */
+    BENCH_WRITE,        /* WRITE_COHERENT, user buffer -> coherent buffer */
+    BENCH_READ,         /* READ_COHERENT, coherent buffer -> user buffer */
+    BENCH_NR_OPS
+};
+
+static const struct {
+    const char *name;
+    int has_dir;        /* Streaming op, swept over the three directions */
+} bench_ops[BENCH_NR_OPS] = {
+    [BENCH_ALLOC_FREE]  = { "alloc_free",  0 },
+    [BENCH_MAP_SINGLE]  = { "map_single",  1 },
+    [BENCH_MAP_SG]      = { "map_sg",      1 },
+    [BENCH_SYNC_SINGLE] = { "sync_single", 1 },
+    [BENCH_SYNC_SG]     = { "sync_sg",     1 },
+    [BENCH_WRITE]       = { "write",       0 },
+    [BENCH_READ]        = { "read",        0 },
+};
+
+static const char *const bench_dir_names[] = { "none", "to_device", "from_device", "bidirectional" };
+
+enum bench_format {
+    BENCH_CSV,
+    BENCH_JSON
+};
+
+static enum bench_format g_bench_format = BENCH_CSV;
+static const char *g_bench_output = NULL;
+
+struct bench_arg {
+    pthread_barrier_t *start;
+    int op;
+    int dir;
+    unsigned long size;
+    uint32_t *lat_ns;   /* BENCH_ITERS samples */
+    int err;
+};
+
+struct bench_result {
+    unsigned long ops;
+    double ops_per_sec;
+    double avg_ns;
+    uint32_t p50_ns, p90_ns, p99_ns, p999_ns, max_ns;
+};
+
+/* Resources an op needs but does not measure, e.g. the mapping a sync acts on */
+static int bench_setup(int fd, struct bench_arg *arg, struct dma_ioctl_param *param)
+{
+    memset(param, 0, sizeof(*param));
+    param->size = arg->size;
+    param->direction = arg->dir;
+
+    switch (arg->op) {
+    case BENCH_SYNC_SINGLE:
+        return ioctl(fd, DMA_IOCTL_MAP_SINGLE, param);
+    case BENCH_SYNC_SG:
+        return ioctl(fd, DMA_IOCTL_MAP_SG, param);
+    case BENCH_WRITE:
+    case BENCH_READ:
+        return ioctl(fd, DMA_IOCTL_ALLOC_COHERENT, param);
+    }
+
+    return 0;
+}
+
+static void bench_teardown(int fd, struct bench_arg *arg, struct dma_ioctl_param *param)
+{
+    switch (arg->op) {
+    case BENCH_SYNC_SINGLE:
+        ioctl(fd, DMA_IOCTL_UNMAP_SINGLE, param);
+        break;
+    case BENCH_SYNC_SG:
+        ioctl(fd, DMA_IOCTL_UNMAP_SG, param);
+        break;
+    case BENCH_WRITE:
+    case BENCH_READ:
+        ioctl(fd, DMA_IOCTL_FREE_COHERENT, param);
+        break;
+    }
+}
+
+/* One measured operation, returns 0 or -1 */
+static int bench_once(int fd, struct bench_arg *arg, struct dma_ioctl_param *param,
+                      uint8_t *buf)
+{
+    struct dma_ioctl_param p;
+
+    switch (arg->op) {
+    case BENCH_ALLOC_FREE:
+        memset(&p, 0, sizeof(p));
+        p.size = arg->size;
+        if (ioctl(fd, DMA_IOCTL_ALLOC_COHERENT, &p) < 0) {
+            return -1;
+        }
+        return ioctl(fd, DMA_IOCTL_FREE_COHERENT, &p) < 0 ? -1 : 0;
+
+    case BENCH_MAP_SINGLE:
+    case BENCH_MAP_SG:
+        memset(&p, 0, sizeof(p));
+        p.size = arg->size;
+        p.direction = arg->dir;
+        if (arg->op == BENCH_MAP_SINGLE) {
+            if (ioctl(fd, DMA_IOCTL_MAP_SINGLE, &p) < 0) {
+                return -1;
+            }
+            return ioctl(fd, DMA_IOCTL_UNMAP_SINGLE, &p) < 0 ? -1 : 0;
+        }
+        if (ioctl(fd, DMA_IOCTL_MAP_SG, &p) < 0) {
+            return -1;
+        }
+        return ioctl(fd, DMA_IOCTL_UNMAP_SG, &p) < 0 ? -1 : 0;
+
+    case BENCH_SYNC_SINGLE:
+        return ioctl(fd, DMA_IOCTL_SYNC_SINGLE, param) < 0 ? -1 : 0;
+
+    case BENCH_SYNC_SG:
+        return ioctl(fd, DMA_IOCTL_SYNC_SG, param) < 0 ? -1 : 0;
+
+    case BENCH_WRITE:
+    case BENCH_READ:
+        param->size = arg->size;
+        param->user_addr = (unsigned long)buf;
+        return ioctl(fd, arg->op == BENCH_WRITE ? DMA_IOCTL_WRITE_COHERENT
+                                                : DMA_IOCTL_READ_COHERENT, param) < 0 ? -1 : 0;
+    }
+
+    return -1;
+}
+
+/*
+ * Each thread opens its own file, so threads contend on the driver's
+ * shared state (allocator, IOMMU, buffer cache) but never on each
+ * other's per-file mappings.
+ */
+static void *bench_worker(void *data)
+{
+    struct bench_arg *arg = data;
+    struct dma_ioctl_param param;
+    uint8_t *buf = NULL;
+    uint64_t t;
+    int fd, i;
+
+    fd = open(DEVNAME_0, O_RDWR);
+    if (fd < 0) {
+        perror("open");
+        arg->err = 1;
+    } else if (bench_setup(fd, arg, &param) < 0) {
+        perror("bench setup");
+        arg->err = 1;
+    }
+    if (!arg->err && (arg->op == BENCH_WRITE || arg->op == BENCH_READ)) {
+        buf = malloc(arg->size);
+        if (!buf) {
+            arg->err = 1;
+        } else {
+            memset(buf, 0x5A, arg->size);
+        }
+    }
+
+    /* Always reach the barrier, or the other threads would wait forever */
+    pthread_barrier_wait(arg->start);
+
+    for (i = 0; i < BENCH_ITERS && !arg->err; i++) {
+        t = now_ns();
+        if (bench_once(fd, arg, &param, buf) < 0) {
+            perror(bench_ops[arg->op].name);
+            arg->err = 1;
+            break;
+        }
+        t = now_ns() - t;
+        arg->lat_ns[i] = t > UINT32_MAX ? UINT32_MAX : t;
+    }
+
+    if (fd >= 0) {
+        bench_teardown(fd, arg, &param);
+        close(fd);
+    }
+    free(buf);
+
+    return NULL;
+}
+
+static int bench_cmp_u32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* Nearest-rank percentile of sorted samples */
+static uint32_t bench_pct(const uint32_t *lat, unsigned long n, double pct)
+{
+    unsigned long idx = (unsigned long)(pct / 100.0 * n + 0.999999);
+
+    return lat[idx ? idx - 1 : 0];
+}
+
+/* Run one point of the sweep on nr_threads threads */
+static int bench_run(int op, int dir, unsigned long size, int nr_threads,
+                     struct bench_result *res)
+{
+    pthread_t tids[BENCH_MAX_THREADS];
+    struct bench_arg args[BENCH_MAX_THREADS];
+    pthread_barrier_t start;
+    unsigned long n = (unsigned long)nr_threads * BENCH_ITERS;
+    uint32_t *lat;
+    double sum = 0;
+    uint64_t t;
+    int err = 0;
+    unsigned long i;
+    int k;
+
+    lat = malloc(n * sizeof(*lat));
+    if (!lat) {
+        return -1;
+    }
+
+    pthread_barrier_init(&start, NULL, nr_threads + 1);
+    memset(args, 0, sizeof(args));
+    for (k = 0; k < nr_threads; k++) {
+        args[k].start = &start;
+        args[k].op = op;
+        args[k].dir = dir;
+        args[k].size = size;
+        args[k].lat_ns = lat + (unsigned long)k * BENCH_ITERS;
+        if (pthread_create(&tids[k], NULL, bench_worker, &args[k])) {
+            /* The barrier counts on every thread, so give up on the whole run */
+            fprintf(stderr, "pthread_create failed\n");
+            exit(1);
+        }
+    }
+    pthread_barrier_wait(&start);
+    t = now_ns();
+    for (k = 0; k < nr_threads; k++) {
+        pthread_join(tids[k], NULL);
+        err |= args[k].err;
+    }
+    t = now_ns() - t;
+    pthread_barrier_destroy(&start);
+
+    if (!err) {
+        qsort(lat, n, sizeof(*lat), bench_cmp_u32);
+        for (i = 0; i < n; i++) {
+            sum += lat[i];
+        }
+        res->ops = n;
+        res->ops_per_sec = n / (t / 1e9);
+        res->avg_ns = sum / n;
+        res->p50_ns = bench_pct(lat, n, 50);
+        res->p90_ns = bench_pct(lat, n, 90);
+        res->p99_ns = bench_pct(lat, n, 99);
+        res->p999_ns = bench_pct(lat, n, 99.9);
+        res->max_ns = lat[n - 1];
+    }
+
+    free(lat);
+    return err ? -1 : 0;
+}
+
+/* Read a one-line sysfs/proc value into buf without the newline */
+static void bench_read_line(const char *path, char *buf, size_t len)
+{
+    FILE *f = fopen(path, "r");
+
+    snprintf(buf, len, "unknown");
+    if (f) {
+        if (fgets(buf, len, f)) {
+            buf[strcspn(buf, "\n")] = '\0';
+        }
+        fclose(f);
+    }
+}
+
+static void bench_json_str(FILE *out, const char *s)
+{
+    fputc('"', out);
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\') {
+            fprintf(out, "\\%c", *s);
+        } else if ((unsigned char)*s < 0x20) {
+            fprintf(out, "\\u%04x", *s);
+        } else {
+            fputc(*s, out);
+        }
+    }
+    fputc('"', out);
+}
+
+/*
+ * Sweep every op over sizes, directions and thread counts and emit one
+ * record per point as CSV (default) or JSON, so runs on different kernels
+ * or driver versions can be diffed. Progress goes to stderr, records to
+ * stdout or the -o file. Every worker opens its own file, so the main
+ * descriptor is not used.
+ */
+static int test_bench_suite(void)
+{
+    static const unsigned long sizes[] = { 4096, 64 * 1024, 1024 * 1024 };
+    static const int threads[] = { 1, 2, 4, BENCH_MAX_THREADS };
+    struct bench_result res;
+    struct utsname uts;
+    char driver[256];
+    FILE *out = stdout;
+    int first = 1;
+    int old_verbose;
+    unsigned int s, t;
+    int op, dir;
+    int ret = 0;
+
+    fprintf(stderr, "\n======> DMA Micro-benchmark Suite <======\n");
+
+    if (g_bench_output) {
+        out = fopen(g_bench_output, "w");
+        if (!out) {
+            perror(g_bench_output);
+            return -1;
+        }
+    }
+
+    /* printk per op would be most of what we measure */
+    old_verbose = set_kernel_verbose(0);
+
+    uname(&uts);
+    bench_read_line(DRIVER_VERSION_PARAM, driver, sizeof(driver));
+
+    if (g_bench_format == BENCH_JSON) {
+        fprintf(out, "{\n  \"kernel\": ");
+        bench_json_str(out, uts.release);
+        fprintf(out, ",\n  \"machine\": ");
+        bench_json_str(out, uts.machine);
+        fprintf(out, ",\n  \"driver\": ");
+        bench_json_str(out, driver);
+        fprintf(out, ",\n  \"iterations\": %d,\n  \"results\": [", BENCH_ITERS);
+    } else {
+        fprintf(out, "# kernel: %s\n# machine: %s\n# driver: %s\n# iterations per thread: %d\n",
+                uts.release, uts.machine, driver, BENCH_ITERS);
+        fprintf(out, "op,size,direction,threads,ops,ops_per_sec,"
+                "avg_ns,p50_ns,p90_ns,p99_ns,p999_ns,max_ns\n");
+    }
+
+    for (op = 0; op < BENCH_NR_OPS; op++) {
+        for (dir = bench_ops[op].has_dir ? DMA_USER_TO_DEVICE : 0;
+             dir <= (bench_ops[op].has_dir ? DMA_USER_BIDIRECTIONAL : 0); dir++) {
+            for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+                for (t = 0; t < sizeof(threads) / sizeof(threads[0]); t++) {
+                    fprintf(stderr, "  %-12s %-14s %8lu bytes %2d threads\n",
+                            bench_ops[op].name, bench_dir_names[dir], sizes[s], threads[t]);
+                    if (bench_run(op, dir, sizes[s], threads[t], &res) < 0) {
+                        fprintf(stderr, "  %s failed, skipping the rest of this op\n",
+                                bench_ops[op].name);
+                        ret = -1;
+                        goto next_op;
+                    }
+
+                    if (g_bench_format == BENCH_JSON) {
+                        fprintf(out, "%s\n    {\"op\": \"%s\", \"size\": %lu, \"direction\": \"%s\", "
+                                "\"threads\": %d, \"ops\": %lu, \"ops_per_sec\": %.1f, "
+                                "\"avg_ns\": %.1f, \"p50_ns\": %u, \"p90_ns\": %u, "
+                                "\"p99_ns\": %u, \"p999_ns\": %u, \"max_ns\": %u}",
+                                first ? "" : ",", bench_ops[op].name, sizes[s],
+                                bench_dir_names[dir], threads[t], res.ops, res.ops_per_sec,
+                                res.avg_ns, res.p50_ns, res.p90_ns, res.p99_ns,
+                                res.p999_ns, res.max_ns);
+                    } else {
+                        fprintf(out, "%s,%lu,%s,%d,%lu,%.1f,%.1f,%u,%u,%u,%u,%u\n",
+                                bench_ops[op].name, sizes[s], bench_dir_names[dir],
+                                threads[t], res.ops, res.ops_per_sec, res.avg_ns,
+                                res.p50_ns, res.p90_ns, res.p99_ns, res.p999_ns,
+                                res.max_ns);
+                    }
+                    first = 0;
+                    fflush(out);
+                }
+            }
+        }
+next_op:
+        ;
+    }
+
+    if (g_bench_format == BENCH_JSON) {
+        fprintf(out, "\n  ]\n}\n");
+    }
+
+    if (out != stdout) {
+        fclose(out);
+    }
+    if (old_verbose > 0) {
+        set_kernel_verbose(1);
+    }
+
+    fprintf(stderr, "Benchmark suite %s\n", ret ? "FAILED" : "completed");
+    return ret;
+}
+
+/*==============================================================================
+ * DMA Information Test
+ *==============================================================================*/
+
+static int test_dma_info(int fd)
+{
+    struct dma_ioctl_param param;
+    int ret;
+
+    printf("\n======> DMA Information Test <======\n");
+
+    memset(&param, 0, sizeof(param));
+    ret = ioctl(fd, DMA_IOCTL_GET_INFO, &param);
+    if (ret < 0) {
+        perror("DMA_IOCTL_GET_INFO");
+        return -1;
+    }
+
+    printf("DMA Information:\n");
+    printf("  DMA mask: %u bits\n", param.mask_bits);
+    printf("  Active DMA address: %#lx\n", param.dma_addr);
+    printf("  Size/count: %lu\n", param.size);
+    printf("  NUMA node: %d\n", param.node);
+
+    return 0;
+}
+
+/*==============================================================================
+ * DMA Mask Test
+ *==============================================================================*/
+
+static int test_dma_mask(int fd)
+{
+    struct dma_ioctl_param param;
+    int ret;
+
+    printf("\n======> DMA Mask Test <======\n");
+
+    /* Set 32-bit mask */
+    memset(&param, 0, sizeof(param));
+    param.mask_bits = 32;
+
+    ret = ioctl(fd, DMA_IOCTL_SET_MASK, &param);
+    if (ret < 0) {
+        printf("Setting 32-bit mask: %s\n", strerror(-ret));
+    } else {
+        printf("Set DMA mask to 32 bits\n");
+    }
+
+    /* Set 64-bit mask */
+    param.mask_bits = 64;
+    ret = ioctl(fd, DMA_IOCTL_SET_MASK, &param);
+    if (ret < 0) {
+        printf("Setting 64-bit mask: %s\n", strerror(-ret));
+    } else {
+        printf("Set DMA mask to 64 bits\n");
+    }
+
+    printf("DMA mask test completed\n");
+
+    return 0;
+}
+
+/*==============================================================================
+ * User Memory (Zero-Copy) Mapping Test
+ *==============================================================================*/
+
+static int test_user_mapping(int fd)
+{
+    struct dma_ioctl_param param;
+    uint8_t *buf;
+    int ret;
+
+    printf("\n======> User Memory Zero-Copy Mapping Test <======\n");
+
+    if (posix_memalign((void **)&buf, sysconf(_SC_PAGESIZE),
+                       USER_MAP_SIZE + USER_MAP_OFFSET)) {
+        perror("posix_memalign");
+        return -1;
+    }
+    memset(buf, 0x3C, USER_MAP_SIZE + USER_MAP_OFFSET);
+
+    /* Map the user buffer in place, no copy into the kernel */
+    memset(&param, 0, sizeof(param));
+    param.user_addr = (unsigned long)(buf + USER_MAP_OFFSET);
+    param.size = USER_MAP_SIZE;
+    param.direction = DMA_USER_BIDIRECTIONAL;
+
+    ret = ioctl(fd, DMA_IOCTL_MAP_USER, &param);
+    if (ret < 0) {
+        perror("DMA_IOCTL_MAP_USER");
+        free(buf);
+        return -1;
+    }
+
+    printf("User buffer mapped:\n");
+    printf("  Handle: %d\n", param.handle);
+    printf("  User address: %#lx\n", param.user_addr);
+    printf("  First DMA address: %#lx\n", param.dma_addr);
+    printf("  Size: %lu bytes\n", param.size);
+    printf("  DMA segments: %d\n", param.count);
+
+    ret = ioctl(fd, DMA_IOCTL_UNMAP_USER, &param);
+    if (ret < 0) {
+        perror("DMA_IOCTL_UNMAP_USER");
+        free(buf);
+        return -1;
+    }
+
+    free(buf);
+
+    printf("User mapping test completed\n");
+
+    return 0;
+}
+
+/*==============================================================================
+ * Main Entry Point
+ *==============================================================================*/
+
+static void print_usage(const char *prog)
+{
+    printf("Usage: %s [OPTIONS]\n", prog);
+    printf("\nDMA Demo Test Program\n");
+    printf("\nOptions:\n");
+    printf("  -b              Run base test (original test)\n");
+    printf("  -a, --all       Run all DMA tests\n");
+    printf("  -c, --coherent  Run coherent DMA test\n");
+    printf("  -s, --single    Run streaming DMA single mapping test\n");
+    printf("  -g, --sg        Run scatter-gather DMA test\n");
+    printf("  -p, --pool      Run DMA pool test\n");
+    printf("  -i, --info      Get DMA information\n");
+    printf("  -m, --mask      Test DMA mask configuration\n");
+    printf("  -u, --user      Run user memory zero-copy mapping test\n");
+    printf("  -S, --sg-bench  Run scatter-gather map/unmap benchmark\n");
+    printf("  -C, --cache-bench  Run streaming buffer cache benchmark\n");
+    printf("  -P, --pool-bench   Run DMA pool bulk alloc/free benchmark\n");
+    printf("  -X, --xfer-bench   Run end-to-end memcpy transfer benchmark\n");
+    printf("  -J, --job-bench    Run asynchronous job queue benchmark\n");
+    printf("  -R, --sync-bench   Run partial and batched sync benchmark\n");
+    printf("  -D, --dmabuf       Run dma-buf export/import ping-pong test\n");
+    printf("  -T, --stress       Run multi-threaded ioctl stress test\n");
+    printf("  -N, --numa-bench   Run NUMA local/remote placement benchmark\n");
+    printf("  -L, --large-bench  Run high-order SG / huge page mapping benchmark\n");
+    printf("  -B, --bench        Run the micro-benchmark suite, not part of -a\n");
+    printf("  -f, --format FMT   Benchmark suite output: csv (default) or json\n");
+    printf("  -o, --output FILE  Write benchmark suite records to FILE, not stdout\n");
+    printf("  -t N            Run specific test case (1-18)\n");
+    printf("  -v, --verbose   Enable verbose output\n");
+    printf("  -h, --help      Show this help message\n");
+    printf("\nTest cases:\n");
+    printf("  1 - Coherent DMA\n");
+    printf("  2 - Streaming DMA Single Mapping\n");
+    printf("  3 - Scatter-Gather DMA\n");
+    printf("  4 - DMA Pool\n");
+    printf("  5 - DMA Information\n");
+    printf("  6 - DMA Mask Configuration\n");
+    printf("  7 - User Memory Zero-Copy Mapping\n");
+    printf("  8 - Scatter-Gather Map/Unmap Benchmark\n");
+    printf("  9 - Streaming Buffer Cache Benchmark\n");
+    printf("  10 - DMA Pool Bulk Benchmark\n");
+    printf("  11 - End-to-End Transfer Benchmark\n");
+    printf("  12 - Asynchronous Job Queue Benchmark\n");
+    printf("  13 - Partial and Batched Sync Benchmark\n");
+    printf("  14 - dma-buf Sharing Test\n");
+    printf("  15 - Multi-threaded Stress Test\n");
+    printf("  16 - NUMA Placement Benchmark\n");
+    printf("  17 - Large Buffer Benchmark\n");
+    printf("  18 - Micro-benchmark Suite\n");
     printf("\nExamples:\n");
     printf("  %s -a              # Run all tests\n", prog);
     printf("  %s -c -v           # Run coherent test with verbose output\n", prog);
     printf("  %s -t 1            # Run test case 1\n", prog);
+    printf("  %s -B -f json -o bench.json  # Benchmark suite as JSON\n", prog);
 }
 
 int main(int argc, char *argv[], char *envp[])
@@ -534,13 +2920,27 @@ int main(int argc, char *argv[], char *envp[])
         {"pool",      no_argument,       0, 'p'},
         {"info",      no_argument,       0, 'i'},
         {"mask",      no_argument,       0, 'm'},
+        {"user",      no_argument,       0, 'u'},
+        {"sg-bench",  no_argument,       0, 'S'},
+        {"cache-bench", no_argument,     0, 'C'},
+        {"pool-bench", no_argument,      0, 'P'},
+        {"xfer-bench", no_argument,      0, 'X'},
+        {"job-bench",  no_argument,      0, 'J'},
+        {"sync-bench", no_argument,      0, 'R'},
+        {"dmabuf",     no_argument,      0, 'D'},
+        {"stress",     no_argument,      0, 'T'},
+        {"numa-bench", no_argument,      0, 'N'},
+        {"large-bench", no_argument,     0, 'L'},
+        {"bench",      no_argument,      0, 'B'},
+        {"format",     required_argument, 0, 'f'},
+        {"output",     required_argument, 0, 'o'},
         {"verbose",   no_argument,       0, 'v'},
         {"help",      no_argument,       0, 'h'},
         {0, 0, 0, 0}
     };
 
     /* Parse command line */
-    while ((opt = getopt_long(argc, argv, "abcghipsmt:vt:", long_options, NULL)) != -1) {
+    while ((opt = getopt_long(argc, argv, "abcghipsmuSCPXJRDTNLBf:o:t:v", long_options, NULL)) != -1) {
         switch (opt) {
         case 'a':
             run_all = 1;
@@ -566,12 +2966,61 @@ int main(int argc, char *argv[], char *envp[])
         case 'm':
             test_mask |= (1 << 5);
             break;
+        case 'u':
+            test_mask |= (1 << 6);
+            break;
+        case 'S':
+            test_mask |= (1 << 7);
+            break;
+        case 'C':
+            test_mask |= (1 << 8);
+            break;
+        case 'P':
+            test_mask |= (1 << 9);
+            break;
+        case 'X':
+            test_mask |= (1 << 10);
+            break;
+        case 'J':
+            test_mask |= (1 << 11);
+            break;
+        case 'R':
+            test_mask |= (1 << 12);
+            break;
+        case 'D':
+            test_mask |= (1 << 13);
+            break;
+        case 'T':
+            test_mask |= (1 << 14);
+            break;
+        case 'N':
+            test_mask |= (1 << 15);
+            break;
+        case 'L':
+            test_mask |= (1 << 16);
+            break;
+        case 'B':
+            test_mask |= (1 << 17);
+            break;
+        case 'f':
+            if (strcmp(optarg, "csv") == 0) {
+                g_bench_format = BENCH_CSV;
+            } else if (strcmp(optarg, "json") == 0) {
+                g_bench_format = BENCH_JSON;
+            } else {
+                fprintf(stderr, "Invalid format: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'o':
+            g_bench_output = optarg;
+            break;
         case 'v':
             g_verbose = 1;
             break;
         case 't':
             test_num = atoi(optarg);
-            if (test_num >= 1 && test_num <= 6) {
+            if (test_num >= 1 && test_num <= 18) {
                 test_mask |= (1 << (test_num - 1));
             } else {
                 fprintf(stderr, "Invalid test case: %s\n", optarg);
@@ -610,7 +3059,7 @@ int main(int argc, char *argv[], char *envp[])
 
     /* Run all tests */
     if (run_all) {
-        test_mask = 0x3F;  /* All 6 tests */
+        test_mask |= 0x1FFFF; /* All 17 tests, -B only when asked for */
     }
 
     /* Run selected tests */
@@ -650,6 +3099,78 @@ int main(int argc, char *argv[], char *envp[])
         }
     }
 
+    if (test_mask & (1 << 6)) {
+        if (test_user_mapping(fd) < 0) {
+            ret = 1;
+        }
+    }
+
+    if (test_mask & (1 << 7)) {
+        if (test_sg_bench(fd) < 0) {
+            ret = 1;
+        }
+    }
+
+    if (test_mask & (1 << 8)) {
+        if (test_cache_bench(fd) < 0) {
+            ret = 1;
+        }
+    }
+
+    if (test_mask & (1 << 9)) {
+        if (test_pool_bench(fd) < 0) {
+            ret = 1;
+        }
+    }
+
+    if (test_mask & (1 << 10)) {
+        if (test_xfer_bench(fd) < 0) {
+            ret = 1;
+        }
+    }
+
+    if (test_mask & (1 << 11)) {
+        if (test_job_bench() < 0) {
+            ret = 1;
+        }
+    }
+
+    if (test_mask & (1 << 12)) {
+        if (test_sync_bench(fd) < 0) {
+            ret = 1;
+        }
+    }
+
+    if (test_mask & (1 << 13)) {
+        if (test_dmabuf(fd) < 0) {
+            ret = 1;
+        }
+    }
+
+    if (test_mask & (1 << 14)) {
+        if (test_stress(fd) < 0) {
+            ret = 1;
+        }
+    }
+
+    if (test_mask & (1 << 15)) {
+        if (test_numa_bench(fd) < 0) {
+            ret = 1;
+        }
+    }
+
+    if (test_mask & (1 << 16)) {
+        if (test_large_bench(fd) < 0) {
+            ret = 1;
+        }
+    }
+
+    if (test_mask & (1 << 17)) {
+        if (test_bench_suite() < 0) {
+            ret = 1;
+        }
+    }
+
     /* Close device */
     if (fd >= 0) {
         close(fd);
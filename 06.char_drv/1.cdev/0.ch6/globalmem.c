@@ -12,6 +12,9 @@
 #include <linux/cdev.h>
 #include <linux/slab.h>
 #include <linux/uaccess.h>
+#include <linux/uio.h>
+#include <linux/splice.h>
+#include <linux/version.h>
 
 #define GLOBALMEM_SIZE	0x1000
 #define MEM_CLEAR 0x1
@@ -56,51 +59,57 @@ static long globalmem_ioctl(struct file *filp, unsigned int cmd,
 	return 0;
 }
 
-static ssize_t globalmem_read(struct file *filp, char __user * buf, size_t size,
-			      loff_t * ppos)
+/*
+ * read_iter/write_iter instead of read/write: readv()/writev() and AIO hand
+ * the whole iovec over in one call rather than one call per segment.
+ */
+static ssize_t globalmem_read_iter(struct kiocb *iocb, struct iov_iter *to)
 {
-	unsigned long p = *ppos;
-	unsigned int count = size;
+	unsigned long p = iocb->ki_pos;
+	size_t count = iov_iter_count(to);
+	size_t copied;
 	int ret = 0;
-	struct globalmem_dev *dev = filp->private_data;
+	struct globalmem_dev *dev = iocb->ki_filp->private_data;
 
 	if (p >= GLOBALMEM_SIZE)
 		return 0;
 	if (count > GLOBALMEM_SIZE - p)
 		count = GLOBALMEM_SIZE - p;
 
-	if (copy_to_user(buf, dev->mem + p, count)) {
+	copied = copy_to_iter(dev->mem + p, count, to);
+	if (copied == 0 && count) {
 		ret = -EFAULT;
 	} else {
-		*ppos += count;
-		ret = count;
+		iocb->ki_pos += copied;
+		ret = copied;
 
-		printk(KERN_INFO "read %u bytes(s) from %lu\n", count, p);
+		printk(KERN_INFO "read %zu bytes(s) from %lu\n", copied, p);
 	}
 
 	return ret;
 }
 
-static ssize_t globalmem_write(struct file *filp, const char __user * buf,
-			       size_t size, loff_t * ppos)
+static ssize_t globalmem_write_iter(struct kiocb *iocb, struct iov_iter *from)
 {
-	unsigned long p = *ppos;
-	unsigned int count = size;
+	unsigned long p = iocb->ki_pos;
+	size_t count = iov_iter_count(from);
+	size_t copied;
 	int ret = 0;
-	struct globalmem_dev *dev = filp->private_data;
+	struct globalmem_dev *dev = iocb->ki_filp->private_data;
 
 	if (p >= GLOBALMEM_SIZE)
 		return 0;
 	if (count > GLOBALMEM_SIZE - p)
 		count = GLOBALMEM_SIZE - p;
 
-	if (copy_from_user(dev->mem + p, buf, count))
+	copied = copy_from_iter(dev->mem + p, count, from);
+	if (copied == 0 && count)
 		ret = -EFAULT;
 	else {
-		*ppos += count;
-		ret = count;
+		iocb->ki_pos += copied;
+		ret = copied;
 
-		printk(KERN_INFO "written %u bytes(s) from %lu\n", count, p);
+		printk(KERN_INFO "written %zu bytes(s) from %lu\n", copied, p);
 	}
 
 	return ret;
@@ -144,8 +153,15 @@ static loff_t globalmem_llseek(struct file *filp, loff_t offset, int orig)
 static const struct file_operations globalmem_fops = {
 	.owner = THIS_MODULE,
 	.llseek = globalmem_llseek,
-	.read = globalmem_read,
-	.write = globalmem_write,
+	.read_iter = globalmem_read_iter,
+	.write_iter = globalmem_write_iter,
+	/* splice()/sendfile() via read_iter/write_iter, no user bounce buffer */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 5, 0)
+	.splice_read = copy_splice_read,
+#else
+	.splice_read = generic_file_splice_read,
+#endif
+	.splice_write = iter_file_splice_write,
 	.unlocked_ioctl = globalmem_ioctl,
 	.open = globalmem_open,
 	.release = globalmem_release,
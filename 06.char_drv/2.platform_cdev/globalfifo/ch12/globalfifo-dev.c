@@ -9,24 +9,43 @@
 #include <linux/module.h>
 #include <linux/platform_device.h>
 
+#include "globalfifo.h"
+
+static unsigned int fifo_size;
+module_param(fifo_size, uint, S_IRUGO);
+MODULE_PARM_DESC(fifo_size, "FIFO capacity passed as platform_data, 0 for the driver default");
+
+static bool multi_queue;
+module_param(multi_queue, bool, S_IRUGO);
+MODULE_PARM_DESC(multi_queue, "ask for per-CPU lanes through platform_data");
+
 static struct platform_device *globalfifo_pdev;
 
 static int __init globalfifodev_init(void)
 {
+	struct globalfifo_platform_data pdata = {
+		.fifo_size = fifo_size,
+		.multi_queue = multi_queue,
+	};
 	int ret;
 
 	globalfifo_pdev = platform_device_alloc("globalfifo", -1);
 	if (!globalfifo_pdev)
 		return -ENOMEM;
 
+	ret = platform_device_add_data(globalfifo_pdev, &pdata, sizeof(pdata));
+	if (ret)
+		goto err;
+
 	ret = platform_device_add(globalfifo_pdev);
-	if (ret) {
-		platform_device_put(globalfifo_pdev);
-		return ret;
-	}
+	if (ret)
+		goto err;
 
 	return 0;
 
+err:
+	platform_device_put(globalfifo_pdev);
+	return ret;
 }
 module_init(globalfifodev_init);
 
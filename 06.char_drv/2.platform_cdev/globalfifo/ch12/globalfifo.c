@@ -12,25 +12,1141 @@
 #include <linux/init.h>
 #include <linux/cdev.h>
 #include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/log2.h>
 #include <linux/poll.h>
+#include <linux/uio.h>
+#include <linux/splice.h>
+#include <linux/version.h>
+#include <linux/kthread.h>
+#include <linux/sched/mm.h>
+#include <linux/workqueue.h>
+#include <linux/timekeeping.h>
+#include <linux/hrtimer.h>
+#include <linux/percpu.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
 #include <linux/platform_device.h>
+#include <linux/property.h>
 #include <linux/miscdevice.h>
 #include <linux/of_device.h>
+#include <linux/rcupdate.h>
+
+#include "globalfifo.h"
 
 #define GLOBALFIFO_SIZE	0x1000
-#define FIFO_CLEAR 0x1
+#define GLOBALFIFO_MAX_SIZE	(64 << 20)
 #define GLOBALFIFO_MAJOR 231
 
-struct globalfifo_dev {
-	struct cdev cdev;
-	unsigned int current_len;
-	unsigned char mem[GLOBALFIFO_SIZE];
-	struct mutex mutex;
-	wait_queue_head_t r_wait;
-	wait_queue_head_t w_wait;
-	struct fasync_struct *async_queue;
-	struct miscdevice miscdev;
-};
+/* by default POLLOUT is raised once a quarter of the FIFO is free */
+#define GLOBALFIFO_OUT_THRESH_SHIFT	2
+
+/* log2 buckets of blocked time in ns, the last one also takes longer sleeps */
+#define GLOBALFIFO_LAT_BUCKETS	32
+
+static unsigned int fifo_size = GLOBALFIFO_SIZE;
+module_param(fifo_size, uint, S_IRUGO);
+MODULE_PARM_DESC(fifo_size, "default FIFO capacity in bytes");
+
+static bool multi_queue;
+module_param(multi_queue, bool, S_IRUGO);
+MODULE_PARM_DESC(multi_queue, "give every CPU its own FIFO lane by default");
+
+/*
+ * Per-CPU counters, summed up by the readers in sysfs stats/ and debugfs.
+ * Every field is a u64 event count except max_fill, which is the highest
+ * fill level a write left behind on that CPU.
+ */
+struct globalfifo_stats {
+	u64 bytes_in;
+	u64 bytes_out;
+	u64 writes;		/* write()s and AIO writes that moved data */
+	u64 reads;		/* likewise, FIFO_READ_RECORDS counts once */
+	u64 w_eagain;		/* full FIFO and the writer cannot wait */
+	u64 r_eagain;		/* empty FIFO and the reader cannot wait */
+	u64 w_sleeps;		/* times a blocking writer went to sleep */
+	u64 r_sleeps;
+	u64 r_wakeups;		/* wakeups sent to sleeping readers */
+	u64 coalesce_fires;	/* rx_timer expiries */
+	u64 max_fill;
+	u64 w_lat[GLOBALFIFO_LAT_BUCKETS];	/* ns asleep per w_sleep */
+	u64 r_lat[GLOBALFIFO_LAT_BUCKETS];
+};
+
+/*
+ * The FIFO is a single-producer/single-consumer ring. head is only moved
+ * by the writer and tail only by the reader; both run freely and are
+ * masked on access, so head - tail is the fill level even after they
+ * wrap. The writer publishes data with smp_store_release(&head) after
+ * copying it in and the reader returns space with
+ * smp_store_release(&tail) after copying it out, so one reader and one
+ * writer never share a lock. r_mutex and w_mutex only serialise several
+ * readers (or several writers) against each other; with one of each they
+ * are never contended.
+ *
+ * head and tail live in the control page that precedes the data area, so
+ * the ring can be mmap()ed and driven from userspace. Both are therefore
+ * untrusted and every fill level derived from them is clamped to size.
+ * The control page and data come from one vmalloc_user() area. size is a
+ * power of two of at least PAGE_SIZE and is kept here rather than read
+ * back from ctrl->size. The area and size only change in FIFO_RESIZE,
+ * which holds both mutexes and refuses while the ring is mapped.
+ *
+ * Holders of either mutex use globalfifo_ctrl(). Everything else that
+ * peeks at the ring without them (poll, the wait conditions, the
+ * r_waiting and w_waiting flags) goes through RCU, and FIFO_RESIZE waits
+ * for a grace period before freeing the old area.
+ */
+struct globalfifo_dev {
+	struct cdev cdev;
+	struct globalfifo_ring_ctrl __rcu *ctrl;
+	unsigned char *mem;
+	unsigned int size;
+	unsigned int out_thresh;	/* tx_lowat, or a quarter of size */
+	unsigned int tx_lowat;		/* FIFO_SET_LOWAT, 0: default */
+	unsigned int rx_lowat;
+	unsigned int coalesce_us;
+	bool rx_flush;			/* see globalfifo_data_ready() */
+	struct hrtimer rx_timer;
+	struct globalfifo_stats __percpu *stats;
+	struct dentry *debugfs;
+	atomic_t mmap_count;
+	struct mutex r_mutex;
+	struct mutex w_mutex;
+	wait_queue_head_t r_wait;
+	wait_queue_head_t w_wait;
+	struct fasync_struct *async_queue;
+	spinlock_t aio_lock;		/* protects r_pending and w_pending */
+	struct list_head r_pending;
+	struct list_head w_pending;
+	struct work_struct aio_work;
+	struct globalfifo_lane *lanes;	/* multi-queue mode, else NULL */
+	unsigned int nr_lanes;
+	unsigned int order;		/* GLOBALFIFO_ORDER_*, under r_mutex */
+	unsigned int rr_next;
+	struct globalfifo_lane *partial;
+	bool record;			/* FIFO_SET_RECORD */
+	struct miscdevice miscdev;
+};
+
+static inline unsigned int globalfifo_used(struct globalfifo_dev *dev,
+					   unsigned int head, unsigned int tail)
+{
+	return min(head - tail, READ_ONCE(dev->size));
+}
+
+/* the ring, for a holder of r_mutex or w_mutex */
+static inline struct globalfifo_ring_ctrl *
+globalfifo_ctrl(struct globalfifo_dev *dev)
+{
+	return rcu_dereference_protected(dev->ctrl,
+					 lockdep_is_held(&dev->r_mutex) ||
+					 lockdep_is_held(&dev->w_mutex));
+}
+
+/* callable without either mutex, see the RCU note above */
+static inline unsigned int globalfifo_len(struct globalfifo_dev *dev)
+{
+	struct globalfifo_ring_ctrl *ctrl;
+	unsigned int len;
+
+	rcu_read_lock();
+	ctrl = rcu_dereference(dev->ctrl);
+	len = globalfifo_used(dev, READ_ONCE(ctrl->head),
+			      READ_ONCE(ctrl->tail));
+	rcu_read_unlock();
+	return len;
+}
+
+/*
+ * Set r_waiting/w_waiting in the control page before sleeping so that a
+ * producer/consumer working through mmap() calls FIFO_RING_NOTIFY. The
+ * barrier orders the flag store before the caller re-reads the indexes.
+ */
+static inline void globalfifo_want_notify(struct globalfifo_dev *dev,
+					  bool writer)
+{
+	struct globalfifo_ring_ctrl *ctrl;
+
+	rcu_read_lock();
+	ctrl = rcu_dereference(dev->ctrl);
+	WRITE_ONCE(*(writer ? &ctrl->w_waiting : &ctrl->r_waiting), 1);
+	rcu_read_unlock();
+	smp_mb();
+}
+
+/* called by a side that made progress, see globalfifo_aio_queue() */
+static void globalfifo_aio_kick(struct globalfifo_dev *dev,
+				struct list_head *pending)
+{
+	/* order the index update before the list check */
+	smp_mb();
+	if (!list_empty_careful(pending))
+		queue_work(system_wq, &dev->aio_work);
+}
+
+static unsigned int globalfifo_norm_size(unsigned int size)
+{
+	size = clamp_t(unsigned int, size, PAGE_SIZE, GLOBALFIFO_MAX_SIZE);
+	return roundup_pow_of_two(size);
+}
+
+/* one control page followed by the data, zeroed and mappable */
+static struct globalfifo_ring_ctrl *globalfifo_alloc_ring(unsigned int size)
+{
+	struct globalfifo_ring_ctrl *ctrl;
+
+	ctrl = vmalloc_user(PAGE_SIZE + size);
+	if (!ctrl)
+		return NULL;
+	ctrl->size = size;
+	ctrl->data_offset = PAGE_SIZE;
+	return ctrl;
+}
+
+/* follows size, so FIFO_RESIZE and FIFO_SET_LOWAT both recompute it */
+static void globalfifo_update_thresh(struct globalfifo_dev *dev)
+{
+	unsigned int size = dev->size;
+
+	WRITE_ONCE(dev->out_thresh, dev->tx_lowat ? min(dev->tx_lowat, size) :
+				    size >> GLOBALFIFO_OUT_THRESH_SHIFT);
+}
+
+static void globalfifo_set_ring(struct globalfifo_dev *dev,
+				struct globalfifo_ring_ctrl *ctrl)
+{
+	rcu_assign_pointer(dev->ctrl, ctrl);
+	dev->mem = (unsigned char *)ctrl + PAGE_SIZE;
+	WRITE_ONCE(dev->size, ctrl->size);
+	globalfifo_update_thresh(dev);
+}
+
+static int globalfifo_resize(struct globalfifo_dev *dev, unsigned int size)
+{
+	struct globalfifo_ring_ctrl *ctrl, *old;
+	int ret = 0;
+
+	ctrl = globalfifo_alloc_ring(globalfifo_norm_size(size));
+	if (!ctrl)
+		return -ENOMEM;
+
+	mutex_lock(&dev->r_mutex);
+	mutex_lock(&dev->w_mutex);
+	old = globalfifo_ctrl(dev);
+	if (old->head != old->tail || atomic_read(&dev->mmap_count)) {
+		old = ctrl;
+		ret = -EBUSY;
+	} else {
+		globalfifo_set_ring(dev, ctrl);
+	}
+	mutex_unlock(&dev->w_mutex);
+	mutex_unlock(&dev->r_mutex);
+
+	/* lockless readers may still be looking at the old ring */
+	if (!ret)
+		synchronize_rcu();
+	vfree(old);
+	if (!ret)
+		wake_up_interruptible(&dev->w_wait);
+	return ret;
+}
+
+/*
+ * Copy count bytes starting at index idx of a size byte ring out to / in
+ * from an iov_iter. A wrapped region is moved in at most two segments,
+ * whatever the number of iovec segments on the user side. Returns the
+ * bytes actually copied, which is short only on a fault.
+ */
+static size_t globalfifo_copy_out(unsigned char *mem, unsigned int size,
+				  struct iov_iter *to, unsigned int idx,
+				  unsigned int count)
+{
+	unsigned int off = idx & (size - 1);
+	unsigned int l = min(count, size - off);
+	size_t copied;
+
+	copied = copy_to_iter(mem + off, l, to);
+	if (copied == l)
+		copied += copy_to_iter(mem, count - l, to);
+	return copied;
+}
+
+static size_t globalfifo_copy_in(unsigned char *mem, unsigned int size,
+				 struct iov_iter *from, unsigned int idx,
+				 unsigned int count)
+{
+	unsigned int off = idx & (size - 1);
+	unsigned int l = min(count, size - off);
+	size_t copied;
+
+	copied = copy_from_iter(mem + off, l, from);
+	if (copied == l)
+		copied += copy_from_iter(mem, count - l, from);
+	return copied;
+}
+
+/* small wrap-aware copies of driver-owned data such as chunk headers */
+static void globalfifo_peek(unsigned char *mem, unsigned int size,
+			    unsigned int idx, void *buf, unsigned int len)
+{
+	unsigned int off = idx & (size - 1);
+	unsigned int l = min(len, size - off);
+
+	memcpy(buf, mem + off, l);
+	memcpy(buf + l, mem, len - l);
+}
+
+static void globalfifo_poke(unsigned char *mem, unsigned int size,
+			    unsigned int idx, const void *buf, unsigned int len)
+{
+	unsigned int off = idx & (size - 1);
+	unsigned int l = min(len, size - off);
+
+	memcpy(mem + off, buf, l);
+	memcpy(mem, buf + l, len - l);
+}
+
+/* O_NONBLOCK, or a RWF_NOWAIT/io_uring attempt that must not sleep */
+static inline bool globalfifo_nowait(struct kiocb *iocb)
+{
+	return (iocb->ki_filp->f_flags & O_NONBLOCK) ||
+	       (iocb->ki_flags & IOCB_NOWAIT);
+}
+
+static int globalfifo_lock(struct kiocb *iocb, struct mutex *lock)
+{
+	if (iocb->ki_flags & IOCB_NOWAIT)
+		return mutex_trylock(lock) ? 0 : -EAGAIN;
+	return mutex_lock_interruptible(lock) ? -ERESTARTSYS : 0;
+}
+
+static inline unsigned int globalfifo_lat_bucket(u64 ns)
+{
+	return ns ? min_t(unsigned int, ilog2(ns),
+			  GLOBALFIFO_LAT_BUCKETS - 1) : 0;
+}
+
+/* start is the ktime_get_ns() at which the caller went to sleep */
+static inline void globalfifo_count_lat(u64 __percpu *hist, u64 start)
+{
+	this_cpu_inc(hist[globalfifo_lat_bucket(ktime_get_ns() - start)]);
+}
+
+static inline void globalfifo_count_read(struct globalfifo_dev *dev,
+					 size_t bytes)
+{
+	this_cpu_inc(dev->stats->reads);
+	this_cpu_add(dev->stats->bytes_out, bytes);
+}
+
+static inline void globalfifo_count_write(struct globalfifo_dev *dev,
+					  size_t bytes)
+{
+	this_cpu_inc(dev->stats->writes);
+	this_cpu_add(dev->stats->bytes_in, bytes);
+}
+
+static void globalfifo_wake_readers(struct globalfifo_dev *dev)
+{
+	/* the barrier in wq_has_sleeper() orders our index update first */
+	if (wq_has_sleeper(&dev->r_wait)) {
+		this_cpu_inc(dev->stats->r_wakeups);
+		wake_up_interruptible(&dev->r_wait);
+	}
+
+	if (dev->async_queue)
+		kill_fasync(&dev->async_queue, SIGIO, POLL_IN);
+}
+
+/*
+ * Readers are woken, and POLLIN raised, only once rx_lowat bytes are
+ * queued (like SO_RCVLOWAT), so a burst of small writes costs one wakeup
+ * instead of one each. Data below the watermark is not stranded: after
+ * coalesce_us the rx_timer marks it readable anyway (rx_flush), and so
+ * does a writer that finds the FIFO full. The reader clears rx_flush
+ * once it has emptied the FIFO. In multi-queue mode the watermark applies
+ * to each lane, headers included. The default rx_lowat of 1 wakes on
+ * every write. Parked AIO reads are not held back.
+ */
+static inline bool globalfifo_lowat_met(struct globalfifo_dev *dev,
+					unsigned int len)
+{
+	return len && (len >= READ_ONCE(dev->rx_lowat) ||
+		       READ_ONCE(dev->rx_flush));
+}
+
+/* a write left len bytes queued */
+static void globalfifo_data_ready(struct globalfifo_dev *dev,
+				  unsigned int len)
+{
+	unsigned int us = READ_ONCE(dev->coalesce_us);
+	struct globalfifo_stats *st;
+
+	st = get_cpu_ptr(dev->stats);
+	if (len > st->max_fill)
+		st->max_fill = len;
+	put_cpu_ptr(dev->stats);
+
+	/* armed even if rx_flush is set, the reader may be clearing it */
+	if (len < READ_ONCE(dev->rx_lowat) && us &&
+	    !hrtimer_active(&dev->rx_timer))
+		hrtimer_start(&dev->rx_timer,
+			      ns_to_ktime((u64)us * NSEC_PER_USEC),
+			      HRTIMER_MODE_REL);
+
+	if (globalfifo_lowat_met(dev, len))
+		globalfifo_wake_readers(dev);
+}
+
+/* make whatever is queued readable now */
+static void globalfifo_rx_flush(struct globalfifo_dev *dev)
+{
+	WRITE_ONCE(dev->rx_flush, true);
+	globalfifo_wake_readers(dev);
+}
+
+static enum hrtimer_restart globalfifo_rx_timer(struct hrtimer *timer)
+{
+	struct globalfifo_dev *dev = container_of(timer, struct globalfifo_dev,
+						  rx_timer);
+
+	this_cpu_inc(dev->stats->coalesce_fires);
+	globalfifo_rx_flush(dev);
+	return HRTIMER_NORESTART;
+}
+
+/*
+ * Record mode (FIFO_SET_RECORD) keeps write() boundaries: every write()
+ * is stored as a header followed by the payload, the same chunk format
+ * the multi-queue lanes use, and read() returns exactly one whole record
+ * or fails with -EMSGSIZE if the buffer is too small for it. A record
+ * larger than the FIFO can never be written, so that also fails with
+ * -EMSGSIZE. FIFO_READ_RECORDS dequeues several records in one call.
+ */
+struct globalfifo_chunk {
+	u32 len;
+	u32 pad;
+	u64 ts;			/* ktime_get_ns() when it was published */
+};
+
+/* one whole record out of the ring, with r_mutex held */
+static ssize_t globalfifo_consume_rec(struct globalfifo_dev *dev,
+				      struct iov_iter *to)
+{
+	struct globalfifo_chunk hdr;
+	unsigned int head, tail, used;
+	size_t copied;
+
+	head = smp_load_acquire(&globalfifo_ctrl(dev)->head);
+	tail = READ_ONCE(globalfifo_ctrl(dev)->tail);
+	if (head == tail) {
+		WRITE_ONCE(dev->rx_flush, false);
+		return -EAGAIN;
+	}
+
+	/* mmap() is refused in record mode, only we write the ring */
+	used = globalfifo_used(dev, head, tail);
+	globalfifo_peek(dev->mem, dev->size, tail, &hdr, sizeof(hdr));
+	if (WARN_ON_ONCE(hdr.len > used - sizeof(hdr)))
+		return -EIO;
+	if (hdr.len > iov_iter_count(to))
+		return -EMSGSIZE;
+
+	copied = globalfifo_copy_out(dev->mem, dev->size, to,
+				     tail + sizeof(hdr), hdr.len);
+	if (copied != hdr.len)
+		return -EFAULT;
+
+	tail += sizeof(hdr) + hdr.len;
+	smp_store_release(&globalfifo_ctrl(dev)->tail, tail);
+	if (tail == head)
+		WRITE_ONCE(dev->rx_flush, false);
+
+	/* a writer may wait for room for a whole record, always wake */
+	wake_up_interruptible(&dev->w_wait);
+	return copied;
+}
+
+/* the whole of from as one record into the ring, with w_mutex held */
+static ssize_t globalfifo_produce_rec(struct globalfifo_dev *dev,
+				      struct iov_iter *from)
+{
+	struct globalfifo_chunk hdr;
+	size_t count = iov_iter_count(from), copied;
+	unsigned int head, tail, used;
+
+	if (!count)
+		return 0;
+	if (count > dev->size - sizeof(hdr))
+		return -EMSGSIZE;
+
+	head = READ_ONCE(globalfifo_ctrl(dev)->head);
+	tail = smp_load_acquire(&globalfifo_ctrl(dev)->tail);
+	used = globalfifo_used(dev, head, tail);
+	if (dev->size - used < sizeof(hdr) + count)
+		return -EAGAIN;
+
+	copied = globalfifo_copy_in(dev->mem, dev->size, from,
+				    head + sizeof(hdr), count);
+	if (copied != count)
+		return -EFAULT;
+
+	hdr.len = count;
+	hdr.pad = 0;
+	hdr.ts = ktime_get_ns();
+	globalfifo_poke(dev->mem, dev->size, head, &hdr, sizeof(hdr));
+
+	smp_store_release(&globalfifo_ctrl(dev)->head,
+			  head + sizeof(hdr) + count);
+	return count;
+}
+
+/* room for a write of count bytes, all of it in record mode */
+static bool globalfifo_writable(struct globalfifo_dev *dev, size_t count)
+{
+	unsigned int room = READ_ONCE(dev->size) - globalfifo_len(dev);
+
+	if (READ_ONCE(dev->record))
+		return room >= sizeof(struct globalfifo_chunk) + count;
+	return room != 0;
+}
+
+/*
+ * Move up to iov_iter_count(to) bytes out of the ring, with r_mutex held.
+ * Returns -EAGAIN if the FIFO is empty.
+ */
+static ssize_t globalfifo_consume(struct globalfifo_dev *dev,
+				  struct iov_iter *to)
+{
+	size_t count = iov_iter_count(to), copied;
+	unsigned int head, tail, used, avail;
+
+	if (dev->record)
+		return globalfifo_consume_rec(dev, to);
+
+	/* pairs with smp_store_release(&ctrl->head) in globalfifo_produce() */
+	head = smp_load_acquire(&globalfifo_ctrl(dev)->head);
+	tail = READ_ONCE(globalfifo_ctrl(dev)->tail);
+	if (head == tail) {
+		WRITE_ONCE(dev->rx_flush, false);
+		return -EAGAIN;
+	}
+
+	used = globalfifo_used(dev, head, tail);
+	if (count > used)
+		count = used;
+
+	copied = globalfifo_copy_out(dev->mem, dev->size, to, tail, count);
+	if (copied == 0 && count)
+		return -EFAULT;
+
+	/* only hand the space back to the writer once it has been copied */
+	smp_store_release(&globalfifo_ctrl(dev)->tail, tail + copied);
+	if (copied == used)
+		WRITE_ONCE(dev->rx_flush, false);
+
+	/*
+	 * Blocked writers only sleep on a full FIFO; pollers wait for
+	 * out_thresh free bytes. Wake either only when that changes.
+	 */
+	avail = dev->size - used;
+	if (avail == 0 ||
+	    (avail < dev->out_thresh && avail + copied >= dev->out_thresh))
+		wake_up_interruptible(&dev->w_wait);
+	return copied;
+}
+
+/*
+ * Move up to iov_iter_count(from) bytes into the ring, with w_mutex held.
+ * Returns -EAGAIN if the FIFO is full. The caller wakes readers.
+ */
+static ssize_t globalfifo_produce(struct globalfifo_dev *dev,
+				  struct iov_iter *from)
+{
+	size_t count = iov_iter_count(from), copied;
+	unsigned int head, tail, used;
+
+	if (dev->record)
+		return globalfifo_produce_rec(dev, from);
+
+	head = READ_ONCE(globalfifo_ctrl(dev)->head);
+	/* pairs with the tail release in globalfifo_consume() */
+	tail = smp_load_acquire(&globalfifo_ctrl(dev)->tail);
+	used = globalfifo_used(dev, head, tail);
+	if (used == dev->size)
+		return -EAGAIN;
+
+	if (count > dev->size - used)
+		count = dev->size - used;
+
+	copied = globalfifo_copy_in(dev->mem, dev->size, from, head, count);
+	if (copied == 0 && count)
+		return -EFAULT;
+
+	/* publish the data only after it has been copied in */
+	smp_store_release(&globalfifo_ctrl(dev)->head, head + copied);
+	return copied;
+}
+
+/*
+ * Multi-queue mode (multi_queue param, platform_data or "multi-queue"
+ * property): every CPU gets its own lane, a kvzalloc()ed ring of size bytes
+ * with its own writer lock and wait queue, so producers on different CPUs
+ * share neither a lock nor a cache line. Each write() becomes one chunk, a
+ * struct globalfifo_chunk header followed by the payload. The reader
+ * drains the lanes under r_mutex, one chunk at a time, either round-robin
+ * or oldest chunk first (FIFO_SET_ORDER). A chunk may be read in pieces;
+ * its space goes back to the writer once all of it has been read. Writers
+ * sleep on their lane's w_wait; poll() readiness is device-wide, so pollers
+ * sleep on dev->w_wait, which the reader wakes along with the lane. The
+ * mmap()ed ring, FIFO_RESIZE and AIO parking are single-ring features and
+ * are refused (or served synchronously) in this mode.
+ */
+struct globalfifo_lane {
+	struct mutex lock;	/* serialises writers on this lane */
+	wait_queue_head_t w_wait;
+	unsigned char *mem;
+	unsigned int head;
+	/* consumer side, only touched under dev->r_mutex */
+	unsigned int tail ____cacheline_aligned_in_smp;
+	unsigned int rd_off;	/* payload already read from the chunk at tail */
+} ____cacheline_aligned_in_smp;
+
+/* free bytes, as seen by the lane's writer */
+static inline unsigned int globalfifo_lane_room(struct globalfifo_dev *dev,
+						struct globalfifo_lane *lane)
+{
+	/* pairs with the tail release in globalfifo_mq_consume() */
+	return dev->size - (READ_ONCE(lane->head) -
+			    smp_load_acquire(&lane->tail));
+}
+
+static bool globalfifo_mq_empty(struct globalfifo_dev *dev)
+{
+	unsigned int i;
+
+	for (i = 0; i < dev->nr_lanes; i++)
+		if (READ_ONCE(dev->lanes[i].head) !=
+		    READ_ONCE(dev->lanes[i].tail))
+			return false;
+	return true;
+}
+
+/* some lane reached rx_lowat, see globalfifo_lowat_met() */
+static bool globalfifo_mq_readable(struct globalfifo_dev *dev)
+{
+	struct globalfifo_lane *lane;
+	unsigned int i;
+
+	for (i = 0; i < dev->nr_lanes; i++) {
+		lane = &dev->lanes[i];
+		if (globalfifo_lowat_met(dev, READ_ONCE(lane->head) -
+					      READ_ONCE(lane->tail)))
+			return true;
+	}
+	return false;
+}
+
+static bool globalfifo_readable(struct globalfifo_dev *dev)
+{
+	if (dev->lanes)
+		return globalfifo_mq_readable(dev);
+	return globalfifo_lowat_met(dev, globalfifo_len(dev));
+}
+
+/* re-arms r_waiting for an mmap producer every time it is not readable */
+static bool globalfifo_readable_notify(struct globalfifo_dev *dev)
+{
+	if (globalfifo_readable(dev))
+		return true;
+	if (dev->lanes)
+		return false;
+	globalfifo_want_notify(dev, false);
+	return globalfifo_readable(dev);
+}
+
+/* sleep, with no lock held, until globalfifo_readable() */
+static int globalfifo_wait_readable(struct globalfifo_dev *dev)
+{
+	u64 t;
+	int ret;
+
+	if (globalfifo_readable(dev))
+		return 0;
+
+	this_cpu_inc(dev->stats->r_sleeps);
+	t = ktime_get_ns();
+	ret = wait_event_interruptible(dev->r_wait,
+				       globalfifo_readable_notify(dev));
+	globalfifo_count_lat(dev->stats->r_lat, t);
+	return ret ? -ERESTARTSYS : 0;
+}
+
+/* lane to read the next chunk from, NULL if all are empty; r_mutex held */
+static struct globalfifo_lane *globalfifo_mq_pick(struct globalfifo_dev *dev)
+{
+	struct globalfifo_lane *lane, *best = NULL;
+	struct globalfifo_chunk hdr;
+	u64 best_ts = U64_MAX;
+	unsigned int i, n;
+
+	/* finish a partly read chunk first */
+	if (dev->partial)
+		return dev->partial;
+
+	for (i = 0; i < dev->nr_lanes; i++) {
+		n = (dev->rr_next + i) % dev->nr_lanes;
+		lane = &dev->lanes[n];
+		/* pairs with the head release in globalfifo_mq_write_iter() */
+		if (smp_load_acquire(&lane->head) == lane->tail)
+			continue;
+
+		if (dev->order == GLOBALFIFO_ORDER_RR) {
+			dev->rr_next = (n + 1) % dev->nr_lanes;
+			return lane;
+		}
+
+		globalfifo_peek(lane->mem, dev->size, lane->tail, &hdr,
+					sizeof(hdr));
+		if (hdr.ts < best_ts) {
+			best = lane;
+			best_ts = hdr.ts;
+		}
+	}
+	return best;
+}
+
+/*
+ * Move chunks out of the lanes until to is full, with r_mutex held.
+ * Returns -EAGAIN if all lanes are empty.
+ */
+static ssize_t globalfifo_mq_consume(struct globalfifo_dev *dev,
+				     struct iov_iter *to)
+{
+	struct globalfifo_lane *lane = NULL;
+	struct globalfifo_chunk hdr;
+	size_t count, copied, done = 0;
+	unsigned int tail, avail, freed;
+
+	while (iov_iter_count(to) && (lane = globalfifo_mq_pick(dev))) {
+		tail = lane->tail;
+		globalfifo_peek(lane->mem, dev->size, tail, &hdr, sizeof(hdr));
+		if (dev->record && hdr.len > iov_iter_count(to))
+			return -EMSGSIZE;
+
+		count = min_t(size_t, hdr.len - lane->rd_off,
+			      iov_iter_count(to));
+		copied = globalfifo_copy_out(lane->mem, dev->size, to,
+					     tail + sizeof(hdr) + lane->rd_off,
+					     count);
+		/* a record is consumed whole or not at all */
+		if (dev->record && copied != count)
+			return -EFAULT;
+		done += copied;
+		lane->rd_off += copied;
+		if (lane->rd_off < hdr.len) {
+			/* to is full, or faulted part-way */
+			dev->partial = lane;
+			break;
+		}
+
+		dev->partial = NULL;
+		lane->rd_off = 0;
+		avail = dev->size - (READ_ONCE(lane->head) - tail);
+		freed = sizeof(hdr) + hdr.len;
+		smp_store_release(&lane->tail, tail + freed);
+
+		/*
+		 * Writers sleep until a header fits (or a whole record, which
+		 * may need any amount), pollers for out_thresh. The two are
+		 * independent: tx_lowat may put out_thresh below a header.
+		 */
+		if (dev->record || avail <= sizeof(hdr) ||
+		    (avail < dev->out_thresh && avail + freed >= dev->out_thresh)) {
+			wake_up_interruptible(&lane->w_wait);
+			wake_up_interruptible(&dev->w_wait);
+		}
+
+		/* one record per read() in record mode */
+		if (dev->record)
+			break;
+	}
+	if (!lane)
+		WRITE_ONCE(dev->rx_flush, false);
+	if (done)
+		return done;
+	return lane ? -EFAULT : -EAGAIN;
+}
+
+static ssize_t globalfifo_mq_read_iter(struct kiocb *iocb,
+				       struct iov_iter *to)
+{
+	ssize_t ret;
+	struct globalfifo_dev *dev = container_of(iocb->ki_filp->private_data,
+		struct globalfifo_dev, miscdev);
+
+	if (!iov_iter_count(to))
+		return 0;
+
+	/* blocking readers wait for rx_lowat, non-blocking take what is there */
+	if (!globalfifo_nowait(iocb)) {
+		ret = globalfifo_wait_readable(dev);
+		if (ret)
+			return ret;
+	}
+
+	ret = globalfifo_lock(iocb, &dev->r_mutex);
+	if (ret)
+		return ret;
+
+	while ((ret = globalfifo_mq_consume(dev, to)) == -EAGAIN) {
+		mutex_unlock(&dev->r_mutex);
+
+		if (globalfifo_nowait(iocb)) {
+			this_cpu_inc(dev->stats->r_eagain);
+			return -EAGAIN;
+		}
+
+		ret = globalfifo_wait_readable(dev);
+		if (ret)
+			return ret;
+
+		if (mutex_lock_interruptible(&dev->r_mutex))
+			return -ERESTARTSYS;
+	}
+	mutex_unlock(&dev->r_mutex);
+	if (ret > 0)
+		globalfifo_count_read(dev, ret);
+	return ret;
+}
+
+/*
+ * The calling CPU's lane, or if that lacks need free bytes any lane that
+ * has them, so a POLLOUT from globalfifo_mq_poll() is honoured by the next
+ * write. A writer that migrates afterwards simply keeps the lane.
+ */
+static struct globalfifo_lane *globalfifo_mq_lane(struct globalfifo_dev *dev,
+						  unsigned int need)
+{
+	struct globalfifo_lane *lane = &dev->lanes[raw_smp_processor_id()];
+	unsigned int i;
+
+	if (globalfifo_lane_room(dev, lane) >= need)
+		return lane;
+	for (i = 0; i < dev->nr_lanes; i++)
+		if (globalfifo_lane_room(dev, &dev->lanes[i]) >= need)
+			return &dev->lanes[i];
+	return lane;
+}
+
+static ssize_t globalfifo_mq_write_iter(struct kiocb *iocb,
+					struct iov_iter *from)
+{
+	struct globalfifo_dev *dev = container_of(iocb->ki_filp->private_data,
+		struct globalfifo_dev, miscdev);
+	struct globalfifo_lane *lane;
+	struct globalfifo_chunk hdr;
+	size_t count = iov_iter_count(from), copied;
+	unsigned int head, room, need;
+	ssize_t ret;
+	u64 t;
+
+	if (!count)
+		return 0;
+
+	/* a header and one byte, or the whole record in record mode */
+	need = sizeof(hdr) + 1;
+	if (dev->record) {
+		if (count > dev->size - sizeof(hdr))
+			return -EMSGSIZE;
+		need = sizeof(hdr) + count;
+	}
+
+	lane = globalfifo_mq_lane(dev, need);
+	ret = globalfifo_lock(iocb, &lane->lock);
+	if (ret)
+		return ret;
+
+	while ((room = globalfifo_lane_room(dev, lane)) < need) {
+		mutex_unlock(&lane->lock);
+
+		/* don't let the reader wait for a watermark we cannot reach */
+		globalfifo_rx_flush(dev);
+		if (globalfifo_nowait(iocb)) {
+			this_cpu_inc(dev->stats->w_eagain);
+			return -EAGAIN;
+		}
+
+		this_cpu_inc(dev->stats->w_sleeps);
+		t = ktime_get_ns();
+		ret = wait_event_interruptible(lane->w_wait,
+				globalfifo_lane_room(dev, lane) >= need);
+		globalfifo_count_lat(dev->stats->w_lat, t);
+		if (ret)
+			return -ERESTARTSYS;
+
+		if (mutex_lock_interruptible(&lane->lock))
+			return -ERESTARTSYS;
+	}
+
+	if (count > room - sizeof(hdr))
+		count = room - sizeof(hdr);
+
+	head = lane->head;
+	copied = globalfifo_copy_in(lane->mem, dev->size, from,
+				    head + sizeof(hdr), count);
+	if (copied == 0 || (dev->record && copied != count)) {
+		ret = -EFAULT;
+		goto out;
+	}
+
+	hdr.len = copied;
+	hdr.pad = 0;
+	hdr.ts = ktime_get_ns();
+	globalfifo_poke(lane->mem, dev->size, head, &hdr, sizeof(hdr));
+
+	/* publish header and payload together */
+	head += sizeof(hdr) + copied;
+	smp_store_release(&lane->head, head);
+	ret = copied;
+ out:
+	mutex_unlock(&lane->lock);
+	if (ret > 0) {
+		globalfifo_count_write(dev, ret);
+		globalfifo_data_ready(dev, head - READ_ONCE(lane->tail));
+	}
+	return ret;
+}
+
+/*
+ * Device-wide readiness: any lane readable, or any lane with out_thresh free
+ * bytes and room for a chunk, which globalfifo_mq_lane() will then pick. Not
+ * tied to the polling CPU, since epoll re-checks from wherever it runs.
+ */
+static unsigned int globalfifo_mq_poll(struct file *filp, poll_table *wait)
+{
+	struct globalfifo_dev *dev = container_of(filp->private_data,
+		struct globalfifo_dev, miscdev);
+	unsigned int thresh, i, mask = 0;
+
+	poll_wait(filp, &dev->r_wait, wait);
+	poll_wait(filp, &dev->w_wait, wait);
+
+	if (globalfifo_mq_readable(dev))
+		mask |= POLLIN | POLLRDNORM;
+
+	thresh = max_t(unsigned int, READ_ONCE(dev->out_thresh),
+		       sizeof(struct globalfifo_chunk) + 1);
+	for (i = 0; i < dev->nr_lanes; i++) {
+		if (globalfifo_lane_room(dev, &dev->lanes[i]) >= thresh) {
+			mask |= POLLOUT | POLLWRNORM;
+			break;
+		}
+	}
+
+	return mask;
+}
+
+static void globalfifo_mq_clear(struct globalfifo_dev *dev)
+{
+	struct globalfifo_lane *lane;
+	unsigned int i;
+
+	mutex_lock(&dev->r_mutex);
+	for (i = 0; i < dev->nr_lanes; i++) {
+		lane = &dev->lanes[i];
+		mutex_lock(&lane->lock);
+		WRITE_ONCE(lane->tail, lane->head);
+		lane->rd_off = 0;
+		mutex_unlock(&lane->lock);
+		wake_up_interruptible(&lane->w_wait);
+	}
+	dev->partial = NULL;
+	mutex_unlock(&dev->r_mutex);
+	wake_up_interruptible(&dev->w_wait);
+}
+
+static void globalfifo_mq_free(struct globalfifo_dev *dev)
+{
+	unsigned int i;
+
+	if (!dev->lanes)
+		return;
+	for (i = 0; i < dev->nr_lanes; i++)
+		kvfree(dev->lanes[i].mem);
+	kfree(dev->lanes);
+	dev->lanes = NULL;
+}
+
+static int globalfifo_mq_init(struct globalfifo_dev *dev)
+{
+	struct globalfifo_lane *lane;
+	unsigned int i;
+
+	dev->nr_lanes = nr_cpu_ids;
+	dev->lanes = kcalloc(dev->nr_lanes, sizeof(*dev->lanes), GFP_KERNEL);
+	if (!dev->lanes)
+		return -ENOMEM;
+
+	for (i = 0; i < dev->nr_lanes; i++) {
+		lane = &dev->lanes[i];
+		mutex_init(&lane->lock);
+		init_waitqueue_head(&lane->w_wait);
+		lane->mem = kvzalloc(dev->size, GFP_KERNEL);
+		if (!lane->mem) {
+			globalfifo_mq_free(dev);
+			return -ENOMEM;
+		}
+	}
+	return 0;
+}
+
+static bool globalfifo_empty(struct globalfifo_dev *dev)
+{
+	return dev->lanes ? globalfifo_mq_empty(dev) : globalfifo_len(dev) == 0;
+}
+
+/* switching framing is only allowed while nothing is buffered or mapped */
+static int globalfifo_set_record(struct globalfifo_dev *dev, bool record)
+{
+	unsigned int i;
+	int ret = 0;
+
+	mutex_lock(&dev->r_mutex);
+	mutex_lock(&dev->w_mutex);
+	for (i = 0; i < dev->nr_lanes; i++)
+		mutex_lock(&dev->lanes[i].lock);
+
+	if (!globalfifo_empty(dev) || dev->partial ||
+	    atomic_read(&dev->mmap_count))
+		ret = -EBUSY;
+	else
+		WRITE_ONCE(dev->record, record);
+
+	for (i = 0; i < dev->nr_lanes; i++)
+		mutex_unlock(&dev->lanes[i].lock);
+	mutex_unlock(&dev->w_mutex);
+	mutex_unlock(&dev->r_mutex);
+	return ret;
+}
+
+/*
+ * FIFO_READ_RECORDS: dequeue up to max_recs whole records into buf, packed
+ * back to back, and store their lengths in lens. Blocks (unless
+ * O_NONBLOCK) until rx_lowat is met and at least one record is available,
+ * and stops at the first record that does not fit into what is left of buf.
+ * Each length slot is written before its record is dequeued, so a bad lens
+ * array fails with nothing lost; only a slot unmapped under us in between
+ * can still drop a record.
+ */
+static long globalfifo_read_records(struct file *filp,
+				    struct globalfifo_dev *dev,
+				    struct globalfifo_rec_batch __user *argp)
+{
+	struct globalfifo_rec_batch batch;
+	struct iov_iter iter;
+	u32 __user *lens;
+	u32 nr = 0, bytes = 0;
+	ssize_t ret;
+
+	if (!READ_ONCE(dev->record))
+		return -EINVAL;
+	if (copy_from_user(&batch, argp, sizeof(batch)))
+		return -EFAULT;
+	if (!batch.max_recs)
+		return -EINVAL;
+	lens = u64_to_user_ptr(batch.lens);
+	if (!access_ok(lens, array_size(batch.max_recs, sizeof(*lens))))
+		return -EFAULT;
+	iov_iter_ubuf(&iter, ITER_DEST, u64_to_user_ptr(batch.buf),
+		      batch.buf_len);
+
+	for (;;) {
+		if (!(filp->f_flags & O_NONBLOCK)) {
+			ret = globalfifo_wait_readable(dev);
+			if (ret)
+				return ret;
+		}
+		if (mutex_lock_interruptible(&dev->r_mutex))
+			return -ERESTARTSYS;
+		while (nr < batch.max_recs) {
+			/* fault the slot in before the record is gone */
+			if (put_user(0, lens + nr)) {
+				ret = -EFAULT;
+				break;
+			}
+			ret = dev->lanes ? globalfifo_mq_consume(dev, &iter) :
+					   globalfifo_consume(dev, &iter);
+			if (ret < 0)
+				break;
+			if (put_user(ret, lens + nr)) {
+				ret = -EFAULT;
+				break;
+			}
+			nr++;
+			bytes += ret;
+		}
+		mutex_unlock(&dev->r_mutex);
+
+		if (nr || ret != -EAGAIN || (filp->f_flags & O_NONBLOCK))
+			break;
+	}
+
+	if (!nr) {
+		if (ret == -EAGAIN)
+			this_cpu_inc(dev->stats->r_eagain);
+		return ret;
+	}
+	globalfifo_count_read(dev, bytes);
+	if (!dev->lanes)
+		globalfifo_aio_kick(dev, &dev->w_pending);
+
+	if (put_user(nr, &argp->nr_recs) || put_user(bytes, &argp->bytes))
+		return -EFAULT;
+	return 0;
+}
+
+static void globalfifo_get_lowat(struct globalfifo_dev *dev,
+				 struct globalfifo_lowat *lw)
+{
+	memset(lw, 0, sizeof(*lw));
+	lw->rx_lowat = READ_ONCE(dev->rx_lowat);
+	lw->tx_lowat = READ_ONCE(dev->tx_lowat);
+	lw->coalesce_us = READ_ONCE(dev->coalesce_us);
+}
+
+/* FIFO_SET_LOWAT and the sysfs attributes, see globalfifo_lowat_met() */
+static int globalfifo_set_lowat(struct globalfifo_dev *dev,
+				const struct globalfifo_lowat *lw)
+{
+	unsigned int i;
+	int ret = 0;
+
+	/* size only changes under both mutexes */
+	mutex_lock(&dev->r_mutex);
+	mutex_lock(&dev->w_mutex);
+	if (lw->rx_lowat > dev->size || lw->tx_lowat > dev->size) {
+		ret = -EINVAL;
+	} else {
+		WRITE_ONCE(dev->rx_lowat, max(lw->rx_lowat, 1U));
+		WRITE_ONCE(dev->tx_lowat, lw->tx_lowat);
+		WRITE_ONCE(dev->coalesce_us, lw->coalesce_us);
+		globalfifo_update_thresh(dev);
+	}
+	mutex_unlock(&dev->w_mutex);
+	mutex_unlock(&dev->r_mutex);
+	if (ret)
+		return ret;
+
+	/* lower watermarks may have made either side ready */
+	globalfifo_wake_readers(dev);
+	wake_up_interruptible(&dev->w_wait);
+	for (i = 0; i < dev->nr_lanes; i++)
+		wake_up_interruptible(&dev->lanes[i].w_wait);
+	return 0;
+}
 
 static int globalfifo_fasync(int fd, struct file *filp, int mode)
 {
@@ -42,7 +1158,9 @@ static int globalfifo_fasync(int fd, struct file *filp, int mode)
 
 static int globalfifo_open(struct inode *inode, struct file *filp)
 {
-       return 0;
+	/* read_iter/write_iter honour IOCB_NOWAIT, see globalfifo_lock() */
+	filp->f_mode |= FMODE_NOWAIT;
+	return 0;
 }
 
 static int globalfifo_release(struct inode *inode, struct file *filp)
@@ -56,17 +1174,90 @@ static long globalfifo_ioctl(struct file *filp, unsigned int cmd,
 {
 	struct globalfifo_dev *dev = container_of(filp->private_data,
 		struct globalfifo_dev, miscdev);
+	void __user *argp = (void __user *)arg;
+	struct globalfifo_ring_ctrl *ctrl;
+	struct globalfifo_lowat lw;
+	u32 size, order, record;
 
 	switch (cmd) {
 	case FIFO_CLEAR:
-		mutex_lock(&dev->mutex);
-		dev->current_len = 0;
-		memset(dev->mem, 0, GLOBALFIFO_SIZE);
-		mutex_unlock(&dev->mutex);
+		if (dev->lanes) {
+			globalfifo_mq_clear(dev);
+			printk(KERN_INFO "globalfifo is set to zero\n");
+			break;
+		}
+		mutex_lock(&dev->r_mutex);
+		mutex_lock(&dev->w_mutex);
+		ctrl = globalfifo_ctrl(dev);
+		WRITE_ONCE(ctrl->tail, READ_ONCE(ctrl->head));
+		mutex_unlock(&dev->w_mutex);
+		mutex_unlock(&dev->r_mutex);
+		wake_up_interruptible(&dev->w_wait);
+		globalfifo_aio_kick(dev, &dev->w_pending);
 
 		printk(KERN_INFO "globalfifo is set to zero\n");
 		break;
 
+	case FIFO_GET_SIZE:
+		return put_user(READ_ONCE(dev->size), (u32 __user *)argp);
+
+	case FIFO_RESIZE:
+		if (dev->lanes)
+			return -EOPNOTSUPP;
+		if (get_user(size, (u32 __user *)argp))
+			return -EFAULT;
+		return globalfifo_resize(dev, size);
+
+	case FIFO_RING_NOTIFY:
+		if (dev->lanes)
+			return -EOPNOTSUPP;
+		if (arg & GLOBALFIFO_NOTIFY_READERS) {
+			rcu_read_lock();
+			WRITE_ONCE(rcu_dereference(dev->ctrl)->r_waiting, 0);
+			rcu_read_unlock();
+			wake_up_interruptible(&dev->r_wait);
+			if (dev->async_queue)
+				kill_fasync(&dev->async_queue, SIGIO, POLL_IN);
+			globalfifo_aio_kick(dev, &dev->r_pending);
+		}
+		if (arg & GLOBALFIFO_NOTIFY_WRITERS) {
+			rcu_read_lock();
+			WRITE_ONCE(rcu_dereference(dev->ctrl)->w_waiting, 0);
+			rcu_read_unlock();
+			wake_up_interruptible(&dev->w_wait);
+			globalfifo_aio_kick(dev, &dev->w_pending);
+		}
+		break;
+
+	case FIFO_SET_ORDER:
+		if (get_user(order, (u32 __user *)argp))
+			return -EFAULT;
+		if (!dev->lanes || order > GLOBALFIFO_ORDER_TS)
+			return -EINVAL;
+		mutex_lock(&dev->r_mutex);
+		dev->order = order;
+		mutex_unlock(&dev->r_mutex);
+		break;
+
+	case FIFO_SET_RECORD:
+		if (get_user(record, (u32 __user *)argp))
+			return -EFAULT;
+		return globalfifo_set_record(dev, record != 0);
+
+	case FIFO_READ_RECORDS:
+		return globalfifo_read_records(filp, dev, argp);
+
+	case FIFO_GET_LOWAT:
+		globalfifo_get_lowat(dev, &lw);
+		if (copy_to_user(argp, &lw, sizeof(lw)))
+			return -EFAULT;
+		break;
+
+	case FIFO_SET_LOWAT:
+		if (copy_from_user(&lw, argp, sizeof(lw)))
+			return -EFAULT;
+		return globalfifo_set_lowat(dev, &lw);
+
 	default:
 		return -EINVAL;
 	}
@@ -76,173 +1267,727 @@ static long globalfifo_ioctl(struct file *filp, unsigned int cmd,
 static unsigned int globalfifo_poll(struct file *filp, poll_table * wait)
 {
 	unsigned int mask = 0;
+	unsigned int len;
 	struct globalfifo_dev *dev = container_of(filp->private_data,
 		struct globalfifo_dev, miscdev);
 
-	mutex_lock(&dev->mutex);
+	if (dev->lanes)
+		return globalfifo_mq_poll(filp, wait);
 
 	poll_wait(filp, &dev->r_wait, wait);
 	poll_wait(filp, &dev->w_wait, wait);
 
-	if (dev->current_len != 0) {
+	/*
+	 * Before reporting "not ready", ask an mmap producer/consumer to
+	 * notify us, see struct globalfifo_ring_ctrl.
+	 */
+	len = globalfifo_len(dev);
+	if (!globalfifo_lowat_met(dev, len)) {
+		globalfifo_want_notify(dev, false);
+		len = globalfifo_len(dev);
+	}
+	if (READ_ONCE(dev->size) - len < READ_ONCE(dev->out_thresh)) {
+		globalfifo_want_notify(dev, true);
+		len = globalfifo_len(dev);
+	}
+
+	if (globalfifo_lowat_met(dev, len)) {
 		mask |= POLLIN | POLLRDNORM;
 	}
 
-	if (dev->current_len != GLOBALFIFO_SIZE) {
+	if (READ_ONCE(dev->size) - len >= READ_ONCE(dev->out_thresh)) {
 		mask |= POLLOUT | POLLWRNORM;
 	}
 
-	mutex_unlock(&dev->mutex);
 	return mask;
 }
 
-static ssize_t globalfifo_read(struct file *filp, char __user *buf,
-			       size_t count, loff_t *ppos)
+/*
+ * Asynchronous AIO/io_uring requests that find the FIFO empty (or full) are
+ * not completed synchronously inside io_submit(). They are parked on
+ * r_pending/w_pending and -EIOCBQUEUED is returned. Whenever the other
+ * side makes progress, aio_work completes them in FIFO order through
+ * ->ki_complete(). The worker runs in a kthread, so it borrows the
+ * submitter's mm to copy to/from the user buffers. A synchronous reader
+ * or writer may overtake parked requests.
+ */
+struct globalfifo_aio {
+	struct list_head list;
+	struct kiocb *iocb;
+	struct iov_iter iter;
+	const void *iov;	/* dup_iter() copy, NULL for ITER_UBUF */
+	struct mm_struct *mm;
+	bool cancelled;
+};
+
+static void globalfifo_aio_complete(struct globalfifo_aio *req, long res)
+{
+	struct kiocb *iocb = req->iocb;
+
+	kfree(req->iov);
+	mmdrop(req->mm);
+	kfree(req);
+	iocb->ki_complete(iocb, res);
+}
+
+#ifdef IOCB_AIO_RW
+/* io_cancel() holds the aio context lock, so only flag it for aio_work */
+static int globalfifo_aio_cancel(struct kiocb *iocb)
 {
-	int ret;
-	struct globalfifo_dev *dev = container_of(filp->private_data,
+	struct globalfifo_dev *dev = container_of(iocb->ki_filp->private_data,
 		struct globalfifo_dev, miscdev);
+	struct globalfifo_aio *req;
+	unsigned long flags;
 
-	DECLARE_WAITQUEUE(wait, current);
+	spin_lock_irqsave(&dev->aio_lock, flags);
+	list_for_each_entry(req, &dev->r_pending, list)
+		if (req->iocb == iocb)
+			req->cancelled = true;
+	list_for_each_entry(req, &dev->w_pending, list)
+		if (req->iocb == iocb)
+			req->cancelled = true;
+	spin_unlock_irqrestore(&dev->aio_lock, flags);
 
-	mutex_lock(&dev->mutex);
-	add_wait_queue(&dev->r_wait, &wait);
+	queue_work(system_wq, &dev->aio_work);
+	return 0;
+}
+#endif
 
-	while (dev->current_len == 0) {
-		if (filp->f_flags & O_NONBLOCK) {
-			ret = -EAGAIN;
-			goto out;
-		}
-		__set_current_state(TASK_INTERRUPTIBLE);
-		mutex_unlock(&dev->mutex);
+static int globalfifo_aio_queue(struct globalfifo_dev *dev,
+				struct kiocb *iocb, struct iov_iter *iter,
+				struct list_head *pending)
+{
+	struct globalfifo_aio *req;
+
+	req = kzalloc(sizeof(*req), GFP_KERNEL);
+	if (!req)
+		return -ENOMEM;
+
+	/* the iovec array the iter points at lives in the submitter's frame */
+	req->iov = dup_iter(&req->iter, iter, GFP_KERNEL);
+	if (!req->iov && iter_is_iovec(iter)) {
+		kfree(req);
+		return -ENOMEM;
+	}
+	req->iocb = iocb;
+	req->mm = current->mm;
+	mmgrab(req->mm);
+
+#ifdef IOCB_AIO_RW
+	/* only safe since it ignores non-aio (io_uring) kiocbs itself */
+	kiocb_set_cancel_fn(iocb, globalfifo_aio_cancel);
+#endif
+
+	spin_lock_irq(&dev->aio_lock);
+	list_add_tail(&req->list, pending);
+	spin_unlock_irq(&dev->aio_lock);
+
+	/*
+	 * The other side may have made progress after we found the FIFO
+	 * empty/full but before the request was visible on the list, so
+	 * always let the worker take a look.
+	 */
+	queue_work(system_wq, &dev->aio_work);
+	return -EIOCBQUEUED;
+}
+
+static ssize_t globalfifo_aio_transfer(struct globalfifo_dev *dev,
+				       struct globalfifo_aio *req, bool read)
+{
+	ssize_t ret;
+
+	if (!mmget_not_zero(req->mm))
+		return -EFAULT;
+	kthread_use_mm(req->mm);
+	ret = read ? globalfifo_consume(dev, &req->iter) :
+		     globalfifo_produce(dev, &req->iter);
+	kthread_unuse_mm(req->mm);
+	mmput(req->mm);
+	return ret;
+}
+
+/* complete parked requests of one side in order, returns true on progress */
+static bool globalfifo_aio_serve(struct globalfifo_dev *dev,
+				 struct list_head *pending,
+				 struct mutex *lock, bool read)
+{
+	struct globalfifo_aio *req, *tmp;
+	bool progress = false, cancelled;
+	LIST_HEAD(reap);
+	ssize_t ret;
 
-		schedule();
-		if (signal_pending(current)) {
-			ret = -ERESTARTSYS;
-			goto out2;
+	/*
+	 * Reap cancelled requests wherever they sit: one parked behind a
+	 * head that keeps getting -EAGAIN would otherwise never complete.
+	 */
+	spin_lock_irq(&dev->aio_lock);
+	list_for_each_entry_safe(req, tmp, pending, list)
+		if (req->cancelled)
+			list_move_tail(&req->list, &reap);
+	spin_unlock_irq(&dev->aio_lock);
+	list_for_each_entry_safe(req, tmp, &reap, list)
+		globalfifo_aio_complete(req, -ECANCELED);
+
+	mutex_lock(lock);
+	for (;;) {
+		spin_lock_irq(&dev->aio_lock);
+		req = list_first_entry_or_null(pending, struct globalfifo_aio,
+					       list);
+		cancelled = req && req->cancelled;
+		if (cancelled)
+			list_del(&req->list);
+		spin_unlock_irq(&dev->aio_lock);
+		if (!req)
+			break;
+		if (cancelled) {
+			globalfifo_aio_complete(req, -ECANCELED);
+			continue;
 		}
 
-		mutex_lock(&dev->mutex);
+		ret = globalfifo_aio_transfer(dev, req, read);
+		if (ret == -EAGAIN)
+			break;
+
+		spin_lock_irq(&dev->aio_lock);
+		list_del(&req->list);
+		spin_unlock_irq(&dev->aio_lock);
+		globalfifo_aio_complete(req, ret);
+		if (ret > 0 && read)
+			globalfifo_count_read(dev, ret);
+		else if (ret > 0)
+			globalfifo_count_write(dev, ret);
+		progress = true;
 	}
+	mutex_unlock(lock);
 
-	if (count > dev->current_len)
-		count = dev->current_len;
+	if (progress && !read)
+		globalfifo_data_ready(dev, globalfifo_len(dev));
+	return progress;
+}
 
-	if (copy_to_user(buf, dev->mem, count)) {
-		ret = -EFAULT;
+static void globalfifo_aio_work(struct work_struct *work)
+{
+	struct globalfifo_dev *dev = container_of(work, struct globalfifo_dev,
+						  aio_work);
+	bool progress;
+
+	/* completing reads frees space for parked writes and vice versa */
+	do {
+		progress = globalfifo_aio_serve(dev, &dev->r_pending,
+						&dev->r_mutex, true);
+		progress |= globalfifo_aio_serve(dev, &dev->w_pending,
+						 &dev->w_mutex, false);
+	} while (progress);
+}
+
+/* fail everything still parked, the device is going away */
+static void globalfifo_aio_flush(struct globalfifo_dev *dev)
+{
+	struct globalfifo_aio *req, *tmp;
+	LIST_HEAD(list);
+
+	cancel_work_sync(&dev->aio_work);
+	spin_lock_irq(&dev->aio_lock);
+	list_splice_init(&dev->r_pending, &list);
+	list_splice_init(&dev->w_pending, &list);
+	spin_unlock_irq(&dev->aio_lock);
+
+	list_for_each_entry_safe(req, tmp, &list, list)
+		globalfifo_aio_complete(req, -ENODEV);
+}
+
+/* asynchronous kiocb whose user buffers the worker can reach later */
+static inline bool globalfifo_can_queue(struct kiocb *iocb,
+					struct iov_iter *iter)
+{
+	return !is_sync_kiocb(iocb) && user_backed_iter(iter) &&
+	       !globalfifo_nowait(iocb);
+}
+
+/*
+ * read_iter/write_iter instead of read/write: readv()/writev(), io_uring
+ * and AIO hand over the whole iovec in one call, so the mutex is taken and
+ * the other side woken once per batch rather than once per segment.
+ */
+static ssize_t globalfifo_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	ssize_t ret;
+	struct globalfifo_dev *dev = container_of(iocb->ki_filp->private_data,
+		struct globalfifo_dev, miscdev);
+
+	if (dev->lanes)
+		return globalfifo_mq_read_iter(iocb, to);
+
+	/* blocking readers wait for rx_lowat, non-blocking take what is there */
+	if (!globalfifo_nowait(iocb) && !globalfifo_can_queue(iocb, to)) {
+		ret = globalfifo_wait_readable(dev);
+		if (ret)
+			return ret;
+	}
+
+	ret = globalfifo_lock(iocb, &dev->r_mutex);
+	if (ret)
+		return ret;
+
+	if (globalfifo_can_queue(iocb, to)) {
+		/* keep parked requests in order */
+		ret = list_empty_careful(&dev->r_pending) ?
+		      globalfifo_consume(dev, to) : -EAGAIN;
+		if (ret == -EAGAIN) {
+			globalfifo_want_notify(dev, false);
+			ret = globalfifo_aio_queue(dev, iocb, to,
+						   &dev->r_pending);
+		}
 		goto out;
-	} else {
-		memcpy(dev->mem, dev->mem + count, dev->current_len - count);
-		dev->current_len -= count;
-		printk(KERN_INFO "read %d bytes(s),current_len:%d\n", count,
-		       dev->current_len);
+	}
 
-		wake_up_interruptible(&dev->w_wait);
+	while ((ret = globalfifo_consume(dev, to)) == -EAGAIN) {
+		mutex_unlock(&dev->r_mutex);
+
+		if (globalfifo_nowait(iocb)) {
+			this_cpu_inc(dev->stats->r_eagain);
+			return -EAGAIN;
+		}
+
+		ret = globalfifo_wait_readable(dev);
+		if (ret)
+			return ret;
 
-		ret = count;
+		if (mutex_lock_interruptible(&dev->r_mutex))
+			return -ERESTARTSYS;
 	}
  out:
-	mutex_unlock(&dev->mutex);
- out2:
-	remove_wait_queue(&dev->w_wait, &wait);
-	set_current_state(TASK_RUNNING);
+	mutex_unlock(&dev->r_mutex);
+	if (ret > 0) {
+		globalfifo_count_read(dev, ret);
+		globalfifo_aio_kick(dev, &dev->w_pending);
+	}
 	return ret;
 }
 
-static ssize_t globalfifo_write(struct file *filp, const char __user *buf,
-				size_t count, loff_t *ppos)
+static ssize_t globalfifo_write_iter(struct kiocb *iocb, struct iov_iter *from)
 {
-	struct globalfifo_dev *dev = container_of(filp->private_data,
+	struct globalfifo_dev *dev = container_of(iocb->ki_filp->private_data,
 		struct globalfifo_dev, miscdev);
 
-	int ret;
-	DECLARE_WAITQUEUE(wait, current);
+	ssize_t ret;
+	u64 t;
+
+	if (dev->lanes)
+		return globalfifo_mq_write_iter(iocb, from);
 
-	mutex_lock(&dev->mutex);
-	add_wait_queue(&dev->w_wait, &wait);
+	ret = globalfifo_lock(iocb, &dev->w_mutex);
+	if (ret)
+		return ret;
 
-	while (dev->current_len == GLOBALFIFO_SIZE) {
-		if (filp->f_flags & O_NONBLOCK) {
-			ret = -EAGAIN;
-			goto out;
+	if (globalfifo_can_queue(iocb, from)) {
+		ret = list_empty_careful(&dev->w_pending) ?
+		      globalfifo_produce(dev, from) : -EAGAIN;
+		if (ret == -EAGAIN) {
+			globalfifo_want_notify(dev, true);
+			ret = globalfifo_aio_queue(dev, iocb, from,
+						   &dev->w_pending);
 		}
-		__set_current_state(TASK_INTERRUPTIBLE);
+		goto out;
+	}
 
-		mutex_unlock(&dev->mutex);
+	while ((ret = globalfifo_produce(dev, from)) == -EAGAIN) {
+		mutex_unlock(&dev->w_mutex);
 
-		schedule();
-		if (signal_pending(current)) {
-			ret = -ERESTARTSYS;
-			goto out2;
+		/* don't let the reader wait for a watermark we cannot reach */
+		globalfifo_rx_flush(dev);
+		if (globalfifo_nowait(iocb)) {
+			this_cpu_inc(dev->stats->w_eagain);
+			return -EAGAIN;
 		}
 
-		mutex_lock(&dev->mutex);
+		this_cpu_inc(dev->stats->w_sleeps);
+		globalfifo_want_notify(dev, true);
+		t = ktime_get_ns();
+		ret = wait_event_interruptible(dev->w_wait,
+				globalfifo_writable(dev, iov_iter_count(from)));
+		globalfifo_count_lat(dev->stats->w_lat, t);
+		if (ret)
+			return -ERESTARTSYS;
+
+		if (mutex_lock_interruptible(&dev->w_mutex))
+			return -ERESTARTSYS;
+	}
+ out:
+	mutex_unlock(&dev->w_mutex);
+	if (ret > 0) {
+		globalfifo_count_write(dev, ret);
+		globalfifo_data_ready(dev, globalfifo_len(dev));
+		globalfifo_aio_kick(dev, &dev->r_pending);
 	}
+	return ret;
+}
 
-	if (count > GLOBALFIFO_SIZE - dev->current_len)
-		count = GLOBALFIFO_SIZE - dev->current_len;
+static void globalfifo_vma_open(struct vm_area_struct *vma)
+{
+	struct globalfifo_dev *dev = vma->vm_private_data;
 
-	if (copy_from_user(dev->mem + dev->current_len, buf, count)) {
-		ret = -EFAULT;
-		goto out;
-	} else {
-		dev->current_len += count;
-		printk(KERN_INFO "written %d bytes(s),current_len:%d\n", count,
-		       dev->current_len);
+	atomic_inc(&dev->mmap_count);
+}
 
-		wake_up_interruptible(&dev->r_wait);
+static void globalfifo_vma_close(struct vm_area_struct *vma)
+{
+	struct globalfifo_dev *dev = vma->vm_private_data;
 
-		if (dev->async_queue) {
-			kill_fasync(&dev->async_queue, SIGIO, POLL_IN);
-			printk(KERN_DEBUG "%s kill SIGIO\n", __func__);
-		}
+	atomic_dec(&dev->mmap_count);
+}
 
-		ret = count;
+static const struct vm_operations_struct globalfifo_vm_ops = {
+	.open = globalfifo_vma_open,
+	.close = globalfifo_vma_close,
+};
+
+/* map the control page and the data area, see struct globalfifo_ring_ctrl */
+static int globalfifo_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	struct globalfifo_dev *dev = container_of(filp->private_data,
+		struct globalfifo_dev, miscdev);
+	int ret;
+
+	/* the lanes of multi-queue mode have no shared layout */
+	if (dev->lanes)
+		return -ENODEV;
+	if (vma->vm_pgoff)
+		return -EINVAL;
+
+	mutex_lock(&dev->r_mutex);
+	mutex_lock(&dev->w_mutex);
+	/* nor have records, see globalfifo_set_record() */
+	if (dev->record)
+		ret = -ENODEV;
+	else
+		ret = remap_vmalloc_range(vma, globalfifo_ctrl(dev), 0);
+	if (!ret) {
+		vma->vm_ops = &globalfifo_vm_ops;
+		vma->vm_private_data = dev;
+		atomic_inc(&dev->mmap_count);
 	}
+	mutex_unlock(&dev->w_mutex);
+	mutex_unlock(&dev->r_mutex);
 
- out:
-	mutex_unlock(&dev->mutex);
- out2:
-	remove_wait_queue(&dev->w_wait, &wait);
-	set_current_state(TASK_RUNNING);
 	return ret;
 }
 
 static const struct file_operations globalfifo_fops = {
 	.owner = THIS_MODULE,
-	.read = globalfifo_read,
-	.write = globalfifo_write,
+	.read_iter = globalfifo_read_iter,
+	.write_iter = globalfifo_write_iter,
+	/*
+	 * splice()/sendfile() between the FIFO and a pipe, socket or file
+	 * run the same read_iter/write_iter on kernel pages, so no user
+	 * buffer is involved.
+	 */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 5, 0)
+	.splice_read = copy_splice_read,
+#else
+	.splice_read = generic_file_splice_read,
+#endif
+	.splice_write = iter_file_splice_write,
 	.unlocked_ioctl = globalfifo_ioctl,
 	.poll = globalfifo_poll,
+	.mmap = globalfifo_mmap,
 	.fasync = globalfifo_fasync,
 	.open = globalfifo_open,
 	.release = globalfifo_release,
 };
 
+/* sum of one u64 field of struct globalfifo_stats over all CPUs */
+static u64 globalfifo_stat_sum(struct globalfifo_dev *dev, size_t off)
+{
+	u64 sum = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		sum += *(u64 *)((void *)per_cpu_ptr(dev->stats, cpu) + off);
+	return sum;
+}
+
+#define globalfifo_stat(dev, field) \
+	globalfifo_stat_sum(dev, offsetof(struct globalfifo_stats, field))
+
+static u64 globalfifo_max_fill(struct globalfifo_dev *dev)
+{
+	u64 fill = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		fill = max(fill, per_cpu_ptr(dev->stats, cpu)->max_fill);
+	return fill;
+}
+
+static struct globalfifo_dev *globalfifo_from_dev(struct device *d)
+{
+	struct miscdevice *misc = dev_get_drvdata(d);
+
+	return container_of(misc, struct globalfifo_dev, miscdev);
+}
+
+/* rx_lowat, tx_lowat and coalesce_us under /sys/class/misc/globalfifoN/ */
+#define GLOBALFIFO_LOWAT_ATTR(field)					\
+static ssize_t field##_show(struct device *d,				\
+			    struct device_attribute *attr, char *buf)	\
+{									\
+	struct globalfifo_lowat lw;					\
+									\
+	globalfifo_get_lowat(globalfifo_from_dev(d), &lw);		\
+	return sprintf(buf, "%u\n", lw.field);				\
+}									\
+									\
+static ssize_t field##_store(struct device *d,				\
+			     struct device_attribute *attr,		\
+			     const char *buf, size_t count)		\
+{									\
+	struct globalfifo_dev *dev = globalfifo_from_dev(d);		\
+	struct globalfifo_lowat lw;					\
+	int ret;							\
+									\
+	globalfifo_get_lowat(dev, &lw);					\
+	ret = kstrtou32(buf, 0, &lw.field);				\
+	if (!ret)							\
+		ret = globalfifo_set_lowat(dev, &lw);			\
+	return ret ? ret : count;					\
+}									\
+static DEVICE_ATTR_RW(field)
+
+GLOBALFIFO_LOWAT_ATTR(rx_lowat);
+GLOBALFIFO_LOWAT_ATTR(tx_lowat);
+GLOBALFIFO_LOWAT_ATTR(coalesce_us);
+
+static struct attribute *globalfifo_attrs[] = {
+	&dev_attr_rx_lowat.attr,
+	&dev_attr_tx_lowat.attr,
+	&dev_attr_coalesce_us.attr,
+	NULL,
+};
+
+static const struct attribute_group globalfifo_group = {
+	.attrs = globalfifo_attrs,
+};
+
+/* the stats/ subdirectory, a subset of the debugfs stats file */
+#define GLOBALFIFO_STAT_ATTR(name)					\
+static ssize_t name##_show(struct device *d,				\
+			   struct device_attribute *attr, char *buf)	\
+{									\
+	return sprintf(buf, "%llu\n",					\
+		       globalfifo_stat(globalfifo_from_dev(d), name));	\
+}									\
+static DEVICE_ATTR_RO(name)
+
+GLOBALFIFO_STAT_ATTR(r_sleeps);
+GLOBALFIFO_STAT_ATTR(w_sleeps);
+GLOBALFIFO_STAT_ATTR(r_wakeups);
+GLOBALFIFO_STAT_ATTR(coalesce_fires);
+
+static struct attribute *globalfifo_stats_attrs[] = {
+	&dev_attr_r_sleeps.attr,
+	&dev_attr_w_sleeps.attr,
+	&dev_attr_r_wakeups.attr,
+	&dev_attr_coalesce_fires.attr,
+	NULL,
+};
+
+static const struct attribute_group globalfifo_stats_group = {
+	.name = "stats",
+	.attrs = globalfifo_stats_attrs,
+};
+
+static const struct attribute_group *globalfifo_groups[] = {
+	&globalfifo_group,
+	&globalfifo_stats_group,
+	NULL,
+};
+
+/*
+ * debugfs, one directory per instance named like the device node:
+ *   stats          the counters of struct globalfifo_stats and the fill
+ *   read_latency   log2 histogram of the time blocked readers slept
+ *   write_latency  the same for writers
+ *   reset          write anything to zero all of it
+ */
+#define GLOBALFIFO_COUNTER(field) \
+	{ #field, offsetof(struct globalfifo_stats, field) }
+
+static const struct {
+	const char *name;
+	size_t off;
+} globalfifo_counters[] = {
+	GLOBALFIFO_COUNTER(bytes_in),
+	GLOBALFIFO_COUNTER(bytes_out),
+	GLOBALFIFO_COUNTER(writes),
+	GLOBALFIFO_COUNTER(reads),
+	GLOBALFIFO_COUNTER(w_eagain),
+	GLOBALFIFO_COUNTER(r_eagain),
+	GLOBALFIFO_COUNTER(w_sleeps),
+	GLOBALFIFO_COUNTER(r_sleeps),
+	GLOBALFIFO_COUNTER(r_wakeups),
+	GLOBALFIFO_COUNTER(coalesce_fires),
+};
+
+static int globalfifo_stats_show(struct seq_file *m, void *v)
+{
+	struct globalfifo_dev *dev = m->private;
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(globalfifo_counters); i++)
+		seq_printf(m, "%-16s %llu\n", globalfifo_counters[i].name,
+			   globalfifo_stat_sum(dev, globalfifo_counters[i].off));
+	seq_printf(m, "%-16s %llu\n", "max_fill", globalfifo_max_fill(dev));
+	if (!dev->lanes)
+		seq_printf(m, "%-16s %u\n", "fill", globalfifo_len(dev));
+	seq_printf(m, "%-16s %u\n", "size", READ_ONCE(dev->size));
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(globalfifo_stats);
+
+static void globalfifo_hist_show(struct seq_file *m, size_t off)
+{
+	struct globalfifo_dev *dev = m->private;
+	u64 count[GLOBALFIFO_LAT_BUCKETS];
+	int i, last = -1;
+
+	for (i = 0; i < GLOBALFIFO_LAT_BUCKETS; i++) {
+		count[i] = globalfifo_stat_sum(dev, off + i * sizeof(u64));
+		if (count[i])
+			last = i;
+	}
+
+	seq_printf(m, "%24s : count\n", "ns");
+	for (i = 0; i <= last; i++) {
+		if (i == GLOBALFIFO_LAT_BUCKETS - 1)
+			seq_printf(m, "%10llu -> %-11s : %llu\n", 1ULL << i,
+				   "", count[i]);
+		else
+			seq_printf(m, "%10llu -> %-11llu : %llu\n",
+				   i ? 1ULL << i : 0, (2ULL << i) - 1,
+				   count[i]);
+	}
+}
+
+static int globalfifo_read_latency_show(struct seq_file *m, void *v)
+{
+	globalfifo_hist_show(m, offsetof(struct globalfifo_stats, r_lat));
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(globalfifo_read_latency);
+
+static int globalfifo_write_latency_show(struct seq_file *m, void *v)
+{
+	globalfifo_hist_show(m, offsetof(struct globalfifo_stats, w_lat));
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(globalfifo_write_latency);
+
+/* not atomic against concurrent I/O, a counter may keep a few events */
+static ssize_t globalfifo_reset_write(struct file *filp,
+				      const char __user *buf, size_t count,
+				      loff_t *ppos)
+{
+	struct globalfifo_dev *dev = filp->private_data;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		memset(per_cpu_ptr(dev->stats, cpu), 0,
+		       sizeof(struct globalfifo_stats));
+	return count;
+}
+
+static const struct file_operations globalfifo_reset_fops = {
+	.owner = THIS_MODULE,
+	.open = simple_open,
+	.write = globalfifo_reset_write,
+	.llseek = noop_llseek,
+};
+
+static void globalfifo_debugfs_init(struct globalfifo_dev *dev)
+{
+	dev->debugfs = debugfs_create_dir(dev->miscdev.name, NULL);
+	debugfs_create_file("stats", 0444, dev->debugfs, dev,
+			    &globalfifo_stats_fops);
+	debugfs_create_file("read_latency", 0444, dev->debugfs, dev,
+			    &globalfifo_read_latency_fops);
+	debugfs_create_file("write_latency", 0444, dev->debugfs, dev,
+			    &globalfifo_write_latency_fops);
+	debugfs_create_file("reset", 0200, dev->debugfs, dev,
+			    &globalfifo_reset_fops);
+}
+
 static int globalfifo_probe(struct platform_device *pdev)
 {
+	struct globalfifo_platform_data *pdata = dev_get_platdata(&pdev->dev);
 	struct globalfifo_dev *gl;
+	struct globalfifo_ring_ctrl *ctrl;
+	u32 size = fifo_size;
+	bool mq = multi_queue;
 	int ret;
 
 	gl = devm_kzalloc(&pdev->dev, sizeof(*gl), GFP_KERNEL);
 	if (!gl)
 		return -ENOMEM;
 	gl->miscdev.minor = MISC_DYNAMIC_MINOR;
-	gl->miscdev.name = "globalfifo";
+	if (pdev->id == PLATFORM_DEVID_NONE)
+		gl->miscdev.name = "globalfifo";
+	else
+		gl->miscdev.name = devm_kasprintf(&pdev->dev, GFP_KERNEL,
+						  "globalfifo%d", pdev->id);
+	if (!gl->miscdev.name)
+		return -ENOMEM;
 	gl->miscdev.fops = &globalfifo_fops;
+	gl->miscdev.groups = globalfifo_groups;
+
+	gl->stats = devm_alloc_percpu(&pdev->dev, struct globalfifo_stats);
+	if (!gl->stats)
+		return -ENOMEM;
+
+	/* the device property wins over platform_data over the module param */
+	if (pdata && pdata->fifo_size)
+		size = pdata->fifo_size;
+	device_property_read_u32(&pdev->dev, "fifo-size", &size);
+	if ((pdata && pdata->multi_queue) ||
+	    device_property_read_bool(&pdev->dev, "multi-queue"))
+		mq = true;
 
-	mutex_init(&gl->mutex);
+	ctrl = globalfifo_alloc_ring(globalfifo_norm_size(size));
+	if (!ctrl)
+		return -ENOMEM;
+	gl->rx_lowat = 1;
+	globalfifo_set_ring(gl, ctrl);
+	atomic_set(&gl->mmap_count, 0);
+
+	mutex_init(&gl->r_mutex);
+	mutex_init(&gl->w_mutex);
 	init_waitqueue_head(&gl->r_wait);
 	init_waitqueue_head(&gl->w_wait);
+	spin_lock_init(&gl->aio_lock);
+	INIT_LIST_HEAD(&gl->r_pending);
+	INIT_LIST_HEAD(&gl->w_pending);
+	INIT_WORK(&gl->aio_work, globalfifo_aio_work);
+	hrtimer_init(&gl->rx_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	gl->rx_timer.function = globalfifo_rx_timer;
 	platform_set_drvdata(pdev, gl);
 
+	if (mq) {
+		ret = globalfifo_mq_init(gl);
+		if (ret < 0)
+			goto err;
+	}
+
 	ret = misc_register(&gl->miscdev);
 	if (ret < 0)
 		goto err;
+	globalfifo_debugfs_init(gl);
 
-	dev_info(&pdev->dev, "globalfifo drv probed\n");
+	dev_info(&pdev->dev, "globalfifo drv probed, %u bytes%s\n", gl->size,
+		 gl->lanes ? " per CPU lane" : "");
 	return 0;
 err:
+	globalfifo_mq_free(gl);
+	vfree(rcu_dereference_protected(gl->ctrl, 1));
 	return ret;
 }
 
@@ -251,6 +1996,11 @@ static int globalfifo_remove(struct platform_device *pdev)
 	struct globalfifo_dev *gl = platform_get_drvdata(pdev);
 
 	misc_deregister(&gl->miscdev);
+	debugfs_remove_recursive(gl->debugfs);
+	globalfifo_aio_flush(gl);
+	hrtimer_cancel(&gl->rx_timer);
+	globalfifo_mq_free(gl);
+	vfree(rcu_dereference_protected(gl->ctrl, 1));
 
 	dev_info(&pdev->dev, "globalfifo drv removed\n");
 	return 0;
@@ -0,0 +1,109 @@
+/*
+ * globalfifo interface shared by the driver and its userspace tools
+ *
+ * Licensed under GPLv2 or later.
+ */
+
+#ifndef _GLOBALFIFO_H
+#define _GLOBALFIFO_H
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+#define FIFO_CLEAR 0x1
+
+#define GLOBALFIFO_IOC_MAGIC	'g'
+
+/* current capacity in bytes */
+#define FIFO_GET_SIZE	_IOR(GLOBALFIFO_IOC_MAGIC, 1, __u32)
+/* change the capacity, only allowed while the FIFO is empty and unmapped */
+#define FIFO_RESIZE	_IOW(GLOBALFIFO_IOC_MAGIC, 2, __u32)
+/* wake sleepers after producing/consuming through the mmap'ed ring */
+#define FIFO_RING_NOTIFY	_IO(GLOBALFIFO_IOC_MAGIC, 3)
+
+#define GLOBALFIFO_NOTIFY_READERS	0x1	/* data was produced */
+#define GLOBALFIFO_NOTIFY_WRITERS	0x2	/* space was consumed */
+
+/* multi-queue mode only: the order in which read() drains the CPU lanes */
+#define FIFO_SET_ORDER	_IOW(GLOBALFIFO_IOC_MAGIC, 4, __u32)
+
+#define GLOBALFIFO_ORDER_RR	0	/* one write() per lane in turn */
+#define GLOBALFIFO_ORDER_TS	1	/* oldest write() first */
+
+/*
+ * Record mode, switched with FIFO_SET_RECORD (0/1) while the FIFO is empty
+ * and unmapped: every write() is one record and read() returns exactly
+ * one whole record, or -EMSGSIZE if it does not fit into the buffer.
+ * FIFO_READ_RECORDS dequeues up to max_recs records in one call.
+ */
+struct globalfifo_rec_batch {
+	__u64 buf;		/* payloads, packed back to back */
+	__u64 lens;		/* __u32[max_recs], length of each record */
+	__u32 buf_len;
+	__u32 max_recs;
+	__u32 nr_recs;		/* out: records dequeued */
+	__u32 bytes;		/* out: payload bytes in buf */
+};
+
+#define FIFO_SET_RECORD		_IOW(GLOBALFIFO_IOC_MAGIC, 5, __u32)
+#define FIFO_READ_RECORDS	_IOWR(GLOBALFIFO_IOC_MAGIC, 6, \
+				      struct globalfifo_rec_batch)
+
+/*
+ * Wakeup coalescing, also in sysfs. Readers are woken and POLLIN raised
+ * once rx_lowat bytes are queued (0 means 1), or coalesce_us after the
+ * first byte below it if coalesce_us is not 0. POLLOUT is raised once
+ * tx_lowat bytes are free (0: a quarter of the FIFO); in multi-queue mode
+ * in any one lane, and the next write() goes to such a lane. Neither may
+ * exceed the FIFO size.
+ */
+struct globalfifo_lowat {
+	__u32 rx_lowat;
+	__u32 tx_lowat;
+	__u32 coalesce_us;
+	__u32 pad;
+};
+
+#define FIFO_GET_LOWAT	_IOR(GLOBALFIFO_IOC_MAGIC, 7, struct globalfifo_lowat)
+#define FIFO_SET_LOWAT	_IOW(GLOBALFIFO_IOC_MAGIC, 8, struct globalfifo_lowat)
+
+/*
+ * mmap() layout: offset 0 is one control page, the data area of
+ * ctrl->size bytes follows at ctrl->data_offset. head is written by the
+ * producer only and tail by the consumer only; both run freely and are
+ * masked with size - 1. Publish with a release store and read the other
+ * side's index with an acquire load.
+ *
+ * A consumer about to sleep in poll() sets r_waiting, issues a full
+ * barrier and re-checks the ring; a producer publishes head, issues a full
+ * barrier and only calls FIFO_RING_NOTIFY if r_waiting is set, which
+ * clears it again. w_waiting works the same way in the other direction.
+ * The driver sets the flags itself when read()/write()/poll() go to sleep,
+ * and its own read()/write() paths always wake sleepers.
+ */
+struct globalfifo_ring_ctrl {
+	__u32 head;
+	__u32 r_waiting;
+	__u32 pad0[14];
+	__u32 tail;
+	__u32 w_waiting;
+	__u32 pad1[14];
+	__u32 size;		/* read only */
+	__u32 data_offset;	/* read only */
+};
+
+#ifdef __KERNEL__
+/*
+ * platform_data of the "globalfifo" platform device. fifo_size is rounded
+ * up to a power of two of at least PAGE_SIZE; 0 keeps the module default.
+ * A "fifo-size" device property (e.g. from the device tree) overrides it.
+ * multi_queue (or a "multi-queue" property) gives every CPU its own lane
+ * of fifo_size bytes; mmap() and FIFO_RESIZE are not available then.
+ */
+struct globalfifo_platform_data {
+	unsigned int fifo_size;
+	bool multi_queue;
+};
+#endif
+
+#endif /* _GLOBALFIFO_H */
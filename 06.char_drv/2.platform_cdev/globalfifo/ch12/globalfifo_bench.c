@@ -0,0 +1,424 @@
+/*
+ * globalfifo throughput benchmark
+ *
+ * device mode: one writer and one reader thread move msg_size chunks
+ * through the device for the given time and report bytes/s and msgs/s.
+ * -f resizes the FIFO first (ch12 driver only).
+ * -r N switches the FIFO to record mode and lets the reader dequeue up to
+ * N messages per FIFO_READ_RECORDS call (N = 1: one read() per message).
+ * -l/-c set the read low-watermark and the wakeup coalescing timeout; the
+ * sleep and wakeup counters from sysfs show how many context switches
+ * that saves.
+ * Load ch9/globalfifo.ko (memcpy-shift FIFO) or ch12/globalfifo.ko (ring)
+ * to compare the old and the new driver on the same machine.
+ *
+ * model mode (-m): runs the old shift algorithm and the new ring algorithm
+ * in userspace on the same access pattern, with the FIFO kept nearly full,
+ * so the O(n) cost of the shift can be seen without loading a module.
+ *
+ * Licensed under GPLv2 or later.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include <libgen.h>
+#include <sys/ioctl.h>
+
+#include "globalfifo.h"
+
+#define FIFO_SIZE	0x1000
+
+static const char *dev_name = "/dev/globalfifo";
+static size_t msg_size = 64;
+static int seconds = 5;
+static unsigned int fifo_bytes;
+static unsigned int rec_batch;
+static struct globalfifo_lowat lowat;
+static int set_lowat;
+static volatile int stop;
+
+struct worker {
+	pthread_t thread;
+	int fd;
+	unsigned long long bytes;
+	unsigned long long ops;
+	unsigned long long msgs;	/* record mode only */
+};
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void wake_handler(int signum)
+{
+}
+
+static void *writer_fn(void *arg)
+{
+	struct worker *w = arg;
+	char *buf = malloc(msg_size);
+	ssize_t ret;
+
+	memset(buf, 0x5a, msg_size);
+	while (!stop) {
+		ret = write(w->fd, buf, msg_size);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("write");
+			break;
+		}
+		w->bytes += ret;
+		w->ops++;
+	}
+	free(buf);
+	return NULL;
+}
+
+/* record mode: up to rec_batch whole messages per ioctl */
+static void *batch_reader_fn(void *arg)
+{
+	struct worker *w = arg;
+	char *buf = malloc(msg_size * rec_batch);
+	__u32 *lens = calloc(rec_batch, sizeof(*lens));
+	struct globalfifo_rec_batch batch = {
+		.buf = (unsigned long)buf,
+		.lens = (unsigned long)lens,
+		.buf_len = msg_size * rec_batch,
+		.max_recs = rec_batch,
+	};
+
+	while (!stop) {
+		if (ioctl(w->fd, FIFO_READ_RECORDS, &batch) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("FIFO_READ_RECORDS");
+			break;
+		}
+		w->bytes += batch.bytes;
+		w->ops++;
+		w->msgs += batch.nr_recs;
+	}
+	free(lens);
+	free(buf);
+	return NULL;
+}
+
+static void *reader_fn(void *arg)
+{
+	struct worker *w = arg;
+	char *buf = malloc(msg_size);
+	ssize_t ret;
+
+	while (!stop) {
+		ret = read(w->fd, buf, msg_size);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("read");
+			break;
+		}
+		w->bytes += ret;
+		w->ops++;
+	}
+	free(buf);
+	return NULL;
+}
+
+/* /sys/class/misc/<dev>/stats/<name>, -1 if the driver has none */
+static long long read_stat(const char *name)
+{
+	char path[256], *dev = strdup(dev_name);
+	long long val = -1;
+	FILE *f;
+
+	snprintf(path, sizeof(path), "/sys/class/misc/%s/stats/%s",
+		 basename(dev), name);
+	free(dev);
+	f = fopen(path, "r");
+	if (!f)
+		return -1;
+	if (fscanf(f, "%lld", &val) != 1)
+		val = -1;
+	fclose(f);
+	return val;
+}
+
+static const char *const stat_names[] = {
+	"r_sleeps", "w_sleeps", "r_wakeups", "coalesce_fires",
+};
+#define NR_STATS	(sizeof(stat_names) / sizeof(stat_names[0]))
+
+static int bench_device(void)
+{
+	struct worker wr = { 0 }, rd = { 0 };
+	struct sigaction sa;
+	struct globalfifo_lowat old_lowat;
+	long long stats[NR_STATS];
+	__u32 record;
+	double t0, t;
+	unsigned int i;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = wake_handler;	/* no SA_RESTART: interrupt blocked I/O */
+	sigaction(SIGUSR1, &sa, NULL);
+
+	wr.fd = open(dev_name, O_WRONLY);
+	rd.fd = open(dev_name, O_RDONLY);
+	if (wr.fd < 0 || rd.fd < 0) {
+		perror(dev_name);
+		return -1;
+	}
+
+	if (fifo_bytes && ioctl(wr.fd, FIFO_RESIZE, &fifo_bytes) < 0) {
+		perror("FIFO_RESIZE");
+		return -1;
+	}
+	if (ioctl(wr.fd, FIFO_GET_SIZE, &fifo_bytes) == 0)
+		printf("fifo size %u bytes\n", fifo_bytes);
+	if (rec_batch) {
+		record = 1;
+		if (ioctl(wr.fd, FIFO_SET_RECORD, &record) < 0) {
+			perror("FIFO_SET_RECORD");
+			return -1;
+		}
+	}
+	if (set_lowat) {
+		if (ioctl(wr.fd, FIFO_GET_LOWAT, &old_lowat) < 0 ||
+		    ioctl(wr.fd, FIFO_SET_LOWAT, &lowat) < 0) {
+			perror("FIFO_SET_LOWAT");
+			return -1;
+		}
+		printf("rx_lowat %u, coalesce %u us\n", lowat.rx_lowat,
+		       lowat.coalesce_us);
+	}
+	for (i = 0; i < NR_STATS; i++)
+		stats[i] = read_stat(stat_names[i]);
+
+	t0 = now();
+	pthread_create(&rd.thread, NULL,
+		       rec_batch > 1 ? batch_reader_fn : reader_fn, &rd);
+	pthread_create(&wr.thread, NULL, writer_fn, &wr);
+	sleep(seconds);
+	stop = 1;
+	pthread_kill(wr.thread, SIGUSR1);
+	pthread_kill(rd.thread, SIGUSR1);
+	pthread_join(wr.thread, NULL);
+	pthread_join(rd.thread, NULL);
+	t = now() - t0;
+
+	printf("device %s, msg %zu bytes, %.2f s\n", dev_name, msg_size, t);
+	printf("  written: %.2f MB/s, %.0f msgs/s\n",
+	       wr.bytes / t / 1e6, wr.ops / t);
+	printf("  read:    %.2f MB/s, %.0f reads/s\n",
+	       rd.bytes / t / 1e6, rd.ops / t);
+	if (rec_batch > 1)
+		printf("           %.0f msgs/s, %.1f msgs per call\n",
+		       rd.msgs / t, rd.ops ? (double)rd.msgs / rd.ops : 0);
+	for (i = 0; i < NR_STATS; i++)
+		if (stats[i] >= 0)
+			printf("  %-15s %lld\n", stat_names[i],
+			       read_stat(stat_names[i]) - stats[i]);
+
+	if (set_lowat)
+		ioctl(wr.fd, FIFO_SET_LOWAT, &old_lowat);
+	if (rec_batch) {
+		record = 0;
+		ioctl(wr.fd, FIFO_CLEAR, 0);
+		ioctl(wr.fd, FIFO_SET_RECORD, &record);
+	}
+
+	close(wr.fd);
+	close(rd.fd);
+	return 0;
+}
+
+/* the old algorithm: data always starts at mem[0], reads shift it down */
+struct shift_fifo {
+	unsigned int current_len;
+	unsigned char mem[FIFO_SIZE];
+};
+
+static size_t shift_write(struct shift_fifo *f, const void *buf, size_t count)
+{
+	if (count > FIFO_SIZE - f->current_len)
+		count = FIFO_SIZE - f->current_len;
+	memcpy(f->mem + f->current_len, buf, count);
+	f->current_len += count;
+	return count;
+}
+
+static size_t shift_read(struct shift_fifo *f, void *buf, size_t count)
+{
+	if (count > f->current_len)
+		count = f->current_len;
+	memcpy(buf, f->mem, count);
+	memmove(f->mem, f->mem + count, f->current_len - count);
+	f->current_len -= count;
+	return count;
+}
+
+/* the new algorithm: free running head/tail, at most two copies */
+struct ring_fifo {
+	unsigned int head;
+	unsigned int tail;
+	unsigned char mem[FIFO_SIZE];
+};
+
+static size_t ring_write(struct ring_fifo *f, const void *buf, size_t count)
+{
+	unsigned int off = f->head & (FIFO_SIZE - 1);
+	size_t l;
+
+	if (count > FIFO_SIZE - (f->head - f->tail))
+		count = FIFO_SIZE - (f->head - f->tail);
+	l = count < FIFO_SIZE - off ? count : FIFO_SIZE - off;
+	memcpy(f->mem + off, buf, l);
+	memcpy(f->mem, (const char *)buf + l, count - l);
+	f->head += count;
+	return count;
+}
+
+static size_t ring_read(struct ring_fifo *f, void *buf, size_t count)
+{
+	unsigned int off = f->tail & (FIFO_SIZE - 1);
+	size_t l;
+
+	if (count > f->head - f->tail)
+		count = f->head - f->tail;
+	l = count < FIFO_SIZE - off ? count : FIFO_SIZE - off;
+	memcpy(buf, f->mem + off, l);
+	memcpy((char *)buf + l, f->mem, count - l);
+	f->tail += count;
+	return count;
+}
+
+#define MODEL_BATCH	1024
+
+static void bench_model(void)
+{
+	static struct shift_fifo sf;
+	static struct ring_fifo rf;
+	char *in = malloc(msg_size), *out = malloc(msg_size);
+	unsigned long long ops;
+	size_t moved;
+	double t0, t;
+	int i;
+
+	memset(in, 0x5a, msg_size);
+
+	/* keep both FIFOs one message short of full */
+	while (sf.current_len + msg_size <= FIFO_SIZE - msg_size)
+		shift_write(&sf, in, msg_size);
+	while (rf.head - rf.tail + msg_size <= FIFO_SIZE - msg_size)
+		ring_write(&rf, in, msg_size);
+
+	printf("model, fifo %d bytes, msg %zu bytes, %d s each\n",
+	       FIFO_SIZE, msg_size, seconds);
+
+	ops = moved = 0;
+	t0 = now();
+	do {
+		for (i = 0; i < MODEL_BATCH; i++) {
+			shift_write(&sf, in, msg_size);
+			moved += shift_read(&sf, out, msg_size);
+		}
+		ops += MODEL_BATCH;
+	} while ((t = now() - t0) < seconds);
+	printf("  shift: %.2f MB/s, %.0f msgs/s\n", moved / t / 1e6, ops / t);
+
+	ops = moved = 0;
+	t0 = now();
+	do {
+		for (i = 0; i < MODEL_BATCH; i++) {
+			ring_write(&rf, in, msg_size);
+			moved += ring_read(&rf, out, msg_size);
+		}
+		ops += MODEL_BATCH;
+	} while ((t = now() - t0) < seconds);
+	printf("  ring:  %.2f MB/s, %.0f msgs/s\n", moved / t / 1e6, ops / t);
+
+	free(in);
+	free(out);
+}
+
+static void usage(const char *prog)
+{
+	printf("Usage: %s [-m] [-d DEV] [-f FIFO_SIZE] [-r BATCH] [-l RX_LOWAT] [-c USECS]\n"
+	       "       [-s MSG_SIZE] [-t SECONDS]\n", prog);
+	printf("  -m  compare the shift and ring algorithms in userspace\n");
+	printf("  -d  device node (default %s)\n", dev_name);
+	printf("  -f  resize the (empty) FIFO before the run\n");
+	printf("  -r  record mode, read up to BATCH messages per call\n");
+	printf("  -l  wake the reader once RX_LOWAT bytes are queued\n");
+	printf("  -c  ... or USECS after the first byte below it\n");
+	printf("  -s  message size in bytes (default %zu)\n", msg_size);
+	printf("  -t  run time in seconds (default %d)\n", seconds);
+}
+
+int main(int argc, char **argv)
+{
+	int model = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "md:f:r:l:c:s:t:h")) != -1) {
+		switch (opt) {
+		case 'm':
+			model = 1;
+			break;
+		case 'd':
+			dev_name = optarg;
+			break;
+		case 'f':
+			fifo_bytes = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			rec_batch = strtoul(optarg, NULL, 0);
+			break;
+		case 'l':
+			lowat.rx_lowat = strtoul(optarg, NULL, 0);
+			set_lowat = 1;
+			break;
+		case 'c':
+			lowat.coalesce_us = strtoul(optarg, NULL, 0);
+			set_lowat = 1;
+			break;
+		case 's':
+			msg_size = strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			seconds = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	if (msg_size == 0) {
+		fprintf(stderr, "message size must not be 0\n");
+		return 1;
+	}
+
+	if (model) {
+		if (msg_size > FIFO_SIZE / 2) {
+			fprintf(stderr, "model message size must be 1..%d\n",
+				FIFO_SIZE / 2);
+			return 1;
+		}
+		bench_model();
+		return 0;
+	}
+	return bench_device() ? 1 : 0;
+}
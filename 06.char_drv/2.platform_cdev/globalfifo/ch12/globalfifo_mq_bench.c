@@ -0,0 +1,220 @@
+/*
+ * globalfifo producer scaling benchmark
+ *
+ * For n = 1..max producers, runs n writer threads pinned to CPUs 0..n-1
+ * and one reader pinned to the next CPU, and reports the aggregate bytes/s
+ * the reader drained. Load ch12/globalfifo.ko with multi_queue=1 to get
+ * per-CPU lanes, or without it to see the single ring for comparison.
+ *
+ * Licensed under GPLv2 or later.
+ */
+
+#define _GNU_SOURCE		/* CPU_SET, pthread_setaffinity_np */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/ioctl.h>
+
+#include "globalfifo.h"
+
+static const char *dev_name = "/dev/globalfifo";
+static size_t msg_size = 64;
+static int seconds = 3;
+static int max_producers;
+static int order = -1;
+static volatile int stop;
+
+struct worker {
+	pthread_t thread;
+	int fd;
+	int cpu;
+	unsigned long long bytes;
+};
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void wake_handler(int signum)
+{
+}
+
+static void pin(int cpu)
+{
+	cpu_set_t set;
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set))
+		fprintf(stderr, "cannot pin to cpu %d\n", cpu);
+}
+
+static void *writer_fn(void *arg)
+{
+	struct worker *w = arg;
+	char *buf = malloc(msg_size);
+	ssize_t ret;
+
+	pin(w->cpu);
+	memset(buf, 0x5a, msg_size);
+	while (!stop) {
+		ret = write(w->fd, buf, msg_size);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("write");
+			break;
+		}
+		w->bytes += ret;
+	}
+	free(buf);
+	return NULL;
+}
+
+static void *reader_fn(void *arg)
+{
+	struct worker *w = arg;
+	char *buf = malloc(msg_size * 64);
+	ssize_t ret;
+
+	pin(w->cpu);
+	while (!stop) {
+		ret = read(w->fd, buf, msg_size * 64);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("read");
+			break;
+		}
+		w->bytes += ret;
+	}
+	free(buf);
+	return NULL;
+}
+
+static int run(int n)
+{
+	struct worker *wr = calloc(n, sizeof(*wr));
+	struct worker rd = { .cpu = n };
+	double t0, t;
+	int i;
+
+	rd.fd = open(dev_name, O_RDONLY);
+	if (rd.fd < 0) {
+		perror(dev_name);
+		return -1;
+	}
+	ioctl(rd.fd, FIFO_CLEAR, 0);
+
+	stop = 0;
+	t0 = now();
+	pthread_create(&rd.thread, NULL, reader_fn, &rd);
+	for (i = 0; i < n; i++) {
+		wr[i].cpu = i;
+		wr[i].fd = open(dev_name, O_WRONLY);
+		pthread_create(&wr[i].thread, NULL, writer_fn, &wr[i]);
+	}
+	sleep(seconds);
+	stop = 1;
+	for (i = 0; i < n; i++)
+		pthread_kill(wr[i].thread, SIGUSR1);
+	pthread_kill(rd.thread, SIGUSR1);
+	for (i = 0; i < n; i++) {
+		pthread_join(wr[i].thread, NULL);
+		close(wr[i].fd);
+	}
+	pthread_join(rd.thread, NULL);
+	t = now() - t0;
+
+	printf("%3d producer(s): %10.2f MB/s aggregate, %8.2f MB/s per producer\n",
+	       n, rd.bytes / t / 1e6, rd.bytes / t / 1e6 / n);
+
+	close(rd.fd);
+	free(wr);
+	return 0;
+}
+
+static void usage(const char *prog)
+{
+	printf("Usage: %s [-d DEV] [-n MAX_PRODUCERS] [-o rr|ts] [-s MSG_SIZE] [-t SECONDS]\n",
+	       prog);
+	printf("  -d  device node (default %s)\n", dev_name);
+	printf("  -n  largest number of producers (default: online CPUs - 1)\n");
+	printf("  -o  lane drain order, multi-queue mode only\n");
+	printf("  -s  message size in bytes (default %zu)\n", msg_size);
+	printf("  -t  run time in seconds per step (default %d)\n", seconds);
+}
+
+int main(int argc, char **argv)
+{
+	struct sigaction sa;
+	__u32 val;
+	int opt, fd, n;
+
+	while ((opt = getopt(argc, argv, "d:n:o:s:t:h")) != -1) {
+		switch (opt) {
+		case 'd':
+			dev_name = optarg;
+			break;
+		case 'n':
+			max_producers = atoi(optarg);
+			break;
+		case 'o':
+			order = strcmp(optarg, "ts") ? GLOBALFIFO_ORDER_RR :
+						       GLOBALFIFO_ORDER_TS;
+			break;
+		case 's':
+			msg_size = strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			seconds = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	if (msg_size == 0) {
+		fprintf(stderr, "message size must not be 0\n");
+		return 1;
+	}
+	if (max_producers <= 0)
+		max_producers = sysconf(_SC_NPROCESSORS_ONLN) - 1;
+	if (max_producers <= 0)
+		max_producers = 1;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = wake_handler;	/* no SA_RESTART: interrupt blocked I/O */
+	sigaction(SIGUSR1, &sa, NULL);
+
+	fd = open(dev_name, O_RDONLY);
+	if (fd < 0) {
+		perror(dev_name);
+		return 1;
+	}
+	if (order >= 0) {
+		val = order;
+		if (ioctl(fd, FIFO_SET_ORDER, &val) < 0)
+			perror("FIFO_SET_ORDER (not in multi-queue mode?)");
+	}
+	close(fd);
+
+	printf("device %s, msg %zu bytes, %d s per step\n", dev_name,
+	       msg_size, seconds);
+	for (n = 1; n <= max_producers; n++)
+		if (run(n))
+			return 1;
+	return 0;
+}
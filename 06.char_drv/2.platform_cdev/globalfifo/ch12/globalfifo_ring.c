@@ -0,0 +1,186 @@
+/*
+ * userspace access to the mmap()ed globalfifo ring
+ *
+ * Licensed under GPLv2 or later.
+ */
+
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+#include "globalfifo_ring.h"
+
+#define load_acquire(p)		__atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define store_release(p, v)	__atomic_store_n(p, v, __ATOMIC_RELEASE)
+#define smp_mb()		__atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+int gf_ring_open(struct gf_ring *r, const char *dev_name)
+{
+	long page = sysconf(_SC_PAGESIZE);
+
+	memset(r, 0, sizeof(*r));
+	r->fd = open(dev_name, O_RDWR);
+	if (r->fd < 0)
+		return -1;
+
+	if (ioctl(r->fd, FIFO_GET_SIZE, &r->size) < 0)
+		goto err;
+
+	r->map_len = page + r->size;
+	r->ctrl = mmap(NULL, r->map_len, PROT_READ | PROT_WRITE, MAP_SHARED,
+		       r->fd, 0);
+	if (r->ctrl == MAP_FAILED)
+		goto err;
+
+	r->data = (unsigned char *)r->ctrl + r->ctrl->data_offset;
+	return 0;
+err:
+	close(r->fd);
+	return -1;
+}
+
+void gf_ring_close(struct gf_ring *r)
+{
+	munmap(r->ctrl, r->map_len);
+	close(r->fd);
+}
+
+/* pending: bytes already filled/drained but not committed yet */
+static void *ring_write_ptr(struct gf_ring *r, unsigned int pending,
+			    size_t *len)
+{
+	unsigned int head = r->ctrl->head + pending;
+	unsigned int tail = load_acquire(&r->ctrl->tail);
+	unsigned int off = head & (r->size - 1);
+	size_t room = r->size - (head - tail);
+
+	*len = room < r->size - off ? room : r->size - off;
+	return r->data + off;
+}
+
+static const void *ring_read_ptr(struct gf_ring *r, unsigned int pending,
+				 size_t *len)
+{
+	unsigned int tail = r->ctrl->tail + pending;
+	unsigned int head = load_acquire(&r->ctrl->head);
+	unsigned int off = tail & (r->size - 1);
+	size_t avail = head - tail;
+
+	*len = avail < r->size - off ? avail : r->size - off;
+	return r->data + off;
+}
+
+void *gf_ring_write_ptr(struct gf_ring *r, size_t *len)
+{
+	return ring_write_ptr(r, 0, len);
+}
+
+void gf_ring_write_commit(struct gf_ring *r, size_t n)
+{
+	store_release(&r->ctrl->head, r->ctrl->head + (unsigned int)n);
+	/* order the head store before reading r_waiting, see globalfifo.h */
+	smp_mb();
+	if (r->ctrl->r_waiting)
+		ioctl(r->fd, FIFO_RING_NOTIFY, GLOBALFIFO_NOTIFY_READERS);
+}
+
+const void *gf_ring_read_ptr(struct gf_ring *r, size_t *len)
+{
+	return ring_read_ptr(r, 0, len);
+}
+
+void gf_ring_read_commit(struct gf_ring *r, size_t n)
+{
+	store_release(&r->ctrl->tail, r->ctrl->tail + (unsigned int)n);
+	smp_mb();
+	if (r->ctrl->w_waiting)
+		ioctl(r->fd, FIFO_RING_NOTIFY, GLOBALFIFO_NOTIFY_WRITERS);
+}
+
+size_t gf_ring_write(struct gf_ring *r, const void *buf, size_t len)
+{
+	size_t done = 0, l;
+	void *p;
+
+	/* at most two rounds: up to the wrap point, then from the start */
+	while (done < len) {
+		p = ring_write_ptr(r, done, &l);
+		if (!l)
+			break;
+		if (l > len - done)
+			l = len - done;
+		memcpy(p, (const char *)buf + done, l);
+		done += l;
+	}
+	if (done)
+		gf_ring_write_commit(r, done);
+	return done;
+}
+
+size_t gf_ring_read(struct gf_ring *r, void *buf, size_t len)
+{
+	size_t done = 0, l;
+	const void *p;
+
+	while (done < len) {
+		p = ring_read_ptr(r, done, &l);
+		if (!l)
+			break;
+		if (l > len - done)
+			l = len - done;
+		memcpy((char *)buf + done, p, l);
+		done += l;
+	}
+	if (done)
+		gf_ring_read_commit(r, done);
+	return done;
+}
+
+static int ring_wait(struct gf_ring *r, unsigned int *waiting, short events,
+		     int (*ready)(struct gf_ring *r), int timeout_ms)
+{
+	struct pollfd pfd = { .fd = r->fd, .events = events };
+	int ret;
+
+	for (;;) {
+		if (ready(r))
+			return 1;
+
+		store_release(waiting, 1);
+		smp_mb();
+		if (ready(r)) {
+			store_release(waiting, 0);
+			return 1;
+		}
+
+		ret = poll(&pfd, 1, timeout_ms);
+		store_release(waiting, 0);
+		if (ret <= 0)
+			return ret;
+	}
+}
+
+static int ring_readable(struct gf_ring *r)
+{
+	return load_acquire(&r->ctrl->head) != r->ctrl->tail;
+}
+
+static int ring_writable(struct gf_ring *r)
+{
+	return r->ctrl->head - load_acquire(&r->ctrl->tail) != r->size;
+}
+
+int gf_ring_wait_readable(struct gf_ring *r, int timeout_ms)
+{
+	return ring_wait(r, &r->ctrl->r_waiting, POLLIN, ring_readable,
+			 timeout_ms);
+}
+
+int gf_ring_wait_writable(struct gf_ring *r, int timeout_ms)
+{
+	return ring_wait(r, &r->ctrl->w_waiting, POLLOUT, ring_writable,
+			 timeout_ms);
+}
@@ -0,0 +1,48 @@
+/*
+ * userspace access to the mmap()ed globalfifo ring
+ *
+ * One producer and one consumer may use the ring at a time, whether they
+ * go through this library or through read()/write(). Data is moved with
+ * plain loads and stores; the driver is only entered to sleep in poll()
+ * and to wake the other side with FIFO_RING_NOTIFY when it is waiting.
+ *
+ * Licensed under GPLv2 or later.
+ */
+
+#ifndef _GLOBALFIFO_RING_H
+#define _GLOBALFIFO_RING_H
+
+#include <stddef.h>
+
+#include "globalfifo.h"
+
+struct gf_ring {
+	int fd;
+	struct globalfifo_ring_ctrl *ctrl;
+	unsigned char *data;
+	unsigned int size;
+	size_t map_len;
+};
+
+int gf_ring_open(struct gf_ring *r, const char *dev_name);
+void gf_ring_close(struct gf_ring *r);
+
+/*
+ * Zero-copy interface: *_ptr() returns the contiguous readable/writable
+ * region at the current index (up to the wrap point), *_commit() publishes
+ * n bytes of it to the other side.
+ */
+void *gf_ring_write_ptr(struct gf_ring *r, size_t *len);
+void gf_ring_write_commit(struct gf_ring *r, size_t n);
+const void *gf_ring_read_ptr(struct gf_ring *r, size_t *len);
+void gf_ring_read_commit(struct gf_ring *r, size_t n);
+
+/* copying helpers on top, never block, return the bytes moved */
+size_t gf_ring_write(struct gf_ring *r, const void *buf, size_t len);
+size_t gf_ring_read(struct gf_ring *r, void *buf, size_t len);
+
+/* sleep in poll() until data/space is available, 0 on timeout */
+int gf_ring_wait_readable(struct gf_ring *r, int timeout_ms);
+int gf_ring_wait_writable(struct gf_ring *r, int timeout_ms);
+
+#endif /* _GLOBALFIFO_RING_H */
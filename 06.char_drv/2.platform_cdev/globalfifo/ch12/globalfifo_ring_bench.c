@@ -0,0 +1,241 @@
+/*
+ * globalfifo read()/write() vs mmap() ring benchmark
+ *
+ * A producer and a consumer thread move msg_size messages through the
+ * device for the given time, first with read()/write() and then through
+ * the shared ring (globalfifo_ring.c), and report messages/s and how often
+ * the ring side had to enter the kernel to sleep or to wake the other side.
+ *
+ * Licensed under GPLv2 or later.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "globalfifo_ring.h"
+
+#define WAIT_MS		100	/* re-check the stop flag this often */
+
+static const char *dev_name = "/dev/globalfifo";
+static size_t msg_size = 64;
+static int seconds = 5;
+static volatile int stop;
+
+struct worker {
+	pthread_t thread;
+	int fd;
+	struct gf_ring *ring;
+	unsigned long long msgs;
+	unsigned long long sleeps;
+};
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void wake_handler(int signum)
+{
+}
+
+static void *rw_producer(void *arg)
+{
+	struct worker *w = arg;
+	char *buf = malloc(msg_size);
+	ssize_t ret;
+
+	memset(buf, 0x5a, msg_size);
+	while (!stop) {
+		ret = write(w->fd, buf, msg_size);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("write");
+			break;
+		}
+		w->msgs++;
+	}
+	free(buf);
+	return NULL;
+}
+
+static void *rw_consumer(void *arg)
+{
+	struct worker *w = arg;
+	char *buf = malloc(msg_size);
+	ssize_t ret;
+
+	while (!stop) {
+		ret = read(w->fd, buf, msg_size);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("read");
+			break;
+		}
+		w->msgs++;
+	}
+	free(buf);
+	return NULL;
+}
+
+/* whole messages only, so msgs counts the same unit in both modes */
+static void *ring_producer(void *arg)
+{
+	struct worker *w = arg;
+	struct gf_ring *r = w->ring;
+	char *buf = malloc(msg_size);
+	size_t done;
+
+	memset(buf, 0x5a, msg_size);
+	while (!stop) {
+		done = 0;
+		while (done < msg_size && !stop) {
+			done += gf_ring_write(r, buf + done, msg_size - done);
+			if (done < msg_size) {
+				w->sleeps++;
+				gf_ring_wait_writable(r, WAIT_MS);
+			}
+		}
+		if (done == msg_size)
+			w->msgs++;
+	}
+	free(buf);
+	return NULL;
+}
+
+static void *ring_consumer(void *arg)
+{
+	struct worker *w = arg;
+	struct gf_ring *r = w->ring;
+	char *buf = malloc(msg_size);
+	size_t done;
+
+	while (!stop) {
+		done = 0;
+		while (done < msg_size && !stop) {
+			done += gf_ring_read(r, buf + done, msg_size - done);
+			if (done < msg_size) {
+				w->sleeps++;
+				gf_ring_wait_readable(r, WAIT_MS);
+			}
+		}
+		if (done == msg_size)
+			w->msgs++;
+	}
+	free(buf);
+	return NULL;
+}
+
+static int run(const char *name, void *(*prod_fn)(void *),
+	       void *(*cons_fn)(void *), struct gf_ring *ring)
+{
+	struct worker prod = { .ring = ring }, cons = { .ring = ring };
+	double t0, t;
+
+	if (!ring) {
+		prod.fd = open(dev_name, O_WRONLY);
+		cons.fd = open(dev_name, O_RDONLY);
+		if (prod.fd < 0 || cons.fd < 0) {
+			perror(dev_name);
+			return -1;
+		}
+	}
+
+	stop = 0;
+	t0 = now();
+	pthread_create(&cons.thread, NULL, cons_fn, &cons);
+	pthread_create(&prod.thread, NULL, prod_fn, &prod);
+	sleep(seconds);
+	stop = 1;
+	pthread_kill(prod.thread, SIGUSR1);
+	pthread_kill(cons.thread, SIGUSR1);
+	pthread_join(prod.thread, NULL);
+	pthread_join(cons.thread, NULL);
+	t = now() - t0;
+
+	printf("  %-6s %.0f msgs/s, %.2f MB/s", name, cons.msgs / t,
+	       cons.msgs * msg_size / t / 1e6);
+	if (ring)
+		printf(", sleeps: producer %llu consumer %llu",
+		       prod.sleeps, cons.sleeps);
+	printf("\n");
+
+	if (!ring) {
+		close(prod.fd);
+		close(cons.fd);
+	}
+	return 0;
+}
+
+static void usage(const char *prog)
+{
+	printf("Usage: %s [-d DEV] [-s MSG_SIZE] [-t SECONDS]\n", prog);
+	printf("  -d  device node (default %s)\n", dev_name);
+	printf("  -s  message size in bytes (default %zu)\n", msg_size);
+	printf("  -t  run time in seconds per mode (default %d)\n", seconds);
+}
+
+int main(int argc, char **argv)
+{
+	struct sigaction sa;
+	struct gf_ring ring;
+	int opt, ret;
+
+	while ((opt = getopt(argc, argv, "d:s:t:h")) != -1) {
+		switch (opt) {
+		case 'd':
+			dev_name = optarg;
+			break;
+		case 's':
+			msg_size = strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			seconds = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	if (msg_size == 0) {
+		fprintf(stderr, "message size must not be 0\n");
+		return 1;
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = wake_handler;	/* no SA_RESTART: interrupt blocked I/O */
+	sigaction(SIGUSR1, &sa, NULL);
+
+	if (gf_ring_open(&ring, dev_name) < 0) {
+		perror("gf_ring_open");
+		return 1;
+	}
+	if (msg_size > ring.size) {
+		fprintf(stderr, "message size must be 1..%u\n", ring.size);
+		gf_ring_close(&ring);
+		return 1;
+	}
+
+	printf("device %s, fifo %u bytes, msg %zu bytes, %d s each\n",
+	       dev_name, ring.size, msg_size, seconds);
+
+	/* the ring stays mapped, the read()/write() run uses the same FIFO */
+	ret = run("rw", rw_producer, rw_consumer, NULL);
+	if (!ret)
+		ret = run("mmap", ring_producer, ring_consumer, &ring);
+
+	gf_ring_close(&ring);
+	return ret ? 1 : 0;
+}
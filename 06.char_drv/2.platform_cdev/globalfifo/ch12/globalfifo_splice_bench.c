@@ -0,0 +1,202 @@
+/*
+ * globalfifo splice() vs read()/write() benchmark
+ *
+ * A producer thread writes a stream of total bytes into the device and a
+ * drain thread splices everything that arrives in a pipe to /dev/null.
+ * In between, the main thread moves the stream from the device into the
+ * pipe, first with a read()/write() loop through a user buffer and then
+ * with splice(), and reports MB/s and the CPU time the mover used.
+ *
+ * Licensed under GPLv2 or later.
+ */
+
+#define _GNU_SOURCE		/* splice, F_SETPIPE_SZ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/ioctl.h>
+
+#include "globalfifo.h"
+
+static const char *dev_name = "/dev/globalfifo";
+static size_t total = 256 << 20;
+static size_t chunk = 64 << 10;
+
+struct stream {
+	int dev_fd;
+	int pipe_fd[2];
+	int null_fd;
+};
+
+static double clock_s(clockid_t id)
+{
+	struct timespec ts;
+
+	clock_gettime(id, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *producer_fn(void *arg)
+{
+	char *buf = malloc(chunk);
+	size_t done = 0;
+	ssize_t ret;
+	int fd;
+
+	fd = open(dev_name, O_WRONLY);
+	if (fd < 0) {
+		perror(dev_name);
+		exit(1);
+	}
+	memset(buf, 0x5a, chunk);
+	while (done < total) {
+		ret = write(fd, buf, total - done < chunk ? total - done : chunk);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("write");
+			exit(1);
+		}
+		done += ret;
+	}
+	close(fd);
+	free(buf);
+	return NULL;
+}
+
+/* empties the pipe until the mover closes the write end */
+static void *drain_fn(void *arg)
+{
+	struct stream *s = arg;
+	ssize_t ret;
+
+	do {
+		ret = splice(s->pipe_fd[0], NULL, s->null_fd, NULL, chunk,
+			     SPLICE_F_MOVE);
+	} while (ret > 0 || (ret < 0 && errno == EINTR));
+	if (ret < 0)
+		perror("splice to /dev/null");
+	return NULL;
+}
+
+static ssize_t move_rw(struct stream *s, char *buf)
+{
+	ssize_t ret, off, n;
+
+	ret = read(s->dev_fd, buf, chunk);
+	for (off = 0; off < ret; off += n) {
+		n = write(s->pipe_fd[1], buf + off, ret - off);
+		if (n < 0)
+			return n;
+	}
+	return ret;
+}
+
+static ssize_t move_splice(struct stream *s, char *buf)
+{
+	return splice(s->dev_fd, NULL, s->pipe_fd[1], NULL, chunk,
+		      SPLICE_F_MOVE);
+}
+
+static int run(const char *name,
+	       ssize_t (*move)(struct stream *s, char *buf))
+{
+	pthread_t producer, drain;
+	struct stream s;
+	char *buf = malloc(chunk);
+	size_t moved = 0;
+	unsigned long long calls = 0;
+	double t0, c0, t, c;
+	ssize_t ret;
+
+	s.dev_fd = open(dev_name, O_RDONLY);
+	s.null_fd = open("/dev/null", O_WRONLY);
+	if (s.dev_fd < 0 || s.null_fd < 0 || pipe(s.pipe_fd) < 0) {
+		perror("open");
+		return -1;
+	}
+	/* room for one chunk, so neither mode is limited by the pipe */
+	fcntl(s.pipe_fd[1], F_SETPIPE_SZ, chunk);
+	ioctl(s.dev_fd, FIFO_CLEAR, 0);
+
+	pthread_create(&drain, NULL, drain_fn, &s);
+	pthread_create(&producer, NULL, producer_fn, NULL);
+
+	t0 = clock_s(CLOCK_MONOTONIC);
+	c0 = clock_s(CLOCK_THREAD_CPUTIME_ID);
+	while (moved < total) {
+		ret = move(&s, buf);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			/* the producer would block forever, give up */
+			perror(name);
+			exit(1);
+		}
+		moved += ret;
+		calls++;
+	}
+	c = clock_s(CLOCK_THREAD_CPUTIME_ID) - c0;
+	t = clock_s(CLOCK_MONOTONIC) - t0;
+
+	close(s.pipe_fd[1]);
+	pthread_join(producer, NULL);
+	pthread_join(drain, NULL);
+	close(s.pipe_fd[0]);
+	close(s.null_fd);
+	close(s.dev_fd);
+	free(buf);
+
+	printf("  %-6s %8.2f MB/s, mover cpu %.3f s (%.0f%% of %.3f s), %.1f KB per call\n",
+	       name, moved / t / 1e6, c, c / t * 100, t,
+	       calls ? moved / 1024.0 / calls : 0);
+	return 0;
+}
+
+static void usage(const char *prog)
+{
+	printf("Usage: %s [-d DEV] [-b CHUNK] [-n TOTAL_MB]\n", prog);
+	printf("  -d  device node (default %s)\n", dev_name);
+	printf("  -b  bytes per read()/write()/splice() (default %zu)\n",
+	       chunk);
+	printf("  -n  megabytes to move per mode (default %zu)\n",
+	       total >> 20);
+}
+
+int main(int argc, char **argv)
+{
+	int opt;
+
+	while ((opt = getopt(argc, argv, "d:b:n:h")) != -1) {
+		switch (opt) {
+		case 'd':
+			dev_name = optarg;
+			break;
+		case 'b':
+			chunk = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			total = strtoul(optarg, NULL, 0) << 20;
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	if (chunk == 0 || total == 0) {
+		fprintf(stderr, "chunk and total must not be 0\n");
+		return 1;
+	}
+
+	printf("device %s, %zu MB in %zu byte chunks\n", dev_name,
+	       total >> 20, chunk);
+	if (run("rw", move_rw) || run("splice", move_splice))
+		return 1;
+	return 0;
+}
@@ -0,0 +1,237 @@
+/*
+ * AIO benchmark for vectored I/O on globalfifo/globalmem
+ *
+ * Keeps a queue of qdepth IOCB_CMD_PREADV/PWRITEV requests in flight, each
+ * with nr_vecs small segments, and reports ops/s and the p50/p99 latency
+ * from io_submit() to the completion being reaped. Half of each batch are
+ * writes and half are reads. By default the device is opened O_NONBLOCK,
+ * so a full or empty FIFO completes with -EAGAIN (counted separately).
+ * With -b it is opened blocking: the ch12 driver then parks requests it
+ * cannot complete yet and completes them from the other side's progress,
+ * so io_submit() itself never sleeps.
+ *
+ * Uses the raw aio syscalls so it builds without libaio; see aior.c for
+ * the libaio version of a single read. AIO needs .read_iter/.write_iter,
+ * so run it against ch12/globalfifo.ko or ch6/globalmem.ko, not the
+ * read/write-only driver in this directory.
+ *
+ * Licensed under GPLv2 or later.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/aio_abi.h>
+
+static const char *dev_name = "/dev/globalfifo";
+static int qdepth = 64;
+static int nr_vecs = 4;
+static size_t seg_size = 16;
+static int seconds = 5;
+static int blocking;
+
+static inline int io_setup(unsigned nr, aio_context_t *ctx)
+{
+	return syscall(SYS_io_setup, nr, ctx);
+}
+
+static inline int io_destroy(aio_context_t ctx)
+{
+	return syscall(SYS_io_destroy, ctx);
+}
+
+static inline int io_submit(aio_context_t ctx, long nr, struct iocb **iocbpp)
+{
+	return syscall(SYS_io_submit, ctx, nr, iocbpp);
+}
+
+static inline int io_getevents(aio_context_t ctx, long min_nr, long max_nr,
+			       struct io_event *events,
+			       struct timespec *timeout)
+{
+	return syscall(SYS_io_getevents, ctx, min_nr, max_nr, events, timeout);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void usage(const char *prog)
+{
+	printf("Usage: %s [-b] [-d DEV] [-q QDEPTH] [-v NR_VECS] [-s SEG_SIZE] [-t SECONDS]\n",
+	       prog);
+	printf("  -b  open without O_NONBLOCK, let the driver park requests\n");
+	printf("  -d  device node (default %s)\n", dev_name);
+	printf("  -q  requests in flight (default %d)\n", qdepth);
+	printf("  -v  iovec segments per request (default %d)\n", nr_vecs);
+	printf("  -s  bytes per segment (default %zu)\n", seg_size);
+	printf("  -t  run time in seconds (default %d)\n", seconds);
+}
+
+int main(int argc, char **argv)
+{
+	aio_context_t ctx = 0;
+	struct iocb *cbs, **cbp;
+	struct io_event *events;
+	struct iovec *iov;
+	double *submit_t, *lat = NULL, t0, t, t_done;
+	unsigned long long ops = 0, again = 0, bytes = 0;
+	size_t nr_lat = 0, max_lat = 1 << 20;
+	char *buf;
+	int fd, opt, i, j, ret;
+
+	while ((opt = getopt(argc, argv, "bd:q:v:s:t:h")) != -1) {
+		switch (opt) {
+		case 'b':
+			blocking = 1;
+			break;
+		case 'd':
+			dev_name = optarg;
+			break;
+		case 'q':
+			qdepth = atoi(optarg);
+			break;
+		case 'v':
+			nr_vecs = atoi(optarg);
+			break;
+		case 's':
+			seg_size = strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			seconds = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	if (qdepth < 2 || nr_vecs < 1 || seg_size == 0) {
+		fprintf(stderr, "need qdepth >= 2, nr_vecs >= 1, seg_size >= 1\n");
+		return 1;
+	}
+
+	fd = open(dev_name, blocking ? O_RDWR : O_RDWR | O_NONBLOCK);
+	if (fd < 0) {
+		perror(dev_name);
+		return 1;
+	}
+
+	cbs = calloc(qdepth, sizeof(*cbs));
+	cbp = calloc(qdepth, sizeof(*cbp));
+	events = calloc(qdepth, sizeof(*events));
+	iov = calloc((size_t)qdepth * nr_vecs, sizeof(*iov));
+	submit_t = calloc(qdepth, sizeof(*submit_t));
+	lat = malloc(max_lat * sizeof(*lat));
+	buf = malloc((size_t)qdepth * nr_vecs * seg_size);
+	if (!cbs || !cbp || !events || !iov || !submit_t || !lat || !buf) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+	memset(buf, 0x5a, (size_t)qdepth * nr_vecs * seg_size);
+
+	for (i = 0; i < qdepth; i++) {
+		for (j = 0; j < nr_vecs; j++) {
+			iov[i * nr_vecs + j].iov_base =
+				buf + ((size_t)i * nr_vecs + j) * seg_size;
+			iov[i * nr_vecs + j].iov_len = seg_size;
+		}
+		/* first half writes, second half reads */
+		cbs[i].aio_lio_opcode = i < qdepth / 2 ? IOCB_CMD_PWRITEV :
+							 IOCB_CMD_PREADV;
+		cbs[i].aio_fildes = fd;
+		cbs[i].aio_buf = (unsigned long)&iov[i * nr_vecs];
+		cbs[i].aio_nbytes = nr_vecs;
+		cbs[i].aio_offset = 0;
+		cbs[i].aio_data = i;
+		cbp[i] = &cbs[i];
+	}
+
+	ret = io_setup(qdepth, &ctx);
+	if (ret < 0) {
+		perror("io_setup");
+		return 1;
+	}
+
+	t0 = now();
+	do {
+		t = now();
+		for (i = 0; i < qdepth; i++)
+			submit_t[i] = t;
+		ret = io_submit(ctx, qdepth, cbp);
+		if (ret != qdepth) {
+			fprintf(stderr, "io_submit: %s\n",
+				ret < 0 ? strerror(errno) : "short submit");
+			break;
+		}
+
+		for (i = 0; i < qdepth; i += ret) {
+			ret = io_getevents(ctx, 1, qdepth - i, events, NULL);
+			if (ret < 0) {
+				if (errno == EINTR) {
+					ret = 0;
+					continue;
+				}
+				perror("io_getevents");
+				goto out;
+			}
+			t_done = now();
+			for (j = 0; j < ret; j++) {
+				if ((long long)events[j].res == -EAGAIN) {
+					again++;
+					continue;
+				}
+				if ((long long)events[j].res < 0) {
+					fprintf(stderr, "aio: %s\n",
+						strerror(-(long long)events[j].res));
+					goto out;
+				}
+				ops++;
+				bytes += events[j].res;
+				if (nr_lat < max_lat)
+					lat[nr_lat++] =
+						t_done - submit_t[events[j].data];
+			}
+		}
+	} while ((t = now() - t0) < seconds);
+out:
+	t = now() - t0;
+	io_destroy(ctx);
+	close(fd);
+
+	printf("device %s, qdepth %d, %d x %zu byte segments, %.2f s\n",
+	       dev_name, qdepth, nr_vecs, seg_size, t);
+	printf("  %.0f ops/s, %.2f MB/s, %llu EAGAIN\n", ops / t,
+	       bytes / t / 1e6, again);
+	if (nr_lat) {
+		qsort(lat, nr_lat, sizeof(*lat), cmp_double);
+		printf("  latency p50 %.1f us, p99 %.1f us\n",
+		       lat[nr_lat / 2] * 1e6, lat[nr_lat * 99 / 100] * 1e6);
+	}
+
+	free(buf);
+	free(lat);
+	free(submit_t);
+	free(iov);
+	free(events);
+	free(cbp);
+	free(cbs);
+	return 0;
+}